@@ -0,0 +1,224 @@
+// Converter between CSV arrival logs and binary arrival traces.
+//
+// Writes the fixed-record traces the simulations read with --arrivals (see
+// common/arrival_trace.h) from a CSV log with one arrival per line:
+//   time,entity,type,service
+// time and service are in nanoseconds, entity and type are unsigned integers,
+// and service may be left empty. With --timestamps=delta (the default) time is
+// the gap since the previous arrival; with --timestamps=absolute it is a
+// timestamp, and the gaps are taken between consecutive lines, which must not
+// go back in time. A first line that does not start with a digit is taken as a
+// header, and lines starting with '#' are skipped.
+//
+// Example:
+//   arrival_convert --csv=arrivals.csv --out=arrivals.trace --timestamps=absolute
+//   barbershop/barbershop --non-interactive --chairs=8 --barber-time=50us --arrivals=arrivals.trace
+//
+// --dump=path prints a trace back as CSV (delta timestamps), the first --limit
+// records of it if given.
+//
+// The input is read in large blocks and parsed in place, without iostreams, so
+// converting a log of billions of lines is bound by the disk.
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include "../common/options.h"
+#include "../common/sim_time.h"
+#include "../common/arrival_trace.h"
+
+using namespace std;
+
+// Block the input is read in.
+const size_t CONVERT_BLOCK_BYTES = 1 << 20;
+
+// parse_field()
+// Parses one unsigned integer field ending at a comma or the end of the line
+// and moves past the comma. An empty field reads as 0.
+bool parse_field(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    if (cursor != end && *cursor != ',') {
+        from_chars_result result = from_chars(cursor, end, value);
+        if (result.ec != errc() || (result.ptr != end && *result.ptr != ',')) {
+            return false;
+        }
+        cursor = result.ptr;
+    }
+    if (cursor != end) {
+        cursor++;
+    }
+    return true;
+}
+
+// Converts CSV lines into records as they are read.
+struct Converter {
+    FILE* out = NULL;
+    bool absolute = false;
+    uint64_t count = 0;
+    uint64_t line_number = 0;
+    uint64_t previous_ns = 0;
+    uint64_t total_ns = 0;
+    vector<ArrivalRecord> batch;
+
+    // line()
+    // Converts one line. Returns false with error set if it is malformed.
+    bool line(const char* begin, const char* end, string& error) {
+        line_number++;
+        if (end != begin && end[-1] == '\r') {
+            end--;
+        }
+        if (begin == end || *begin == '#' || (line_number == 1 && (*begin < '0' || *begin > '9'))) {
+            return true;
+        }
+        uint64_t time, entity, type, service;
+        const char* cursor = begin;
+        if (!parse_field(cursor, end, time) || !parse_field(cursor, end, entity) ||
+            !parse_field(cursor, end, type) || !parse_field(cursor, end, service) || cursor != end ||
+            entity > UINT32_MAX || type > UINT32_MAX) {
+            error = "line " + to_string(line_number) + ": expected time,entity,type,service";
+            return false;
+        }
+        uint64_t delta_ns = time;
+        if (absolute) {
+            if (count > 0 && time < previous_ns) {
+                error = "line " + to_string(line_number) + ": timestamp goes back in time";
+                return false;
+            }
+            delta_ns = (count > 0) ? time - previous_ns : 0;
+            previous_ns = time;
+        }
+        total_ns += delta_ns;
+        batch.push_back(ArrivalRecord{delta_ns, service, (uint32_t)entity, (uint32_t)type});
+        count++;
+        if (batch.size() == CONVERT_BLOCK_BYTES / sizeof(ArrivalRecord)) {
+            flush();
+        }
+        return true;
+    }
+
+    // flush()
+    // Writes out the records converted so far.
+    void flush() {
+        fwrite(batch.data(), sizeof(ArrivalRecord), batch.size(), out);
+        batch.clear();
+    }
+};
+
+// convert()
+// Converts a CSV log into a trace.
+void convert(Options& options, const string& csv_path, const string& out_path, bool absolute) {
+    FILE* in = fopen(csv_path.c_str(), "rb");
+    if (in == NULL) {
+        options.fail("cannot open " + csv_path + ": " + strerror(errno));
+    }
+    Converter converter;
+    converter.absolute = absolute;
+    converter.out = fopen(out_path.c_str(), "wb");
+    if (converter.out == NULL) {
+        options.fail("cannot create " + out_path + ": " + strerror(errno));
+    }
+    ArrivalTraceHeader header = {};
+    memcpy(header.magic, ARRIVAL_TRACE_MAGIC, sizeof(header.magic));
+    header.version = ARRIVAL_TRACE_VERSION;
+    header.record_size = sizeof(ArrivalRecord);
+    fwrite(&header, sizeof(header), 1, converter.out);
+
+    // Parse whole lines out of each block and carry a partial last line over
+    // to the next.
+    vector<char> block(CONVERT_BLOCK_BYTES);
+    size_t carried = 0;
+    string error;
+    while (true) {
+        if (carried == block.size()) {
+            block.resize(block.size() * 2);
+        }
+        size_t got = fread(block.data() + carried, 1, block.size() - carried, in);
+        size_t filled = carried + got;
+        const char* start = block.data();
+        const char* end = block.data() + filled;
+        while (true) {
+            const char* newline = (const char*)memchr(start, '\n', end - start);
+            if (newline == NULL) {
+                break;
+            }
+            if (!converter.line(start, newline, error)) {
+                options.fail(csv_path + ", " + error);
+            }
+            start = newline + 1;
+        }
+        carried = end - start;
+        if (got == 0) {
+            if (carried > 0 && !converter.line(start, end, error)) {
+                options.fail(csv_path + ", " + error);
+            }
+            break;
+        }
+        memmove(block.data(), start, carried);
+    }
+    fclose(in);
+    converter.flush();
+
+    // The count goes into the header once it is known.
+    header.count = converter.count;
+    fseek(converter.out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, converter.out);
+    if (fclose(converter.out) != 0) {
+        options.fail("cannot write " + out_path + ": " + strerror(errno));
+    }
+    cout << "Wrote " << converter.count << " arrivals over " << format_duration(converter.total_ns) << " to " <<
+            out_path << endl;
+}
+
+// dump()
+// Prints a trace as CSV.
+void dump(Options& options, const string& path, uint64_t limit) {
+    string error;
+    if (!arrival_trace.open(path, error)) {
+        options.fail(error);
+    }
+    string text = "time,entity,type,service\n";
+    char digits[24];
+    for (uint64_t i = 0; i < arrival_trace.size() && i < limit; i++) {
+        const ArrivalRecord* record = arrival_trace.next();
+        uint64_t fields[] = {record->delta_ns, record->entity, record->type, record->service_ns};
+        for (int f = 0; f < 4; f++) {
+            to_chars_result result = to_chars(digits, digits + sizeof(digits), fields[f]);
+            text.append(digits, result.ptr - digits);
+            text += (f < 3) ? ',' : '\n';
+        }
+        if (text.size() >= CONVERT_BLOCK_BYTES) {
+            fwrite(text.data(), 1, text.size(), stdout);
+            text.clear();
+        }
+    }
+    fwrite(text.data(), 1, text.size(), stdout);
+    arrival_trace.close();
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    string csv_path = options.get("csv", "");
+    string out_path = options.get("out", "");
+    string dump_path = options.get("dump", "");
+    string timestamps = options.get("timestamps", "delta");
+    uint64_t limit = options.value("limit", (uint64_t)UINT64_MAX);
+    options.check_unused();
+    if (timestamps != "delta" && timestamps != "absolute") {
+        options.fail("--timestamps must be delta or absolute");
+    }
+    if (!dump_path.empty()) {
+        dump(options, dump_path, limit);
+    } else if (!csv_path.empty() && !out_path.empty()) {
+        convert(options, csv_path, out_path, timestamps == "absolute");
+    } else {
+        options.fail("give --csv and --out to convert, or --dump to print a trace");
+    }
+    return 0;
+}
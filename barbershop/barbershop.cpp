@@ -3,142 +3,467 @@
 // a customer enters the barbershop and all chairs are occupied, then the customer leaves
 // the shop. If the barber is busy, but chairs are available, then the customer sits in
 // one of the free chairs. If the barber is asleep, the customer wakes up the barber.
+//
+// Customers come in priority classes (walk-in, appointment, VIP), drawn with
+// --class-mix weights or taken from an --arrivals trace. The barber always takes
+// the highest class waiting, and within a class the customer who arrived first.
+// --deadlines gives each class a time after arriving by which it should be in the
+// barber's chair, and --balk what a customer of each class does when every chair
+// is taken: leave, or preempt the newest customer of a lower class, who leaves
+// instead. Waiting times and missed deadlines are reported per class.
 
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
-#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/bucket_queue.h"
+#include "../common/alloc_count.h"
+#include "../common/perf.h"
 
 // Namespace declaration
 using namespace std;
 
 // Global variables 
-int num_customers;
-int max_chairs;
-long int barber_wait_time;
-long int customer_rate;
+int num_customers = 10;
+int max_chairs = 3;
+Interval barber_wait_time = Interval::seconds(1);
+Interval customer_rate = Interval::seconds(1);
 // Define barber status enum
 enum enum_barber_status { AWAKE = true, ASLEEP = false};
 enum_barber_status barber_status = ASLEEP;
 // Define worker process management variable 
-bool worker_active = false;
+atomic<bool> worker_active(false);
+// Counted down once per customer, served or balked.
+CompletionLatch completion;
+// Wakes the barber when a customer arrives to an empty queue.
+Wakeup barber_wakeup;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_served;
+LiveMetric* live_balked;
+LiveMetric* live_queue_depth;
+// Customers turned away because the waiting room was full.
+int num_balked = 0;
+
+// Customer classes, in increasing priority.
+enum customer_class {WALK_IN, APPOINTMENT, VIP};
+const int NUM_CLASSES = 3;
+const char* const CLASS_LABELS[] = {"walk_in", "appointment", "vip"};
+// What a customer does on finding every chair taken.
+enum balk_rule {BALK_LEAVE, BALK_PREEMPT};
+
+// A class's parameters and results. The producer counts arrivals, balks and
+// preemptions under the mutex; the barber alone records the rest.
+struct CustomerClass {
+    int weight = 0;             // Share of the arrivals, out of total_weight.
+    uint64_t deadline_ns = 0;   // Longest wait for the barber's chair, 0 for none.
+    balk_rule on_full = BALK_LEAVE;
+    int arrived = 0;
+    int balked = 0;
+    int preempted = 0;
+    int served = 0;
+    int missed_deadline = 0;
+    LatencyHistogram wait;      // From the intended arrival to the barber's chair.
+};
+CustomerClass classes[NUM_CLASSES];
+int total_weight = 0;
+
+// A customer in the waiting room.
+struct WaitingCustomer {
+    int id;
+    customer_class type;
+    uint64_t arrival_ns;
+};
 
 // Mutex lock semaphore, and queue variables.
-pthread_mutex_t mutex;
-queue<int> customer_queue;
+SampleLock queue_mutex;
+// The waiting room: one level per class with the VIPs on level 0, so the next
+// customer to seat and the one to preempt are both found in constant time.
+BucketQueue<WaitingCustomer> customer_queue;
+// The barber's pass through the locked queue, for --perf.
+PerfRegion barber_pop("barber_pop");
+
+// level_of()
+// The waiting-room level of a class.
+int level_of(customer_class type) {
+    return VIP - type;
+}
+
+// Events logged by the barber and the customers.
+enum barbershop_event {
+    CUSTOMER_WAITING,   // arg: number of waiting customers
+    CUSTOMER_BALKED,
+    CUSTOMER_PREEMPTED, // arg: customer given the chair
+    CUSTOMER_SEATED,
+    BARBER_WOKEN,
+    HAIRCUT_FINISHED,
+    BARBER_ASLEEP
+};
+
+// append_customer()
+// Appends "Customer #id" to out without building a string.
+void append_customer(string& out, int64_t id) {
+    out += "Customer #";
+    log_append(out, id);
+}
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    switch (e.event) {
+        case CUSTOMER_WAITING:
+            append_customer(out, e.entity);
+            out += " arrives and sits in the waiting room. Current # of waiting customers: ";
+            log_append(out, e.arg);
+            out += "\n";
+            break;
+        case CUSTOMER_BALKED:
+            append_customer(out, e.entity);
+            out += " arrives and sees that there is no room for them in the waiting room, so they leave.\n";
+            break;
+        case CUSTOMER_PREEMPTED:
+            append_customer(out, e.entity);
+            out += " gives up their chair in the waiting room to ";
+            append_customer(out, e.arg);
+            out += " and leaves.\n";
+            break;
+        case CUSTOMER_SEATED:
+            append_customer(out, e.entity);
+            out += " sits down in the barber's chair.\n";
+            break;
+        case BARBER_WOKEN:
+            append_customer(out, e.entity);
+            out += " has woken the barber.\n";
+            break;
+        case HAIRCUT_FINISHED:
+            append_customer(out, e.entity);
+            out += "'s haircut is finished. They leave the barbershop.\n";
+            break;
+        case BARBER_ASLEEP:
+            out += "There are no customers waiting. The barber has fallen asleep.\n";
+            break;
+    }
+}
 
 // Code for the barber, the "worker thread"
 void* barber(void* arg) {
+    trace_thread_name("barber");
+    perf_thread_start("barber");
     while (worker_active) {
         // Lock the mutex (nodifying the customer queue).
-        pthread_mutex_lock(&mutex);
+        perf_begin(barber_pop);
+        sync_mutex_lock(&queue_mutex);
         // Check the customer queue.
         if (!customer_queue.empty()) { // There are customers in the queue.
-            // Pop the first customer from the queue.
-            int customer = customer_queue.front();
-            customer_queue.pop();
+            // Pop the first customer of the highest class from the queue.
+            WaitingCustomer waiting = customer_queue.pop_min();
+            int customer = waiting.id;
+            handoff.dequeued(customer);
+            trace_queue("customer_queue", "pop customer_queue", customer_queue.size());
+            live_queue_depth->set(customer_queue.size());
 
             // Unlock the mutex (done with modifications to the customer queue)
-            pthread_mutex_unlock(&mutex);
+            sync_mutex_unlock(&queue_mutex);
+            perf_end(barber_pop);
             // Announce that a new customer is being processed.
-            cout << "Customer #" << customer << " sits down in the barber's chair.\n";
+            log_event(CUSTOMER_SEATED, customer);
+            // Record how long they waited, against their class's deadline.
+            CustomerClass& c = classes[waiting.type];
+            uint64_t waited = monotonic_ns() - waiting.arrival_ns;
+            c.wait.record(waited);
+            c.served++;
+            if (c.deadline_ns != 0 && waited > c.deadline_ns) {
+                c.missed_deadline++;
+            }
 
             // If the barber is asleep, wake up the barber.
             if (barber_status == ASLEEP) {
                 barber_status = AWAKE;
-                cout << "Customer #" << customer << " has woken the barber.\n";
+                log_event(BARBER_WOKEN, customer);
             }
 
             // Process the customer in the barber's chair.
             // Wait x time to "process the customer".
-            sleep(barber_wait_time);
+            trace_begin("haircut", customer);
+            sleep_for_ns(arrival_service(customer - 1, barber_wait_time));
+            trace_end("haircut", customer);
             // Customer is done being processed.
-            cout << "Customer #" << customer << "'s haircut is finished. They leave the barbershop.\n";
+            log_event(HAIRCUT_FINISHED, customer);
+            live_served->add();
+            completion.count_down();
 
         } else { // There are no customers in the queue.
             // No customers in the queue, so the barber falls asleep.
             if (barber_status == AWAKE ) {
-                cout << "There are no customers waiting. The barber has fallen asleep.\n";
+                log_event(BARBER_ASLEEP, 0);
                 barber_status = ASLEEP;
             }
 
             // Unlock the mutex (done with modifications to the customer queue)
-            pthread_mutex_unlock(&mutex);
+            sync_mutex_unlock(&queue_mutex);
+            perf_end(barber_pop);
+            // Sleep until a customer arrives or the simulation ends.
+            barber_wakeup.wait();
         }
     }
     return NULL;
 }
 
-int main() {
+// draw_class()
+// The class of the customer just arrived: from the arrival trace, or drawn by
+// the --class-mix weights.
+customer_class draw_class() {
+    if (arrival_current != NULL) {
+        return (customer_class)(arrival_current->type % NUM_CLASSES);
+    }
+    int draw = sim_choice(total_weight);
+    int type = 0;
+    while (draw >= classes[type].weight) {
+        draw -= classes[type].weight;
+        type++;
+    }
+    return (customer_class)type;
+}
+
+// preempt()
+// Frees a chair for customer id of the given class, if the class preempts and
+// someone of a lower class is waiting: the newest of the lowest class waiting
+// leaves. Call with the mutex held.
+bool preempt(customer_class type, int id) {
+    if (classes[type].on_full != BALK_PREEMPT || customer_queue.empty() ||
+        customer_queue.max_level() <= level_of(type)) {
+        return false;
+    }
+    WaitingCustomer evicted = customer_queue.pop_back(customer_queue.max_level());
+    classes[evicted.type].preempted++;
+    log_event(CUSTOMER_PREEMPTED, evicted.id, id);
+    completion.count_down();
+    return true;
+}
+
+// split_classes()
+// Splits a per-class option into one value per class.
+vector<string> split_classes(Options& options, const string& name, const string& text) {
+    vector<string> values;
+    stringstream list(text);
+    string value;
+    while (getline(list, value, ',')) {
+        values.push_back(value);
+    }
+    if (values.size() != NUM_CLASSES) {
+        options.fail("--" + name + " takes one value per class: walk-in,appointment,vip");
+    }
+    return values;
+}
+
+// read_classes()
+// Reads --class-mix, --deadlines and --balk.
+void read_classes(Options& options) {
+    vector<string> weights = split_classes(options, "class-mix", options.get("class-mix", "100,0,0"));
+    vector<string> deadlines = split_classes(options, "deadlines", options.get("deadlines", "0,0,0"));
+    vector<string> rules = split_classes(options, "balk", options.get("balk", "leave,leave,leave"));
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        istringstream weight(weights[c]);
+        if (!(weight >> classes[c].weight) || !(weight >> ws).eof() || classes[c].weight < 0) {
+            options.fail("--class-mix weights must be whole numbers of at least 0");
+        }
+        total_weight += classes[c].weight;
+        if (!parse_duration(deadlines[c], classes[c].deadline_ns)) {
+            options.fail("--deadlines must be durations such as 500ms, or 0 for none");
+        }
+        if (rules[c] == "leave" || rules[c] == "preempt") {
+            classes[c].on_full = (rules[c] == "leave") ? BALK_LEAVE : BALK_PREEMPT;
+        } else {
+            options.fail("--balk takes leave or preempt for each class, not " + rules[c]);
+        }
+    }
+    if (total_weight == 0) {
+        options.fail("--class-mix needs at least one class with a weight above 0");
+    }
+}
+
+// class_report()
+// Prints each class's results and adds them to the report.
+void class_report(Report& report) {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        const CustomerClass& k = classes[c];
+        string label = CLASS_LABELS[c];
+        if (k.arrived > 0) {
+            cout << "Class " << label << ": " << k.arrived << " arrived, " << k.served << " served, " << k.balked <<
+                    " balked, " << k.preempted << " preempted; wait p50 " << k.wait.percentile(50) << " ns, p99 " <<
+                    k.wait.percentile(99) << " ns, max " << (k.wait.total ? k.wait.max : 0) << " ns";
+            if (k.deadline_ns != 0) {
+                cout << "; " << k.missed_deadline << " past the " << format_duration(k.deadline_ns) << " deadline";
+            }
+            cout << endl;
+        }
+        report.add(label + "_weight", k.weight);
+        report.add(label + "_deadline", format_duration(k.deadline_ns));
+        report.add(label + "_balk", k.on_full == BALK_LEAVE ? "leave" : "preempt");
+        report.add(label + "_arrived", k.arrived);
+        report.add(label + "_served", k.served);
+        report.add(label + "_balked", k.balked);
+        report.add(label + "_preempted", k.preempted);
+        report.add(label + "_missed_deadline", k.missed_deadline);
+        k.wait.add_to_report(report, label + "_wait");
+    }
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
     // Initialize the mutex lock
-    pthread_mutex_init(&mutex, NULL);
+    sync_mutex_init(&queue_mutex, "mutex");
 
     // Ask user how many customers they'd like to simulate 
     cout << "Barbershop Simulation\n" << \
             "--------------------\n";
-    cout << "How many customers would you like to simulate? (n): ";
-    cin >> num_customers;
-    cout << "How many chairs are in the waiting room? (n): ";
-    cin >> max_chairs;
-    cout << "How often should new customers appear? (seconds): ";
-    cin >> customer_rate;
-    cout << "How long should the barber spend on each customer? (seconds): ";
-    cin >> barber_wait_time;
+    options.ask("customers", "How many customers would you like to simulate? (n): ", num_customers);
+    options.ask("chairs", "How many chairs are in the waiting room? (n): ", max_chairs);
+    options.ask("customer-rate", "How often should new customers appear? (seconds, or e.g. 250ms, exp:50us): ", customer_rate);
+    options.ask("barber-time", "How long should the barber spend on each customer? (seconds, or e.g. 250ms, exp:50us): ", barber_wait_time);
+    read_classes(options);
+    sim_time_start(options);
+    arrival_trace_start(options, num_customers);
+    replay_start(options, "barbershop");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    perf_start(options);
+    live_stats_start(options, "barbershop");
+    live_arrived = live_counter("arrived");
+    live_served = live_counter("served");
+    live_balked = live_counter("balked");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&queue_mutex, sizeof(queue_mutex));
+    customer_queue.init(NUM_CLASSES, max_chairs);
+    placement_bind(&customer_queue, sizeof(customer_queue));
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_customers);
+    handoff.reset(num_customers);
 
     // Initalize barber worker thread.
     barber_status = ASLEEP;
     worker_active = true;
     pthread_t barber_thread;
-    pthread_create(&barber_thread, NULL, barber, 0);
+    pthread_create(&barber_thread, placement_worker_attr(), barber, 0);
 
-    // Enqueue customers.
+    // Enqueue customers. Arrival times come from the schedule (see --load), and
+    // latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(customer_rate);
     for (int i = 1; i < num_customers + 1; i++) {
+        uint64_t arrival_ns = arrivals.wait();
+        customer_class type = draw_class();
         // Lock the mutex (nodifying the customer queue).
-        pthread_mutex_lock(&mutex);
+        sync_mutex_lock(&queue_mutex);
+        live_arrived->add();
+        classes[type].arrived++;
+        bool notify_barber = false;
 
-        if (customer_queue.size() >= max_chairs) {
-            // Queue full, do not add.
-            cout << "Customer #" << i << " arrives and sees that there is no room for them in the waiting room, so they leave.\n";
+        if (customer_queue.size() >= max_chairs && !preempt(type, i)) {
+            // Queue full, and no one this customer may take a chair from.
+            num_balked++;
+            classes[type].balked++;
+            live_balked->add();
+            log_event(CUSTOMER_BALKED, i);
+            completion.count_down();
         } else {
-            customer_queue.push(i);
-            cout << "Customer #" << i << " arrives and sits in the waiting room. Current # of waiting customers: " << customer_queue.size() << "\n";
+            handoff.enqueued(i, arrival_ns);
+            customer_queue.push(level_of(type), WaitingCustomer{i, type, arrival_ns});
+            trace_queue("customer_queue", "push customer_queue", customer_queue.size());
+            live_queue_depth->set(customer_queue.size());
+            log_event(CUSTOMER_WAITING, i, customer_queue.size());
+            // Wake the barber if this customer is the only one waiting.
+            notify_barber = customer_queue.size() == 1;
         }
 
         // Unlock the mutex (done with modifications to the customer queue)
-        pthread_mutex_unlock(&mutex);
-
-        // Wait customer_rate amount seconds before another customer arrives.
-        sleep(customer_rate);
+        sync_mutex_unlock(&queue_mutex);
+        if (notify_barber) {
+            barber_wakeup.notify();
+        }
     }
 
-    // Hold the main thread until the customer queue is empty.
-    while (!customer_queue.empty()) {}
-    // Wait an additional time for the barber to finish with the last customer.
-    sleep(barber_wait_time);
-    // Kill the barber.
+    // Hold the main thread until every customer has had a haircut or left.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the barber and wait for it to exit.
     worker_active = false;
+    wakeup_shutdown();
+    pthread_join(barber_thread, NULL);
 
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker thread to finish being killed before printing results.
-    sleep(1);
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
             "-------------------\n";
     cout << "The barber shop is now closed.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("customers", num_customers);
+    report.add("chairs", max_chairs);
+    report.add("customer_rate", customer_rate.to_string());
+    report.add("barber_time", barber_wait_time.to_string());
+    int num_preempted = 0;
+    for (const CustomerClass& c : classes) {
+        num_preempted += c.preempted;
+    }
+    report.add("served", num_customers - num_balked - num_preempted);
+    report.add("balked", num_balked);
+    report.add("preempted", num_preempted);
+    report.add("elapsed_us", elapsed_us);
+    class_report(report);
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    alloc_report(report, num_customers);
+    lock_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
 
     // Free the mutex lock.
-    pthread_mutex_destroy(&mutex);
+    sync_mutex_destroy(&queue_mutex);
 
     return 0;
 }
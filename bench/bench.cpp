@@ -0,0 +1,395 @@
+// Regression benchmarks for the simulations.
+//
+// Runs a fixed, seeded workload of every sample at several scales and measures,
+// over --repeat runs of each:
+//   throughput    entities served per second of the program's elapsed time
+//   p50_ns        median latency from an entity's intended arrival to its pop
+//   p99_ns        99th percentile of the same
+//   cpu_us        user plus system CPU time of the process
+//   max_rss_kb    peak resident set size
+// Every entity arrives at the start and is served in no time, so the runs
+// measure the samples' own queueing and synchronization cost rather than the
+// simulated service, and --seed fixes every random choice. The barbershop and
+// office hours get a chair for every entity, so nobody is turned away; a run
+// whose report counts fewer served than entities fails.
+//
+// Example:
+//   bench --output=baseline.json                        record a baseline
+//   bench --baseline=baseline.json --output=new.json    compare against it
+//   bench --sample=cigarettes,vermont_bridge --scales=large
+//
+// The results file is a JSON array with one flat object per workload: the
+// median of each metric and its noise, the median absolute deviation scaled to
+// a standard deviation, relative to the median. With --baseline every metric
+// is compared with the same workload's in the baseline file, and a change
+// counts only if it exceeds both --threshold percent and --noise-factor times
+// the combined noise of the two measurements. bench exits with status 1 if any
+// metric regressed or any run failed, so scripts can gate on it.
+//
+// The samples are looked up under --root (default ".") where the repository
+// builds them, e.g. barbershop/barbershop. Runs go one at a time, pinned to the
+// first --cpus allowed CPUs, after --warmup discarded runs of each workload.
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <unistd.h>
+#include "../common/options.h"
+#include "../common/run_process.h"
+#include "../common/topology.h"
+
+using namespace std;
+
+// A sample and its fixed workload. The entity count is passed with
+// count_option, except for readers_writers, whose operations are spelled out,
+// and also as the number of chairs for samples with a chairs_option. Samples
+// that can turn entities away report how many they served as served_key.
+struct BenchSample {
+    string name;
+    string program;             // Relative to --root.
+    string count_option;
+    string chairs_option;
+    string served_key;
+    vector<string> args;
+};
+
+const vector<BenchSample> BENCH_SAMPLES = {
+    {"barbershop", "barbershop/barbershop", "customers", "chairs", "served", {"--customer-rate=0", "--barber-time=0"}},
+    {"teaching_assistant", "teaching_assistant/teaching_assistant", "students", "chairs", "helped",
+     {"--student-rate=0", "--ta-time=0"}},
+    {"cigarettes", "cigarettes/cigarettes", "smokers", "", "", {"--smoker-rate=0", "--agent-time=0"}},
+    {"readers_writers", "readers_writers/readers_writers", "operations", "", "", {}},
+    {"vermont_bridge", "vermont_bridge/vermont_bridge", "farmers", "", "", {"--arrival-rate=0", "--time-to-cross=0"}},
+    {"monkeys_queue", "monkeys/monkeys_queue", "monkeys", "", "", {"--arrival-rate=0", "--time-to-cross=0"}},
+    {"monkeys_2", "monkeys/monkeys_2/monkeys", "primates", "", "",
+     {"--mode=monkey", "--arrival-rate=0", "--time-to-cross=0"}},
+};
+
+const vector<pair<string, int>> BENCH_SCALES = {{"small", 1000}, {"medium", 10000}, {"large", 100000}};
+
+// Operation mix of the readers_writers workload, repeated to the entity count.
+const string READERS_WRITERS_MIX = "RRRW";
+
+struct BenchMetric {
+    string name;
+    bool higher_is_better;
+};
+
+const vector<BenchMetric> BENCH_METRICS = {
+    {"throughput", true}, {"p50_ns", false}, {"p99_ns", false}, {"cpu_us", false}, {"max_rss_kb", false},
+};
+
+// One workload's measurements: every run's value of every metric, then their
+// medians and noise.
+struct BenchResult {
+    string sample;
+    string scale;
+    int entities = 0;
+    int failed = 0;
+    vector<vector<double>> runs;    // runs[metric][repeat]
+    vector<double> median;
+    vector<double> noise;
+};
+
+// split()
+// Splits a comma-separated list.
+vector<string> split(const string& list) {
+    vector<string> items;
+    stringstream in(list);
+    string item;
+    while (getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// median_of()
+double median_of(vector<double> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    size_t n = values.size();
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// noise_of()
+// The median absolute deviation, scaled to estimate a standard deviation
+// (1.4826 for normally distributed values), relative to the median.
+double noise_of(const vector<double>& values, double median) {
+    if (values.size() < 2 || median == 0) {
+        return 0;
+    }
+    vector<double> deviations;
+    for (double v : values) {
+        deviations.push_back(fabs(v - median));
+    }
+    return 1.4826 * median_of(deviations) / fabs(median);
+}
+
+// report_number()
+// A numeric field of a parsed report, or -1 if it is missing.
+double report_number(const vector<pair<string, string>>& report, const string& key) {
+    for (const auto& field : report) {
+        if (field.first == key) {
+            return atof(field.second.c_str());
+        }
+    }
+    return -1;
+}
+
+// unquote()
+// A JSON string value without its quotes.
+string unquote(const string& value) {
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+        return value.substr(1, value.size() - 2);
+    }
+    return value;
+}
+
+// run_workload()
+// Runs one sample at one scale --warmup + --repeat times and keeps the
+// measured runs.
+BenchResult run_workload(const BenchSample& sample, const string& scale, int entities, const string& root,
+                         const vector<int>& cpus, int warmup, int repeat, long long seed) {
+    BenchResult result;
+    result.sample = sample.name;
+    result.scale = scale;
+    result.entities = entities;
+    result.runs.assign(BENCH_METRICS.size(), vector<double>());
+
+    vector<string> args = {root + "/" + sample.program};
+    if (sample.name == "readers_writers") {
+        string operations;
+        while ((int)operations.size() < entities) {
+            operations += READERS_WRITERS_MIX;
+        }
+        operations.resize(entities);
+        args.push_back("--operations=" + operations);
+    } else {
+        args.push_back("--" + sample.count_option + "=" + to_string(entities));
+    }
+    if (!sample.chairs_option.empty()) {
+        args.push_back("--" + sample.chairs_option + "=" + to_string(entities));
+    }
+    args.insert(args.end(), sample.args.begin(), sample.args.end());
+    args.push_back("--seed=" + to_string(seed));
+    args.push_back("--non-interactive");
+    args.push_back("--quiet");
+    args.push_back("--report=json");
+
+    for (int r = 0; r < warmup + repeat; r++) {
+        ProcessResult process = run_pinned(args, cpus);
+        vector<pair<string, string>> report = parse_report_line(process.output);
+        double elapsed_us = report_number(report, "elapsed_us");
+        if (process.exit_status != 0 || elapsed_us <= 0) {
+            cerr << sample.name << " (" << scale << ") failed with status " << process.exit_status << "\n";
+            result.failed++;
+            continue;
+        }
+        double served = sample.served_key.empty() ? entities : report_number(report, sample.served_key);
+        if (served != entities) {
+            cerr << sample.name << " (" << scale << ") served " << served << " of " << entities << " entities\n";
+            result.failed++;
+            continue;
+        }
+        if (r < warmup) {
+            continue;
+        }
+        double values[] = {
+            served * 1e6 / elapsed_us,
+            report_number(report, "arrival_to_pop_p50_ns"),
+            report_number(report, "arrival_to_pop_p99_ns"),
+            (double)(process.user_us + process.system_us),
+            (double)process.max_rss_kb,
+        };
+        for (size_t m = 0; m < BENCH_METRICS.size(); m++) {
+            result.runs[m].push_back(values[m]);
+        }
+    }
+    for (size_t m = 0; m < BENCH_METRICS.size(); m++) {
+        double median = median_of(result.runs[m]);
+        result.median.push_back(median);
+        result.noise.push_back(noise_of(result.runs[m], median));
+    }
+    return result;
+}
+
+// write_results()
+// Writes the results file, one workload per line.
+void write_results(ostream& out, const vector<BenchResult>& results, int repeat, long long seed,
+                   const vector<int>& cpus) {
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "{\"sample\": \"" << r.sample << "\", \"scale\": \"" << r.scale << "\", \"entities\": " <<
+               r.entities << ", \"repeat\": " << repeat << ", \"seed\": " << seed << ", \"cpus\": " <<
+               cpus.size() << ", \"failed\": " << r.failed;
+        for (size_t m = 0; m < BENCH_METRICS.size(); m++) {
+            out << fixed << setprecision(1) << ", \"" << BENCH_METRICS[m].name << "\": " << r.median[m] <<
+                   setprecision(4) << ", \"" << BENCH_METRICS[m].name << "_noise\": " << r.noise[m];
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+// read_baseline()
+// Reads a results file back as one parsed object per workload.
+vector<vector<pair<string, string>>> read_baseline(Options& options, const string& path) {
+    ifstream in(path);
+    if (!in) {
+        options.fail("cannot read --baseline " + path);
+    }
+    vector<vector<pair<string, string>>> workloads;
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line[0] == '{') {
+            workloads.push_back(parse_report_line(line));
+        }
+    }
+    return workloads;
+}
+
+int main(int argc, char** argv) {
+    Options options(argc, argv);
+    string root = options.get("root", ".");
+    string sample_list = options.get("sample", "");
+    string scale_list = options.get("scales", "small,medium");
+    int repeat = options.value("repeat", 5);
+    int warmup = options.value("warmup", 1);
+    long long seed = options.value("seed", 1LL);
+    double threshold = options.value("threshold", 5.0);
+    double noise_factor = options.value("noise-factor", 3.0);
+    string baseline_path = options.get("baseline", "");
+    string output_path = options.get("output", "");
+    vector<int> allowed = allowed_cpus();
+    int num_cpus = options.value("cpus", min((int)allowed.size(), 4));
+    options.check_unused();
+    if (repeat < 1 || warmup < 0) {
+        options.fail("--repeat must be at least 1 and --warmup at least 0");
+    }
+    if (num_cpus < 1 || num_cpus > (int)allowed.size()) {
+        options.fail("--cpus must be between 1 and " + to_string(allowed.size()));
+    }
+    vector<int> cpus(allowed.begin(), allowed.begin() + num_cpus);
+
+    // Pick the workloads.
+    vector<const BenchSample*> samples;
+    for (const string& name : split(sample_list)) {
+        auto found = find_if(BENCH_SAMPLES.begin(), BENCH_SAMPLES.end(),
+                             [&](const BenchSample& s) { return s.name == name; });
+        if (found == BENCH_SAMPLES.end()) {
+            options.fail("unknown --sample " + name);
+        }
+        samples.push_back(&*found);
+    }
+    if (samples.empty()) {
+        for (const BenchSample& s : BENCH_SAMPLES) {
+            samples.push_back(&s);
+        }
+    }
+    vector<pair<string, int>> scales;
+    for (const string& name : split(scale_list)) {
+        auto found = find_if(BENCH_SCALES.begin(), BENCH_SCALES.end(),
+                             [&](const pair<string, int>& s) { return s.first == name; });
+        if (found == BENCH_SCALES.end()) {
+            options.fail("unknown scale " + name + " (expected small, medium or large)");
+        }
+        scales.push_back(*found);
+    }
+    for (const BenchSample* sample : samples) {
+        string path = root + "/" + sample->program;
+        if (access(path.c_str(), X_OK) != 0) {
+            options.fail(path + " is not built (see --root)");
+        }
+    }
+    vector<vector<pair<string, string>>> baseline;
+    if (!baseline_path.empty()) {
+        baseline = read_baseline(options, baseline_path);
+    }
+
+    // Run every workload.
+    vector<BenchResult> results;
+    bool failed = false;
+    for (const BenchSample* sample : samples) {
+        for (const auto& scale : scales) {
+            cerr << "bench: " << sample->name << " (" << scale.first << ", " << scale.second << " entities)\n";
+            results.push_back(run_workload(*sample, scale.first, scale.second, root, cpus, warmup, repeat, seed));
+            failed |= results.back().failed > 0;
+        }
+    }
+    if (!output_path.empty()) {
+        ofstream file(output_path);
+        write_results(file, results, repeat, seed, cpus);
+        if (!file) {
+            options.fail("cannot write " + output_path);
+        }
+    }
+
+    // Print the medians, and the comparison with the baseline if there is one.
+    bool regressed = false;
+    ostringstream table;
+    table << left << setw(28) << "Workload" << setw(12) << "Metric" << right;
+    if (baseline.empty()) {
+        table << setw(16) << "median" << setw(10) << "noise" << "\n";
+    } else {
+        table << setw(16) << "baseline" << setw(16) << "current" << setw(10) << "change" << setw(10) <<
+                 "allowed" << "  verdict\n";
+    }
+    for (const BenchResult& r : results) {
+        const vector<pair<string, string>>* base = NULL;
+        for (const auto& workload : baseline) {
+            if (unquote(workload.empty() ? "" : workload[0].second) == r.sample) {
+                for (const auto& field : workload) {
+                    if (field.first == "scale" && unquote(field.second) == r.scale) {
+                        base = &workload;
+                    }
+                }
+            }
+        }
+        for (size_t m = 0; m < BENCH_METRICS.size(); m++) {
+            const BenchMetric& metric = BENCH_METRICS[m];
+            table << left << setw(28) << (r.sample + " (" + r.scale + ")") << setw(12) << metric.name << right <<
+                     fixed << setprecision(1);
+            if (baseline.empty()) {
+                table << setw(16) << r.median[m] << setw(9) << r.noise[m] * 100 << "%\n";
+                continue;
+            }
+            double before = base ? report_number(*base, metric.name) : -1;
+            if (before <= 0) {
+                table << setw(16) << "-" << setw(16) << r.median[m] << setw(10) << "-" << setw(10) << "-" <<
+                         "  no baseline\n";
+                continue;
+            }
+            double before_noise = max(0.0, report_number(*base, metric.name + "_noise"));
+            double change = (r.median[m] - before) / before * 100;
+            double allowed_change = max(threshold, noise_factor * 100 * hypot(before_noise, r.noise[m]));
+            double gain = metric.higher_is_better ? change : -change;
+            string verdict = "unchanged";
+            if (gain < -allowed_change) {
+                verdict = "REGRESSED";
+                regressed = true;
+            } else if (gain > allowed_change) {
+                verdict = "improved";
+            }
+            table << setw(16) << before << setw(16) << r.median[m] << setw(9) << showpos << change << "%" <<
+                     noshowpos << setw(9) << allowed_change << "%  " << verdict << "\n";
+        }
+    }
+    cout << table.str() << flush;
+    if (regressed) {
+        cerr << "bench: regressions against " << baseline_path << "\n";
+    }
+    return (regressed || failed) ? 1 : 0;
+}
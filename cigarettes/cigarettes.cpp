@@ -10,15 +10,44 @@
 // on completion. The agent then puts out another two of the three ingredients,
 // and the cycle repeats.
 
+// With --agents=M (or --agents=cores) the smokeshop has M agents, each with a
+// table and a queue of its own. Arriving smokers are sent to the least loaded
+// table (--dispatch=shortest, the default) or to each table in turn
+// (--dispatch=round-robin), and an agent whose table is empty takes the
+// first smoker waiting at the next busy table before it goes to sleep. The
+// run reports cigarettes per second and how busy each agent was. The sync
+// wrappers register at most SYNC_MAX_OBJECTS (16) objects, so the tables
+// beyond the 16th keep unregistered mutexes: they work as usual but are left
+// out of --trace, --lock-profile, the watchdog dump and --replay's lock order.
+// To see the throughput as the agents grow to the core count, e.g.
+//   sweep --program=cigarettes/cigarettes --param agents=1..8
+//         --param smokers=10000 --param smoker-rate=exp:100us --param agent-time=exp:400us
+
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <vector>
 #include <queue>
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <optional>
+#include <memory>
 #include <pthread.h>
 #include <unistd.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/lockfree_queue.h"
+#include "../common/alloc_count.h"
+#include "../common/topology.h"
+#include "../common/perf.h"
 
 using namespace std;
 
@@ -36,8 +65,9 @@ class Smoker {
 
         Smoker(int id) {
             this->id = id;
-            // Generate random number from 0 to 2.
-            int random_int = rand() % 3;
+            // Generate random number from 0 to 2, or take it from the
+            // arrival trace.
+            int random_int = arrival_choice(3);
             // Assign random item to smoker.
             this->inventory.push_back(VALID_ITEMS[random_int]);
         }
@@ -81,142 +111,557 @@ class Smoker {
 };
 
 // Global variables
-int num_smokers;
-long int agent_wait_time;
-long int smoker_rate;
-bool agent_active = false;
+int num_smokers = 10;
+Interval agent_wait_time = Interval::seconds(1);
+Interval smoker_rate = Interval::seconds(1);
+atomic<bool> agent_active(false);
+// Counted down once per smoker that has been vended to.
+CompletionLatch completion;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_smoked;
+LiveMetric* live_queue_depth;
 
 // Enum for agent status.
 enum enum_agent_status {ASLEEP = 0, AWAKE = 1};
-enum_agent_status agent_status = ASLEEP;
 
-// Mutex lock and queue variables.
-pthread_mutex_t mutex; // Locks shared variables
-queue<Smoker> smoker_queue; // Shared variable
+// How arriving smokers are sent to the tables.
+enum dispatch_policy {DISPATCH_SHORTEST, DISPATCH_ROUND_ROBIN};
+const char* const DISPATCH_LABELS[] = {"shortest", "round-robin"};
+const int MAX_AGENTS = 1024;
+int num_agents = 1;
+dispatch_policy dispatch = DISPATCH_SHORTEST;
+
+// One agent's table: its queue of smokers, the mutex guarding it and the
+// agent's own counters.
+struct alignas(64) Table {
+    int index = 0;
+    // Names for the lock, the queue and the thread, numbered from 2 when there
+    // is more than one table so that a single table keeps its old names.
+    string mutex_name = "mutex";
+    string queue_name = "smoker_queue";
+    string thread_name = "agent";
+    SampleLock mutex; // Locks shared variables
+    queue<Smoker> smoker_queue; // Shared variable
+    // Used instead of smoker_queue with --queue=lockfree.
+    LockFreeQueue<Smoker> lockfree_smoker_queue;
+    // Wakes the agent when a smoker arrives to an empty table, or when there
+    // are smokers to take from a busy one.
+    Wakeup wakeup;
+    // Load seen by the dispatcher: smokers queued, and whether one is being
+    // vended to.
+    atomic<int> queued{0};
+    atomic<bool> busy{false};
+    // Set while the agent sleeps with nothing to do.
+    atomic<bool> sleeping{false};
+    // Owned by the agent.
+    enum_agent_status agent_status = ASLEEP;
+    long long served = 0;
+    long long stolen = 0;
+    uint64_t busy_ns = 0;
+};
+
+vector<unique_ptr<Table>> tables;
+// Smokers queued at every table.
+atomic<int> total_queued(0);
+// Next table for round-robin dispatch, and where shortest starts looking.
+unsigned next_table = 0;
+// An agent's pass through its table's queue, for --perf.
+PerfRegion agent_pop("agent_pop");
+
+// Events logged by the agent and the smokers.
+enum smokeshop_event {
+    SMOKER_ARRIVED,
+    AGENT_WOKEN,
+    SMOKER_INVENTORY,   // arg: packed inventory, see pack_items()
+    SMOKER_NEEDS,       // arg: packed items needed
+    AGENT_GRABBING,
+    SMOKER_SMOKES,
+    AGENT_ASLEEP,
+    AGENT_STEALS        // arg: packed tables, see pack_tables()
+};
+
+// pack_tables()
+// Packs the agent's table and, for AGENT_STEALS, the table a smoker was taken
+// from into a log argument.
+int64_t pack_tables(int agent_table, int from_table = 0) {
+    return agent_table | (from_table << 16);
+}
+
+// append_agent()
+// Appends "Agent #n" for the agent of a packed table, or "Agent" for the only
+// one.
+void append_agent(string& out, int64_t tables) {
+    out += "Agent";
+    if (num_agents > 1) {
+        out += " #";
+        log_append(out, (tables & 0xffff) + 1);
+    }
+}
+
+// pack_items()
+// Packs a list of items into a log argument, four bits per item (its index in
+// VALID_ITEMS plus one), so the list can be logged without building a string.
+int64_t pack_items(const vector<string>& items) {
+    int64_t packed = 0;
+    int shift = 0;
+    for (const string& item : items) {
+        int index = find(VALID_ITEMS.begin(), VALID_ITEMS.end(), item) - VALID_ITEMS.begin();
+        packed |= (int64_t)(index + 1) << shift;
+        shift += 4;
+    }
+    return packed;
+}
+
+// append_items()
+// Inverse of pack_items(): appends the items to out as a comma-separated list.
+void append_items(string& out, int64_t packed) {
+    for (bool first = true; packed != 0; packed >>= 4, first = false) {
+        if (!first) {
+            out += ", ";
+        }
+        out += VALID_ITEMS[(packed & 0xf) - 1];
+    }
+}
+
+// append_smoker()
+// Appends "Smoker #id" to out without building a string.
+void append_smoker(string& out, int64_t id) {
+    out += "Smoker #";
+    log_append(out, id);
+}
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    switch (e.event) {
+        case SMOKER_ARRIVED:
+            append_smoker(out, e.entity);
+            out += " has arrived.\n";
+            break;
+        case AGENT_WOKEN:
+            append_smoker(out, e.entity);
+            if (num_agents > 1) {
+                out += " has woken agent #";
+                log_append(out, (e.arg & 0xffff) + 1);
+                out += ".\n";
+            } else {
+                out += " has woken the barber.\n";
+            }
+            break;
+        case SMOKER_INVENTORY:
+            append_smoker(out, e.entity);
+            out += "'s inventory: ";
+            if (e.arg) {
+                append_items(out, e.arg);
+            } else {
+                out += "nothing.";
+            }
+            out += "\n";
+            break;
+        case SMOKER_NEEDS:
+            append_smoker(out, e.entity);
+            out += " needs ";
+            append_items(out, e.arg);
+            out += " to roll a cigarette.\n";
+            break;
+        case AGENT_GRABBING:
+            append_agent(out, e.arg);
+            out += " is grabbing the requested items...\n";
+            break;
+        case SMOKER_SMOKES:
+            append_smoker(out, e.entity);
+            out += " smokes a cigarette and leaves.\n";
+            break;
+        case AGENT_ASLEEP:
+            if (num_agents > 1) {
+                out += "There are no smokers to take. ";
+                append_agent(out, e.arg);
+                out += " has gone to sleep.\n";
+            } else {
+                out += "There are no smokers in the queue. The agent has gone to sleep.\n";
+            }
+            break;
+        case AGENT_STEALS:
+            append_agent(out, e.arg);
+            out += " takes ";
+            append_smoker(out, e.entity);
+            out += " from table #";
+            log_append(out, (e.arg >> 16) + 1);
+            out += ".\n";
+            break;
+    }
+}
+
+// take_smoker()
+// Pops the first smoker off a table's queue for the given agent, if there is
+// one. With the locked queue, call with the table's mutex held.
+optional<Smoker> take_smoker(Table& table, int agent) {
+    optional<Smoker> smoker;
+    size_t depth = 0;
+    if (queue_lockfree) {
+        smoker = table.lockfree_smoker_queue.pop();
+        depth = table.lockfree_smoker_queue.size();
+    } else if (!table.smoker_queue.empty()) {
+        smoker = table.smoker_queue.front();
+        table.smoker_queue.pop();
+        depth = table.smoker_queue.size();
+    }
+    if (smoker) {
+        table.queued.fetch_sub(1);
+        int waiting = total_queued.fetch_sub(1) - 1;
+        handoff.dequeued(smoker->id, agent);
+        trace_queue(table.queue_name.c_str(), "pop smoker_queue", depth);
+        live_queue_depth->set(waiting);
+    }
+    return smoker;
+}
+
+// steal_smoker()
+// Takes the first smoker off the next table, after the agent's own, that has
+// any waiting.
+optional<Smoker> steal_smoker(Table& thief) {
+    for (int i = 1; i < num_agents; i++) {
+        Table& table = *tables[(thief.index + i) % num_agents];
+        if (table.queued.load() == 0) {
+            continue;
+        }
+        if (!queue_lockfree) {
+            sync_mutex_lock(&table.mutex);
+        }
+        optional<Smoker> smoker = take_smoker(table, thief.index);
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&table.mutex);
+        }
+        if (smoker) {
+            log_event(AGENT_STEALS, smoker->id, pack_tables(thief.index, table.index));
+            thief.stolen++;
+            return smoker;
+        }
+    }
+    return nullopt;
+}
+
+// choose_table()
+// The table an arriving smoker is sent to.
+Table& choose_table() {
+    if (num_agents == 1) {
+        return *tables[0];
+    }
+    unsigned start = next_table++;
+    if (dispatch == DISPATCH_ROUND_ROBIN) {
+        return *tables[start % num_agents];
+    }
+    // Shortest queue, counting a smoker being vended to. Ties go to the first
+    // table after a rotating start, so equal tables share the arrivals.
+    Table* best = NULL;
+    int best_load = 0;
+    for (int i = 0; i < num_agents; i++) {
+        Table& table = *tables[(start + i) % num_agents];
+        int load = table.queued.load() + table.busy.load();
+        if (best == NULL || load < best_load) {
+            best = &table;
+            best_load = load;
+        }
+    }
+    return *best;
+}
+
+// wake_sleeping_agent()
+// Wakes one sleeping agent other than the given table's, to take a smoker
+// from a busy table.
+void wake_sleeping_agent(const Table& busy_table) {
+    for (int i = 1; i < num_agents; i++) {
+        Table& table = *tables[(busy_table.index + i) % num_agents];
+        if (table.sleeping.exchange(false)) {
+            table.wakeup.notify();
+            return;
+        }
+    }
+}
 
 // Agent function 
 // Creates an "agent", a worker which contains infinite materials
 void* agent(void* arg) {
+    Table& table = *(Table*)arg;
+    trace_thread_name(table.thread_name.c_str());
+    perf_thread_start(table.thread_name.c_str());
     while (agent_active) {
-        // Take control of the mutex.
-        pthread_mutex_lock(&mutex);
-
-        // Check if there are smokers in the queue.
-        if (!smoker_queue.empty()) {
-            // Pop the first smoker off the queue.
-            Smoker smoker = smoker_queue.front();
-            smoker_queue.pop();
-            
-            // Release control of the mutex.
-            pthread_mutex_unlock(&mutex);
+        // Take control of the mutex, unless the queue is lock-free.
+        perf_begin(agent_pop);
+        if (!queue_lockfree) {
+            sync_mutex_lock(&table.mutex);
+        }
+
+        // Check if there are smokers in the queue, and pop the first one off.
+        optional<Smoker> next_smoker = take_smoker(table, table.index);
+        if (!next_smoker && table.agent_status == AWAKE) {
+            // Sleep the agent.
+            log_event(AGENT_ASLEEP, 0, pack_tables(table.index));
+            table.agent_status = ASLEEP;
+        }
+
+        // Release control of the mutex.
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&table.mutex);
+        }
+        perf_end(agent_pop);
+
+        // With an empty table, take a smoker from another one.
+        if (!next_smoker && num_agents > 1) {
+            next_smoker = steal_smoker(table);
+        }
+
+        if (next_smoker) {
+            Smoker& smoker = *next_smoker;
+            table.busy = true;
+            uint64_t busy_from_ns = monotonic_ns();
 
             // Wake up the agent if they're asleep.
-            if (agent_status == ASLEEP) {
-                cout << "Smoker #" << smoker.id << " has woken the barber.\n";
-                agent_status = AWAKE;
+            if (table.agent_status == ASLEEP) {
+                log_event(AGENT_WOKEN, smoker.id, pack_tables(table.index));
+                table.agent_status = AWAKE;
             }
 
             // Print the smokers inventory to the screen.
-            cout << smoker.to_string() << "\n";
+            log_event(SMOKER_INVENTORY, smoker.id, pack_items(smoker.inventory));
 
             // Find what the smoker needs for a cig and print to the screen.
             vector<string> items_needed = smoker.findNeeded();
-            cout << "Smoker #" << smoker.id << " needs ";
-            string items = "";
-            for (string item : items_needed) {
-                items += item + ", ";
-            }
-            items.resize(items.size() - 2);
-            cout << items << " to roll a cigarette.\n";
+            log_event(SMOKER_NEEDS, smoker.id, pack_items(items_needed));
 
             // Sleep to process the smoker.
-            cout << "Agent is grabbing the requested items...\n";
-            sleep(agent_wait_time);
+            log_event(AGENT_GRABBING, smoker.id, pack_tables(table.index));
+            trace_begin("vend", smoker.id);
+            sleep_for_ns(arrival_service(smoker.id - 1, agent_wait_time));
+            trace_end("vend", smoker.id);
 
             // Add items to smoker's inventory.
             for (string item : items_needed) {
                 smoker.inventory.push_back(item);
             }
-            cout << smoker.to_string() << "\n";
-            cout << "Smoker #" << smoker.id << " smokes a cigarette and leaves.\n";
+            log_event(SMOKER_INVENTORY, smoker.id, pack_items(smoker.inventory));
+            log_event(SMOKER_SMOKES, smoker.id);
+            live_smoked->add();
+            table.served++;
+            table.busy_ns += monotonic_ns() - busy_from_ns;
+            table.busy = false;
+            completion.count_down();
 
         } else { // The smoker queue is empty. 
-            // Sleep the agent.
-            if (agent_status == AWAKE) {
-                cout << "There are no smokers in the queue. The agent has gone to sleep.\n";
-                agent_status = ASLEEP;
+            // Tell the dispatcher this agent is free to take smokers from busy
+            // tables, then look once more, since a smoker may have arrived
+            // before the flag was visible.
+            if (num_agents > 1) {
+                table.sleeping = true;
+                if (total_queued.load() > 0) {
+                    table.sleeping = false;
+                    continue;
+                }
             }
-            // Release control of the mutex.
-            pthread_mutex_unlock(&mutex);
+            // Sleep until a smoker arrives or the simulation ends.
+            table.wakeup.wait();
+            table.sleeping = false;
         }
     }
     return NULL;
 }
 
 // Main program.
-int main() {
-    // Initialize the mutex lock
-    pthread_mutex_init(&mutex, NULL);
-    // Seed random number generator. 
-    srand(time(0));
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
 
     // Get input from the user.
     cout << "Cigarette/Smoker Simulation\n" << \
             "--------------------\n";
-    cout << "How many smokers would you like to simulate? (n): ";
-    cin >> num_smokers;
-    cout << "How often should new smokers appear? (seconds): ";
-    cin >> smoker_rate;
-    cout << "How long should the agent take to vend materials? (seconds): ";
-    cin >> agent_wait_time;
+    options.ask("smokers", "How many smokers would you like to simulate? (n): ", num_smokers);
+    options.ask("smoker-rate", "How often should new smokers appear? (seconds, or e.g. 250ms, exp:50us): ", smoker_rate);
+    options.ask("agent-time", "How long should the agent take to vend materials? (seconds, or e.g. 250ms, exp:50us): ", agent_wait_time);
+    string agents = options.get("agents", "1");
+    num_agents = (agents == "cores") ? min((int)allowed_cpus().size(), MAX_AGENTS) : atoi(agents.c_str());
+    if (num_agents < 1 || num_agents > MAX_AGENTS) {
+        options.fail("--agents must be from 1 to " + to_string(MAX_AGENTS) + ", or cores");
+    }
+    string policy = options.get("dispatch", "shortest");
+    if (policy == "round-robin") {
+        dispatch = DISPATCH_ROUND_ROBIN;
+    } else if (policy != "shortest") {
+        options.fail("unknown --dispatch " + policy + " (expected shortest or round-robin)");
+    }
+    sim_time_start(options);
+    arrival_trace_start(options, num_smokers);
+    replay_start(options, "cigarettes");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    queue_start(options);
+    perf_start(options);
+    live_stats_start(options, "cigarettes");
+    live_arrived = live_counter("arrived");
+    live_smoked = live_counter("smoked");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+
+    // Set up a table, and initialize its mutex lock, for every agent.
+    for (int a = 0; a < num_agents; a++) {
+        tables.push_back(make_unique<Table>());
+        Table& table = *tables.back();
+        table.index = a;
+        if (num_agents > 1) {
+            table.mutex_name += "_" + to_string(a + 1);
+            table.queue_name += "_" + to_string(a + 1);
+            table.thread_name += "_" + to_string(a + 1);
+        }
+        // The smokeshop registers nothing but the table mutexes.
+        if (a < SYNC_MAX_OBJECTS) {
+            sync_mutex_init(&table.mutex, table.mutex_name.c_str());
+        } else {
+            table.mutex.init();
+        }
+        placement_bind(&table, sizeof(table));
+    }
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_smokers);
+    handoff.reset(num_smokers);
+    // Agents pop from their own tables at the same time.
+    handoff.shard(num_agents);
 
-    // Start agent thread.
-    agent_status = ASLEEP;
+    // Start the agent threads, spread over the --placement's worker CPUs.
     agent_active = true;
-    pthread_t agent_thread;
-    pthread_create(&agent_thread, NULL, agent, 0);
+    vector<pthread_t> agent_threads(num_agents);
+    for (int a = 0; a < num_agents; a++) {
+        pthread_create(&agent_threads[a], placement_worker_attr(), agent, tables[a].get());
+    }
 
-    // Enqueue smokers.
+    // Enqueue smokers. Arrival times come from the schedule (see --load), and
+    // latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(smoker_rate);
     for (int i = 1; i < num_smokers + 1; i++) {
-        // Lock the mutex,
-        pthread_mutex_lock(&mutex);
+        uint64_t arrival_ns = arrivals.wait();
+        // Send the smoker to a table.
+        Table& table = choose_table();
+        // Lock the mutex, unless the queue is lock-free.
+        if (!queue_lockfree) {
+            sync_mutex_lock(&table.mutex);
+        }
 
         // Add smoker to the queue.
-        cout << "Smoker #" << i << " has arrived.\n";
-        smoker_queue.push(Smoker(i));
+        log_event(SMOKER_ARRIVED, i);
+        live_arrived->add();
+        handoff.enqueued(i, arrival_ns);
+        // Wake the agent if this smoker is the only one waiting.
+        bool notify_agent;
+        size_t depth;
+        if (queue_lockfree) {
+            notify_agent = table.lockfree_smoker_queue.push(Smoker(i));
+            depth = table.lockfree_smoker_queue.size();
+        } else {
+            table.smoker_queue.push(Smoker(i));
+            depth = table.smoker_queue.size();
+            notify_agent = depth == 1;
+        }
+        table.queued.fetch_add(1);
+        int waiting = total_queued.fetch_add(1) + 1;
+        trace_queue(table.queue_name.c_str(), "push smoker_queue", depth);
+        live_queue_depth->set(waiting);
 
         // Unlock the mutex;
-        pthread_mutex_unlock(&mutex);
-
-        // Wait for the set amount of time before adding another smoker.
-        sleep(smoker_rate);
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&table.mutex);
+        }
+        if (notify_agent) {
+            table.wakeup.notify();
+        }
+        // The table's agent is busy; another agent may be free to take them.
+        if (num_agents > 1 && table.busy.load()) {
+            wake_sleeping_agent(table);
+        }
     }
 
-    // Hold the main thread until the smoker queue is empty.
-    while (!smoker_queue.empty()) {}
-    // Wait for the agent to vend to the last smoker.
-    sleep(agent_wait_time);
-    // Kill the agent.
+    // Hold the main thread until the agents have vended to every smoker.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the agents and wait for them to exit.
     agent_active = false;
-
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker thread to finish being killed before printing results.
-    sleep(1);
+    wakeup_shutdown();
+    for (pthread_t thread : agent_threads) {
+        pthread_join(thread, NULL);
+    }
+    handoff.merge_shards();
+
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
             "-------------------\n";
     cout << "The smokeshop is now closed.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+    double cigarettes_per_sec = elapsed_us > 0 ? num_smokers * 1e6 / elapsed_us : 0;
+    if (num_agents > 1) {
+        long long stolen = 0;
+        cout << "Agents: " << num_agents << " (" << DISPATCH_LABELS[dispatch] << " dispatch), " <<
+                cigarettes_per_sec << " cigarettes/sec\n";
+        for (const unique_ptr<Table>& table : tables) {
+            double utilization = elapsed_us > 0 ? table->busy_ns / 1e3 / elapsed_us : 0;
+            cout << "  Agent #" << table->index + 1 << ": " << table->served << " served (" << table->stolen <<
+                    " from other tables), " << utilization * 100 << "% busy\n";
+            stolen += table->stolen;
+        }
+        cout << flush;
+        report.add("stolen", stolen);
+    }
 
-    // Free the mutex lock from memory.
-    pthread_mutex_destroy(&mutex);
+    // Print machine-readable results if requested.
+    report.add("smokers", num_smokers);
+    report.add("smoker_rate", smoker_rate.to_string());
+    report.add("agent_time", agent_wait_time.to_string());
+    report.add("elapsed_us", elapsed_us);
+    report.add("agents", num_agents);
+    report.add("dispatch", DISPATCH_LABELS[dispatch]);
+    report.add("cigarettes_per_sec", cigarettes_per_sec);
+    for (const unique_ptr<Table>& table : tables) {
+        string prefix = "agent_" + to_string(table->index + 1);
+        report.add(prefix + "_served", table->served);
+        report.add(prefix + "_stolen", table->stolen);
+        report.add(prefix + "_utilization", elapsed_us > 0 ? table->busy_ns / 1e3 / elapsed_us : 0);
+    }
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    alloc_report(report, num_smokers);
+    lock_report(report);
+    queue_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
+
+    // Free the mutex locks from memory.
+    for (const unique_ptr<Table>& table : tables) {
+        sync_mutex_destroy(&table->mutex);
+    }
 
     // End program.
     return 0;
@@ -0,0 +1,95 @@
+// Allocation counting for the simulations.
+//
+// Including this header replaces the global operator new and delete with
+// versions that count every allocation and its size and then call malloc()/free().
+// The replacements have to be ordinary, non-inline definitions, so this header
+// may only be included from a program's main file, never from another header.
+//
+// alloc_start() marks the start of the measured stretch (after the parameters
+// are read and the threads' buffers set up), alloc_stop() its end, and
+// alloc_report() prints the allocations in between, in total and per entity.
+// Counting costs one relaxed atomic add per allocation.
+
+#ifndef POSIX_SAMPLES_ALLOC_COUNT_H
+#define POSIX_SAMPLES_ALLOC_COUNT_H
+
+// Library imports
+#include <iostream>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include "report.h"
+
+inline std::atomic<uint64_t> alloc_count(0);
+inline std::atomic<uint64_t> alloc_bytes(0);
+inline uint64_t alloc_started_count = 0;
+inline uint64_t alloc_started_bytes = 0;
+inline uint64_t alloc_stopped_count = 0;
+inline uint64_t alloc_stopped_bytes = 0;
+
+void* operator new(std::size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    size_t align = (size_t)alignment;
+    void* p = aligned_alloc(align, (size + align - 1) / align * align);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+// GCC flags free() on memory from operator new once the two are inlined
+// together, but here operator new is malloc().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, std::size_t) noexcept { free(p); }
+void operator delete[](void* p, std::size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+// alloc_start()
+// Starts the measured stretch.
+inline void alloc_start() {
+    alloc_started_count = alloc_count.load();
+    alloc_started_bytes = alloc_bytes.load();
+}
+
+// alloc_stop()
+// Ends the measured stretch, before the results are printed.
+inline void alloc_stop() {
+    alloc_stopped_count = alloc_count.load();
+    alloc_stopped_bytes = alloc_bytes.load();
+}
+
+// alloc_report()
+// Prints the allocations made between alloc_start() and alloc_stop() and adds
+// them to the report.
+inline void alloc_report(Report& report, uint64_t entities) {
+    uint64_t count = alloc_stopped_count - alloc_started_count;
+    uint64_t bytes = alloc_stopped_bytes - alloc_started_bytes;
+    double per_entity = entities ? (double)count / entities : 0;
+    std::cout << "Allocations: " << count << " (" << bytes << " bytes), " << per_entity << " per entity" << std::endl;
+    report.add("allocations", (long long)count);
+    report.add("allocated_bytes", (long long)bytes);
+    report.add("allocations_per_entity", per_entity);
+}
+
+#endif
@@ -0,0 +1,211 @@
+// Binary arrival traces, read in place with mmap().
+//
+// --arrivals=path replaces a program's generated arrivals with a recorded
+// trace. The trace gives every arrival's gap from the previous one, its type
+// and its service demand. The run has one entity per record, whatever count
+// was asked for. The file is mapped read-only and never parsed or copied.
+// Records are handed out by pointer as the producer reaches them. The kernel
+// is asked to read a window ahead of the cursor (MADV_WILLNEED), and pages far
+// behind it are dropped (MADV_DONTNEED), so a trace much larger than memory
+// streams through a bounded working set.
+//
+// File layout, in native (little-endian) byte order:
+//   ArrivalTraceHeader  "PSARRIVL", version, record size, record count
+//   ArrivalRecord...    count fixed-size records
+// arrival_convert (arrivals/arrival_convert.cpp) writes traces from CSV.
+//
+// What a record's fields mean to each program:
+//   type     barbershop: the customer's class (0 walk-in, 1 appointment, 2 VIP)
+//            teaching_assistant: unused
+//            cigarettes: the smoker's starting item (0 paper, 1 tobacco,
+//              2 matches)
+//            readers_writers: 0 read, 1 write
+//            vermont_bridge: 0 northbound, 1 southbound
+//            monkeys_queue, monkeys_2: 0 eastward, 1 westward
+//   service  the haircut, help session, vend or crossing time in nanoseconds
+//            (a crossing group takes its first member's); 0 falls back to the
+//            program's own interval. readers_writers has no service time.
+//   entity   carried through for tools; the programs number entities in
+//            trace order.
+// Types outside a program's range are taken modulo the range.
+
+#ifndef POSIX_SAMPLES_ARRIVAL_TRACE_H
+#define POSIX_SAMPLES_ARRIVAL_TRACE_H
+
+// Library imports
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "options.h"
+#include "report.h"
+
+const char ARRIVAL_TRACE_MAGIC[8] = {'P', 'S', 'A', 'R', 'R', 'I', 'V', 'L'};
+const uint32_t ARRIVAL_TRACE_VERSION = 1;
+// How far ahead of the cursor the kernel is asked to read.
+const size_t ARRIVAL_PREFETCH_BYTES = 8 << 20;
+// How much is kept mapped behind the cursor, for workers looking up the
+// service demand of entities still queued.
+const size_t ARRIVAL_RETAIN_BYTES = 64 << 20;
+
+struct ArrivalTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct ArrivalRecord {
+    uint64_t delta_ns;      // Since the previous arrival; the first is since the start.
+    uint64_t service_ns;    // Service demand, or 0 for the program's own interval.
+    uint32_t entity;
+    uint32_t type;
+};
+
+static_assert(sizeof(ArrivalTraceHeader) == 32, "the trace header is part of the file format");
+static_assert(sizeof(ArrivalRecord) == 24, "the trace record is part of the file format");
+
+class ArrivalTrace {
+    private:
+        const char* base = NULL;
+        size_t length = 0;
+        const ArrivalRecord* records = NULL;
+        uint64_t count = 0;
+        uint64_t cursor = 0;
+        size_t prefetched = 0;  // Byte offset the read-ahead has been asked up to.
+        size_t dropped = 0;     // Byte offset below which pages have been dropped.
+
+        static size_t page_floor(size_t offset) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            return offset / page * page;
+        }
+
+    public:
+        std::string path;
+
+        bool active() const { return base != NULL; }
+        uint64_t size() const { return count; }
+
+        // open()
+        // Maps and checks a trace file. On failure sets error and returns false.
+        bool open(const std::string& file, std::string& error) {
+            int fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0) {
+                error = "cannot open " + file + ": " + strerror(errno);
+                return false;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ArrivalTraceHeader)) {
+                ::close(fd);
+                error = file + " is too short to be an arrival trace";
+                return false;
+            }
+            void* address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                error = "cannot map " + file + ": " + strerror(errno);
+                return false;
+            }
+            const ArrivalTraceHeader* header = (const ArrivalTraceHeader*)address;
+            size_t available = (info.st_size - sizeof(ArrivalTraceHeader)) / sizeof(ArrivalRecord);
+            if (memcmp(header->magic, ARRIVAL_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+                error = file + " is not an arrival trace";
+            } else if (header->version != ARRIVAL_TRACE_VERSION || header->record_size != sizeof(ArrivalRecord)) {
+                error = file + " has trace version " + std::to_string(header->version) + ", expected " +
+                        std::to_string(ARRIVAL_TRACE_VERSION);
+            } else if (header->count > available) {
+                error = file + " is truncated: " + std::to_string(header->count) + " records declared, " +
+                        std::to_string(available) + " present";
+            }
+            if (!error.empty()) {
+                munmap(address, info.st_size);
+                return false;
+            }
+            base = (const char*)address;
+            length = info.st_size;
+            records = (const ArrivalRecord*)(base + sizeof(ArrivalTraceHeader));
+            count = header->count;
+            cursor = 0;
+            prefetched = 0;
+            dropped = 0;
+            path = file;
+            madvise((void*)base, length, MADV_SEQUENTIAL);
+            return true;
+        }
+
+        // next()
+        // The next arrival's record, or NULL once the trace is exhausted.
+        const ArrivalRecord* next() {
+            if (cursor == count) {
+                return NULL;
+            }
+            size_t offset = (const char*)&records[cursor] - base;
+            if (offset >= prefetched) {
+                size_t from = page_floor(offset);
+                prefetched = std::min(length, from + ARRIVAL_PREFETCH_BYTES);
+                madvise((void*)(base + from), prefetched - from, MADV_WILLNEED);
+                if (from > dropped + ARRIVAL_RETAIN_BYTES) {
+                    size_t drop_to = page_floor(from - ARRIVAL_RETAIN_BYTES);
+                    madvise((void*)(base + dropped), drop_to - dropped, MADV_DONTNEED);
+                    dropped = drop_to;
+                }
+            }
+            return &records[cursor++];
+        }
+
+        // at()
+        // The record of arrival index (0-based), wherever the cursor is.
+        const ArrivalRecord& at(uint64_t index) const {
+            return records[index];
+        }
+
+        // close()
+        // Unmaps the trace.
+        void close() {
+            if (base != NULL) {
+                munmap((void*)base, length);
+                base = NULL;
+            }
+        }
+};
+
+inline ArrivalTrace arrival_trace;
+// The record of the arrival the producer issued last.
+inline const ArrivalRecord* arrival_current = NULL;
+
+// arrival_trace_start()
+// Reads --arrivals and, if a trace is given, maps it and sets the number of
+// entities to its record count. Call from main() after the parameters are read.
+inline void arrival_trace_start(Options& options, int& num_entities) {
+    std::string path = options.get("arrivals", "");
+    if (path.empty()) {
+        return;
+    }
+    std::string error;
+    if (!arrival_trace.open(path, error)) {
+        options.fail("--arrivals: " + error);
+    }
+    if (arrival_trace.size() == 0 || arrival_trace.size() >= INT_MAX) {
+        options.fail("--arrivals: " + path + " has " + std::to_string(arrival_trace.size()) +
+                     " records; a run takes 1 to " + std::to_string(INT_MAX - 1));
+    }
+    num_entities = (int)arrival_trace.size();
+}
+
+// arrival_trace_report()
+// Adds the trace, if any, to the report.
+inline void arrival_trace_report(Report& report) {
+    if (arrival_trace.active()) {
+        report.add("arrival_trace", arrival_trace.path);
+        report.add("arrival_trace_records", (long long)arrival_trace.size());
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+// Bucketed priority queue with a fixed number of priority levels.
+//
+// Every level is a fixed-capacity FIFO ring, and a 64-bit mask has a bit set
+// for each level that holds anything. push() appends to its level's ring,
+// pop_min() takes the front of the lowest non-empty level, found with one
+// count-trailing-zeros on the mask, and pop_back() takes the newest entry of
+// a level (to evict it). All of them are O(1) whatever the number of waiting
+// entries, and nothing is allocated after init(). Entries of one level come
+// out in the order they went in.
+
+#ifndef POSIX_SAMPLES_BUCKET_QUEUE_H
+#define POSIX_SAMPLES_BUCKET_QUEUE_H
+
+// Library imports
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+const int BUCKET_QUEUE_MAX_LEVELS = 64;
+
+template <typename T>
+class BucketQueue {
+    private:
+        std::vector<T> slots;           // levels * capacity, one ring per level
+        std::vector<size_t> head;       // Slot of each level's front.
+        std::vector<size_t> length;     // Entries in each level.
+        size_t capacity = 0;
+        size_t total = 0;
+        uint64_t occupied = 0;          // Bit per non-empty level.
+
+        T& slot(int level, size_t position) {
+            return slots[level * capacity + (head[level] + position) % capacity];
+        }
+
+    public:
+        // init()
+        // Sets up levels priority levels (at most BUCKET_QUEUE_MAX_LEVELS), each
+        // holding up to capacity entries. Level 0 is served first.
+        void init(int levels, size_t capacity) {
+            this->capacity = capacity;
+            slots.assign(levels * capacity, T());
+            head.assign(levels, 0);
+            length.assign(levels, 0);
+            total = 0;
+            occupied = 0;
+        }
+
+        size_t size() const { return total; }
+        bool empty() const { return total == 0; }
+        size_t size(int level) const { return length[level]; }
+
+        // push()
+        // Appends to a level. Returns false if that level is full.
+        bool push(int level, const T& item) {
+            if (length[level] == capacity) {
+                return false;
+            }
+            slot(level, length[level]) = item;
+            length[level]++;
+            total++;
+            occupied |= 1ULL << level;
+            return true;
+        }
+
+        // min_level()
+        // The lowest non-empty level. Only call when not empty.
+        int min_level() const {
+            return __builtin_ctzll(occupied);
+        }
+
+        // max_level()
+        // The highest non-empty level. Only call when not empty.
+        int max_level() const {
+            return 63 - __builtin_clzll(occupied);
+        }
+
+        // pop_min()
+        // Removes and returns the oldest entry of the lowest non-empty level.
+        // Only call when not empty.
+        T pop_min() {
+            int level = min_level();
+            T item = slot(level, 0);
+            head[level] = (head[level] + 1) % capacity;
+            if (--length[level] == 0) {
+                occupied &= ~(1ULL << level);
+            }
+            total--;
+            return item;
+        }
+
+        // pop_back()
+        // Removes and returns the newest entry of a non-empty level.
+        T pop_back(int level) {
+            T item = slot(level, length[level] - 1);
+            if (--length[level] == 0) {
+                occupied &= ~(1ULL << level);
+            }
+            total--;
+            return item;
+        }
+};
+
+#endif
@@ -0,0 +1,18 @@
+// Monotonic clock shared by the logging and tracing helpers.
+
+#ifndef POSIX_SAMPLES_CLOCK_H
+#define POSIX_SAMPLES_CLOCK_H
+
+// Library imports
+#include <cstdint>
+#include <time.h>
+
+// monotonic_ns()
+// Current CLOCK_MONOTONIC time. Served from the vDSO, so no system call.
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,620 @@
+// Coroutine runtime for simulating very large numbers of entities.
+//
+// Every simulated entity (customer, farmer, monkey) is a C++20 coroutine rather
+// than a queue entry or an OS thread. A coroutine frame is a few hundred bytes, so
+// a million live entities fit comfortably in memory, and a handful of worker
+// threads run them all.
+//
+//   CoroRuntime runtime(4);              // four worker threads
+//   runtime.run(arrivals(runtime));      // returns when every task has finished
+//
+// A task is any function returning CoroTask. Inside one:
+//   co_await runtime.sleep_for(ns);      // timer
+//   co_await semaphore.acquire();        // AsyncSemaphore, FIFO
+//   co_await rope.acquire(direction);    // DirectionalGate, FIFO
+//   runtime.spawn(other_task(...));      // start another entity
+//
+// Scheduling: each worker owns a Chase-Lev work-stealing deque. A task made ready
+// on a worker (spawned, or woken by a semaphore release) goes onto that worker's
+// deque; idle workers steal from the others. Tasks made ready from outside the
+// workers go through a shared injection queue. Timers live in one heap; whichever
+// worker is free fires the expired ones, and idle workers sleep until the next
+// deadline or until new work arrives.
+//
+// Requires C++20 (-std=c++20). Not included by the pthread samples, which are
+// built as C++17.
+
+#ifndef POSIX_SAMPLES_CORO_H
+#define POSIX_SAMPLES_CORO_H
+
+#if __cplusplus < 202002L
+#error "coro.h requires C++20 (-std=c++20)"
+#endif
+
+// Library imports
+#include <coroutine>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+#include "clock.h"
+
+class CoroRuntime;
+
+// The runtime the calling code belongs to, and the calling worker's index (-1 off
+// the workers).
+inline CoroRuntime* coro_runtime = nullptr;
+inline thread_local int coro_worker_index = -1;
+
+inline void coro_task_finished();
+
+// Fire-and-forget coroutine. The frame is created suspended, handed to the
+// runtime with spawn(), and destroys itself when it returns.
+class CoroTask {
+    public:
+        struct promise_type {
+            CoroTask get_return_object() {
+                return CoroTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> h) noexcept {
+                    h.destroy();
+                    coro_task_finished();
+                }
+                void await_resume() noexcept {}
+            };
+            FinalAwaiter final_suspend() noexcept { return {}; }
+
+            void return_void() {}
+            void unhandled_exception() { std::abort(); }
+        };
+
+        std::coroutine_handle<> handle;
+
+        explicit CoroTask(std::coroutine_handle<> handle) : handle(handle) {}
+};
+
+// Chase-Lev work-stealing deque of coroutine handles ("Dynamic Circular
+// Work-Stealing Deque", with the C11 memory orderings of Le et al.). The owner
+// pushes and takes at the bottom; thieves steal from the top.
+class WorkStealingDeque {
+    private:
+        struct Ring {
+            int64_t capacity;
+            std::atomic<void*>* slots;
+
+            explicit Ring(int64_t capacity) : capacity(capacity), slots(new std::atomic<void*>[capacity]) {}
+            ~Ring() { delete[] slots; }
+
+            void* get(int64_t i) { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+            void put(int64_t i, void* x) { slots[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+        };
+
+        alignas(64) std::atomic<int64_t> top{0};
+        alignas(64) std::atomic<int64_t> bottom{0};
+        std::atomic<Ring*> ring;
+        // Rings replaced by grow(). A thief may still be reading one, so they are
+        // only freed with the deque.
+        std::vector<Ring*> retired;
+
+    public:
+        WorkStealingDeque() : ring(new Ring(1024)) {}
+
+        ~WorkStealingDeque() {
+            delete ring.load();
+            for (Ring* r : retired) {
+                delete r;
+            }
+        }
+
+        // push()
+        // Owner only.
+        void push(void* x) {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            Ring* r = ring.load(std::memory_order_relaxed);
+            if (b - t > r->capacity - 1) {
+                Ring* bigger = new Ring(r->capacity * 2);
+                for (int64_t i = t; i < b; i++) {
+                    bigger->put(i, r->get(i));
+                }
+                retired.push_back(r);
+                ring.store(bigger, std::memory_order_release);
+                r = bigger;
+            }
+            r->put(b, x);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // take()
+        // Owner only. Returns nullptr when empty.
+        void* take() {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Ring* r = ring.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_relaxed);
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            void* x = r->get(b);
+            if (t == b) {
+                // Last element: race the thieves for it.
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    x = nullptr;
+                }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return x;
+        }
+
+        // steal()
+        // Any thread. Returns nullptr when empty or when it lost a race.
+        void* steal() {
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b) {
+                return nullptr;
+            }
+            Ring* r = ring.load(std::memory_order_acquire);
+            void* x = r->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return x;
+        }
+
+        bool empty() {
+            return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+        }
+};
+
+// Per-worker state and counters.
+struct CoroWorker {
+    WorkStealingDeque deque;
+    pthread_t thread;
+    uint64_t resumed = 0;
+    uint64_t stolen = 0;
+    uint64_t parked = 0;
+};
+
+class CoroRuntime {
+    private:
+        std::vector<CoroWorker*> workers;
+
+        // Injection queue for work made ready off the workers.
+        pthread_mutex_t inject_lock = PTHREAD_MUTEX_INITIALIZER;
+        std::deque<void*> injected;
+        std::atomic<size_t> injected_size{0};
+
+        // Timers, earliest deadline first.
+        typedef std::pair<uint64_t, void*> Timer;
+        pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+        std::atomic<uint64_t> next_deadline{UINT64_MAX};
+
+        // Parking for idle workers.
+        pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t idle_wake;
+        std::atomic<int> idle{0};
+
+        std::atomic<bool> stopping{false};
+        std::atomic<int64_t> live{0};
+        std::atomic<int64_t> peak{0};
+        std::atomic<uint64_t> spawned{0};
+
+        // Completion of run().
+        pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+        static void* worker_main(void* arg) {
+            std::pair<CoroRuntime*, int>* self = (std::pair<CoroRuntime*, int>*)arg;
+            self->first->worker_loop(self->second);
+            delete self;
+            return nullptr;
+        }
+
+        // fire_timers()
+        // Moves every expired timer onto the calling worker's deque.
+        void fire_timers(CoroWorker* w) {
+            uint64_t now = monotonic_ns();
+            if (next_deadline.load(std::memory_order_acquire) > now) {
+                return;
+            }
+            pthread_mutex_lock(&timer_lock);
+            int fired = 0;
+            while (!timers.empty() && timers.top().first <= now) {
+                w->deque.push(timers.top().second);
+                timers.pop();
+                fired++;
+            }
+            next_deadline.store(timers.empty() ? UINT64_MAX : timers.top().first, std::memory_order_release);
+            pthread_mutex_unlock(&timer_lock);
+            if (fired > 1) {
+                wake_one();
+            }
+        }
+
+        // find_work()
+        // Own deque first, then the injection queue, then the other workers.
+        void* find_work(int index) {
+            CoroWorker* w = workers[index];
+            void* x = w->deque.take();
+            if (x != nullptr) {
+                return x;
+            }
+            if (injected_size.load(std::memory_order_acquire) > 0) {
+                pthread_mutex_lock(&inject_lock);
+                if (!injected.empty()) {
+                    x = injected.front();
+                    injected.pop_front();
+                    injected_size.fetch_sub(1, std::memory_order_release);
+                }
+                pthread_mutex_unlock(&inject_lock);
+                if (x != nullptr) {
+                    return x;
+                }
+            }
+            int n = workers.size();
+            for (int i = 1; i < n; i++) {
+                x = workers[(index + i) % n]->deque.steal();
+                if (x != nullptr) {
+                    w->stolen++;
+                    return x;
+                }
+            }
+            return nullptr;
+        }
+
+        // park()
+        // Sleeps until new work is signalled or the next timer is due. idle is
+        // raised before the final look for work, so a concurrent schedule() either
+        // sees the idle worker and signals it, or its work is found here.
+        void park(int index) {
+            pthread_mutex_lock(&idle_lock);
+            idle.fetch_add(1, std::memory_order_seq_cst);
+            bool have_work = false;
+            for (CoroWorker* other : workers) {
+                have_work = have_work || !other->deque.empty();
+            }
+            have_work = have_work || injected_size.load(std::memory_order_seq_cst) > 0 || stopping.load();
+            if (!have_work) {
+                workers[index]->parked++;
+                uint64_t deadline = next_deadline.load(std::memory_order_acquire);
+                // Never sleep unbounded; a late timer costs at most this much.
+                uint64_t limit = monotonic_ns() + 10000000;
+                if (deadline > limit) {
+                    deadline = limit;
+                }
+                struct timespec ts;
+                ts.tv_sec = deadline / 1000000000ULL;
+                ts.tv_nsec = deadline % 1000000000ULL;
+                pthread_cond_timedwait(&idle_wake, &idle_lock, &ts);
+            }
+            idle.fetch_sub(1, std::memory_order_seq_cst);
+            pthread_mutex_unlock(&idle_lock);
+        }
+
+        void worker_loop(int index) {
+            coro_worker_index = index;
+            CoroWorker* w = workers[index];
+            while (!stopping.load(std::memory_order_acquire)) {
+                fire_timers(w);
+                void* x = find_work(index);
+                if (x != nullptr) {
+                    w->resumed++;
+                    std::coroutine_handle<>::from_address(x).resume();
+                } else {
+                    park(index);
+                }
+            }
+        }
+
+        void wake_one() {
+            if (idle.load(std::memory_order_seq_cst) > 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_signal(&idle_wake);
+                pthread_mutex_unlock(&idle_lock);
+            }
+        }
+
+    public:
+        explicit CoroRuntime(int num_workers) {
+            // Timed waits for idle workers are on CLOCK_MONOTONIC, like the timers.
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&idle_wake, &attr);
+            pthread_condattr_destroy(&attr);
+            for (int i = 0; i < num_workers; i++) {
+                workers.push_back(new CoroWorker());
+            }
+            coro_runtime = this;
+        }
+
+        ~CoroRuntime() {
+            for (CoroWorker* w : workers) {
+                delete w;
+            }
+            coro_runtime = nullptr;
+        }
+
+        // schedule()
+        // Makes a suspended coroutine ready to run.
+        void schedule(std::coroutine_handle<> h) {
+            if (coro_worker_index >= 0) {
+                workers[coro_worker_index]->deque.push(h.address());
+            } else {
+                pthread_mutex_lock(&inject_lock);
+                injected.push_back(h.address());
+                injected_size.fetch_add(1, std::memory_order_seq_cst);
+                pthread_mutex_unlock(&inject_lock);
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wake_one();
+        }
+
+        // spawn()
+        // Starts a new task.
+        void spawn(CoroTask task) {
+            int64_t now_live = live.fetch_add(1, std::memory_order_relaxed) + 1;
+            int64_t seen = peak.load(std::memory_order_relaxed);
+            while (now_live > seen && !peak.compare_exchange_weak(seen, now_live, std::memory_order_relaxed)) {}
+            spawned.fetch_add(1, std::memory_order_relaxed);
+            schedule(task.handle);
+        }
+
+        // finished()
+        // Called as each task returns; wakes run() once none are left.
+        void finished() {
+            if (live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                pthread_mutex_lock(&done_lock);
+                pthread_cond_broadcast(&done_cond);
+                pthread_mutex_unlock(&done_lock);
+            }
+        }
+
+        // run()
+        // Starts the workers on the root task and returns once it and everything
+        // it spawned have finished.
+        void run(CoroTask root) {
+            spawn(root);
+            for (size_t i = 0; i < workers.size(); i++) {
+                pthread_create(&workers[i]->thread, NULL, worker_main, new std::pair<CoroRuntime*, int>(this, i));
+            }
+            pthread_mutex_lock(&done_lock);
+            while (live.load(std::memory_order_acquire) > 0) {
+                pthread_cond_wait(&done_cond, &done_lock);
+            }
+            pthread_mutex_unlock(&done_lock);
+            stopping.store(true, std::memory_order_release);
+            pthread_mutex_lock(&idle_lock);
+            pthread_cond_broadcast(&idle_wake);
+            pthread_mutex_unlock(&idle_lock);
+            for (CoroWorker* w : workers) {
+                pthread_join(w->thread, NULL);
+            }
+        }
+
+        // add_timer()
+        // Resumes h once the CLOCK_MONOTONIC deadline has passed.
+        void add_timer(uint64_t deadline_ns, std::coroutine_handle<> h) {
+            pthread_mutex_lock(&timer_lock);
+            timers.push(Timer(deadline_ns, h.address()));
+            next_deadline.store(timers.top().first, std::memory_order_release);
+            pthread_mutex_unlock(&timer_lock);
+            // An idle worker may be sleeping past this deadline.
+            wake_one();
+        }
+
+        struct SleepAwaiter {
+            CoroRuntime* runtime;
+            uint64_t deadline_ns;
+
+            bool await_ready() { return deadline_ns <= monotonic_ns(); }
+            void await_suspend(std::coroutine_handle<> h) { runtime->add_timer(deadline_ns, h); }
+            void await_resume() {}
+        };
+
+        SleepAwaiter sleep_until(uint64_t deadline_ns) { return SleepAwaiter{this, deadline_ns}; }
+        SleepAwaiter sleep_for(uint64_t ns) { return SleepAwaiter{this, monotonic_ns() + ns}; }
+
+        int num_workers() { return workers.size(); }
+        int64_t peak_live() { return peak.load(); }
+        uint64_t total_spawned() { return spawned.load(); }
+
+        uint64_t total_resumed() {
+            uint64_t n = 0;
+            for (CoroWorker* w : workers) {
+                n += w->resumed;
+            }
+            return n;
+        }
+
+        uint64_t total_stolen() {
+            uint64_t n = 0;
+            for (CoroWorker* w : workers) {
+                n += w->stolen;
+            }
+            return n;
+        }
+
+        uint64_t total_parked() {
+            uint64_t n = 0;
+            for (CoroWorker* w : workers) {
+                n += w->parked;
+            }
+            return n;
+        }
+};
+
+inline void coro_task_finished() {
+    coro_runtime->finished();
+}
+
+// Intrusive FIFO node for a suspended acquirer; lives in the coroutine's frame.
+struct CoroWaiter {
+    std::coroutine_handle<> handle;
+    CoroWaiter* next = nullptr;
+    int direction = 0;
+};
+
+// Counting semaphore for coroutines. A release hands the permit straight to the
+// longest waiter, so waiters are served in arrival order.
+class AsyncSemaphore {
+    private:
+        std::atomic<long> count;
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        CoroWaiter* head = nullptr;
+        CoroWaiter* tail = nullptr;
+
+        bool try_decrement() {
+            long c = count.load(std::memory_order_acquire);
+            while (c > 0) {
+                if (count.compare_exchange_weak(c, c - 1, std::memory_order_acq_rel)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        explicit AsyncSemaphore(long initial) : count(initial) {}
+
+        // try_acquire()
+        // Takes a permit if one is free, without waiting.
+        bool try_acquire() { return try_decrement(); }
+
+        struct Awaiter {
+            AsyncSemaphore* semaphore;
+            CoroWaiter waiter;
+
+            bool await_ready() { return semaphore->try_decrement(); }
+
+            bool await_suspend(std::coroutine_handle<> h) {
+                waiter.handle = h;
+                pthread_mutex_lock(&semaphore->lock);
+                // Permits are only added under the lock, so this check is final.
+                if (semaphore->try_decrement()) {
+                    pthread_mutex_unlock(&semaphore->lock);
+                    return false;
+                }
+                if (semaphore->tail == nullptr) {
+                    semaphore->head = &waiter;
+                } else {
+                    semaphore->tail->next = &waiter;
+                }
+                semaphore->tail = &waiter;
+                pthread_mutex_unlock(&semaphore->lock);
+                return true;
+            }
+
+            void await_resume() {}
+        };
+
+        Awaiter acquire() { return Awaiter{this, {}}; }
+
+        void release() {
+            pthread_mutex_lock(&lock);
+            CoroWaiter* w = head;
+            if (w != nullptr) {
+                head = w->next;
+                if (head == nullptr) {
+                    tail = nullptr;
+                }
+            } else {
+                count.fetch_add(1, std::memory_order_acq_rel);
+            }
+            pthread_mutex_unlock(&lock);
+            if (w != nullptr) {
+                coro_runtime->schedule(w->handle);
+            }
+        }
+};
+
+// A shared resource (the ravine rope) that admits up to capacity holders at
+// once, all travelling in the same direction. Waiters are admitted strictly in
+// arrival order, so a stream in one direction cannot starve the other.
+class DirectionalGate {
+    private:
+        int capacity;
+        int holders = 0;
+        int direction = 0;  // Direction of the current holders, when there are any.
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        CoroWaiter* head = nullptr;
+        CoroWaiter* tail = nullptr;
+
+        bool fits(int d) {
+            return holders == 0 || (holders < capacity && direction == d);
+        }
+
+    public:
+        explicit DirectionalGate(int capacity) : capacity(capacity) {}
+
+        struct Awaiter {
+            DirectionalGate* gate;
+            CoroWaiter waiter;
+
+            bool await_ready() { return false; }
+
+            bool await_suspend(std::coroutine_handle<> h) {
+                waiter.handle = h;
+                pthread_mutex_lock(&gate->lock);
+                if (gate->head == nullptr && gate->fits(waiter.direction)) {
+                    gate->holders++;
+                    gate->direction = waiter.direction;
+                    pthread_mutex_unlock(&gate->lock);
+                    return false;
+                }
+                if (gate->tail == nullptr) {
+                    gate->head = &waiter;
+                } else {
+                    gate->tail->next = &waiter;
+                }
+                gate->tail = &waiter;
+                pthread_mutex_unlock(&gate->lock);
+                return true;
+            }
+
+            void await_resume() {}
+        };
+
+        Awaiter acquire(int d) {
+            Awaiter a{this, {}};
+            a.waiter.direction = d;
+            return a;
+        }
+
+        void release() {
+            std::vector<std::coroutine_handle<>> admitted;
+            pthread_mutex_lock(&lock);
+            holders--;
+            while (head != nullptr && fits(head->direction)) {
+                holders++;
+                direction = head->direction;
+                admitted.push_back(head->handle);
+                head = head->next;
+                if (head == nullptr) {
+                    tail = nullptr;
+                }
+            }
+            pthread_mutex_unlock(&lock);
+            for (std::coroutine_handle<> h : admitted) {
+                coro_runtime->schedule(h);
+            }
+        }
+};
+
+#endif
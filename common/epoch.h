@@ -0,0 +1,232 @@
+// Epoch-based memory reclamation for lock-free structures.
+//
+// A lock-free structure cannot delete a node as soon as it unlinks it: another
+// thread may have loaded a pointer to the node a moment earlier and still be
+// reading it. Threads therefore pin the current epoch with an EpochGuard for as
+// long as they hold pointers into a structure, and unlinked nodes are retired
+// with epoch_retire() instead of deleted. A retired node is stamped with the
+// global epoch. The epoch only advances once every pinned thread has seen the
+// current one, so by the time it has advanced twice past a node's stamp no
+// thread can still hold the node, and it is freed.
+//
+// Each thread keeps its retired nodes on its own list, oldest first, and every
+// EPOCH_COLLECT_EVERY retirements tries to advance the epoch and free what has
+// become safe. A thread that stays pinned, or is descheduled while pinned,
+// holds the epoch back and every thread's retired nodes pile up behind it.
+// epoch_report() measures that cost: how long nodes waited between retirement
+// and their free, and the peak of memory retired but not yet freed.
+
+#ifndef POSIX_SAMPLES_EPOCH_H
+#define POSIX_SAMPLES_EPOCH_H
+
+// Library imports
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include "report.h"
+#include "clock.h"
+#include "histogram.h"
+#include "sim_time.h"
+
+const int EPOCH_MAX_THREADS = 64;
+const int EPOCH_COLLECT_EVERY = 32;
+// A thread's pinned epoch while it is not pinned.
+const uint64_t EPOCH_UNPINNED = UINT64_MAX;
+
+// Header of anything that can be retired. Structures derive their nodes from
+// it; destroy frees the whole node.
+struct EpochRetired {
+    EpochRetired* next_retired = NULL;
+    uint64_t epoch = 0;
+    uint64_t retired_ns = 0;
+    size_t bytes = 0;
+    void (*destroy)(EpochRetired*) = NULL;
+};
+
+// One thread's pin and retired list, on its own cache lines.
+struct alignas(64) EpochThread {
+    std::atomic<uint64_t> pinned{EPOCH_UNPINNED};
+    int depth = 0;                      // Nested guards.
+    int since_collect = 0;
+    EpochRetired* oldest = NULL;
+    EpochRetired* newest = NULL;
+    LatencyHistogram latency;           // Retirement to free, owned by the thread.
+};
+
+struct EpochDomain {
+    std::atomic<uint64_t> global{0};
+    EpochThread threads[EPOCH_MAX_THREADS];
+    std::atomic<int> num_threads{0};
+    std::atomic<uint64_t> retired{0};
+    std::atomic<uint64_t> freed{0};
+    std::atomic<uint64_t> advances{0};
+    std::atomic<int64_t> retained_bytes{0};
+    std::atomic<int64_t> retained_nodes{0};
+    std::atomic<int64_t> peak_bytes{0};
+    std::atomic<int64_t> peak_nodes{0};
+};
+
+inline EpochDomain epoch_domain;
+inline thread_local EpochThread* epoch_self = NULL;
+
+// epoch_thread()
+// The calling thread's record, taken on first use.
+inline EpochThread* epoch_thread() {
+    if (epoch_self == NULL) {
+        int index = epoch_domain.num_threads.fetch_add(1);
+        if (index >= EPOCH_MAX_THREADS) {
+            std::cerr << "epoch: more than " << EPOCH_MAX_THREADS << " threads use lock-free structures" << std::endl;
+            abort();
+        }
+        epoch_self = &epoch_domain.threads[index];
+    }
+    return epoch_self;
+}
+
+// Pins the current epoch for the guard's lifetime. Guards nest.
+class EpochGuard {
+    private:
+        EpochThread* self;
+
+    public:
+        EpochGuard() : self(epoch_thread()) {
+            if (self->depth++ == 0) {
+                self->pinned.store(epoch_domain.global.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+                // The pin has to be visible before any pointer into the
+                // structure is loaded.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        ~EpochGuard() {
+            if (--self->depth == 0) {
+                self->pinned.store(EPOCH_UNPINNED, std::memory_order_release);
+            }
+        }
+
+        EpochGuard(const EpochGuard&) = delete;
+        EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// epoch_raise_peak()
+// Raises peak to value if value is higher.
+inline void epoch_raise_peak(std::atomic<int64_t>& peak, int64_t value) {
+    int64_t seen = peak.load(std::memory_order_relaxed);
+    while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+// epoch_free()
+// Frees one retired node and takes it off the retained totals.
+inline void epoch_free(EpochRetired* node) {
+    epoch_domain.retained_bytes.fetch_sub(node->bytes, std::memory_order_relaxed);
+    epoch_domain.retained_nodes.fetch_sub(1, std::memory_order_relaxed);
+    node->destroy(node);
+}
+
+// epoch_collect()
+// Advances the global epoch if every pinned thread has seen it, then frees the
+// calling thread's retired nodes that no thread can still hold.
+inline void epoch_collect() {
+    EpochThread* self = epoch_thread();
+    uint64_t current = epoch_domain.global.load(std::memory_order_seq_cst);
+    bool behind = false;
+    int num_threads = std::min(epoch_domain.num_threads.load(std::memory_order_acquire), EPOCH_MAX_THREADS);
+    for (int i = 0; i < num_threads && !behind; i++) {
+        uint64_t pinned = epoch_domain.threads[i].pinned.load(std::memory_order_seq_cst);
+        behind = pinned != EPOCH_UNPINNED && pinned != current;
+    }
+    if (!behind && epoch_domain.global.compare_exchange_strong(current, current + 1, std::memory_order_seq_cst)) {
+        epoch_domain.advances.fetch_add(1, std::memory_order_relaxed);
+        current++;
+    }
+
+    uint64_t now = monotonic_ns();
+    uint64_t freed = 0;
+    while (self->oldest != NULL && self->oldest->epoch + 2 <= current) {
+        EpochRetired* node = self->oldest;
+        self->oldest = node->next_retired;
+        self->latency.record(now - node->retired_ns);
+        epoch_free(node);
+        freed++;
+    }
+    if (self->oldest == NULL) {
+        self->newest = NULL;
+    }
+    epoch_domain.freed.fetch_add(freed, std::memory_order_relaxed);
+}
+
+// epoch_retire()
+// Hands over a node the caller has unlinked, to be freed once no thread can
+// still hold it. Call while pinned.
+inline void epoch_retire(EpochRetired* node) {
+    EpochThread* self = epoch_thread();
+    node->epoch = epoch_domain.global.load(std::memory_order_seq_cst);
+    node->retired_ns = monotonic_ns();
+    node->next_retired = NULL;
+    if (self->newest == NULL) {
+        self->oldest = node;
+    } else {
+        self->newest->next_retired = node;
+    }
+    self->newest = node;
+    epoch_domain.retired.fetch_add(1, std::memory_order_relaxed);
+    int64_t bytes = epoch_domain.retained_bytes.fetch_add(node->bytes, std::memory_order_relaxed) + node->bytes;
+    int64_t nodes = epoch_domain.retained_nodes.fetch_add(1, std::memory_order_relaxed) + 1;
+    epoch_raise_peak(epoch_domain.peak_bytes, bytes);
+    epoch_raise_peak(epoch_domain.peak_nodes, nodes);
+    if (++self->since_collect == EPOCH_COLLECT_EVERY) {
+        self->since_collect = 0;
+        epoch_collect();
+    }
+}
+
+// epoch_drain()
+// Frees every node still retired. Call once no other thread uses the
+// structures, e.g. after joining the workers. Returns the number freed.
+inline uint64_t epoch_drain() {
+    uint64_t drained = 0;
+    int num_threads = std::min(epoch_domain.num_threads.load(), EPOCH_MAX_THREADS);
+    for (int i = 0; i < num_threads; i++) {
+        EpochThread& thread = epoch_domain.threads[i];
+        while (thread.oldest != NULL) {
+            EpochRetired* node = thread.oldest;
+            thread.oldest = node->next_retired;
+            epoch_free(node);
+            drained++;
+        }
+        thread.newest = NULL;
+    }
+    return drained;
+}
+
+// epoch_report()
+// Drains what is still retired, then prints the reclamation latency and the
+// peak retained memory and adds them to the report. Call after the workers
+// have been joined.
+inline void epoch_report(Report& report) {
+    uint64_t drained = epoch_drain();
+    LatencyHistogram latency;
+    int num_threads = std::min(epoch_domain.num_threads.load(), EPOCH_MAX_THREADS);
+    for (int i = 0; i < num_threads; i++) {
+        latency.merge(epoch_domain.threads[i].latency);
+    }
+    std::cout << "Reclamation (epochs): " << epoch_domain.retired.load() << " nodes retired, " <<
+                 epoch_domain.freed.load() << " freed during the run after p50 " <<
+                 format_duration(latency.percentile(50)) << ", p99 " << format_duration(latency.percentile(99)) <<
+                 ", max " << format_duration(latency.total ? latency.max : 0) << ", " << drained <<
+                 " at exit; peak retained " << epoch_domain.peak_bytes.load() << " bytes in " <<
+                 epoch_domain.peak_nodes.load() << " nodes, " << epoch_domain.advances.load() << " epochs" <<
+                 std::endl;
+    report.add("reclaim_retired", (long long)epoch_domain.retired.load());
+    report.add("reclaim_freed_at_exit", (long long)drained);
+    report.add("reclaim_epochs", (long long)epoch_domain.advances.load());
+    report.add("reclaim_peak_bytes", (long long)epoch_domain.peak_bytes.load());
+    report.add("reclaim_peak_nodes", (long long)epoch_domain.peak_nodes.load());
+    latency.add_to_report(report, "reclaim_latency");
+}
+
+#endif
@@ -0,0 +1,261 @@
+// Asynchronous event logger for the simulation threads.
+//
+// Worker threads used to format and print their messages with cout while they held
+// the queue locks. Instead, each thread now appends a compact binary record (event
+// id, entity id, one argument and a timestamp) to its own single-producer ring
+// buffer. Nothing is formatted and no lock is taken on that path. A background
+// thread drains every ring, merges the records by timestamp and hands them to the
+// program's formatter, which reproduces the original messages.
+//
+// The mode is chosen with --log:
+//   text    background formatting to stdout (the default)
+//   sync    format and print on the calling thread, the old behavior
+//   binary  write the raw records to the file given with --log-file
+//   off     record nothing (the default with --quiet)
+//
+// Formatters append to a string the logger reuses, so once it has grown to the
+// size of a batch, formatting allocates nothing. They write numbers with
+// log_append() rather than std::to_string(), which returns a new string.
+
+#ifndef POSIX_SAMPLES_EVENT_LOG_H
+#define POSIX_SAMPLES_EVENT_LOG_H
+
+// Library imports
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "options.h"
+#include "clock.h"
+
+// One logged event. Programs define their own event ids and decide what the
+// entity and argument mean for each of them.
+struct LogEvent {
+    uint64_t timestamp_ns;
+    uint16_t event;
+    uint16_t thread;
+    int32_t entity;
+    int64_t arg;
+};
+
+// Appends the text for one event (including its newline) to out.
+typedef void (*log_formatter)(const LogEvent& e, std::string& out);
+
+enum log_mode { LOG_OFF, LOG_TEXT, LOG_SYNC, LOG_BINARY };
+
+// Single-producer/single-consumer ring of events, one per logging thread.
+// The head is only written by the owning thread and the tail only by the
+// background thread, each on its own cache line.
+class EventRing {
+    public:
+        static const size_t CAPACITY = 1 << 14;
+
+        alignas(64) std::atomic<uint64_t> head{0};
+        uint64_t cached_tail = 0;
+        alignas(64) std::atomic<uint64_t> tail{0};
+        alignas(64) LogEvent events[CAPACITY];
+        uint16_t thread = 0;
+        // Times the owning thread found the ring full and had to wait.
+        std::atomic<uint64_t> full_waits{0};
+
+        // push()
+        // Called only by the owning thread. If the background thread has fallen a
+        // whole ring behind, yields until there is room rather than dropping.
+        void push(const LogEvent& e) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            if (h - cached_tail == CAPACITY) {
+                cached_tail = tail.load(std::memory_order_acquire);
+                while (h - cached_tail == CAPACITY) {
+                    full_waits.fetch_add(1, std::memory_order_relaxed);
+                    sched_yield();
+                    cached_tail = tail.load(std::memory_order_acquire);
+                }
+            }
+            events[h & (CAPACITY - 1)] = e;
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        // drain()
+        // Called only by the background thread. Moves every published event with a
+        // timestamp at or before the cutoff into out.
+        void drain(std::vector<LogEvent>& out, uint64_t cutoff_ns) {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            uint64_t h = head.load(std::memory_order_acquire);
+            while (t != h && events[t & (CAPACITY - 1)].timestamp_ns <= cutoff_ns) {
+                out.push_back(events[t & (CAPACITY - 1)]);
+                t++;
+            }
+            tail.store(t, std::memory_order_release);
+        }
+};
+
+// Process-wide logger state.
+struct EventLog {
+    log_mode mode = LOG_OFF;
+    log_formatter formatter = NULL;
+    FILE* binary_file = NULL;
+    std::atomic<bool> running{false};
+    pthread_t flusher;
+    // Registry of every thread's ring. Only touched when a thread logs for the
+    // first time and by the background thread, never on the hot path.
+    pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<EventRing>> rings;
+    // Serializes output in sync mode.
+    pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t events_written = 0;
+    // Reused by every drain, and in sync mode by every event under sync_mutex.
+    std::vector<LogEvent> batch;
+    std::string text;
+};
+
+inline EventLog event_log;
+inline thread_local EventRing* event_log_ring = NULL;
+
+// event_log_thread_ring()
+// Returns the calling thread's ring, registering one on first use.
+inline EventRing* event_log_thread_ring() {
+    if (event_log_ring == NULL) {
+        std::unique_ptr<EventRing> ring(new EventRing());
+        pthread_mutex_lock(&event_log.rings_mutex);
+        ring->thread = event_log.rings.size();
+        event_log_ring = ring.get();
+        event_log.rings.push_back(std::move(ring));
+        pthread_mutex_unlock(&event_log.rings_mutex);
+    }
+    return event_log_ring;
+}
+
+// event_log_drain()
+// Collects events from every ring up to the cutoff, sorts them into timestamp
+// order and writes them out.
+inline void event_log_drain(uint64_t cutoff_ns) {
+    std::vector<LogEvent>& batch = event_log.batch;
+    batch.clear();
+    pthread_mutex_lock(&event_log.rings_mutex);
+    for (auto& ring : event_log.rings) {
+        ring->drain(batch, cutoff_ns);
+    }
+    pthread_mutex_unlock(&event_log.rings_mutex);
+    if (batch.empty()) {
+        return;
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const LogEvent& a, const LogEvent& b) {
+        return a.timestamp_ns < b.timestamp_ns;
+    });
+    event_log.events_written += batch.size();
+
+    if (event_log.mode == LOG_BINARY) {
+        fwrite(batch.data(), sizeof(LogEvent), batch.size(), event_log.binary_file);
+        return;
+    }
+    std::string& text = event_log.text;
+    text.clear();
+    for (const LogEvent& e : batch) {
+        event_log.formatter(e, text);
+    }
+    std::cout << text << std::flush;
+}
+
+// Events younger than this are left in the rings for the next pass, so a thread
+// that took its timestamp just before the drain still gets sorted into place.
+const uint64_t EVENT_LOG_SETTLE_NS = 1000000;
+
+inline void* event_log_flusher(void*) {
+    while (event_log.running.load(std::memory_order_acquire)) {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+        event_log_drain(monotonic_ns() - EVENT_LOG_SETTLE_NS);
+    }
+    return NULL;
+}
+
+// event_log_start()
+// Reads --log/--log-file and starts the background thread if needed. Call once
+// from main() before the worker threads are created.
+inline void event_log_start(Options& options, log_formatter formatter) {
+    std::string mode = options.get("log", options.quiet() ? "off" : "text");
+    std::string path = options.get("log-file", "events.bin");
+    event_log.formatter = formatter;
+    if (mode == "text") {
+        event_log.mode = LOG_TEXT;
+    } else if (mode == "sync") {
+        event_log.mode = LOG_SYNC;
+    } else if (mode == "binary") {
+        event_log.mode = LOG_BINARY;
+        event_log.binary_file = fopen(path.c_str(), "wb");
+        if (event_log.binary_file == NULL) {
+            options.fail("cannot write " + path);
+        }
+    } else if (mode == "off") {
+        event_log.mode = LOG_OFF;
+    } else {
+        options.fail("unknown --log mode " + mode + " (expected text, sync, binary or off)");
+    }
+
+    if (event_log.mode == LOG_TEXT || event_log.mode == LOG_BINARY) {
+        event_log.running.store(true, std::memory_order_release);
+        pthread_create(&event_log.flusher, NULL, event_log_flusher, 0);
+    }
+}
+
+// event_log_stop()
+// Stops the background thread and writes out everything still buffered. Call
+// from main() once the workers are done, before printing the results.
+inline void event_log_stop() {
+    if (event_log.running.exchange(false)) {
+        pthread_join(event_log.flusher, NULL);
+    }
+    if (event_log.mode == LOG_TEXT || event_log.mode == LOG_BINARY) {
+        event_log_drain(UINT64_MAX);
+    }
+    if (event_log.binary_file != NULL) {
+        fclose(event_log.binary_file);
+        event_log.binary_file = NULL;
+    }
+    std::cout << std::flush;
+}
+
+// log_append()
+// Appends a number to a formatter's output without allocating.
+inline void log_append(std::string& out, long long value) {
+    char digits[24];
+    std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+// log_enabled()
+// Whether events are being recorded, for callers that would otherwise walk
+// data only to log it.
+inline bool log_enabled() {
+    return event_log.mode != LOG_OFF;
+}
+
+// log_event()
+// Records one event from the calling thread.
+inline void log_event(uint16_t event, int32_t entity, int64_t arg = 0) {
+    if (event_log.mode == LOG_OFF) {
+        return;
+    }
+    if (event_log.mode == LOG_SYNC) {
+        // Formatters may keep state between events, so they run under the lock too.
+        LogEvent e = {monotonic_ns(), event, 0, entity, arg};
+        pthread_mutex_lock(&event_log.sync_mutex);
+        event_log.text.clear();
+        event_log.formatter(e, event_log.text);
+        std::cout << event_log.text;
+        pthread_mutex_unlock(&event_log.sync_mutex);
+        return;
+    }
+    EventRing* ring = event_log_thread_ring();
+    ring->push(LogEvent{monotonic_ns(), event, ring->thread, entity, arg});
+}
+
+#endif
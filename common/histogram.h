@@ -0,0 +1,115 @@
+// Fixed-size latency histogram with logarithmic buckets.
+//
+// Values are nanoseconds. Each power of two is split into 16 linear sub-buckets,
+// so any recorded value is reported within about 6% of what was measured, and
+// recording is a couple of shifts and an increment. Not thread-safe: callers
+// either keep one per thread and merge() at the end, or record under a lock they
+// already hold.
+
+#ifndef POSIX_SAMPLES_HISTOGRAM_H
+#define POSIX_SAMPLES_HISTOGRAM_H
+
+// Library imports
+#include <cstdint>
+#include <string>
+#include "report.h"
+
+class LatencyHistogram {
+    public:
+        static const int SUB_BITS = 4;
+        static const int SUB_BUCKETS = 1 << SUB_BITS;
+        static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+        uint64_t counts[BUCKETS] = {};
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t min = UINT64_MAX;
+        uint64_t max = 0;
+
+        // bucket_of()
+        // Values below SUB_BUCKETS get a bucket each; above that, the top SUB_BITS
+        // bits after the leading one pick the sub-bucket within its power of two.
+        static int bucket_of(uint64_t value) {
+            if (value < (uint64_t)SUB_BUCKETS) {
+                return (int)value;
+            }
+            int exponent = 63 - __builtin_clzll(value);
+            int shift = exponent - SUB_BITS;
+            return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+        }
+
+        // bucket_value()
+        // The midpoint of a bucket, used when reporting percentiles.
+        static uint64_t bucket_value(int bucket) {
+            if (bucket < SUB_BUCKETS) {
+                return bucket;
+            }
+            int shift = bucket / SUB_BUCKETS - 1;
+            uint64_t low = ((uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS)) << shift;
+            return low + ((1ULL << shift) >> 1);
+        }
+
+        void record(uint64_t value) {
+            counts[bucket_of(value)]++;
+            total++;
+            sum += value;
+            if (value < min) {
+                min = value;
+            }
+            if (value > max) {
+                max = value;
+            }
+        }
+
+        void merge(const LatencyHistogram& other) {
+            for (int i = 0; i < BUCKETS; i++) {
+                counts[i] += other.counts[i];
+            }
+            total += other.total;
+            sum += other.sum;
+            if (other.min < min) {
+                min = other.min;
+            }
+            if (other.max > max) {
+                max = other.max;
+            }
+        }
+
+        // percentile()
+        // The value at or below which p percent of the recordings fall.
+        uint64_t percentile(double p) const {
+            if (total == 0) {
+                return 0;
+            }
+            uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+            if (rank < 1) {
+                rank = 1;
+            }
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    uint64_t value = bucket_value(i);
+                    return value < min ? min : (value > max ? max : value);
+                }
+            }
+            return max;
+        }
+
+        uint64_t mean() const {
+            return total == 0 ? 0 : sum / total;
+        }
+
+        // add_to_report()
+        // Adds <prefix>_count, _mean_ns, _p50_ns, _p90_ns, _p99_ns and _max_ns.
+        void add_to_report(Report& report, const std::string& prefix) const {
+            report.add(prefix + "_count", (long long)total);
+            report.add(prefix + "_mean_ns", (long long)mean());
+            report.add(prefix + "_p50_ns", (long long)percentile(50));
+            report.add(prefix + "_p90_ns", (long long)percentile(90));
+            report.add(prefix + "_p99_ns", (long long)percentile(99));
+            report.add(prefix + "_max_ns", (long long)(total == 0 ? 0 : max));
+        }
+};
+
+#endif
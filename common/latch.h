@@ -0,0 +1,66 @@
+// Countdown latch used by main() to wait for the simulated entities.
+//
+// main() arms the latch with the number of entities (customers, students, ...)
+// before the workers start. Whoever finishes with an entity, whether it was served
+// or turned away, counts it down. main() blocks in wait() instead of spinning on
+// the queue, and the time of the final count_down() is kept so the elapsed time
+// ends at the real last completion.
+
+#ifndef POSIX_SAMPLES_LATCH_H
+#define POSIX_SAMPLES_LATCH_H
+
+// Library imports
+#include <cstdint>
+#include <pthread.h>
+#include "clock.h"
+
+class CompletionLatch {
+    private:
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+        long remaining = 0;
+        uint64_t completed_at = 0;
+
+    public:
+        // reset()
+        // Arms the latch for count entities. A count of zero is already complete.
+        void reset(long count) {
+            pthread_mutex_lock(&lock);
+            remaining = count;
+            completed_at = monotonic_ns();
+            pthread_mutex_unlock(&lock);
+        }
+
+        // count_down()
+        // Marks n entities as finished.
+        void count_down(long n = 1) {
+            pthread_mutex_lock(&lock);
+            remaining -= n;
+            if (remaining <= 0) {
+                completed_at = monotonic_ns();
+                pthread_cond_broadcast(&done);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        // wait()
+        // Blocks until every entity has been counted down.
+        void wait() {
+            pthread_mutex_lock(&lock);
+            while (remaining > 0) {
+                pthread_cond_wait(&done, &lock);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        // completed_ns()
+        // CLOCK_MONOTONIC time at which the last entity finished.
+        uint64_t completed_ns() {
+            pthread_mutex_lock(&lock);
+            uint64_t t = completed_at;
+            pthread_mutex_unlock(&lock);
+            return t;
+        }
+};
+
+#endif
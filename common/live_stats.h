@@ -0,0 +1,190 @@
+// Live statistics published to POSIX shared memory while a simulation runs.
+//
+// With --live-stats (or --live-stats=/name) the program creates a shared-memory
+// segment, by default /posix_samples.<program>.<pid>, and publishes into it:
+//   - counters (served, balked, crossed, ...) that only go up,
+//   - gauges (queue depth, ...) that hold the latest value,
+//   - a snapshot of the latency percentiles, measured from each entity's
+//     intended arrival time to its hand-off to a worker.
+// monitor/monitor polls the segment and prints the counters as rates.
+//
+// Every metric is a single 64-bit atomic in the segment, updated with a relaxed
+// store or add, so publishing costs no syscall and no lock. The latency snapshot
+// is several words and is written under a sequence lock: its single writer (the
+// thread recording the hand-off, which holds the queue lock) makes the sequence
+// odd while writing, and readers retry until they see the same even sequence
+// before and after reading. The snapshot is refreshed at most every
+// LIVE_SNAPSHOT_INTERVAL_NS.
+//
+// Without --live-stats the metrics live in an ordinary private segment, so the
+// samples update them the same way either way.
+
+#ifndef POSIX_SAMPLES_LIVE_STATS_H
+#define POSIX_SAMPLES_LIVE_STATS_H
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "options.h"
+#include "clock.h"
+#include "histogram.h"
+
+const uint32_t LIVE_STATS_MAGIC = 0x4c495645;     // "LIVE"
+const uint32_t LIVE_STATS_VERSION = 1;
+const int LIVE_MAX_METRICS = 32;
+const uint64_t LIVE_SNAPSHOT_INTERVAL_NS = 10000000;
+
+enum live_metric_kind { LIVE_COUNTER = 0, LIVE_GAUGE = 1 };
+
+// One named value in the segment.
+struct LiveMetric {
+    char name[40];
+    uint32_t kind;
+    std::atomic<uint64_t> value;
+
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    void set(uint64_t v) { value.store(v, std::memory_order_relaxed); }
+};
+
+// Latency percentiles, written under the sequence lock. The fields are atomics
+// only so that the reader's racing loads are well defined.
+struct LiveLatency {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> p50_ns;
+    std::atomic<uint64_t> p90_ns;
+    std::atomic<uint64_t> p99_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+// The shared-memory layout. magic is stored last, so a reader that sees it can
+// trust the header; num_metrics is published with release after each metric's
+// name has been written.
+struct LiveStatsSegment {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    int32_t pid;
+    std::atomic<uint32_t> finished;
+    char program[64];
+    uint64_t started_ns;
+    std::atomic<uint32_t> num_metrics;
+    LiveLatency latency;
+    LiveMetric metrics[LIVE_MAX_METRICS];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "live statistics need lock-free 64-bit atomics");
+
+struct LiveStatsState {
+    LiveStatsSegment local;         // Used when nothing is published.
+    LiveStatsSegment* segment = &local;
+    std::string name;
+    bool enabled = false;
+    uint64_t next_snapshot_ns = 0;
+    LiveMetric unused;              // Handed out once the segment is full.
+};
+
+inline LiveStatsState live_stats;
+
+// live_stats_start()
+// Reads --live-stats and creates the shared-memory segment. Call once from
+// main(), before registering metrics and before any worker thread starts.
+inline void live_stats_start(Options& options, const char* program) {
+    std::string name = options.get("live-stats", "false");
+    if (name == "false") {
+        return;
+    }
+    if (name == "true") {
+        name = "/posix_samples." + std::string(program) + "." + std::to_string(getpid());
+    }
+    if (name[0] != '/') {
+        name = "/" + name;
+    }
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(LiveStatsSegment)) != 0) {
+        options.fail("cannot create shared-memory segment " + name + ": " + strerror(errno));
+    }
+    void* address = mmap(NULL, sizeof(LiveStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        options.fail("cannot map shared-memory segment " + name + ": " + strerror(errno));
+    }
+
+    // The new pages are zero-filled, which is a valid empty segment.
+    LiveStatsSegment* segment = (LiveStatsSegment*)address;
+    segment->version = LIVE_STATS_VERSION;
+    segment->pid = getpid();
+    snprintf(segment->program, sizeof(segment->program), "%s", program);
+    segment->started_ns = monotonic_ns();
+    segment->magic.store(LIVE_STATS_MAGIC, std::memory_order_release);
+    live_stats.segment = segment;
+    live_stats.name = name;
+    live_stats.enabled = true;
+    std::cerr << "live-stats: publishing to " << name << "\n";
+}
+
+// live_metric()
+// Registers a metric and returns the slot to update.
+inline LiveMetric* live_metric(const char* name, live_metric_kind kind) {
+    LiveStatsSegment* segment = live_stats.segment;
+    uint32_t index = segment->num_metrics.load(std::memory_order_relaxed);
+    if (index == LIVE_MAX_METRICS) {
+        return &live_stats.unused;
+    }
+    LiveMetric* metric = &segment->metrics[index];
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    metric->kind = kind;
+    segment->num_metrics.store(index + 1, std::memory_order_release);
+    return metric;
+}
+
+inline LiveMetric* live_counter(const char* name) { return live_metric(name, LIVE_COUNTER); }
+inline LiveMetric* live_gauge(const char* name) { return live_metric(name, LIVE_GAUGE); }
+
+// live_latency()
+// Publishes a snapshot of a latency histogram if the last one is older than
+// LIVE_SNAPSHOT_INTERVAL_NS. The callers must be serialized (one writer at a
+// time).
+inline void live_latency(const LatencyHistogram& histogram) {
+    if (!live_stats.enabled) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    if (now < live_stats.next_snapshot_ns) {
+        return;
+    }
+    live_stats.next_snapshot_ns = now + LIVE_SNAPSHOT_INTERVAL_NS;
+
+    LiveLatency& latency = live_stats.segment->latency;
+    uint32_t sequence = latency.sequence.load(std::memory_order_relaxed);
+    latency.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    latency.count.store(histogram.total, std::memory_order_relaxed);
+    latency.p50_ns.store(histogram.percentile(50), std::memory_order_relaxed);
+    latency.p90_ns.store(histogram.percentile(90), std::memory_order_relaxed);
+    latency.p99_ns.store(histogram.percentile(99), std::memory_order_relaxed);
+    latency.max_ns.store(histogram.total ? histogram.max : 0, std::memory_order_relaxed);
+    latency.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// live_stats_stop()
+// Publishes the final latency snapshot, marks the run finished and removes the
+// segment's name. Readers that already have it mapped keep their mapping.
+inline void live_stats_stop(const LatencyHistogram& histogram) {
+    if (!live_stats.enabled) {
+        return;
+    }
+    live_stats.next_snapshot_ns = 0;
+    live_latency(histogram);
+    live_stats.segment->finished.store(1, std::memory_order_release);
+    shm_unlink(live_stats.name.c_str());
+}
+
+#endif
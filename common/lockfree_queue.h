@@ -0,0 +1,187 @@
+// Unbounded lock-free FIFO queue (Michael and Scott), with epoch-based
+// reclamation of its nodes (see epoch.h).
+//
+// --queue=lockfree moves the samples' entities through a LockFreeQueue instead
+// of a std::queue guarded by the queue's lock; --queue=locked (the default)
+// keeps the lock. Producers and consumers never block each other: a push links
+// a node after the tail with a compare-and-swap, and a pop swings the head past
+// the front node. The node the head leaves behind is retired, not deleted, so
+// a thread that read the old head a moment earlier can still follow it.
+//
+// Every pop copies the entity out of its node before the compare-and-swap that
+// takes it, since other consumers may be reading the same node, so the queue
+// suits small entities and pays a copy per failed attempt for larger ones.
+// size() is kept in a counter beside the list and is approximate while pushes
+// and pops are in flight. push() returns whether the queue was empty, for the
+// samples' "wake the worker on the first arrival" rule. A consumer that pops
+// and then looks at the new front sees every push whose counter update came
+// before its own, so between them the two sides never miss a wakeup.
+//
+// Under --replay the lock-free queue takes no lock, so only the order of the
+// acquisitions that remain is reproduced.
+
+#ifndef POSIX_SAMPLES_LOCKFREE_QUEUE_H
+#define POSIX_SAMPLES_LOCKFREE_QUEUE_H
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <optional>
+#include <utility>
+#include <cstdint>
+#include "options.h"
+#include "report.h"
+#include "epoch.h"
+
+template <typename T>
+class LockFreeQueue {
+    private:
+        struct Node : EpochRetired {
+            std::optional<T> value;     // Empty in the dummy node.
+            std::atomic<Node*> next{NULL};
+        };
+
+        alignas(64) std::atomic<Node*> head;
+        alignas(64) std::atomic<Node*> tail;
+        alignas(64) std::atomic<int64_t> count{0};
+
+        static void destroy_node(EpochRetired* node) {
+            delete static_cast<Node*>(node);
+        }
+
+        static Node* make_node() {
+            Node* node = new Node();
+            node->bytes = sizeof(Node);
+            node->destroy = destroy_node;
+            return node;
+        }
+
+    public:
+        LockFreeQueue() {
+            Node* dummy = make_node();
+            head.store(dummy, std::memory_order_relaxed);
+            tail.store(dummy, std::memory_order_relaxed);
+        }
+
+        // Frees the nodes still queued. Only once no other thread uses it.
+        ~LockFreeQueue() {
+            Node* node = head.load(std::memory_order_relaxed);
+            while (node != NULL) {
+                Node* next = node->next.load(std::memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+
+        LockFreeQueue(const LockFreeQueue&) = delete;
+        LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+        size_t size() const {
+            int64_t n = count.load(std::memory_order_acquire);
+            return n > 0 ? (size_t)n : 0;
+        }
+
+        bool empty() const { return size() == 0; }
+
+        // push()
+        // Appends an entity. Returns true if the queue was empty, i.e. every
+        // entity pushed before it has been popped.
+        bool push(T item) {
+            Node* node = make_node();
+            node->value.emplace(std::move(item));
+            EpochGuard guard;
+            while (true) {
+                Node* last = tail.load(std::memory_order_acquire);
+                Node* next = last->next.load(std::memory_order_acquire);
+                if (last != tail.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                if (next != NULL) {
+                    // The tail is lagging behind a push in progress; help it on.
+                    tail.compare_exchange_weak(last, next, std::memory_order_release, std::memory_order_relaxed);
+                    continue;
+                }
+                if (last->next.compare_exchange_weak(next, node, std::memory_order_release,
+                                                     std::memory_order_relaxed)) {
+                    tail.compare_exchange_strong(last, node, std::memory_order_release, std::memory_order_relaxed);
+                    break;
+                }
+            }
+            return count.fetch_add(1, std::memory_order_acq_rel) <= 0;
+        }
+
+        // pop_if()
+        // Removes and returns the front entity if there is one and take(front)
+        // is true.
+        template <typename Predicate>
+        std::optional<T> pop_if(Predicate take) {
+            EpochGuard guard;
+            while (true) {
+                Node* first = head.load(std::memory_order_acquire);
+                Node* last = tail.load(std::memory_order_acquire);
+                Node* next = first->next.load(std::memory_order_acquire);
+                if (first != head.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                if (next == NULL) {
+                    return std::nullopt;
+                }
+                if (first == last) {
+                    tail.compare_exchange_weak(last, next, std::memory_order_release, std::memory_order_relaxed);
+                    continue;
+                }
+                if (!take(*next->value)) {
+                    return std::nullopt;
+                }
+                std::optional<T> item = next->value;
+                if (head.compare_exchange_weak(first, next, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                    count.fetch_sub(1, std::memory_order_acq_rel);
+                    epoch_retire(first);
+                    return item;
+                }
+            }
+        }
+
+        // pop()
+        // Removes and returns the front entity, if any.
+        std::optional<T> pop() {
+            return pop_if([](const T&) { return true; });
+        }
+
+        // front()
+        // A copy of the front entity, if any.
+        std::optional<T> front() {
+            std::optional<T> item;
+            pop_if([&item](const T& first) {
+                item = first;
+                return false;
+            });
+            return item;
+        }
+};
+
+// Set by --queue=lockfree.
+inline bool queue_lockfree = false;
+
+// queue_start()
+// Reads --queue. Call once from main() before any thread uses a queue.
+inline void queue_start(Options& options) {
+    std::string kind = options.get("queue", "locked");
+    if (kind != "locked" && kind != "lockfree") {
+        options.fail("unknown --queue " + kind + " (expected locked or lockfree)");
+    }
+    queue_lockfree = kind == "lockfree";
+}
+
+// queue_report()
+// Adds the queue kind to the report and, for the lock-free queue, reports its
+// memory reclamation. Call after the workers have been joined.
+inline void queue_report(Report& report) {
+    report.add("queue", queue_lockfree ? "lockfree" : "locked");
+    if (queue_lockfree) {
+        epoch_report(report);
+    }
+}
+
+#endif
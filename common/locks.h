@@ -0,0 +1,353 @@
+// Lock implementations for the samples' short critical sections.
+//
+// The samples' locks guard a queue push or pop, a handful of instructions, yet a
+// pthread mutex or a binary semaphore puts a thread to sleep in the kernel
+// whenever it finds the lock taken. SampleLock lets --lock pick what happens
+// instead:
+//   pthread   pthread_mutex_t, the default
+//   adaptive  futex mutex that spins for a bounded, self-tuning number of
+//             iterations before parking
+//   ticket    FIFO ticket lock
+//   mcs       MCS queue lock; each waiter spins on its own cache line
+// Ticket and MCS waiters spin for up to the adaptive mutex's spin bound and then
+// park on a futex, so a lock held across a sleep (as the bridge holds
+// bridge_semaphore while a car crosses) does not keep its waiters on the CPU.
+//
+// Every implementation is initialized by SampleLock::init(), and the kind is
+// read on each operation, so lock_start() may run after the locks are created,
+// as long as it runs before any thread uses them.
+
+#ifndef POSIX_SAMPLES_LOCKS_H
+#define POSIX_SAMPLES_LOCKS_H
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "options.h"
+#include "report.h"
+#include "topology.h"
+
+enum lock_kind { LOCK_PTHREAD, LOCK_ADAPTIVE, LOCK_TICKET, LOCK_MCS };
+
+inline lock_kind lock_selected = LOCK_PTHREAD;
+const int LOCK_YIELD_SPINS = 128;
+const int LOCK_MAX_NESTED = 8;
+// Upper bound on a waiter's spinning before it parks; 0 on a single CPU, where
+// the holder cannot make progress while we spin.
+inline int lock_max_spins = 1000;
+
+// Slow-path counters, for lock_report().
+inline std::atomic<uint64_t> lock_spun(0);      // Acquired while spinning.
+inline std::atomic<uint64_t> lock_parked(0);    // Had to sleep in the kernel.
+inline std::atomic<uint64_t> lock_yielded(0);   // Spin waits that yielded the CPU.
+
+// lock_futex()
+// FUTEX_WAIT or FUTEX_WAKE on a 32-bit lock word, private to the process.
+inline void lock_futex(void* address, int op, int value) {
+    syscall(SYS_futex, (int*)address, op | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+}
+
+// lock_cpu_relax()
+// Tells the CPU we are in a spin-wait loop.
+inline void lock_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// lock_spin_wait()
+// One iteration of a spin-wait; yields the CPU once the wait has gone on long.
+inline void lock_spin_wait(int& spins) {
+    if (++spins < LOCK_YIELD_SPINS) {
+        lock_cpu_relax();
+    } else {
+        if (spins == LOCK_YIELD_SPINS) {
+            lock_yielded.fetch_add(1, std::memory_order_relaxed);
+        }
+        sched_yield();
+    }
+}
+
+// Futex mutex with three states (0 free, 1 locked, 2 locked with sleepers), after
+// Drepper's "Futexes Are Tricky". Before parking, lock() spins for up to twice
+// the spin count that recently succeeded; acquisitions won by spinning pull the
+// estimate towards their count, and parking shrinks it, so a lock held across
+// long operations soon stops spinning at all.
+class AdaptiveMutex {
+    private:
+        std::atomic<int> state{0};
+        std::atomic<int> spin_estimate{16};
+
+    public:
+        bool try_lock() {
+            int expected = 0;
+            return state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+        }
+
+        void lock() {
+            if (try_lock()) {
+                return;
+            }
+            int estimate = spin_estimate.load(std::memory_order_relaxed);
+            int limit = std::min(2 * estimate + 16, lock_max_spins);
+            for (int spins = 1; spins <= limit; spins++) {
+                lock_cpu_relax();
+                if (state.load(std::memory_order_relaxed) == 0 && try_lock()) {
+                    spin_estimate.store(estimate + (spins - estimate) / 8, std::memory_order_relaxed);
+                    lock_spun.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            spin_estimate.store(estimate - estimate / 8, std::memory_order_relaxed);
+
+            // Park. Marking the lock contended makes the holder's unlock wake us.
+            lock_parked.fetch_add(1, std::memory_order_relaxed);
+            while (state.exchange(2, std::memory_order_acquire) != 0) {
+                lock_futex(&state, FUTEX_WAIT, 2);
+            }
+        }
+
+        void unlock() {
+            if (state.exchange(0, std::memory_order_release) == 2) {
+                lock_futex(&state, FUTEX_WAKE, 1);
+            }
+        }
+};
+
+// FIFO ticket lock. Parked waiters sleep on now_serving; as only the next
+// ticket may proceed, unlock() wakes them all and the others park again.
+class TicketLock {
+    private:
+        std::atomic<uint32_t> next_ticket{0};
+        std::atomic<uint32_t> now_serving{0};
+        std::atomic<int> sleepers{0};
+
+    public:
+        bool try_lock() {
+            uint32_t serving = now_serving.load(std::memory_order_relaxed);
+            uint32_t expected = serving;
+            return next_ticket.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire);
+        }
+
+        void lock() {
+            uint32_t ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+            uint32_t serving;
+            int spins = 0;
+            while ((serving = now_serving.load(std::memory_order_acquire)) != ticket) {
+                if (spins < lock_max_spins) {
+                    spins++;
+                    lock_cpu_relax();
+                    continue;
+                }
+                if (spins++ == lock_max_spins) {
+                    lock_parked.fetch_add(1, std::memory_order_relaxed);
+                }
+                // Announce the sleeper before the last check, so that an unlock
+                // either is seen here or sees the sleeper and wakes it.
+                sleepers.fetch_add(1);
+                if (now_serving.load() == serving) {
+                    lock_futex(&now_serving, FUTEX_WAIT, (int)serving);
+                }
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        void unlock() {
+            now_serving.store(now_serving.load(std::memory_order_relaxed) + 1);
+            if (sleepers.load() != 0) {
+                lock_futex(&now_serving, FUTEX_WAKE, INT32_MAX);
+            }
+        }
+};
+
+// A waiter in an MCS queue. Each thread has a few, one per lock it may hold at
+// once, on separate cache lines. waiting is 0 once the lock is handed over, 1
+// while the waiter spins and 2 once it has parked on it.
+struct alignas(64) McsNode {
+    std::atomic<McsNode*> next{NULL};
+    std::atomic<int> waiting{0};
+    bool in_use = false;
+};
+
+inline thread_local McsNode mcs_nodes[LOCK_MAX_NESTED];
+
+// mcs_node()
+// Takes a free node of the calling thread.
+inline McsNode* mcs_node() {
+    for (McsNode& node : mcs_nodes) {
+        if (!node.in_use) {
+            node.in_use = true;
+            node.next.store(NULL, std::memory_order_relaxed);
+            return &node;
+        }
+    }
+    std::cerr << "locks: more than " << LOCK_MAX_NESTED << " MCS locks held by one thread\n";
+    abort();
+}
+
+// MCS queue lock: waiters form a linked queue and each spins on its own node
+// until its predecessor hands the lock over.
+class McsLock {
+    private:
+        std::atomic<McsNode*> tail{NULL};
+        McsNode* holder = NULL;     // Only accessed by the thread holding the lock.
+
+    public:
+        bool try_lock() {
+            McsNode* node = mcs_node();
+            McsNode* expected = NULL;
+            if (tail.compare_exchange_strong(expected, node, std::memory_order_acquire)) {
+                holder = node;
+                return true;
+            }
+            node->in_use = false;
+            return false;
+        }
+
+        void lock() {
+            McsNode* node = mcs_node();
+            node->waiting.store(1, std::memory_order_relaxed);
+            McsNode* previous = tail.exchange(node, std::memory_order_acq_rel);
+            if (previous != NULL) {
+                previous->next.store(node, std::memory_order_release);
+                int spins = 0;
+                while (spins < lock_max_spins && node->waiting.load(std::memory_order_acquire) != 0) {
+                    spins++;
+                    lock_cpu_relax();
+                }
+                int expected = 1;
+                if (node->waiting.compare_exchange_strong(expected, 2, std::memory_order_acquire)) {
+                    lock_parked.fetch_add(1, std::memory_order_relaxed);
+                    while (node->waiting.load(std::memory_order_acquire) != 0) {
+                        lock_futex(&node->waiting, FUTEX_WAIT, 2);
+                    }
+                }
+            }
+            holder = node;
+        }
+
+        void unlock() {
+            McsNode* node = holder;
+            McsNode* next = node->next.load(std::memory_order_acquire);
+            if (next == NULL) {
+                McsNode* expected = node;
+                if (tail.compare_exchange_strong(expected, NULL, std::memory_order_release)) {
+                    node->in_use = false;
+                    return;
+                }
+                // A waiter swapped itself in but has not linked up yet.
+                int spins = 0;
+                while ((next = node->next.load(std::memory_order_acquire)) == NULL) {
+                    lock_spin_wait(spins);
+                }
+            }
+            if (next->waiting.exchange(0, std::memory_order_release) == 2) {
+                lock_futex(&next->waiting, FUTEX_WAKE, 1);
+            }
+            node->in_use = false;
+        }
+};
+
+// A lock whose implementation is chosen with --lock.
+class SampleLock {
+    private:
+        pthread_mutex_t pthread_mutex;
+        AdaptiveMutex adaptive;
+        TicketLock ticket;
+        McsLock mcs;
+
+    public:
+        void init() {
+            pthread_mutex_init(&pthread_mutex, NULL);
+        }
+
+        void destroy() {
+            pthread_mutex_destroy(&pthread_mutex);
+        }
+
+        bool try_lock() {
+            switch (lock_selected) {
+                case LOCK_ADAPTIVE: return adaptive.try_lock();
+                case LOCK_TICKET: return ticket.try_lock();
+                case LOCK_MCS: return mcs.try_lock();
+                default: return pthread_mutex_trylock(&pthread_mutex) == 0;
+            }
+        }
+
+        void lock() {
+            switch (lock_selected) {
+                case LOCK_ADAPTIVE: adaptive.lock(); break;
+                case LOCK_TICKET: ticket.lock(); break;
+                case LOCK_MCS: mcs.lock(); break;
+                default: pthread_mutex_lock(&pthread_mutex); break;
+            }
+        }
+
+        void unlock() {
+            switch (lock_selected) {
+                case LOCK_ADAPTIVE: adaptive.unlock(); break;
+                case LOCK_TICKET: ticket.unlock(); break;
+                case LOCK_MCS: mcs.unlock(); break;
+                default: pthread_mutex_unlock(&pthread_mutex); break;
+            }
+        }
+};
+
+// lock_kind_name()
+inline const char* lock_kind_name(lock_kind kind) {
+    switch (kind) {
+        case LOCK_ADAPTIVE: return "adaptive";
+        case LOCK_TICKET: return "ticket";
+        case LOCK_MCS: return "mcs";
+        default: return "pthread";
+    }
+}
+
+// lock_parse()
+// Turns a --lock value into a kind. Returns false for an unknown name.
+inline bool lock_parse(const std::string& name, lock_kind& kind) {
+    for (lock_kind k : {LOCK_PTHREAD, LOCK_ADAPTIVE, LOCK_TICKET, LOCK_MCS}) {
+        if (name == lock_kind_name(k)) {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// lock_start()
+// Reads --lock. Call once from main() before any thread takes a SampleLock.
+inline void lock_start(Options& options) {
+    std::string name = options.get("lock", "pthread");
+    if (!lock_parse(name, lock_selected)) {
+        options.fail("unknown --lock " + name + " (expected pthread, adaptive, ticket or mcs)");
+    }
+    if (allowed_cpus().size() == 1) {
+        lock_max_spins = 0;
+    }
+}
+
+// lock_report()
+// Prints the lock implementation and its slow-path counts, and adds them to the
+// report.
+inline void lock_report(Report& report) {
+    std::cout << "Lock: " << lock_kind_name(lock_selected) << ", " << lock_spun.load() << " acquired spinning, " <<
+                 lock_parked.load() << " parked, " << lock_yielded.load() << " yielded" << std::endl;
+    report.add("lock", lock_kind_name(lock_selected));
+    report.add("lock_spun", (long long)lock_spun.load());
+    report.add("lock_parked", (long long)lock_parked.load());
+    report.add("lock_yielded", (long long)lock_yielded.load());
+}
+
+#endif
@@ -0,0 +1,193 @@
+// Command-line and config-file parameters shared by the simulations.
+//
+// Every parameter can be passed as --name=value (or --name value) on the command
+// line, or as a "name = value" line in a file given with --config=path. Values on
+// the command line override values from the config file. A parameter that was not
+// given is prompted for on cin as before, unless --non-interactive is set, in which
+// case its default is used. --quiet silences the simulation narrative, and
+// --report=json|csv prints a single machine-readable result at the end of the run.
+
+#ifndef POSIX_SAMPLES_OPTIONS_H
+#define POSIX_SAMPLES_OPTIONS_H
+
+// Library imports
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdlib>
+
+class Options {
+    private:
+        std::string program;
+        std::map<std::string, std::vector<std::string>> values;
+        std::set<std::string> used;
+
+        // add()
+        // Records a value for a parameter. Repeated parameters keep every value.
+        void add(const std::string& name, const std::string& value) {
+            values[name].push_back(value);
+        }
+
+        // trim()
+        // Removes leading and trailing whitespace from a config-file token.
+        static std::string trim(const std::string& s) {
+            size_t first = s.find_first_not_of(" \t\r\n");
+            if (first == std::string::npos) {
+                return "";
+            }
+            size_t last = s.find_last_not_of(" \t\r\n");
+            return s.substr(first, last - first + 1);
+        }
+
+        // load_config()
+        // Reads "name = value" lines from a config file. Blank lines and lines
+        // starting with '#' are ignored. Command-line values take precedence.
+        void load_config(const std::string& path, std::map<std::string, std::vector<std::string>>& config) {
+            std::ifstream file(path);
+            if (!file) {
+                fail("cannot open config file " + path);
+            }
+            std::string line;
+            int line_number = 0;
+            while (getline(file, line)) {
+                line_number++;
+                line = trim(line);
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                size_t equals = line.find('=');
+                if (equals == std::string::npos) {
+                    fail(path + ":" + std::to_string(line_number) + ": expected name = value");
+                }
+                config[trim(line.substr(0, equals))].push_back(trim(line.substr(equals + 1)));
+            }
+        }
+
+    public:
+        Options(int argc, char** argv) {
+            program = (argc > 0) ? argv[0] : "";
+            std::map<std::string, std::vector<std::string>> config;
+            for (int i = 1; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg.rfind("--", 0) != 0) {
+                    fail("unexpected argument " + arg);
+                }
+                arg = arg.substr(2);
+                std::string value;
+                size_t equals = arg.find('=');
+                if (equals != std::string::npos) {
+                    value = arg.substr(equals + 1);
+                    arg = arg.substr(0, equals);
+                } else if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+                    value = argv[++i];
+                } else {
+                    // Bare flags such as --quiet.
+                    value = "true";
+                }
+
+                if (arg == "config") {
+                    load_config(value, config);
+                } else {
+                    add(arg, value);
+                }
+            }
+            // Config-file values only fill in what the command line did not set.
+            for (auto& entry : config) {
+                if (values.find(entry.first) == values.end()) {
+                    values[entry.first] = entry.second;
+                }
+            }
+        }
+
+        // fail()
+        // Prints an option error and exits; there is nothing to recover from.
+        [[noreturn]] void fail(const std::string& message) const {
+            std::cerr << program << ": " << message << "\n";
+            exit(1);
+        }
+
+        bool has(const std::string& name) {
+            used.insert(name);
+            return values.find(name) != values.end();
+        }
+
+        std::string get(const std::string& name, const std::string& fallback = "") {
+            if (!has(name)) {
+                return fallback;
+            }
+            return values[name].back();
+        }
+
+        // get_all()
+        // Returns every value given for a repeated parameter, in order.
+        std::vector<std::string> get_all(const std::string& name) {
+            if (!has(name)) {
+                return {};
+            }
+            return values[name];
+        }
+
+        bool flag(const std::string& name) {
+            std::string value = get(name, "false");
+            return value == "true" || value == "1" || value == "yes";
+        }
+
+        bool interactive() { return !flag("non-interactive"); }
+        bool quiet() { return flag("quiet"); }
+        std::string report_format() { return get("report", ""); }
+
+        // parse()
+        // Converts a parameter value with operator>>, failing on leftovers.
+        template <typename T>
+        T parse(const std::string& name, const std::string& text) const {
+            std::istringstream stream(text);
+            T value;
+            if (!(stream >> value) || !(stream >> std::ws).eof()) {
+                fail("invalid value for --" + name + ": " + text);
+            }
+            return value;
+        }
+
+        // ask()
+        // Fills in a parameter from the command line or config file. If it was not
+        // given, prompts for it on cin, or keeps the default when non-interactive.
+        template <typename T>
+        void ask(const std::string& name, const std::string& prompt, T& value) {
+            if (has(name)) {
+                value = parse<T>(name, get(name));
+            } else if (interactive()) {
+                std::cout << prompt;
+                std::cin >> value;
+            }
+        }
+
+        // value()
+        // Reads an optional parameter that is never prompted for.
+        template <typename T>
+        T value(const std::string& name, T fallback) {
+            if (!has(name)) {
+                return fallback;
+            }
+            return parse<T>(name, get(name));
+        }
+
+        // check_unused()
+        // Rejects misspelled parameters once the program has read all it knows.
+        void check_unused() {
+            // The shared flags count as read even if the run never looked at them.
+            interactive();
+            quiet();
+            report_format();
+            for (auto& entry : values) {
+                if (used.find(entry.first) == used.end()) {
+                    fail("unknown parameter --" + entry.first);
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,393 @@
+// Hardware performance counters for worker threads and marked regions.
+//
+// With --perf every thread that calls perf_thread_start() (and main(), through
+// perf_start()) opens its own perf_event_open() counter group:
+//   cycles, instructions           IPC, the work done per cycle
+//   cache references, misses       last-level cache traffic
+//   context switches               software event, so counted even where the
+//                                  hardware counters are not (e.g. most VMs)
+// and getrusage(RUSAGE_THREAD) adds the involuntary context switches, the times
+// the thread was preempted rather than blocked. Counting is limited to user
+// space when perf_event_paranoid forbids kernel counting for this user.
+//
+// A region is a stretch of code on a hot path, declared once per site and
+// marked on each pass, e.g. the queue pop of a worker:
+//   PerfRegion barber_pop("barber_pop");
+//   ...
+//   perf_begin(barber_pop);
+//   sync_mutex_lock(&mutex); ... sync_mutex_unlock(&mutex);
+//   perf_end(barber_pop);
+// or with PerfScope scope(region) for the rest of a block. Each boundary reads
+// the counter group and the thread's rusage, two system calls of about a
+// microsecond, so a region's counts include part of that overhead, and a
+// region should cover at least the lock operations it is meant to compare.
+// Without --perf the marks cost one predictable branch.
+//
+// perf_report() prints a table of every thread's totals and every region's
+// per-pass averages at exit, and adds them to the report.
+
+#ifndef POSIX_SAMPLES_PERF_H
+#define POSIX_SAMPLES_PERF_H
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include "options.h"
+#include "report.h"
+#include "trace.h"
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    PERF_CACHE_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_PREEMPTED,             // From getrusage(), not perf_event_open().
+    PERF_NUM_COUNTERS
+};
+
+// Counters opened with perf_event_open(); the rest come from getrusage().
+const int PERF_NUM_EVENTS = PERF_PREEMPTED;
+const char* const PERF_COUNTER_NAMES[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "cache_references", "cache_misses", "context_switches", "preempted"
+};
+const int PERF_MAX_REGIONS = 16;
+
+struct PerfCounts {
+    uint64_t value[PERF_NUM_COUNTERS] = {};
+
+    void add(const PerfCounts& from, const PerfCounts& to) {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            value[i] += to.value[i] - from.value[i];
+        }
+    }
+};
+
+// One thread's counter group and what it has counted.
+struct PerfThread {
+    std::string name;
+    int fds[PERF_NUM_EVENTS];
+    int leader = -1;
+    int num_open = 0;
+    int order[PERF_NUM_EVENTS];     // Counter of each value in a group read.
+    PerfCounts opened;              // Counts when the group was opened.
+    PerfCounts total;               // Set when the thread exits.
+    bool finished = false;
+    PerfCounts region_start[PERF_MAX_REGIONS];
+    PerfCounts region_total[PERF_MAX_REGIONS];
+    uint64_t region_calls[PERF_MAX_REGIONS] = {};
+};
+
+struct PerfState {
+    bool enabled = false;
+    bool user_only = false;
+    bool available[PERF_NUM_EVENTS] = {};
+    std::string unavailable;        // Why the hardware counters could not be opened.
+    const char* region_names[PERF_MAX_REGIONS];
+    int num_regions = 0;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<PerfThread>> threads;
+};
+
+inline PerfState perf;
+inline thread_local PerfThread* perf_self = NULL;
+
+// A marked region. Declare one per site, at namespace scope.
+struct PerfRegion {
+    int index = -1;
+
+    explicit PerfRegion(const char* name) {
+        if (perf.num_regions < PERF_MAX_REGIONS) {
+            index = perf.num_regions++;
+            perf.region_names[index] = name;
+        }
+    }
+};
+
+// perf_event_attr_for()
+// The event behind a counter.
+inline perf_event_attr perf_event_attr_for(int counter, bool user_only) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter == PERF_CONTEXT_SWITCHES ? PERF_TYPE_SOFTWARE : PERF_TYPE_HARDWARE;
+    switch (counter) {
+        case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PERF_INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PERF_CACHE_REFERENCES: attr.config = PERF_COUNT_HW_CACHE_REFERENCES; break;
+        case PERF_CACHE_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        default: attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES; break;
+    }
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    return attr;
+}
+
+// perf_open()
+// Opens one counter for the calling thread in the group led by leader (-1 to
+// start a group). Returns the fd, or -1 with errno set.
+inline int perf_open(int counter, bool user_only, int leader) {
+    perf_event_attr attr = perf_event_attr_for(counter, user_only);
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+// perf_read()
+// Reads the calling thread's counters.
+inline void perf_read(PerfThread* self, PerfCounts& counts) {
+    if (self->leader >= 0) {
+        uint64_t values[1 + PERF_NUM_EVENTS];
+        if (read(self->leader, values, sizeof(values)) > 0) {
+            for (uint64_t i = 0; i < values[0] && (int)i < self->num_open; i++) {
+                counts.value[self->order[i]] = values[1 + i];
+            }
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    counts.value[PERF_PREEMPTED] = usage.ru_nivcsw;
+    if (!perf.available[PERF_CONTEXT_SWITCHES]) {
+        counts.value[PERF_CONTEXT_SWITCHES] = usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+}
+
+// PerfThreadExit
+// Reads a thread's final counts and closes its group when the thread exits.
+struct PerfThreadExit {
+    ~PerfThreadExit() {
+        PerfThread* self = perf_self;
+        if (self == NULL) {
+            return;
+        }
+        PerfCounts now;
+        perf_read(self, now);
+        self->total.add(self->opened, now);
+        self->finished = true;
+        for (int i = 0; i < self->num_open; i++) {
+            close(self->fds[i]);
+        }
+    }
+};
+
+// perf_thread_start()
+// Opens the calling thread's counters under a name for the summary. Call at
+// the top of every worker thread; threads that mark a region without calling
+// it are named after their trace label.
+inline PerfThread* perf_thread_start(const char* name) {
+    if (!perf.enabled || perf_self != NULL) {
+        return perf_self;
+    }
+    std::unique_ptr<PerfThread> thread(new PerfThread());
+    PerfThread* self = thread.get();
+    self->name = name;
+    for (int counter = 0; counter < PERF_NUM_EVENTS; counter++) {
+        if (!perf.available[counter]) {
+            continue;
+        }
+        int fd = perf_open(counter, perf.user_only, self->leader);
+        if (fd < 0) {
+            continue;
+        }
+        if (self->leader < 0) {
+            self->leader = fd;
+        }
+        self->order[self->num_open] = counter;
+        self->fds[self->num_open++] = fd;
+    }
+    perf_read(self, self->opened);
+    pthread_mutex_lock(&perf.mutex);
+    perf.threads.push_back(std::move(thread));
+    pthread_mutex_unlock(&perf.mutex);
+    perf_self = self;
+    static thread_local PerfThreadExit on_exit;
+    (void)on_exit;
+    return self;
+}
+
+// perf_thread()
+// The calling thread's counters, opened on first use.
+inline PerfThread* perf_thread() {
+    return perf_self != NULL ? perf_self : perf_thread_start(trace_thread_label ? trace_thread_label : "thread");
+}
+
+inline void perf_begin(const PerfRegion& region) {
+    if (perf.enabled && region.index >= 0) {
+        PerfThread* self = perf_thread();
+        perf_read(self, self->region_start[region.index]);
+    }
+}
+
+inline void perf_end(const PerfRegion& region) {
+    if (perf.enabled && region.index >= 0) {
+        PerfThread* self = perf_thread();
+        PerfCounts now;
+        perf_read(self, now);
+        self->region_total[region.index].add(self->region_start[region.index], now);
+        self->region_calls[region.index]++;
+    }
+}
+
+// Marks a region from its construction to the end of the enclosing block.
+class PerfScope {
+    private:
+        const PerfRegion& region;
+
+    public:
+        explicit PerfScope(const PerfRegion& region) : region(region) {
+            perf_begin(region);
+        }
+
+        ~PerfScope() {
+            perf_end(region);
+        }
+
+        PerfScope(const PerfScope&) = delete;
+        PerfScope& operator=(const PerfScope&) = delete;
+};
+
+// perf_start()
+// Reads --perf, finds out which counters can be opened, and opens main()'s.
+// Call once from main() before starting any thread.
+inline void perf_start(Options& options) {
+    perf.enabled = options.flag("perf");
+    if (!perf.enabled) {
+        return;
+    }
+    // Count kernel time too where perf_event_paranoid allows it.
+    for (bool user_only : {false, true}) {
+        perf.user_only = user_only;
+        int denied = 0;
+        for (int counter = 0; counter < PERF_NUM_EVENTS; counter++) {
+            int fd = perf_open(counter, user_only, -1);
+            perf.available[counter] = fd >= 0;
+            if (fd >= 0) {
+                close(fd);
+                continue;
+            }
+            if (errno == EACCES || errno == EPERM) {
+                denied++;
+            }
+            if (counter == PERF_CYCLES) {
+                perf.unavailable = strerror(errno);
+            }
+        }
+        if (denied == 0) {
+            break;
+        }
+    }
+    if (!perf.available[PERF_CYCLES]) {
+        std::cerr << "perf: hardware counters unavailable (" << perf.unavailable << "); counting context "
+                     "switches only" << std::endl;
+    }
+    perf_thread_start("main");
+}
+
+// perf_cell()
+// A counter value for the table, or "-" if it was not counted.
+inline std::string perf_cell(double value, int counter, int precision = 0) {
+    if (counter < PERF_NUM_EVENTS && counter != PERF_CONTEXT_SWITCHES && !perf.available[counter]) {
+        return "-";
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(precision) << value;
+    return out.str();
+}
+
+// perf_ipc()
+inline std::string perf_ipc(const PerfCounts& counts) {
+    if (!perf.available[PERF_CYCLES] || !perf.available[PERF_INSTRUCTIONS] || counts.value[PERF_CYCLES] == 0) {
+        return "-";
+    }
+    return perf_cell((double)counts.value[PERF_INSTRUCTIONS] / counts.value[PERF_CYCLES], PERF_INSTRUCTIONS, 2);
+}
+
+// perf_report()
+// Prints every thread's counts and every region's per-pass averages, and adds
+// them to the report. Call after the workers have been joined.
+inline void perf_report(Report& report) {
+    if (!perf.enabled) {
+        return;
+    }
+    // main() is still running, so its counts are read now.
+    if (perf_self != NULL && !perf_self->finished) {
+        PerfCounts now;
+        perf_read(perf_self, now);
+        perf_self->total = PerfCounts();
+        perf_self->total.add(perf_self->opened, now);
+    }
+
+    std::ostringstream out;
+    out << "\nPerformance counters (perf_event_open" << (perf.user_only ? ", user space only" : "") <<
+           (perf.available[PERF_CYCLES] ? "" : "; no hardware counters: " + perf.unavailable) << ")\n" <<
+           std::left << std::setw(24) << "  thread" << std::right << std::setw(14) << "cycles" << std::setw(14) <<
+           "instructions" << std::setw(7) << "IPC" << std::setw(12) << "cache refs" << std::setw(14) <<
+           "cache misses" << std::setw(10) << "switches" << std::setw(11) << "preempted" << "\n";
+    PerfCounts region_totals[PERF_MAX_REGIONS];
+    uint64_t region_calls[PERF_MAX_REGIONS] = {};
+    pthread_mutex_lock(&perf.mutex);
+    for (const auto& thread : perf.threads) {
+        const PerfCounts& c = thread->total;
+        out << "  " << std::left << std::setw(22) << thread->name << std::right << std::setw(14) <<
+               perf_cell(c.value[PERF_CYCLES], PERF_CYCLES) << std::setw(14) <<
+               perf_cell(c.value[PERF_INSTRUCTIONS], PERF_INSTRUCTIONS) << std::setw(7) << perf_ipc(c) <<
+               std::setw(12) << perf_cell(c.value[PERF_CACHE_REFERENCES], PERF_CACHE_REFERENCES) <<
+               std::setw(14) << perf_cell(c.value[PERF_CACHE_MISSES], PERF_CACHE_MISSES) << std::setw(10) <<
+               c.value[PERF_CONTEXT_SWITCHES] << std::setw(11) << c.value[PERF_PREEMPTED] << "\n";
+        for (int counter = 0; counter < PERF_NUM_COUNTERS; counter++) {
+            if (counter >= PERF_NUM_EVENTS || counter == PERF_CONTEXT_SWITCHES || perf.available[counter]) {
+                report.add("perf_" + thread->name + "_" + PERF_COUNTER_NAMES[counter],
+                           (long long)c.value[counter]);
+            }
+        }
+        for (int r = 0; r < perf.num_regions; r++) {
+            PerfCounts zero;
+            region_totals[r].add(zero, thread->region_total[r]);
+            region_calls[r] += thread->region_calls[r];
+        }
+    }
+    pthread_mutex_unlock(&perf.mutex);
+
+    if (std::any_of(region_calls, region_calls + perf.num_regions, [](uint64_t calls) { return calls > 0; })) {
+        out << std::left << std::setw(24) << "  region (per pass)" << std::right << std::setw(14) << "passes" <<
+               std::setw(14) << "cycles" << std::setw(14) << "instructions" << std::setw(7) << "IPC" <<
+               std::setw(14) << "cache misses" << std::setw(10) << "switches" << std::setw(11) << "preempted" <<
+               "\n";
+    }
+    // Regions the run never passed through, e.g. another mode's, are left out.
+    for (int r = 0; r < perf.num_regions; r++) {
+        if (region_calls[r] == 0) {
+            continue;
+        }
+        const PerfCounts& c = region_totals[r];
+        double passes = region_calls[r];
+        out << "  " << std::left << std::setw(22) << perf.region_names[r] << std::right << std::setw(14) <<
+               region_calls[r] << std::setw(14) << perf_cell(c.value[PERF_CYCLES] / passes, PERF_CYCLES) <<
+               std::setw(14) << perf_cell(c.value[PERF_INSTRUCTIONS] / passes, PERF_INSTRUCTIONS) << std::setw(7) <<
+               perf_ipc(c) << std::setw(14) << perf_cell(c.value[PERF_CACHE_MISSES] / passes, PERF_CACHE_MISSES, 2) <<
+               std::setw(10) << std::fixed << std::setprecision(3) << c.value[PERF_CONTEXT_SWITCHES] / passes <<
+               std::setw(11) << c.value[PERF_PREEMPTED] / passes << "\n";
+        std::string prefix = std::string("perf_region_") + perf.region_names[r];
+        report.add(prefix + "_passes", (long long)region_calls[r]);
+        for (int counter = 0; counter < PERF_NUM_COUNTERS; counter++) {
+            if (counter >= PERF_NUM_EVENTS || counter == PERF_CONTEXT_SWITCHES || perf.available[counter]) {
+                report.add(prefix + "_" + PERF_COUNTER_NAMES[counter], (long long)c.value[counter]);
+            }
+        }
+    }
+    std::cout << out.str() << std::flush;
+}
+
+#endif
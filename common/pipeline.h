@@ -0,0 +1,335 @@
+// Staged pipelines with bounded queues between the stages.
+//
+// An item passes through a fixed sequence of stages. Each stage has its own
+// pool of worker threads and a bounded queue in front of it. A worker pops an
+// item, serves it for the stage's service time and pushes it into the next
+// stage's queue; if that queue is full the worker blocks, still holding the
+// finished item, until a slot frees up. A slow stage therefore fills the queue
+// in front of it, then stalls the stage before it, and so on back to the
+// entrance, where Pipeline::enter() turns items away instead of blocking.
+//
+// Each queue is the classic bounded buffer: a counting semaphore of free slots,
+// one of queued items, and a lock around the std::queue, all registered with
+// the sync wrappers. --trace shows backpressure as waits on "<stage>_slots" and
+// idle workers as waits on "<stage>_items". A stage is shut down by queueing
+// one PIPELINE_STOP per worker once everything before it has stopped.
+//
+// For every stage the pipeline measures
+//   queueing delay  from entering the stage's queue to a worker popping it
+//   utilization     the workers' service time over workers x elapsed time
+//   blocked time    workers holding a finished item while the next queue is
+//                   full
+// and, over the whole pipeline, the latency from each item's intended arrival
+// to the end of its last stage. pipeline_report() names the bottleneck, the
+// stage with the highest utilization: the stages before it spend their time
+// blocked and those after it idle.
+
+#ifndef POSIX_SAMPLES_PIPELINE_H
+#define POSIX_SAMPLES_PIPELINE_H
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include <semaphore.h>
+#include "report.h"
+#include "clock.h"
+#include "histogram.h"
+#include "sim_time.h"
+#include "trace.h"
+#include "live_stats.h"
+#include "placement.h"
+#include "sync.h"
+#include "perf.h"
+
+// Each stage registers three sync objects, and sync.h keeps 16.
+const int PIPELINE_MAX_STAGES = 4;
+const int PIPELINE_MAX_WORKERS = 16;
+// Queued once per worker to stop a stage.
+const int PIPELINE_STOP = -1;
+// Every worker's pass through a stage's locked queue, for --perf.
+inline PerfRegion pipeline_pop("pipeline_pop");
+
+struct PipelineItem {
+    int id;
+    uint64_t arrival_ns;    // Intended arrival, for the end-to-end latency.
+    uint64_t queued_ns;     // Entered the current stage's queue.
+};
+
+// One worker's measurements, on its own cache lines.
+struct alignas(64) PipelineWorker {
+    pthread_t thread;
+    int stage = 0;
+    std::string name;
+    uint64_t served = 0;
+    uint64_t busy_ns = 0;
+    uint64_t blocked_ns = 0;
+    LatencyHistogram queueing;
+    LatencyHistogram end_to_end;    // Last stage only.
+};
+
+struct PipelineStage {
+    std::string name;
+    std::string slots_name;
+    std::string items_name;
+    std::string lock_name;
+    std::string push_name;
+    std::string pop_name;
+    std::string depth_name;
+    int num_workers = 1;
+    int capacity = 1;
+    Interval service;
+    sem_t slots;
+    sem_t items;
+    SampleLock lock;
+    std::queue<PipelineItem> queue;
+    LiveMetric* depth = NULL;
+    std::vector<std::unique_ptr<PipelineWorker>> workers;
+};
+
+class Pipeline {
+    public:
+        std::vector<std::unique_ptr<PipelineStage>> stages;
+        // The service time of an item at a stage, e.g. stage.service.sample().
+        uint64_t (*service_ns)(int item, int stage) = NULL;
+        // Called with the first stage's lock held when an item enters the
+        // pipeline, with the first queue's new length.
+        void (*entered)(int item, size_t depth) = NULL;
+        // Called with the stage's lock held when a worker pops an item.
+        void (*popped)(int item, int stage) = NULL;
+        // Called by a worker when it starts serving an item.
+        void (*started)(int item, int stage) = NULL;
+        // Called when an item leaves the last stage.
+        void (*finished)(int item) = NULL;
+        uint64_t started_ns = 0;
+
+        // add_stage()
+        // Appends a stage. Call before start().
+        void add_stage(const std::string& name, int num_workers, int capacity, const Interval& service) {
+            if (stages.size() == PIPELINE_MAX_STAGES) {
+                std::cerr << "pipeline: more than " << PIPELINE_MAX_STAGES << " stages" << std::endl;
+                abort();
+            }
+            std::unique_ptr<PipelineStage> stage(new PipelineStage());
+            stage->name = name;
+            stage->slots_name = name + "_slots";
+            stage->items_name = name + "_items";
+            stage->lock_name = name + "_lock";
+            stage->push_name = "push " + name;
+            stage->pop_name = "pop " + name;
+            stage->depth_name = name + "_depth";
+            stage->num_workers = num_workers;
+            stage->capacity = capacity;
+            stage->service = service;
+            stages.push_back(std::move(stage));
+        }
+
+        // start()
+        // Creates the queues and starts every stage's workers.
+        void start() {
+            for (auto& stage : stages) {
+                sync_sem_init(&stage->slots, stage->slots_name.c_str(), stage->capacity);
+                sync_sem_init(&stage->items, stage->items_name.c_str(), 0);
+                sync_mutex_init(&stage->lock, stage->lock_name.c_str());
+                stage->depth = live_gauge(stage->depth_name.c_str());
+            }
+            started_ns = monotonic_ns();
+            for (size_t s = 0; s < stages.size(); s++) {
+                PipelineStage& stage = *stages[s];
+                for (int w = 0; w < stage.num_workers; w++) {
+                    std::unique_ptr<PipelineWorker> worker(new PipelineWorker());
+                    worker->stage = s;
+                    worker->name = stage.num_workers > 1 ? stage.name + "_" + std::to_string(w) : stage.name;
+                    stage.workers.push_back(std::move(worker));
+                }
+                for (auto& worker : stage.workers) {
+                    pthread_create(&worker->thread, placement_worker_attr(), worker_thread, new WorkerArgs{this,
+                                   worker.get()});
+                }
+            }
+        }
+
+        // enter()
+        // Queues an item at the first stage if it has room. Returns false,
+        // leaving the item out, if the first queue is full.
+        bool enter(int id, uint64_t arrival_ns) {
+            PipelineStage& first = *stages[0];
+            if (sem_trywait(&first.slots) != 0) {
+                return false;
+            }
+            queue_item(first, PipelineItem{id, arrival_ns, 0});
+            return true;
+        }
+
+        // stop()
+        // Stops the stages in order, each once the ones before it have stopped.
+        // Call once every item has left the pipeline.
+        void stop() {
+            for (auto& stage : stages) {
+                for (int w = 0; w < stage->num_workers; w++) {
+                    push(*stage, PipelineItem{PIPELINE_STOP, 0, 0});
+                }
+                for (auto& worker : stage->workers) {
+                    pthread_join(worker->thread, NULL);
+                }
+            }
+        }
+
+        void destroy() {
+            for (auto& stage : stages) {
+                sync_sem_destroy(&stage->slots);
+                sync_sem_destroy(&stage->items);
+                sync_mutex_destroy(&stage->lock);
+            }
+        }
+
+    private:
+        struct WorkerArgs {
+            Pipeline* pipeline;
+            PipelineWorker* worker;
+        };
+
+        // queue_item()
+        // Adds an item to a stage's queue, for which a slot has been taken.
+        void queue_item(PipelineStage& stage, PipelineItem item) {
+            sync_mutex_lock(&stage.lock);
+            item.queued_ns = monotonic_ns();
+            stage.queue.push(item);
+            trace_queue(stage.name.c_str(), stage.push_name.c_str(), stage.queue.size());
+            stage.depth->set(stage.queue.size());
+            if (&stage == stages[0].get() && item.id != PIPELINE_STOP && entered != NULL) {
+                entered(item.id, stage.queue.size());
+            }
+            sync_mutex_unlock(&stage.lock);
+            sync_sem_post(&stage.items);
+        }
+
+        // push()
+        // Adds an item to a stage's queue, blocking while it is full.
+        void push(PipelineStage& stage, const PipelineItem& item) {
+            sync_sem_wait(&stage.slots);
+            queue_item(stage, item);
+        }
+
+        // pop()
+        // Takes the item at the front of a stage's queue, blocking while it is
+        // empty.
+        PipelineItem pop(PipelineStage& stage, int index) {
+            sync_sem_wait(&stage.items);
+            perf_begin(pipeline_pop);
+            sync_mutex_lock(&stage.lock);
+            PipelineItem item = stage.queue.front();
+            stage.queue.pop();
+            trace_queue(stage.name.c_str(), stage.pop_name.c_str(), stage.queue.size());
+            stage.depth->set(stage.queue.size());
+            if (item.id != PIPELINE_STOP && popped != NULL) {
+                popped(item.id, index);
+            }
+            sync_mutex_unlock(&stage.lock);
+            perf_end(pipeline_pop);
+            sync_sem_post(&stage.slots);
+            return item;
+        }
+
+        static void* worker_thread(void* arg) {
+            WorkerArgs args = *(WorkerArgs*)arg;
+            delete (WorkerArgs*)arg;
+            Pipeline& pipeline = *args.pipeline;
+            PipelineWorker& worker = *args.worker;
+            PipelineStage& stage = *pipeline.stages[worker.stage];
+            bool last = worker.stage + 1 == (int)pipeline.stages.size();
+            trace_thread_name(worker.name.c_str());
+            perf_thread_start(worker.name.c_str());
+            while (true) {
+                PipelineItem item = pipeline.pop(stage, worker.stage);
+                if (item.id == PIPELINE_STOP) {
+                    break;
+                }
+                uint64_t begin = monotonic_ns();
+                worker.queueing.record(begin - item.queued_ns);
+                if (pipeline.started != NULL) {
+                    pipeline.started(item.id, worker.stage);
+                }
+                trace_begin(stage.name.c_str(), item.id);
+                sleep_for_ns(pipeline.service_ns(item.id, worker.stage));
+                trace_end(stage.name.c_str(), item.id);
+                uint64_t served = monotonic_ns();
+                worker.busy_ns += served - begin;
+                worker.served++;
+                if (last) {
+                    worker.end_to_end.record(served - item.arrival_ns);
+                    if (pipeline.finished != NULL) {
+                        pipeline.finished(item.id);
+                    }
+                } else {
+                    pipeline.push(*pipeline.stages[worker.stage + 1], item);
+                    worker.blocked_ns += monotonic_ns() - served;
+                }
+            }
+            return NULL;
+        }
+};
+
+// pipeline_report()
+// Prints every stage's queueing delay, utilization and blocked time, the
+// end-to-end latency and the bottleneck stage, and adds them to the report.
+// elapsed_ns is the run's length from the pipeline's start. Call after stop().
+inline void pipeline_report(Report& report, const Pipeline& pipeline, uint64_t elapsed_ns) {
+    std::ostringstream out;
+    out << "Pipeline stages:\n" << std::left << std::setw(16) << "  stage" << std::right << std::setw(8) <<
+           "workers" << std::setw(10) << "capacity" << std::setw(10) << "served" << std::setw(14) << "queue p50" <<
+           std::setw(14) << "queue p99" << std::setw(8) << "busy" << std::setw(10) << "blocked" << "\n";
+    LatencyHistogram end_to_end;
+    int bottleneck = 0;
+    double bottleneck_utilization = -1;
+    for (size_t s = 0; s < pipeline.stages.size(); s++) {
+        const PipelineStage& stage = *pipeline.stages[s];
+        LatencyHistogram queueing;
+        uint64_t served = 0, busy_ns = 0, blocked_ns = 0;
+        for (const auto& worker : stage.workers) {
+            queueing.merge(worker->queueing);
+            end_to_end.merge(worker->end_to_end);
+            served += worker->served;
+            busy_ns += worker->busy_ns;
+            blocked_ns += worker->blocked_ns;
+        }
+        double capacity_ns = (double)elapsed_ns * stage.num_workers;
+        double utilization = capacity_ns > 0 ? busy_ns / capacity_ns : 0;
+        double blocked = capacity_ns > 0 ? blocked_ns / capacity_ns : 0;
+        if (utilization > bottleneck_utilization) {
+            bottleneck = s;
+            bottleneck_utilization = utilization;
+        }
+        out << "  " << std::left << std::setw(14) << stage.name << std::right << std::setw(8) << stage.num_workers <<
+               std::setw(10) << stage.capacity << std::setw(10) << served << std::setw(14) <<
+               format_duration(queueing.percentile(50)) << std::setw(14) << format_duration(queueing.percentile(99)) <<
+               std::fixed << std::setprecision(1) << std::setw(7) << utilization * 100 << "%" << std::setw(9) <<
+               blocked * 100 << "%\n";
+        std::string prefix = "stage_" + stage.name;
+        report.add(prefix + "_workers", stage.num_workers);
+        report.add(prefix + "_capacity", stage.capacity);
+        report.add(prefix + "_served", (long long)served);
+        report.add(prefix + "_utilization", utilization);
+        report.add(prefix + "_blocked", blocked);
+        queueing.add_to_report(report, prefix + "_queueing");
+    }
+    out << "End-to-end latency from intended arrival: p50 " << format_duration(end_to_end.percentile(50)) <<
+           ", p99 " << format_duration(end_to_end.percentile(99)) << ", max " <<
+           format_duration(end_to_end.total ? end_to_end.max : 0) << "\n";
+    if (!pipeline.stages.empty()) {
+        out << "Bottleneck: " << pipeline.stages[bottleneck]->name << " (" << std::fixed << std::setprecision(1) <<
+               bottleneck_utilization * 100 << "% busy)\n";
+        report.add("pipeline_bottleneck", pipeline.stages[bottleneck]->name);
+    }
+    std::cout << out.str() << std::flush;
+    end_to_end.add_to_report(report, "pipeline_latency");
+}
+
+#endif
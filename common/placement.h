@@ -0,0 +1,320 @@
+// Placement of the producer and worker threads, and hand-off latency.
+//
+// --placement chooses where the producer (main) and the worker threads run
+// relative to each other:
+//   none          leave it to the scheduler (the default)
+//   same-core     both on one CPU
+//   smt-sibling   two hardware threads of one core
+//   same-socket   two different cores of one socket
+//   cross-socket  cores on two different sockets
+// If the machine (or the affinity mask) cannot provide the requested layout, the
+// closest one it can provide is used and a warning is printed. Samples with
+// several workers spread them round-robin over every CPU in the same relation
+// to the producer (all the producer's SMT siblings, all the other cores of its
+// socket, all the CPUs of the other socket), starting with the chosen pair's.
+//
+// With a placement chosen, the queue and lock memory registered with
+// placement_bind() is moved to the worker's NUMA node, and the producer's own
+// allocations (the queue nodes it pushes) prefer that node too.
+//
+// Hand-off latency is the time from the producer pushing an entity to a worker
+// popping it, and is reported for every run.
+
+#ifndef POSIX_SAMPLES_PLACEMENT_H
+#define POSIX_SAMPLES_PLACEMENT_H
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "options.h"
+#include "report.h"
+#include "clock.h"
+#include "histogram.h"
+#include "topology.h"
+#include "live_stats.h"
+
+// Memory policy constants from <linux/mempolicy.h>; the syscalls are made
+// directly so no libnuma is needed.
+const int PLACEMENT_MPOL_PREFERRED = 1;
+const unsigned PLACEMENT_MPOL_MF_MOVE = 1 << 1;
+
+struct Placement {
+    std::string requested = "none";
+    std::string mode = "none";     // What was actually used.
+    int producer_cpu = -1;
+    int worker_cpu = -1;
+    int worker_node = -1;
+    // Every CPU workers may be pinned to, worker_cpu first, with the attributes
+    // for each and the next one to hand out.
+    std::vector<int> worker_cpus;
+    std::vector<pthread_attr_t> worker_attrs;
+    size_t next_worker = 0;
+    bool bind_failed = false;
+};
+
+inline Placement placement;
+
+// placement_choose()
+// Picks a producer and worker CPU for the mode. Returns false if the machine has
+// no such pair.
+inline bool placement_choose(const std::vector<CpuInfo>& cpus, const std::string& mode, int& producer, int& worker) {
+    for (const CpuInfo& a : cpus) {
+        for (const CpuInfo& b : cpus) {
+            bool match = false;
+            if (mode == "same-core") {
+                match = a.cpu == b.cpu;
+            } else if (mode == "smt-sibling") {
+                match = a.cpu != b.cpu && a.socket == b.socket && a.core == b.core;
+            } else if (mode == "same-socket") {
+                match = a.socket == b.socket && a.core != b.core;
+            } else if (mode == "cross-socket") {
+                match = a.socket != b.socket;
+            }
+            if (match) {
+                producer = a.cpu;
+                worker = b.cpu;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// placement_worker_set()
+// Every CPU in the same relation to the producer as the chosen worker, with the
+// worker first.
+inline std::vector<int> placement_worker_set(const std::vector<CpuInfo>& cpus, const std::string& mode,
+                                             int producer, int worker) {
+    std::vector<int> set = {worker};
+    const CpuInfo* p = NULL;
+    const CpuInfo* w = NULL;
+    for (const CpuInfo& info : cpus) {
+        if (info.cpu == producer) {
+            p = &info;
+        }
+        if (info.cpu == worker) {
+            w = &info;
+        }
+    }
+    if (p == NULL || w == NULL || mode == "same-core") {
+        return set;
+    }
+    for (const CpuInfo& c : cpus) {
+        bool match = false;
+        if (mode == "smt-sibling") {
+            match = c.cpu != p->cpu && c.socket == p->socket && c.core == p->core;
+        } else if (mode == "same-socket") {
+            match = c.socket == p->socket && c.core != p->core;
+        } else if (mode == "cross-socket") {
+            match = c.socket == w->socket;
+        }
+        if (match && c.cpu != worker) {
+            set.push_back(c.cpu);
+        }
+    }
+    return set;
+}
+
+// placement_fallback()
+// The next closest layout to try when a mode is not available.
+inline std::string placement_fallback(const std::string& mode) {
+    if (mode == "cross-socket") {
+        return "same-socket";
+    } else if (mode == "same-socket") {
+        return "smt-sibling";
+    }
+    return "same-core";
+}
+
+// placement_start()
+// Reads --placement, pins the calling (producer) thread and prepares the worker
+// thread attributes. Call once from main() after any helper threads that should
+// stay unpinned (the event-log flusher) have been started.
+inline void placement_start(Options& options) {
+    std::string requested = options.get("placement", "none");
+    placement.requested = requested;
+    if (requested != "none" && requested != "same-core" && requested != "smt-sibling" &&
+        requested != "same-socket" && requested != "cross-socket") {
+        options.fail("unknown --placement " + requested +
+                     " (expected none, same-core, smt-sibling, same-socket or cross-socket)");
+    }
+    if (requested == "none") {
+        return;
+    }
+
+    std::vector<CpuInfo> cpus = cpu_topology();
+    std::string mode = requested;
+    while (!placement_choose(cpus, mode, placement.producer_cpu, placement.worker_cpu)) {
+        mode = placement_fallback(mode);
+    }
+    if (mode != requested) {
+        std::cerr << "placement: no " << requested << " CPU pair available, using " << mode << "\n";
+    }
+    placement.mode = mode;
+    placement.worker_cpus = placement_worker_set(cpus, mode, placement.producer_cpu, placement.worker_cpu);
+    for (const CpuInfo& info : cpus) {
+        if (info.cpu == placement.worker_cpu) {
+            placement.worker_node = info.node;
+        }
+    }
+
+    // Pin the producer, and have the workers created pinned.
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(placement.producer_cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    placement.worker_attrs.resize(placement.worker_cpus.size());
+    for (size_t i = 0; i < placement.worker_cpus.size(); i++) {
+        CPU_ZERO(&set);
+        CPU_SET(placement.worker_cpus[i], &set);
+        pthread_attr_init(&placement.worker_attrs[i]);
+        pthread_attr_setaffinity_np(&placement.worker_attrs[i], sizeof(set), &set);
+    }
+
+    // The producer allocates the queue nodes; prefer the worker's node for them.
+    unsigned long mask = 1UL << placement.worker_node;
+    if (syscall(SYS_set_mempolicy, PLACEMENT_MPOL_PREFERRED, &mask, sizeof(mask) * 8) != 0) {
+        placement.bind_failed = true;
+    }
+}
+
+// placement_worker_attr()
+// Attributes for creating the next worker thread: pinned to the next CPU of the
+// worker set, round-robin, when a placement was chosen, the defaults (NULL)
+// otherwise. Call from the thread creating the workers.
+inline const pthread_attr_t* placement_worker_attr() {
+    if (placement.worker_attrs.empty()) {
+        return NULL;
+    }
+    return &placement.worker_attrs[placement.next_worker++ % placement.worker_attrs.size()];
+}
+
+// placement_bind()
+// Moves the pages holding a shared queue or lock to the worker's NUMA node.
+inline void placement_bind(const void* address, size_t length) {
+    if (placement.worker_node < 0) {
+        return;
+    }
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    uintptr_t end = ((uintptr_t)address + length + page - 1) & ~(page - 1);
+    unsigned long mask = 1UL << placement.worker_node;
+    if (syscall(SYS_mbind, start, end - start, PLACEMENT_MPOL_PREFERRED, &mask, sizeof(mask) * 8,
+                PLACEMENT_MPOL_MF_MOVE) != 0) {
+        placement.bind_failed = true;
+    }
+}
+
+// Latency of the entities handed from the producer to the workers: from the
+// push to the pop, and from the time the entity was due to arrive (see
+// ArrivalSchedule) to the pop, which also counts any delay in the producer.
+// An entity's enqueued() happens before its dequeued(): under the queue's lock,
+// or with --queue=lockfree by coming before the push and after the pop.
+//
+// dequeued() writes the histograms and the live snapshot unsynchronized, so it
+// needs one consumer popping at a time, which the queue's lock (or, in
+// readers_writers, the resource lock) gives the single-queue samples. Samples
+// whose consumers pop concurrently, such as cigarettes with --agents, call
+// shard() first and dequeued(id, consumer), so that each consumer records into
+// its own histograms, then merge_shards() after joining the consumers. Only
+// consumer 0 publishes the live snapshot, of its own hand-offs, until the final
+// one from the merged histograms.
+struct HandoffShard {
+    LatencyHistogram histogram;
+    LatencyHistogram from_arrival;
+};
+
+struct HandoffLatency {
+    std::vector<uint64_t> enqueued_at;
+    std::vector<uint64_t> arrived_at;
+    LatencyHistogram histogram;
+    LatencyHistogram from_arrival;
+    // Separately allocated, so consumers do not share cache lines.
+    std::vector<std::unique_ptr<HandoffShard>> shards;
+
+    // reset()
+    // Sizes the tables for entity ids 0..max_id.
+    void reset(int max_id) {
+        enqueued_at.assign(max_id + 1, 0);
+        arrived_at.assign(max_id + 1, 0);
+    }
+
+    void enqueued(int id, uint64_t arrival_ns) {
+        enqueued_at[id] = monotonic_ns();
+        arrived_at[id] = arrival_ns;
+    }
+
+    void dequeued(int id) {
+        uint64_t now = monotonic_ns();
+        histogram.record(now - enqueued_at[id]);
+        from_arrival.record(now - arrived_at[id]);
+        live_latency(from_arrival);
+    }
+
+    // shard()
+    // Gives each of num_consumers consumers its own histograms. Call before
+    // starting them.
+    void shard(int num_consumers) {
+        shards.clear();
+        for (int c = 0; c < num_consumers; c++) {
+            shards.push_back(std::make_unique<HandoffShard>());
+        }
+    }
+
+    void dequeued(int id, int consumer) {
+        uint64_t now = monotonic_ns();
+        HandoffShard& shard = *shards[consumer];
+        shard.histogram.record(now - enqueued_at[id]);
+        shard.from_arrival.record(now - arrived_at[id]);
+        if (consumer == 0) {
+            live_latency(shard.from_arrival);
+        }
+    }
+
+    // merge_shards()
+    // Folds the consumers' histograms into the totals. Call after joining them.
+    void merge_shards() {
+        for (const auto& shard : shards) {
+            histogram.merge(shard->histogram);
+            from_arrival.merge(shard->from_arrival);
+        }
+        shards.clear();
+    }
+};
+
+inline HandoffLatency handoff;
+
+// handoff_report()
+// Prints the hand-off latency and adds it, with the placement, to the report.
+inline void handoff_report(Report& report) {
+    const LatencyHistogram& h = handoff.histogram;
+    std::cout << "Hand-off latency (placement " << placement.mode << "): p50 " << h.percentile(50) <<
+                 " ns, p99 " << h.percentile(99) << " ns, max " << (h.total ? h.max : 0) << " ns" << std::endl;
+    const LatencyHistogram& a = handoff.from_arrival;
+    std::cout << "Latency from intended arrival: p50 " << a.percentile(50) << " ns, p99 " << a.percentile(99) <<
+                 " ns, max " << (a.total ? a.max : 0) << " ns" << std::endl;
+    if (placement.bind_failed) {
+        std::cerr << "placement: could not set the NUMA memory policy; memory was left where it was\n";
+    }
+    report.add("placement_requested", placement.requested);
+    report.add("placement", placement.mode);
+    report.add("producer_cpu", placement.producer_cpu);
+    report.add("worker_cpu", placement.worker_cpu);
+    std::string worker_cpus;
+    for (int cpu : placement.worker_cpus) {
+        worker_cpus += (worker_cpus.empty() ? "" : ",") + std::to_string(cpu);
+    }
+    report.add("worker_cpus", worker_cpus);
+    report.add("worker_node", placement.worker_node);
+    h.add_to_report(report, "handoff");
+    a.add_to_report(report, "arrival_to_pop");
+}
+
+#endif
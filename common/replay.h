@@ -0,0 +1,457 @@
+// Reproducible runs: seeding, recording and replaying a schedule.
+//
+// Every random decision the samples make (a farmer's direction, a smoker's
+// inventory, each sampled interval) is drawn from the calling thread's engine
+// (sim_random() in sim_time.h), which is seeded from one run seed and the
+// thread's name. --seed=N fixes the run seed; without it the seed is random and
+// printed at the end, so an interesting run can be repeated.
+//
+// A seed alone does not pin down a run: arrival times depend on how late the
+// producer was, and which thread gets a lock first depends on the scheduler.
+// --record=path writes down, in a compact binary file:
+//   - the seed and the program name,
+//   - every arrival's intended time, as an offset from the start of the
+//     schedule,
+//   - every random draw, per thread,
+//   - the order in which threads acquired the locks and semaphores that go
+//     through the sync.h wrappers.
+// --replay=path runs the same program (with the same parameters) against such
+// a file: arrivals are issued at the recorded offsets, draws return the recorded
+// values, and before every acquisition the sync wrappers make the calling thread
+// wait for its recorded turn, so the locks are taken in the recorded order.
+// Replayed runs of two builds therefore see identical input and, as long as
+// their control flow agrees, an identical interleaving.
+//
+// A replay that cannot follow the recording (a thread acquires a lock the
+// recording does not have next for it, or the thread whose turn it is does not
+// come within REPLAY_STALL_NS, e.g. because a wakeup was coalesced differently)
+// stops enforcing the order and lets the rest of the run proceed freely; the
+// report says where it diverged. Threads are identified by the name given to
+// trace_thread_name(), so each thread taking part needs a distinct name.
+//
+// Numbers in the file are unsigned LEB128 varints:
+//   "PSREPLAY" version program-length program seed
+//   thread-count { name-length name draw-count draw... }
+//   arrival-count arrival-delta...
+//   acquisition-count { thread * REPLAY_MAX_OBJECTS + object }...
+
+#ifndef POSIX_SAMPLES_REPLAY_H
+#define POSIX_SAMPLES_REPLAY_H
+
+// Library imports
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "options.h"
+#include "report.h"
+#include "clock.h"
+#include "trace.h"
+
+enum replay_mode_type { REPLAY_OFF, REPLAY_RECORD, REPLAY_REPLAY };
+
+const char REPLAY_MAGIC[8] = {'P', 'S', 'R', 'E', 'P', 'L', 'A', 'Y'};
+const uint64_t REPLAY_VERSION = 1;
+const int REPLAY_MAX_OBJECTS = 16;
+const uint64_t REPLAY_STALL_NS = 1000000000ULL;
+
+// One thread's part of the recording.
+struct ReplayThread {
+    std::string name;
+    int index = 0;
+    std::vector<uint64_t> draws;
+    size_t next_draw = 0;
+    // Recording: (global sequence number, object) for every acquisition.
+    std::vector<std::pair<uint32_t, uint8_t>> acquired;
+    // Replaying: the positions in the global order that belong to this thread.
+    std::vector<uint32_t> turns;
+    std::vector<uint8_t> objects;
+    size_t next_turn = 0;
+};
+
+// Process-wide recording/replay state.
+struct ReplayState {
+    replay_mode_type mode = REPLAY_OFF;
+    std::string path;
+    std::string program;
+    pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<ReplayThread>> threads;
+    std::vector<uint64_t> arrivals;
+    size_t next_arrival = 0;
+    uint32_t num_acquisitions = 0;
+    // Set once the run has diverged from the recording.
+    std::atomic<uint32_t> diverged_at{UINT32_MAX};
+    std::string divergence;
+};
+
+inline uint64_t replay_seed = std::random_device{}() | (uint64_t)std::random_device{}() << 32;
+inline ReplayState replay_state;
+// Recording or replaying is in progress; cleared by replay_stop().
+inline std::atomic<bool> replay_active(false);
+// Recording: the next global sequence number. Replaying: the position in the
+// recorded order whose turn it is.
+inline std::atomic<uint32_t> replay_position(0);
+inline thread_local ReplayThread* replay_thread = NULL;
+
+// replay_thread_state()
+// Returns the calling thread's part of the recording, found or created by the
+// thread's name on first use.
+inline ReplayThread* replay_thread_state() {
+    if (replay_thread == NULL) {
+        pthread_mutex_lock(&replay_state.threads_mutex);
+        for (auto& thread : replay_state.threads) {
+            if (thread->name == trace_thread_label) {
+                replay_thread = thread.get();
+            }
+        }
+        if (replay_thread == NULL) {
+            std::unique_ptr<ReplayThread> thread(new ReplayThread());
+            thread->name = trace_thread_label;
+            thread->index = replay_state.threads.size();
+            replay_thread = thread.get();
+            replay_state.threads.push_back(std::move(thread));
+        }
+        pthread_mutex_unlock(&replay_state.threads_mutex);
+    }
+    return replay_thread;
+}
+
+// replay_thread_seed()
+// Seed for the calling thread's random engine: the run seed mixed with an
+// FNV-1a hash of the thread's name.
+inline uint64_t replay_thread_seed() {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = trace_thread_label; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return replay_seed ^ hash;
+}
+
+// replay_futex()
+inline void replay_futex(std::atomic<uint32_t>* address, int op, uint32_t value, const struct timespec* timeout) {
+    syscall(SYS_futex, (uint32_t*)address, op | FUTEX_PRIVATE_FLAG, value, timeout, NULL, 0);
+}
+
+// replay_diverge()
+// Gives up on following the recording and releases every waiting thread.
+inline void replay_diverge(uint32_t position, const std::string& reason) {
+    uint32_t expected = UINT32_MAX;
+    if (replay_state.diverged_at.compare_exchange_strong(expected, position)) {
+        replay_state.divergence = reason;
+        replay_active = false;
+        replay_futex(&replay_position, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// replay_draw()
+// Passes a random draw through the recording: records it, or replaces it with
+// the recorded one. Replayed draws are used even after a divergence, so the
+// input stays the recorded one.
+inline uint64_t replay_draw(uint64_t value) {
+    if (replay_state.mode == REPLAY_RECORD && replay_active.load(std::memory_order_relaxed)) {
+        replay_thread_state()->draws.push_back(value);
+    } else if (replay_state.mode == REPLAY_REPLAY) {
+        ReplayThread* thread = replay_thread_state();
+        if (thread->next_draw < thread->draws.size()) {
+            value = thread->draws[thread->next_draw++];
+        }
+    }
+    return value;
+}
+
+// replay_next_arrival()
+// When replaying, fills in the next recorded arrival offset (from the start of
+// the schedule) and returns true.
+inline bool replay_next_arrival(uint64_t& offset_ns) {
+    if (replay_state.mode != REPLAY_REPLAY || replay_state.next_arrival == replay_state.arrivals.size()) {
+        return false;
+    }
+    offset_ns = replay_state.arrivals[replay_state.next_arrival++];
+    return true;
+}
+
+// replay_record_arrival()
+// When recording, appends an arrival offset.
+inline void replay_record_arrival(uint64_t offset_ns) {
+    if (replay_state.mode == REPLAY_RECORD && replay_active.load(std::memory_order_relaxed)) {
+        replay_state.arrivals.push_back(offset_ns);
+    }
+}
+
+// replay_wait_turn()
+// Called before acquiring object: when replaying, blocks until the recorded
+// order reaches the calling thread's next acquisition.
+inline void replay_wait_turn(int object) {
+    if (replay_state.mode != REPLAY_REPLAY || !replay_active.load(std::memory_order_acquire)) {
+        return;
+    }
+    ReplayThread* thread = replay_thread_state();
+    if (thread->next_turn == thread->turns.size() || thread->objects[thread->next_turn] != object) {
+        replay_diverge(replay_position.load(), thread->name + " acquired object " + std::to_string(object) +
+                       (thread->next_turn == thread->turns.size() ? " after its last recorded acquisition" :
+                        ", recorded object " + std::to_string(thread->objects[thread->next_turn])));
+        return;
+    }
+    uint32_t turn = thread->turns[thread->next_turn];
+    uint32_t last = replay_position.load(std::memory_order_acquire);
+    uint64_t last_change_ns = monotonic_ns();
+    while (replay_active.load(std::memory_order_acquire)) {
+        uint32_t position = replay_position.load(std::memory_order_acquire);
+        if (position == turn) {
+            return;
+        }
+        uint64_t now = monotonic_ns();
+        if (position != last) {
+            last = position;
+            last_change_ns = now;
+        } else if (now - last_change_ns > REPLAY_STALL_NS) {
+            replay_diverge(position, "no thread took recorded acquisition " + std::to_string(position) +
+                           " within " + std::to_string(REPLAY_STALL_NS / 1000000) + " ms");
+            return;
+        }
+        struct timespec timeout = {0, 10000000};
+        replay_futex(&replay_position, FUTEX_WAIT, position, &timeout);
+    }
+}
+
+// replay_acquired()
+// Called once object has been acquired: records the acquisition, or passes the
+// turn on to the next one in the recorded order.
+inline void replay_acquired(int object) {
+    if (!replay_active.load(std::memory_order_acquire)) {
+        return;
+    }
+    ReplayThread* thread = replay_thread_state();
+    if (replay_state.mode == REPLAY_RECORD) {
+        uint32_t sequence = replay_position.fetch_add(1, std::memory_order_relaxed);
+        thread->acquired.push_back(std::make_pair(sequence, (uint8_t)object));
+    } else {
+        thread->next_turn++;
+        replay_position.fetch_add(1, std::memory_order_release);
+        replay_futex(&replay_position, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// Varint encoding for the recording file.
+inline void replay_put(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+inline bool replay_get(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF) {
+            return false;
+        }
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool replay_get_string(std::istream& in, std::string& s) {
+    uint64_t length;
+    if (!replay_get(in, length) || length > 4096) {
+        return false;
+    }
+    s.resize(length);
+    return (bool)in.read(&s[0], length);
+}
+
+// replay_load()
+// Reads a recording and turns its acquisition order into each thread's turns.
+// Returns an error message, or "" on success.
+inline std::string replay_load(const std::string& path, const std::string& program) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return "cannot open " + path;
+    }
+    char magic[8];
+    uint64_t version, count, value;
+    std::string recorded_program;
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + 8, REPLAY_MAGIC) ||
+        !replay_get(in, version) || version != REPLAY_VERSION) {
+        return path + " is not a version " + std::to_string(REPLAY_VERSION) + " recording";
+    }
+    if (!replay_get_string(in, recorded_program) || !replay_get(in, replay_seed)) {
+        return path + " is truncated";
+    }
+    if (recorded_program != program) {
+        return path + " was recorded by " + recorded_program + ", not " + program;
+    }
+    if (!replay_get(in, count)) {
+        return path + " is truncated";
+    }
+    for (uint64_t t = 0; t < count; t++) {
+        std::unique_ptr<ReplayThread> thread(new ReplayThread());
+        uint64_t num_draws;
+        if (!replay_get_string(in, thread->name) || !replay_get(in, num_draws)) {
+            return path + " is truncated";
+        }
+        thread->index = t;
+        for (uint64_t d = 0; d < num_draws; d++) {
+            if (!replay_get(in, value)) {
+                return path + " is truncated";
+            }
+            thread->draws.push_back(value);
+        }
+        replay_state.threads.push_back(std::move(thread));
+    }
+    uint64_t offset = 0;
+    if (!replay_get(in, count)) {
+        return path + " is truncated";
+    }
+    for (uint64_t a = 0; a < count; a++) {
+        if (!replay_get(in, value)) {
+            return path + " is truncated";
+        }
+        offset += value;
+        replay_state.arrivals.push_back(offset);
+    }
+    if (!replay_get(in, count)) {
+        return path + " is truncated";
+    }
+    for (uint32_t position = 0; position < count; position++) {
+        if (!replay_get(in, value) || value / REPLAY_MAX_OBJECTS >= replay_state.threads.size()) {
+            return path + " is truncated or corrupt";
+        }
+        ReplayThread* thread = replay_state.threads[value / REPLAY_MAX_OBJECTS].get();
+        thread->turns.push_back(position);
+        thread->objects.push_back(value % REPLAY_MAX_OBJECTS);
+    }
+    replay_state.num_acquisitions = count;
+    return "";
+}
+
+// replay_save()
+// Writes the recording. Call once every recording thread has stopped.
+inline bool replay_save(const std::string& path, size_t& bytes) {
+    std::string out(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+    replay_put(out, REPLAY_VERSION);
+    replay_put(out, replay_state.program.size());
+    out += replay_state.program;
+    replay_put(out, replay_seed);
+    replay_put(out, replay_state.threads.size());
+    std::vector<std::pair<uint32_t, uint32_t>> order;
+    for (auto& thread : replay_state.threads) {
+        replay_put(out, thread->name.size());
+        out += thread->name;
+        replay_put(out, thread->draws.size());
+        for (uint64_t draw : thread->draws) {
+            replay_put(out, draw);
+        }
+        for (auto& acquisition : thread->acquired) {
+            order.push_back(std::make_pair(acquisition.first, thread->index * REPLAY_MAX_OBJECTS + acquisition.second));
+        }
+    }
+    replay_put(out, replay_state.arrivals.size());
+    uint64_t previous = 0;
+    for (uint64_t offset : replay_state.arrivals) {
+        replay_put(out, offset - previous);
+        previous = offset;
+    }
+    std::sort(order.begin(), order.end());
+    replay_put(out, order.size());
+    for (auto& acquisition : order) {
+        replay_put(out, acquisition.second);
+    }
+    replay_state.num_acquisitions = order.size();
+    bytes = out.size();
+    std::ofstream file(path, std::ios::binary);
+    return file.write(out.data(), out.size()) && file.flush();
+}
+
+// replay_start()
+// Reads --seed, --record and --replay. Call once from main() right after
+// sim_time_start(), before sync_profile_start() and before any worker thread
+// starts.
+inline void replay_start(Options& options, const char* program) {
+    std::string record = options.get("record", "");
+    std::string replay = options.get("replay", "");
+    replay_state.program = program;
+    if (options.has("seed")) {
+        if (!replay.empty()) {
+            options.fail("--seed cannot be combined with --replay, which uses the recorded seed");
+        }
+        replay_seed = options.value("seed", replay_seed);
+    }
+    if (!record.empty() && !replay.empty()) {
+        options.fail("--record and --replay cannot be combined");
+    }
+    if (!record.empty()) {
+        replay_state.mode = REPLAY_RECORD;
+        replay_state.path = record;
+    } else if (!replay.empty()) {
+        std::string error = replay_load(replay, program);
+        if (!error.empty()) {
+            options.fail("--replay: " + error);
+        }
+        replay_state.mode = REPLAY_REPLAY;
+        replay_state.path = replay;
+    }
+    replay_active = replay_state.mode != REPLAY_OFF;
+}
+
+// replay_stop()
+// Ends recording and replay enforcement. Call from main() once every entity
+// has completed: how the workers then shut down is not part of the schedule.
+inline void replay_stop() {
+    replay_active = false;
+    replay_futex(&replay_position, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// replay_report()
+// Writes the recording, if any, prints the seed and how the recording or
+// replay went, and adds them to the report. Call after the workers have
+// stopped.
+inline void replay_report(Report& report) {
+    report.add("seed", std::to_string(replay_seed));
+    if (replay_state.mode == REPLAY_RECORD) {
+        size_t bytes = 0;
+        if (!replay_save(replay_state.path, bytes)) {
+            std::cerr << "replay: cannot write " << replay_state.path << "\n";
+        }
+        uint64_t draws = 0;
+        for (auto& thread : replay_state.threads) {
+            draws += thread->draws.size();
+        }
+        std::cout << "Recorded schedule to " << replay_state.path << ": seed " << replay_seed << ", " <<
+                     replay_state.arrivals.size() << " arrivals, " << draws << " draws, " <<
+                     replay_state.num_acquisitions << " acquisitions (" << bytes << " bytes)" << std::endl;
+        report.add("record_bytes", (long long)bytes);
+        report.add("recorded_acquisitions", (long long)replay_state.num_acquisitions);
+    } else if (replay_state.mode == REPLAY_REPLAY) {
+        uint32_t diverged_at = replay_state.diverged_at.load();
+        uint32_t followed = std::min(diverged_at, replay_position.load());
+        std::cout << "Replayed schedule from " << replay_state.path << ": " << followed << " of " <<
+                     replay_state.num_acquisitions << " acquisitions in recorded order";
+        if (diverged_at != UINT32_MAX) {
+            std::cout << ", diverged: " << replay_state.divergence;
+        }
+        std::cout << std::endl;
+        report.add("replayed_acquisitions", (long long)followed);
+        report.add("recorded_acquisitions", (long long)replay_state.num_acquisitions);
+        report.add("replay_diverged", diverged_at != UINT32_MAX ? "true" : "false");
+    } else {
+        std::cout << "Seed: " << replay_seed << " (--seed=" << replay_seed << " repeats its random choices)" << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,88 @@
+// Machine-readable end-of-run results.
+//
+// Each simulation adds its parameters and results to a Report as it goes, and
+// prints it at the end in the format chosen with --report. JSON is a single flat
+// object on one line, CSV is a header line followed by one row. The sweep driver
+// reads these lines back to build its result table.
+
+#ifndef POSIX_SAMPLES_REPORT_H
+#define POSIX_SAMPLES_REPORT_H
+
+// Library imports
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+
+class Report {
+    private:
+        // Keys in insertion order, with values already rendered as JSON.
+        std::vector<std::pair<std::string, std::string>> fields;
+
+        static std::string quote(const std::string& s) {
+            std::string out = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                }
+                out += c;
+            }
+            out += '"';
+            return out;
+        }
+
+        void set(const std::string& key, const std::string& rendered) {
+            for (auto& field : fields) {
+                if (field.first == key) {
+                    field.second = rendered;
+                    return;
+                }
+            }
+            fields.push_back({key, rendered});
+        }
+
+    public:
+        void add(const std::string& key, long long value) { set(key, std::to_string(value)); }
+        void add(const std::string& key, long value) { set(key, std::to_string(value)); }
+        void add(const std::string& key, int value) { set(key, std::to_string(value)); }
+        void add(const std::string& key, const std::string& value) { set(key, quote(value)); }
+        void add(const std::string& key, const char* value) { set(key, quote(value)); }
+
+        void add(const std::string& key, double value) {
+            std::ostringstream stream;
+            stream.precision(6);
+            stream << std::fixed << value;
+            set(key, stream.str());
+        }
+
+        // print()
+        // Writes the report in the requested format. Does nothing if no format was
+        // requested. Clears any --quiet state on cout first so the result is visible.
+        void print(const std::string& format) const {
+            if (format.empty()) {
+                return;
+            }
+            std::cout.clear();
+            if (format == "json") {
+                std::cout << "{";
+                for (size_t i = 0; i < fields.size(); i++) {
+                    std::cout << (i ? ", " : "") << quote(fields[i].first) << ": " << fields[i].second;
+                }
+                std::cout << "}" << std::endl;
+            } else if (format == "csv") {
+                for (size_t i = 0; i < fields.size(); i++) {
+                    std::cout << (i ? "," : "") << fields[i].first;
+                }
+                std::cout << "\n";
+                for (size_t i = 0; i < fields.size(); i++) {
+                    std::cout << (i ? "," : "") << fields[i].second;
+                }
+                std::cout << std::endl;
+            } else {
+                std::cerr << "unknown report format " << format << " (expected json or csv)\n";
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,175 @@
+// Running a simulation as a child process and reading back its report.
+//
+// Used by the drivers (sweep, bench) that launch many independent simulation
+// instances. The child is pinned to a given set of CPUs before exec, its stdout is
+// captured, and its resource usage is collected with wait4().
+
+#ifndef POSIX_SAMPLES_RUN_PROCESS_H
+#define POSIX_SAMPLES_RUN_PROCESS_H
+
+// Library imports
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "topology.h"
+
+// Result of one child process run.
+struct ProcessResult {
+    int exit_status = -1;           // Exit code, or 128 + signal number.
+    std::string output;             // Everything the child wrote to stdout.
+    long long wall_us = 0;          // Wall-clock time from fork to exit.
+    long long user_us = 0;          // CPU time in user mode.
+    long long system_us = 0;        // CPU time in kernel mode.
+    long long max_rss_kb = 0;       // Peak resident set size.
+};
+
+// run_pinned()
+// Runs args[0] with the given arguments, pinned to the given CPUs (no pinning if
+// the list is empty), with stdin from /dev/null. Blocks until the child exits.
+inline ProcessResult run_pinned(const std::vector<std::string>& args, const std::vector<int>& cpus) {
+    ProcessResult result;
+
+    // Build everything the child needs before forking; after fork() the child may
+    // only call async-signal-safe functions.
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(NULL);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        result.output = std::string("pipe: ") + strerror(errno);
+        return result;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: pin, redirect, exec.
+        if (!cpus.empty()) {
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+        }
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        result.output = std::string("fork: ") + strerror(errno);
+        return result;
+    }
+
+    // Parent: drain the child's stdout, then reap it.
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(pipe_fds[0], buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        result.output.append(buffer, n);
+    }
+    close(pipe_fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    auto end_time = std::chrono::steady_clock::now();
+
+    result.wall_us = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+    result.user_us = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+    result.system_us = usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+    result.max_rss_kb = usage.ru_maxrss;
+    if (WIFEXITED(status)) {
+        result.exit_status = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        result.exit_status = 128 + WTERMSIG(status);
+    }
+    return result;
+}
+
+// parse_report_line()
+// Parses the flat JSON object printed by Report::print("json"), taking the last
+// line of the output that starts with '{'. Values are kept as JSON text so numbers
+// and strings can be written back out unchanged.
+inline std::vector<std::pair<std::string, std::string>> parse_report_line(const std::string& output) {
+    std::vector<std::pair<std::string, std::string>> fields;
+    size_t line_start = std::string::npos;
+    size_t pos = 0;
+    while (pos < output.size()) {
+        size_t end = output.find('\n', pos);
+        if (end == std::string::npos) {
+            end = output.size();
+        }
+        if (output[pos] == '{') {
+            line_start = pos;
+        }
+        pos = end + 1;
+    }
+    if (line_start == std::string::npos) {
+        return fields;
+    }
+    size_t line_end = output.find('\n', line_start);
+    std::string line = output.substr(line_start, line_end == std::string::npos ? std::string::npos : line_end - line_start);
+
+    // Reads a JSON string starting at line[i] == '"', leaving i after the close quote.
+    auto read_string = [&](size_t& i) {
+        std::string s;
+        for (i++; i < line.size() && line[i] != '"'; i++) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                i++;
+            }
+            s += line[i];
+        }
+        i++;
+        return s;
+    };
+
+    size_t i = 1;
+    while (i < line.size()) {
+        while (i < line.size() && (line[i] == ' ' || line[i] == ',')) {
+            i++;
+        }
+        if (i >= line.size() || line[i] != '"') {
+            break;
+        }
+        std::string key = read_string(i);
+        while (i < line.size() && (line[i] == ' ' || line[i] == ':')) {
+            i++;
+        }
+        size_t value_start = i;
+        if (i < line.size() && line[i] == '"') {
+            read_string(i);
+        } else {
+            while (i < line.size() && line[i] != ',' && line[i] != '}') {
+                i++;
+            }
+        }
+        fields.push_back({key, line.substr(value_start, i - value_start)});
+    }
+    return fields;
+}
+
+#endif
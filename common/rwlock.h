@@ -0,0 +1,366 @@
+// Reader-writer locks for a resource shared by readers and writers.
+//
+// SampleRwLock takes a read or a write lock, and --rwlock picks the
+// implementation:
+//   semaphore  binary semaphore, the default; readers exclude each other as
+//              well as writers
+//   pthread    pthread_rwlock_t. Readers share the resource, but every read
+//              lock and unlock updates the reader count inside the lock, so
+//              that one cache line moves between the cores of concurrent
+//              readers
+//   bravo      the pthread lock behind a BRAVO reader indicator (Dice and
+//              Kogan, "BRAVO: Biased Locking for Reader-Writer Locks")
+//
+// BRAVO gives every reader thread its own slot in the lock, on its own cache
+// line. While the lock is read-biased a reader marks its slot, checks that the
+// bias is still set, and goes ahead without touching the underlying lock;
+// unlocking clears the slot. A writer takes the underlying write lock, revokes
+// the bias and waits until no slot is marked. Revoking costs a scan of the
+// slots, so the bias then stays off for BRAVO_INHIBIT_MULTIPLIER times as long
+// as the scan took, with readers going through the underlying lock; the first
+// of them to find the time up sets the bias again. Reads cost one store to the
+// reader's own line while writes are rare, and frequent writers spend a
+// bounded share of their time revoking.
+//
+// Threads are numbered on first use and their numbers reused once they exit;
+// threads numbered BRAVO_MAX_READERS and above always read through the
+// underlying lock. Read locks do not nest.
+
+#ifndef POSIX_SAMPLES_RWLOCK_H
+#define POSIX_SAMPLES_RWLOCK_H
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <pthread.h>
+#include <semaphore.h>
+#include "options.h"
+#include "report.h"
+#include "clock.h"
+#include "sim_time.h"
+#include "locks.h"
+
+enum rwlock_kind { RWLOCK_SEMAPHORE, RWLOCK_PTHREAD, RWLOCK_BRAVO };
+
+inline rwlock_kind rwlock_selected = RWLOCK_SEMAPHORE;
+const int BRAVO_MAX_READERS = 256;
+const uint64_t BRAVO_INHIBIT_MULTIPLIER = 9;
+
+// Slow-path counters, for rwlock_report().
+inline std::atomic<uint64_t> rwlock_slow_reads(0);      // BRAVO reads through the underlying lock.
+inline std::atomic<uint64_t> rwlock_revocations(0);
+inline std::atomic<uint64_t> rwlock_revoke_ns(0);
+
+// Reader thread numbers. A number goes back on the free list when its thread
+// exits, so that short-lived threads do not use up the slots.
+inline pthread_mutex_t bravo_numbers_mutex = PTHREAD_MUTEX_INITIALIZER;
+inline std::vector<int> bravo_free_numbers;
+inline std::atomic<int> bravo_num_threads(0);
+inline thread_local int bravo_thread = -1;
+
+struct BravoThreadNumber {
+    ~BravoThreadNumber() {
+        pthread_mutex_lock(&bravo_numbers_mutex);
+        bravo_free_numbers.push_back(bravo_thread);
+        pthread_mutex_unlock(&bravo_numbers_mutex);
+    }
+};
+
+// bravo_thread_index()
+// The calling thread's number, taken on first use.
+inline int bravo_thread_index() {
+    if (bravo_thread < 0) {
+        pthread_mutex_lock(&bravo_numbers_mutex);
+        if (bravo_free_numbers.empty()) {
+            bravo_thread = bravo_num_threads.fetch_add(1, std::memory_order_seq_cst);
+        } else {
+            bravo_thread = bravo_free_numbers.back();
+            bravo_free_numbers.pop_back();
+        }
+        pthread_mutex_unlock(&bravo_numbers_mutex);
+        // Hands the number back when the thread exits.
+        static thread_local BravoThreadNumber release;
+        (void)release;
+    }
+    return bravo_thread;
+}
+
+// One reader thread's slot. Only that thread writes it.
+struct alignas(64) BravoSlot {
+    std::atomic<bool> reading{false};
+    std::atomic<uint64_t> fast_reads{0};
+};
+
+// BRAVO reader indicator in front of a pthread_rwlock_t.
+class BravoRwLock {
+    private:
+        pthread_rwlock_t underlying;
+        alignas(64) std::atomic<bool> read_bias{true};
+        std::atomic<uint64_t> inhibit_until{0};
+        BravoSlot slots[BRAVO_MAX_READERS];
+
+        // revoke()
+        // With the underlying write lock held: turns the bias off and waits for
+        // the fast-path readers to leave.
+        void revoke() {
+            if (!read_bias.load(std::memory_order_relaxed)) {
+                return;
+            }
+            uint64_t start = monotonic_ns();
+            read_bias.store(false, std::memory_order_seq_cst);
+            int num_threads = std::min(bravo_num_threads.load(std::memory_order_seq_cst), BRAVO_MAX_READERS);
+            for (int i = 0; i < num_threads; i++) {
+                int spins = 0;
+                while (slots[i].reading.load(std::memory_order_seq_cst)) {
+                    lock_spin_wait(spins);
+                }
+            }
+            uint64_t now = monotonic_ns();
+            inhibit_until.store(now + (now - start) * BRAVO_INHIBIT_MULTIPLIER, std::memory_order_relaxed);
+            rwlock_revocations.fetch_add(1, std::memory_order_relaxed);
+            rwlock_revoke_ns.fetch_add(now - start, std::memory_order_relaxed);
+        }
+
+        // slow_read_locked()
+        // After a read lock through the underlying lock: sets the bias again
+        // once the inhibit time is up. No writer can be revoking meanwhile. The
+        // release passes the last writer's changes, which this read lock
+        // acquired, on to the readers that take the biased path after it.
+        void slow_read_locked() {
+            rwlock_slow_reads.fetch_add(1, std::memory_order_relaxed);
+            if (!read_bias.load(std::memory_order_relaxed) &&
+                monotonic_ns() >= inhibit_until.load(std::memory_order_relaxed)) {
+                read_bias.store(true, std::memory_order_release);
+            }
+        }
+
+        // fast_read_lock()
+        // Tries the read-biased path. Returns false if the lock is not biased.
+        bool fast_read_lock() {
+            int index = bravo_thread_index();
+            if (index >= BRAVO_MAX_READERS || !read_bias.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            BravoSlot& slot = slots[index];
+            // Either a revoking writer sees the slot marked, or we see the bias
+            // cleared; the seq_cst store and load rule out missing both.
+            slot.reading.store(true, std::memory_order_seq_cst);
+            if (read_bias.load(std::memory_order_seq_cst)) {
+                slot.fast_reads.store(slot.fast_reads.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return true;
+            }
+            slot.reading.store(false, std::memory_order_release);
+            return false;
+        }
+
+    public:
+        void init() {
+            pthread_rwlock_init(&underlying, NULL);
+        }
+
+        void destroy() {
+            pthread_rwlock_destroy(&underlying);
+        }
+
+        bool biased() const {
+            return read_bias.load(std::memory_order_relaxed);
+        }
+
+        // fast_reads()
+        // Read locks taken on the biased path so far.
+        uint64_t fast_reads() const {
+            uint64_t total = 0;
+            for (const BravoSlot& slot : slots) {
+                total += slot.fast_reads.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        bool try_read_lock() {
+            if (fast_read_lock()) {
+                return true;
+            }
+            if (pthread_rwlock_tryrdlock(&underlying) != 0) {
+                return false;
+            }
+            slow_read_locked();
+            return true;
+        }
+
+        void read_lock() {
+            if (fast_read_lock()) {
+                return;
+            }
+            pthread_rwlock_rdlock(&underlying);
+            slow_read_locked();
+        }
+
+        void read_unlock() {
+            if (bravo_thread >= 0 && bravo_thread < BRAVO_MAX_READERS &&
+                slots[bravo_thread].reading.load(std::memory_order_relaxed)) {
+                slots[bravo_thread].reading.store(false, std::memory_order_release);
+                return;
+            }
+            pthread_rwlock_unlock(&underlying);
+        }
+
+        // try_write_lock()
+        // Fails only if the underlying lock is taken; readers already on the
+        // biased path are still waited for.
+        bool try_write_lock() {
+            if (pthread_rwlock_trywrlock(&underlying) != 0) {
+                return false;
+            }
+            revoke();
+            return true;
+        }
+
+        void write_lock() {
+            pthread_rwlock_wrlock(&underlying);
+            revoke();
+        }
+
+        void write_unlock() {
+            pthread_rwlock_unlock(&underlying);
+        }
+};
+
+// A reader-writer lock whose implementation is chosen with --rwlock.
+class SampleRwLock {
+    private:
+        sem_t semaphore;
+        pthread_rwlock_t rwlock;
+        BravoRwLock bravo;
+
+    public:
+        void init() {
+            sem_init(&semaphore, 0, 1);
+            pthread_rwlock_init(&rwlock, NULL);
+            bravo.init();
+        }
+
+        void destroy() {
+            sem_destroy(&semaphore);
+            pthread_rwlock_destroy(&rwlock);
+            bravo.destroy();
+        }
+
+        bool try_read_lock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: return pthread_rwlock_tryrdlock(&rwlock) == 0;
+                case RWLOCK_BRAVO: return bravo.try_read_lock();
+                default: return sem_trywait(&semaphore) == 0;
+            }
+        }
+
+        void read_lock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: pthread_rwlock_rdlock(&rwlock); break;
+                case RWLOCK_BRAVO: bravo.read_lock(); break;
+                default: while (sem_wait(&semaphore) != 0) {} break;
+            }
+        }
+
+        void read_unlock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: pthread_rwlock_unlock(&rwlock); break;
+                case RWLOCK_BRAVO: bravo.read_unlock(); break;
+                default: sem_post(&semaphore); break;
+            }
+        }
+
+        bool try_write_lock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: return pthread_rwlock_trywrlock(&rwlock) == 0;
+                case RWLOCK_BRAVO: return bravo.try_write_lock();
+                default: return sem_trywait(&semaphore) == 0;
+            }
+        }
+
+        void write_lock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: pthread_rwlock_wrlock(&rwlock); break;
+                case RWLOCK_BRAVO: bravo.write_lock(); break;
+                default: while (sem_wait(&semaphore) != 0) {} break;
+            }
+        }
+
+        void write_unlock() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: pthread_rwlock_unlock(&rwlock); break;
+                case RWLOCK_BRAVO: bravo.write_unlock(); break;
+                default: sem_post(&semaphore); break;
+            }
+        }
+
+        // describe()
+        // The lock's state, for diagnostics.
+        std::string describe() {
+            switch (rwlock_selected) {
+                case RWLOCK_PTHREAD: return "rwlock (pthread)";
+                case RWLOCK_BRAVO: return bravo.biased() ? "rwlock (bravo), read-biased" : "rwlock (bravo)";
+                default: {
+                    int value = 0;
+                    sem_getvalue(&semaphore, &value);
+                    return "semaphore, value " + std::to_string(value);
+                }
+            }
+        }
+
+        uint64_t fast_reads() const {
+            return bravo.fast_reads();
+        }
+};
+
+// rwlock_kind_name()
+inline const char* rwlock_kind_name(rwlock_kind kind) {
+    switch (kind) {
+        case RWLOCK_PTHREAD: return "pthread";
+        case RWLOCK_BRAVO: return "bravo";
+        default: return "semaphore";
+    }
+}
+
+// rwlock_parse()
+// Turns an --rwlock value into a kind. Returns false for an unknown name.
+inline bool rwlock_parse(const std::string& name, rwlock_kind& kind) {
+    for (rwlock_kind k : {RWLOCK_SEMAPHORE, RWLOCK_PTHREAD, RWLOCK_BRAVO}) {
+        if (name == rwlock_kind_name(k)) {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// rwlock_start()
+// Reads --rwlock. Call once from main() before any thread takes a SampleRwLock.
+inline void rwlock_start(Options& options) {
+    std::string name = options.get("rwlock", "semaphore");
+    if (!rwlock_parse(name, rwlock_selected)) {
+        options.fail("unknown --rwlock " + name + " (expected semaphore, pthread or bravo)");
+    }
+}
+
+// rwlock_report()
+// Adds the implementation to the report and, for BRAVO, prints and reports how
+// reads were taken and what revoking the bias cost.
+inline void rwlock_report(Report& report, const SampleRwLock& lock) {
+    report.add("rwlock", rwlock_kind_name(rwlock_selected));
+    if (rwlock_selected != RWLOCK_BRAVO) {
+        return;
+    }
+    std::cout << "Reader-writer lock (bravo): " << lock.fast_reads() << " biased reads, " <<
+                 rwlock_slow_reads.load() << " through the lock, " << rwlock_revocations.load() <<
+                 " revocations taking " << format_duration(rwlock_revoke_ns.load()) << std::endl;
+    report.add("rwlock_fast_reads", (long long)lock.fast_reads());
+    report.add("rwlock_slow_reads", (long long)rwlock_slow_reads.load());
+    report.add("rwlock_revocations", (long long)rwlock_revocations.load());
+    report.add("rwlock_revoke_ns", (long long)rwlock_revoke_ns.load());
+}
+
+#endif
@@ -0,0 +1,153 @@
+// Bounded ring buffer in shared memory, usable between threads or processes.
+//
+// The samples hand entities from the producer to the workers through a
+// std::queue guarded by a process-private mutex or semaphore, which only works
+// between threads. ShmRing keeps the entries in a fixed array inside one mapping
+// together with three POSIX semaphores:
+//   lock   guards head and tail
+//   items  counts the filled slots (consumers wait on it)
+//   space  counts the free slots (producers wait on it)
+// When the ring is created process-shared the mapping comes from shm_open() and
+// the semaphores are initialized with pshared = 1, so workers started with fork()
+// (or attaching by name) can use it. Otherwise it is an anonymous private
+// mapping with process-private semaphores, which gives the threaded baseline the
+// same data structure to compare against.
+
+#ifndef POSIX_SAMPLES_SHM_RING_H
+#define POSIX_SAMPLES_SHM_RING_H
+
+// Library imports
+#include <string>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+
+// One handed-off entity and the time it was pushed.
+struct ShmRingEntry {
+    int64_t id;
+    uint64_t enqueued_ns;
+};
+
+struct ShmRing {
+    sem_t lock;
+    sem_t items;
+    sem_t space;
+    uint32_t capacity;
+    bool process_shared;
+    uint64_t head;      // Next slot to pop.
+    uint64_t tail;      // Next slot to push.
+
+    // The capacity entries follow the header in the same mapping.
+    ShmRingEntry* slots() { return (ShmRingEntry*)(this + 1); }
+};
+
+// shm_ring_size()
+// Bytes needed for a ring of the given capacity.
+inline size_t shm_ring_size(uint32_t capacity) {
+    return sizeof(ShmRing) + capacity * sizeof(ShmRingEntry);
+}
+
+// shm_sem_wait()
+// sem_wait() that resumes after signal interruptions.
+inline void shm_sem_wait(sem_t* semaphore) {
+    while (sem_wait(semaphore) != 0 && errno == EINTR) {
+    }
+}
+
+// shm_ring_create()
+// Creates a ring. With process_shared, name is the shm_open() name of the
+// mapping; it stays linked until shm_ring_destroy(). Returns NULL and sets errno
+// on failure.
+inline ShmRing* shm_ring_create(const std::string& name, uint32_t capacity, bool process_shared) {
+    size_t size = shm_ring_size(capacity);
+    void* address;
+    if (process_shared) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            return NULL;
+        }
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return NULL;
+        }
+        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (address == MAP_FAILED) {
+        if (process_shared) {
+            shm_unlink(name.c_str());
+        }
+        return NULL;
+    }
+
+    ShmRing* ring = (ShmRing*)address;
+    int pshared = process_shared ? 1 : 0;
+    sem_init(&ring->lock, pshared, 1);
+    sem_init(&ring->items, pshared, 0);
+    sem_init(&ring->space, pshared, capacity);
+    ring->capacity = capacity;
+    ring->process_shared = process_shared;
+    ring->head = 0;
+    ring->tail = 0;
+    return ring;
+}
+
+// shm_ring_destroy()
+// Destroys the semaphores, unmaps the ring and removes its name.
+inline void shm_ring_destroy(ShmRing* ring, const std::string& name) {
+    bool process_shared = ring->process_shared;
+    sem_destroy(&ring->lock);
+    sem_destroy(&ring->items);
+    sem_destroy(&ring->space);
+    munmap(ring, shm_ring_size(ring->capacity));
+    if (process_shared) {
+        shm_unlink(name.c_str());
+    }
+}
+
+// shm_ring_store()
+// Writes an entry into a slot already reserved through the space semaphore.
+inline void shm_ring_store(ShmRing* ring, const ShmRingEntry& entry) {
+    shm_sem_wait(&ring->lock);
+    ring->slots()[ring->tail % ring->capacity] = entry;
+    ring->tail++;
+    sem_post(&ring->lock);
+    sem_post(&ring->items);
+}
+
+// shm_ring_push()
+// Adds an entry, waiting for a free slot.
+inline void shm_ring_push(ShmRing* ring, const ShmRingEntry& entry) {
+    shm_sem_wait(&ring->space);
+    shm_ring_store(ring, entry);
+}
+
+// shm_ring_try_push()
+// Adds an entry if a slot is free. Returns false if the ring is full.
+inline bool shm_ring_try_push(ShmRing* ring, const ShmRingEntry& entry) {
+    if (sem_trywait(&ring->space) != 0) {
+        return false;
+    }
+    shm_ring_store(ring, entry);
+    return true;
+}
+
+// shm_ring_pop()
+// Removes the oldest entry, waiting for one to arrive.
+inline ShmRingEntry shm_ring_pop(ShmRing* ring) {
+    shm_sem_wait(&ring->items);
+    shm_sem_wait(&ring->lock);
+    ShmRingEntry entry = ring->slots()[ring->head % ring->capacity];
+    ring->head++;
+    sem_post(&ring->lock);
+    sem_post(&ring->space);
+    return entry;
+}
+
+#endif
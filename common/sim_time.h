@@ -0,0 +1,347 @@
+// High-resolution simulated intervals and drift-free waiting.
+//
+// Service and arrival intervals are Interval values instead of whole seconds. An
+// interval is written as a duration with an optional unit (a bare number is still
+// seconds, so "2" means two seconds):
+//   250ms, 50us, 800ns, 1.5s       a constant duration
+//   exp:50us                       exponentially distributed with mean 50us
+//   uniform:10us-90us              uniformly distributed between the bounds
+//
+// Waits are taken against absolute CLOCK_MONOTONIC deadlines with
+// clock_nanosleep(TIMER_ABSTIME), so a producer that schedules arrival n at
+// start + n * rate does not drift by the time it spends between sleeps. With
+// --spin=auto the wake-up latency of clock_nanosleep is measured at startup and
+// the last stretch of every wait (all of a wait shorter than that) is spun
+// instead; --spin=5us sets the spin window explicitly.
+//
+// Producers take their arrival times from an ArrivalSchedule. With --load=open
+// (the default) arrival n is due at start + the first n sampled intervals, no
+// matter how late the producer gets to it; a producer held up by a lock or a
+// slow write issues the overdue arrivals back to back, and every latency is
+// measured from the arrival's intended time, so the stall is counted instead of
+// being omitted. --load=closed waits each interval from the end of the previous
+// enqueue, as the samples once did, for comparison.
+//
+// Sampled intervals and sim_choice() draw from a per-thread engine seeded by
+// --seed; see replay.h for recording and replaying a run. --arrivals takes the
+// arrival times, types and service demands from a trace instead (see
+// arrival_trace.h, and arrival_choice() and arrival_service() below).
+
+#ifndef POSIX_SAMPLES_SIM_TIME_H
+#define POSIX_SAMPLES_SIM_TIME_H
+
+// Library imports
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <time.h>
+#include "options.h"
+#include "clock.h"
+#include "report.h"
+#include "histogram.h"
+#include "replay.h"
+#include "arrival_trace.h"
+
+// parse_duration()
+// Parses "1.5s", "250ms", "50us", "800ns" or a bare number of seconds.
+inline bool parse_duration(const std::string& text, uint64_t& ns) {
+    std::istringstream stream(text);
+    double value;
+    if (!(stream >> value) || value < 0) {
+        return false;
+    }
+    std::string unit;
+    stream >> unit;
+    double scale;
+    if (unit == "" || unit == "s") {
+        scale = 1e9;
+    } else if (unit == "ms") {
+        scale = 1e6;
+    } else if (unit == "us") {
+        scale = 1e3;
+    } else if (unit == "ns") {
+        scale = 1;
+    } else {
+        return false;
+    }
+    ns = (uint64_t)(value * scale + 0.5);
+    return stream.eof() || (stream >> std::ws).eof();
+}
+
+// format_duration()
+// Renders nanoseconds with the largest unit that keeps it readable.
+inline std::string format_duration(uint64_t ns) {
+    char buffer[32];
+    if (ns == 0) {
+        return "0s";
+    } else if (ns % 1000000000ULL == 0) {
+        snprintf(buffer, sizeof(buffer), "%llus", (unsigned long long)(ns / 1000000000ULL));
+    } else if (ns >= 1000000000ULL) {
+        snprintf(buffer, sizeof(buffer), "%.6gs", ns / 1e9);
+    } else if (ns >= 1000000ULL) {
+        snprintf(buffer, sizeof(buffer), "%.6gms", ns / 1e6);
+    } else if (ns >= 1000ULL) {
+        snprintf(buffer, sizeof(buffer), "%.6gus", ns / 1e3);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%lluns", (unsigned long long)ns);
+    }
+    return buffer;
+}
+
+// format_seconds()
+// Renders a nanosecond duration as seconds with microsecond resolution.
+inline std::string format_seconds(uint64_t ns) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%llu.%06llu",
+             (unsigned long long)(ns / 1000000000ULL), (unsigned long long)(ns % 1000000000ULL / 1000));
+    return buffer;
+}
+
+// sim_random()
+// The calling thread's random engine, seeded from the run seed and the thread's
+// name. Threads name themselves with trace_thread_name() before drawing.
+inline std::mt19937_64& sim_random() {
+    static thread_local std::mt19937_64 engine(replay_thread_seed());
+    return engine;
+}
+
+// sim_choice()
+// A random decision between n outcomes, 0 to n - 1, recorded and replayed along
+// with the run.
+inline int sim_choice(int n) {
+    std::uniform_int_distribution<int> distribution(0, n - 1);
+    return replay_draw(distribution(sim_random())) % n;
+}
+
+// A service or arrival interval: a constant or a distribution.
+class Interval {
+    public:
+        enum kind_type { CONSTANT, EXPONENTIAL, UNIFORM };
+        kind_type kind = CONSTANT;
+        uint64_t low_ns = 0;    // The constant, the mean, or the lower bound.
+        uint64_t high_ns = 0;   // Upper bound for UNIFORM.
+
+        Interval() {}
+        Interval(uint64_t ns) : low_ns(ns) {}
+
+        static Interval seconds(long s) { return Interval((uint64_t)s * 1000000000ULL); }
+
+        // parse()
+        // Reads the textual form described at the top of this file.
+        bool parse(const std::string& text) {
+            if (text.rfind("exp:", 0) == 0) {
+                kind = EXPONENTIAL;
+                return parse_duration(text.substr(4), low_ns);
+            }
+            if (text.rfind("uniform:", 0) == 0) {
+                kind = UNIFORM;
+                std::string range = text.substr(8);
+                size_t dash = range.find('-');
+                return dash != std::string::npos &&
+                       parse_duration(range.substr(0, dash), low_ns) &&
+                       parse_duration(range.substr(dash + 1), high_ns) &&
+                       low_ns <= high_ns;
+            }
+            kind = CONSTANT;
+            return parse_duration(text, low_ns);
+        }
+
+        // sample()
+        // Draws one interval in nanoseconds, recorded and replayed along with the
+        // run.
+        uint64_t sample() const {
+            return replay_draw(draw());
+        }
+
+        // draw()
+        // Draws one interval without recording it.
+        uint64_t draw() const {
+            switch (kind) {
+                case CONSTANT:
+                    return low_ns;
+                case EXPONENTIAL: {
+                    std::exponential_distribution<double> distribution(1.0 / std::max<uint64_t>(low_ns, 1));
+                    return (uint64_t)distribution(sim_random());
+                }
+                case UNIFORM: {
+                    std::uniform_int_distribution<uint64_t> distribution(low_ns, high_ns);
+                    return distribution(sim_random());
+                }
+            }
+            return low_ns;
+        }
+
+        uint64_t mean_ns() const {
+            return (kind == UNIFORM) ? (low_ns + high_ns) / 2 : low_ns;
+        }
+
+        std::string to_string() const {
+            switch (kind) {
+                case CONSTANT:
+                    return format_duration(low_ns);
+                case EXPONENTIAL:
+                    return "exp:" + format_duration(low_ns);
+                case UNIFORM:
+                    return "uniform:" + format_duration(low_ns) + "-" + format_duration(high_ns);
+            }
+            return "";
+        }
+};
+
+// Reading an Interval from cin or from an option value.
+inline std::istream& operator>>(std::istream& stream, Interval& interval) {
+    std::string text;
+    if (stream >> text && !interval.parse(text)) {
+        stream.setstate(std::ios::failbit);
+    }
+    return stream;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const Interval& interval) {
+    return stream << interval.to_string();
+}
+
+// Whether arrivals follow an open-loop schedule (see the top of the file).
+inline bool sim_open_loop = true;
+
+// Spin window: waits are slept until this long before the deadline and spun for
+// the rest. Zero disables spinning.
+inline uint64_t sim_spin_ns = 0;
+
+// sleep_until_ns()
+// Waits until the absolute CLOCK_MONOTONIC deadline.
+inline void sleep_until_ns(uint64_t deadline_ns) {
+    uint64_t sleep_deadline = deadline_ns - std::min(deadline_ns, sim_spin_ns);
+    if (sleep_deadline > monotonic_ns()) {
+        struct timespec ts;
+        ts.tv_sec = sleep_deadline / 1000000000ULL;
+        ts.tv_nsec = sleep_deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+    }
+    while (sim_spin_ns != 0 && monotonic_ns() < deadline_ns) {
+        // Spin out the remainder of the wait.
+    }
+}
+
+// sleep_for_ns()
+// Waits for a relative duration, measured from now.
+inline void sleep_for_ns(uint64_t ns) {
+    if (ns != 0) {
+        sleep_until_ns(monotonic_ns() + ns);
+    }
+}
+
+// calibrate_spin()
+// Measures how late clock_nanosleep wakes up for a short sleep and returns the
+// 90th percentile, which becomes the spin window.
+inline uint64_t calibrate_spin() {
+    std::vector<uint64_t> lateness;
+    for (int i = 0; i < 200; i++) {
+        uint64_t deadline = monotonic_ns() + 1000;
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        lateness.push_back(monotonic_ns() - deadline);
+    }
+    std::sort(lateness.begin(), lateness.end());
+    return lateness[lateness.size() * 9 / 10];
+}
+
+// sim_time_start()
+// Reads --spin (off, auto, or a duration) and --load (open or closed). Call once
+// from main().
+inline void sim_time_start(Options& options) {
+    std::string load = options.get("load", "open");
+    if (load != "open" && load != "closed") {
+        options.fail("invalid value for --load: " + load + " (expected open or closed)");
+    }
+    sim_open_loop = (load == "open");
+    std::string spin = options.get("spin", "off");
+    if (spin == "off") {
+        sim_spin_ns = 0;
+    } else if (spin == "auto") {
+        sim_spin_ns = calibrate_spin();
+    } else if (!parse_duration(spin, sim_spin_ns)) {
+        options.fail("invalid value for --spin: " + spin + " (expected off, auto or a duration)");
+    }
+}
+
+// Arrival times for a producer loop.
+class ArrivalSchedule {
+    private:
+        Interval interval;
+        uint64_t start_ns;
+        uint64_t intended_ns;
+        bool started = false;
+
+    public:
+        // How far behind schedule each arrival was issued.
+        LatencyHistogram lag;
+
+        ArrivalSchedule(const Interval& interval) : interval(interval), start_ns(monotonic_ns()), intended_ns(start_ns) {}
+
+        // wait()
+        // Waits for the next arrival and returns the time it was due. The first
+        // arrival is due immediately, or after its gap in an --arrivals trace.
+        // Under --replay the recorded arrival times are used instead.
+        uint64_t wait() {
+            uint64_t offset_ns;
+            if (arrival_trace.active()) {
+                arrival_current = arrival_trace.next();
+            }
+            if (replay_next_arrival(offset_ns)) {
+                intended_ns = start_ns + offset_ns;
+                sleep_until_ns(intended_ns);
+            } else {
+                if (arrival_current != NULL) {
+                    intended_ns = (sim_open_loop ? intended_ns : monotonic_ns()) + arrival_current->delta_ns;
+                    sleep_until_ns(intended_ns);
+                } else if (started) {
+                    intended_ns = (sim_open_loop ? intended_ns : monotonic_ns()) + interval.draw();
+                    sleep_until_ns(intended_ns);
+                }
+                replay_record_arrival(intended_ns - start_ns);
+            }
+            started = true;
+            uint64_t now = monotonic_ns();
+            lag.record(now > intended_ns ? now - intended_ns : 0);
+            return intended_ns;
+        }
+};
+
+// arrival_choice()
+// The type of the arrival just issued, 0 to n - 1: from the --arrivals trace,
+// or a sim_choice() without one.
+inline int arrival_choice(int n) {
+    return arrival_current != NULL ? arrival_current->type % n : sim_choice(n);
+}
+
+// arrival_service()
+// The service demand of arrival index (0-based, in arrival order): from the
+// --arrivals trace when it gives one, otherwise sampled from interval.
+inline uint64_t arrival_service(int index, const Interval& interval) {
+    if (arrival_trace.active() && arrival_trace.at(index).service_ns != 0) {
+        return arrival_trace.at(index).service_ns;
+    }
+    return interval.sample();
+}
+
+// arrival_report()
+// Prints how far the producer fell behind its schedule and adds it to the report.
+inline void arrival_report(Report& report, const ArrivalSchedule& arrivals) {
+    arrival_trace_report(report);
+    const LatencyHistogram& lag = arrivals.lag;
+    std::cout << "Arrival lag (" << (sim_open_loop ? "open" : "closed") << " loop): p50 " << lag.percentile(50) <<
+                 " ns, p99 " << lag.percentile(99) << " ns, max " << (lag.total ? lag.max : 0) << " ns" << std::endl;
+    report.add("load", sim_open_loop ? "open" : "closed");
+    lag.add_to_report(report, "arrival_lag");
+}
+
+#endif
@@ -0,0 +1,561 @@
+// Instrumented wrappers around the pthread mutexes and POSIX semaphores used by
+// the samples.
+//
+// Each lock or semaphore is registered once with its variable name
+// (sync_mutex_init(&mutex, "mutex"), sync_sem_init(&queue_semaphore,
+// "queue_semaphore", 1)). The wrappers then behave exactly like the pthread/sem
+// calls they replace, and additionally report to the tracer when it is enabled:
+//   - a "wait" span from the request to the acquisition,
+//   - a "held" span from the acquisition to the release by the same thread,
+//   - an instant event for every semaphore post.
+// A binary semaphore that is waited on and posted by the same thread (used as a
+// lock) gets "held" spans as well; one posted by another thread (used as a
+// signal) shows up as wait spans and post instants. The mutex wrappers also
+// accept a SampleLock (locks.h), whose implementation is chosen with --lock,
+// and the sync_read_lock()/sync_write_lock() wrappers a SampleRwLock
+// (rwlock.h), chosen with --rwlock.
+//
+// With --lock-profile the wrappers also keep contention statistics: for every
+// object the number of acquisitions, how many of them had to wait, wait-time and
+// hold-time histograms, and the source lines that held it longest. The wrappers
+// pick up their caller's file and line through default arguments, so call sites
+// need no changes. Statistics are kept per thread and merged when
+// sync_profile_report() prints the ranked report at the end of the run.
+//
+// Under --record and --replay (replay.h) the wrappers also log the order of
+// acquisitions, or wait for each acquisition's recorded turn before taking it.
+
+#ifndef POSIX_SAMPLES_SYNC_H
+#define POSIX_SAMPLES_SYNC_H
+
+// Library imports
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <pthread.h>
+#include <semaphore.h>
+#include "options.h"
+#include "report.h"
+#include "clock.h"
+#include "histogram.h"
+#include "trace.h"
+#include "locks.h"
+#include "rwlock.h"
+#include "replay.h"
+
+// What a registered object is, so that it can be inspected by address.
+enum sync_kind { SYNC_PTHREAD_MUTEX, SYNC_SAMPLE_LOCK, SYNC_SEMAPHORE, SYNC_RWLOCK };
+
+// Registered lock or semaphore.
+struct SyncObject {
+    const void* address = NULL;
+    const char* name = NULL;
+    sync_kind kind = SYNC_PTHREAD_MUTEX;
+    const char* wait_name = NULL;
+    const char* held_name = NULL;
+    const char* post_name = NULL;
+    int index = 0;
+    char names[3][64];
+};
+
+const int SYNC_MAX_OBJECTS = 16;
+static_assert(SYNC_MAX_OBJECTS <= REPLAY_MAX_OBJECTS, "replay.h encodes object indices below REPLAY_MAX_OBJECTS");
+inline SyncObject sync_objects[SYNC_MAX_OBJECTS];
+inline int sync_num_objects = 0;
+
+// Locks currently held by the calling thread, with the time each was acquired
+// and where. A semaphore wait is recorded too, in case the same thread posts it
+// (used as a lock), but may be dropped to make room: see sync_hold().
+struct SyncHeld {
+    SyncObject* object;
+    uint64_t acquired_ns;
+    const char* file;
+    int line;
+};
+const int SYNC_MAX_HELD = 8;
+inline thread_local SyncHeld sync_held[SYNC_MAX_HELD];
+inline thread_local int sync_num_held = 0;
+
+// Hold time attributed to one source line.
+struct SyncSite {
+    const char* file = NULL;
+    int line = 0;
+    uint64_t holds = 0;
+    uint64_t hold_ns = 0;
+};
+
+// Contention statistics for one object.
+const int SYNC_MAX_SITES = 8;
+struct SyncStats {
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    LatencyHistogram wait;
+    LatencyHistogram hold;
+    SyncSite sites[SYNC_MAX_SITES];
+    int num_sites = 0;
+
+    // add_site()
+    // Attributes hold time to a source line. Lines beyond SYNC_MAX_SITES are
+    // only counted in the histogram.
+    void add_site(const char* file, int line, uint64_t ns, uint64_t count) {
+        for (int i = 0; i < num_sites; i++) {
+            if (sites[i].line == line && strcmp(sites[i].file, file) == 0) {
+                sites[i].holds += count;
+                sites[i].hold_ns += ns;
+                return;
+            }
+        }
+        if (num_sites < SYNC_MAX_SITES) {
+            sites[num_sites].file = file;
+            sites[num_sites].line = line;
+            sites[num_sites].holds = count;
+            sites[num_sites].hold_ns = ns;
+            num_sites++;
+        }
+    }
+
+    void add_hold(const char* file, int line, uint64_t ns) {
+        hold.record(ns);
+        add_site(file, line, ns, 1);
+    }
+};
+
+// One thread's statistics for every object.
+struct SyncThreadStats {
+    SyncStats objects[SYNC_MAX_OBJECTS];
+};
+
+// Whether the wrappers do anything beyond the pthread/sem call.
+inline bool sync_profiling = false;
+inline bool sync_instrumented = false;
+inline pthread_mutex_t sync_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+inline std::vector<std::unique_ptr<SyncThreadStats>> sync_all_stats;
+inline thread_local SyncThreadStats* sync_stats = NULL;
+
+// sync_thread_stats()
+// Returns the calling thread's statistics, registering them on first use.
+inline SyncThreadStats* sync_thread_stats() {
+    if (sync_stats == NULL) {
+        std::unique_ptr<SyncThreadStats> stats(new SyncThreadStats());
+        sync_stats = stats.get();
+        pthread_mutex_lock(&sync_stats_mutex);
+        sync_all_stats.push_back(std::move(stats));
+        pthread_mutex_unlock(&sync_stats_mutex);
+    }
+    return sync_stats;
+}
+
+// sync_register()
+// Records the name of a lock or semaphore. Called from the init wrappers, before
+// any worker thread exists.
+inline SyncObject* sync_register(const void* address, const char* name, sync_kind kind) {
+    for (int i = 0; i < sync_num_objects; i++) {
+        if (sync_objects[i].address == address) {
+            return &sync_objects[i];
+        }
+    }
+    if (sync_num_objects == SYNC_MAX_OBJECTS) {
+        std::cerr << "sync: more than " << SYNC_MAX_OBJECTS << " locks and semaphores; " << name <<
+                     " is not traced, profiled or replayed" << std::endl;
+        return NULL;
+    }
+    SyncObject* object = &sync_objects[sync_num_objects];
+    object->index = sync_num_objects++;
+    object->address = address;
+    object->name = name;
+    object->kind = kind;
+    snprintf(object->names[0], sizeof(object->names[0]), "wait %s", name);
+    snprintf(object->names[1], sizeof(object->names[1]), "held %s", name);
+    snprintf(object->names[2], sizeof(object->names[2]), "post %s", name);
+    object->wait_name = object->names[0];
+    object->held_name = object->names[1];
+    object->post_name = object->names[2];
+    return object;
+}
+
+// sync_find()
+// Looks up a registered object by address. Only used when instrumentation is on.
+inline SyncObject* sync_find(const void* address) {
+    for (int i = 0; i < sync_num_objects; i++) {
+        if (sync_objects[i].address == address) {
+            return &sync_objects[i];
+        }
+    }
+    return NULL;
+}
+
+// sync_profile_start()
+// Reads --lock-profile. Call once from main() after trace_start() and
+// replay_start().
+inline void sync_profile_start(Options& options) {
+    sync_profiling = options.flag("lock-profile");
+    sync_instrumented = sync_profiling || trace_enabled || replay_state.mode != REPLAY_OFF;
+}
+
+// sync_turn()
+// Before an acquisition: under --replay, waits for its recorded turn.
+inline void sync_turn(const void* address) {
+    if (replay_state.mode == REPLAY_REPLAY) {
+        SyncObject* object = sync_find(address);
+        if (object != NULL) {
+            replay_wait_turn(object->index);
+        }
+    }
+}
+
+// sync_hold()
+// Records that the calling thread now holds an object. A thread that waits on
+// a semaphore it has not posted since its last wait is using it as a signal, so
+// that earlier entry is replaced; when the table is full, the oldest semaphore
+// entry makes room. Locks are never dropped.
+inline void sync_hold(SyncObject* object, uint64_t now, const char* file, int line) {
+    int slot = -1;
+    if (object->kind == SYNC_SEMAPHORE) {
+        for (int i = 0; i < sync_num_held; i++) {
+            if (sync_held[i].object == object) {
+                slot = i;
+                break;
+            }
+        }
+    }
+    if (slot < 0 && sync_num_held < SYNC_MAX_HELD) {
+        slot = sync_num_held++;
+    }
+    if (slot < 0) {
+        for (int i = 0; i < sync_num_held; i++) {
+            if (sync_held[i].object->kind == SYNC_SEMAPHORE &&
+                (slot < 0 || sync_held[i].acquired_ns < sync_held[slot].acquired_ns)) {
+                slot = i;
+            }
+        }
+    }
+    if (slot >= 0) {
+        sync_held[slot] = SyncHeld{object, now, file, line};
+    }
+}
+
+// sync_acquired()
+// Bookkeeping after a lock or semaphore has been taken.
+inline void sync_acquired(const void* address, uint64_t request_ns, bool contended, const char* file, int line) {
+    SyncObject* object = sync_find(address);
+    if (object == NULL) {
+        return;
+    }
+    replay_acquired(object->index);
+    uint64_t now = monotonic_ns();
+    trace_complete("lock", object->wait_name, request_ns, now);
+    if (sync_profiling) {
+        SyncStats& stats = sync_thread_stats()->objects[object->index];
+        stats.acquisitions++;
+        stats.contended += contended;
+        stats.wait.record(now - request_ns);
+    }
+    sync_hold(object, now, file, line);
+}
+
+// sync_released()
+// Bookkeeping when a lock is released or a semaphore posted. Returns true if the
+// calling thread held it, i.e. it was used as a lock.
+inline bool sync_released(const void* address) {
+    for (int i = sync_num_held - 1; i >= 0; i--) {
+        if (sync_held[i].object->address == address) {
+            uint64_t now = monotonic_ns();
+            trace_complete("lock", sync_held[i].object->held_name, sync_held[i].acquired_ns, now);
+            if (sync_profiling) {
+                SyncStats& stats = sync_thread_stats()->objects[sync_held[i].object->index];
+                stats.add_hold(sync_held[i].file, sync_held[i].line, now - sync_held[i].acquired_ns);
+            }
+            sync_held[i] = sync_held[--sync_num_held];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Mutex wrappers.
+inline int sync_mutex_init(pthread_mutex_t* mutex, const char* name) {
+    sync_register(mutex, name, SYNC_PTHREAD_MUTEX);
+    return pthread_mutex_init(mutex, NULL);
+}
+
+inline int sync_mutex_lock(pthread_mutex_t* mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+    if (!sync_instrumented) {
+        return pthread_mutex_lock(mutex);
+    }
+    uint64_t request_ns = monotonic_ns();
+    sync_turn(mutex);
+    bool contended = false;
+    int result = pthread_mutex_trylock(mutex);
+    if (result == EBUSY) {
+        contended = true;
+        result = pthread_mutex_lock(mutex);
+    }
+    sync_acquired(mutex, request_ns, contended, file, line);
+    return result;
+}
+
+inline int sync_mutex_unlock(pthread_mutex_t* mutex) {
+    if (sync_instrumented) {
+        sync_released(mutex);
+    }
+    return pthread_mutex_unlock(mutex);
+}
+
+inline int sync_mutex_destroy(pthread_mutex_t* mutex) {
+    return pthread_mutex_destroy(mutex);
+}
+
+// SampleLock wrappers, the same as the mutex wrappers for whichever lock --lock
+// selected.
+inline int sync_mutex_init(SampleLock* lock, const char* name) {
+    sync_register(lock, name, SYNC_SAMPLE_LOCK);
+    lock->init();
+    return 0;
+}
+
+inline int sync_mutex_lock(SampleLock* lock, const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+    if (!sync_instrumented) {
+        lock->lock();
+        return 0;
+    }
+    uint64_t request_ns = monotonic_ns();
+    sync_turn(lock);
+    bool contended = !lock->try_lock();
+    if (contended) {
+        lock->lock();
+    }
+    sync_acquired(lock, request_ns, contended, file, line);
+    return 0;
+}
+
+inline int sync_mutex_unlock(SampleLock* lock) {
+    if (sync_instrumented) {
+        sync_released(lock);
+    }
+    lock->unlock();
+    return 0;
+}
+
+inline int sync_mutex_destroy(SampleLock* lock) {
+    lock->destroy();
+    return 0;
+}
+
+// SampleRwLock wrappers. Read and write acquisitions of a lock are profiled
+// together, each held until its own release.
+inline int sync_rwlock_init(SampleRwLock* lock, const char* name) {
+    sync_register(lock, name, SYNC_RWLOCK);
+    lock->init();
+    return 0;
+}
+
+inline int sync_read_lock(SampleRwLock* lock, const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+    if (!sync_instrumented) {
+        lock->read_lock();
+        return 0;
+    }
+    uint64_t request_ns = monotonic_ns();
+    sync_turn(lock);
+    bool contended = !lock->try_read_lock();
+    if (contended) {
+        lock->read_lock();
+    }
+    sync_acquired(lock, request_ns, contended, file, line);
+    return 0;
+}
+
+inline int sync_write_lock(SampleRwLock* lock, const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+    if (!sync_instrumented) {
+        lock->write_lock();
+        return 0;
+    }
+    uint64_t request_ns = monotonic_ns();
+    sync_turn(lock);
+    bool contended = !lock->try_write_lock();
+    if (contended) {
+        lock->write_lock();
+    }
+    sync_acquired(lock, request_ns, contended, file, line);
+    return 0;
+}
+
+inline int sync_read_unlock(SampleRwLock* lock) {
+    if (sync_instrumented) {
+        sync_released(lock);
+    }
+    lock->read_unlock();
+    return 0;
+}
+
+inline int sync_write_unlock(SampleRwLock* lock) {
+    if (sync_instrumented) {
+        sync_released(lock);
+    }
+    lock->write_unlock();
+    return 0;
+}
+
+inline int sync_rwlock_destroy(SampleRwLock* lock) {
+    lock->destroy();
+    return 0;
+}
+
+// Semaphore wrappers.
+inline int sync_sem_init(sem_t* semaphore, const char* name, unsigned int value) {
+    sync_register(semaphore, name, SYNC_SEMAPHORE);
+    return sem_init(semaphore, 0, value);
+}
+
+inline int sync_sem_wait(sem_t* semaphore, const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+    if (!sync_instrumented) {
+        return sem_wait(semaphore);
+    }
+    uint64_t request_ns = monotonic_ns();
+    sync_turn(semaphore);
+    bool contended = false;
+    int result = sem_trywait(semaphore);
+    if (result != 0 && errno == EAGAIN) {
+        contended = true;
+        result = sem_wait(semaphore);
+    }
+    sync_acquired(semaphore, request_ns, contended, file, line);
+    return result;
+}
+
+inline int sync_sem_post(sem_t* semaphore) {
+    if (sync_instrumented) {
+        SyncObject* object = sync_find(semaphore);
+        if (object != NULL && !sync_released(semaphore)) {
+            trace_instant("lock", object->post_name);
+        }
+    }
+    return sem_post(semaphore);
+}
+
+inline int sync_sem_destroy(sem_t* semaphore) {
+    return sem_destroy(semaphore);
+}
+
+// sync_describe()
+// The current state of a registered object, for diagnostics: a semaphore's
+// value, or whether a lock is held. A lock is probed by taking and releasing it
+// if it is free, so only call this off the hot path.
+inline std::string sync_describe(const SyncObject& object) {
+    switch (object.kind) {
+        case SYNC_SEMAPHORE: {
+            int value = 0;
+            sem_getvalue((sem_t*)object.address, &value);
+            return "semaphore, value " + std::to_string(value);
+        }
+        case SYNC_SAMPLE_LOCK: {
+            SampleLock* lock = (SampleLock*)object.address;
+            if (!lock->try_lock()) {
+                return "lock, held";
+            }
+            lock->unlock();
+            return "lock, free";
+        }
+        case SYNC_RWLOCK:
+            return ((SampleRwLock*)object.address)->describe();
+        case SYNC_PTHREAD_MUTEX: {
+            pthread_mutex_t* mutex = (pthread_mutex_t*)object.address;
+            if (pthread_mutex_trylock(mutex) != 0) {
+                return "lock, held";
+            }
+            pthread_mutex_unlock(mutex);
+            return "lock, free";
+        }
+    }
+    return "";
+}
+
+// sync_profile_report()
+// Prints every object ranked by total wait time, with its busiest holding sites,
+// and adds the per-object totals to the report. Call from main() once the
+// workers have stopped.
+inline void sync_profile_report(Report& report) {
+    if (!sync_profiling) {
+        return;
+    }
+
+    // Merge the per-thread statistics.
+    std::vector<SyncStats> merged(sync_num_objects);
+    pthread_mutex_lock(&sync_stats_mutex);
+    for (auto& thread : sync_all_stats) {
+        for (int i = 0; i < sync_num_objects; i++) {
+            const SyncStats& from = thread->objects[i];
+            merged[i].acquisitions += from.acquisitions;
+            merged[i].contended += from.contended;
+            merged[i].wait.merge(from.wait);
+            merged[i].hold.merge(from.hold);
+            for (int s = 0; s < from.num_sites; s++) {
+                merged[i].add_site(from.sites[s].file, from.sites[s].line, from.sites[s].hold_ns, from.sites[s].holds);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sync_stats_mutex);
+
+    std::vector<int> order;
+    for (int i = 0; i < sync_num_objects; i++) {
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return merged[a].wait.sum > merged[b].wait.sum;
+    });
+
+    std::cout << "\nLock contention (ranked by total wait time)\n" << \
+                 "-------------------------------------------\n";
+    int rank = 1;
+    for (int i : order) {
+        const SyncStats& s = merged[i];
+        const char* name = sync_objects[i].name;
+        double contended_pct = s.acquisitions ? 100.0 * s.contended / s.acquisitions : 0.0;
+        char line[256];
+        snprintf(line, sizeof(line), "#%d %s: %llu acquisitions, %llu contended (%.1f%%)\n", rank++, name,
+                 (unsigned long long)s.acquisitions, (unsigned long long)s.contended, contended_pct);
+        std::cout << line;
+        snprintf(line, sizeof(line), "    wait: total %llu ns, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                 (unsigned long long)s.wait.sum, (unsigned long long)s.wait.percentile(50),
+                 (unsigned long long)s.wait.percentile(99), (unsigned long long)(s.wait.total ? s.wait.max : 0));
+        std::cout << line;
+        snprintf(line, sizeof(line), "    hold: total %llu ns, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                 (unsigned long long)s.hold.sum, (unsigned long long)s.hold.percentile(50),
+                 (unsigned long long)s.hold.percentile(99), (unsigned long long)(s.hold.total ? s.hold.max : 0));
+        std::cout << line;
+
+        // Holding sites, longest total hold first.
+        std::vector<SyncSite> sites(s.sites, s.sites + s.num_sites);
+        std::stable_sort(sites.begin(), sites.end(), [](const SyncSite& a, const SyncSite& b) {
+            return a.hold_ns > b.hold_ns;
+        });
+        for (const SyncSite& site : sites) {
+            snprintf(line, sizeof(line), "    held at %s:%d  %llu times, %llu ns\n", site.file, site.line,
+                     (unsigned long long)site.holds, (unsigned long long)site.hold_ns);
+            std::cout << line;
+        }
+
+        // Every lock acquisition must have been matched by a release. A
+        // semaphore's holds only count the waits its own thread posted.
+        if (sync_objects[i].kind != SYNC_SEMAPHORE && s.hold.total != s.acquisitions) {
+            std::cerr << "sync: " << name << " was acquired " << s.acquisitions << " times but released " <<
+                         s.hold.total << " times; its hold statistics are incomplete" << std::endl;
+        }
+
+        std::string prefix = std::string("lock_") + name;
+        report.add(prefix + "_acquisitions", (long long)s.acquisitions);
+        report.add(prefix + "_contended", (long long)s.contended);
+        report.add(prefix + "_wait_total_ns", (long long)s.wait.sum);
+        report.add(prefix + "_wait_p99_ns", (long long)s.wait.percentile(99));
+        report.add(prefix + "_hold_total_ns", (long long)s.hold.sum);
+        report.add(prefix + "_hold_p99_ns", (long long)s.hold.percentile(99));
+    }
+    std::cout << std::flush;
+}
+
+#endif
@@ -0,0 +1,124 @@
+// CPU topology as seen through sysfs.
+//
+// Lists the CPUs this process may run on together with the core, socket
+// (physical package) and NUMA node each belongs to. Used for thread placement and
+// by the drivers that pin child processes.
+
+#ifndef POSIX_SAMPLES_TOPOLOGY_H
+#define POSIX_SAMPLES_TOPOLOGY_H
+
+// Library imports
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdlib>
+#include <sched.h>
+#include <dirent.h>
+
+// One CPU and where it sits.
+struct CpuInfo {
+    int cpu = 0;
+    int core = 0;       // core_id, unique within a socket.
+    int socket = 0;     // physical_package_id.
+    int node = 0;       // NUMA node, 0 if the system has no NUMA information.
+};
+
+// allowed_cpus()
+// Returns the CPUs this process may run on, in increasing order.
+inline std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+// parse_cpu_list()
+// Expands a sysfs list such as "0-3,8,10-11".
+inline std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t comma = text.find(',', start);
+        std::string range = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t dash = range.find('-');
+        try {
+            int lo = std::stoi(range.substr(0, dash));
+            int hi = (dash == std::string::npos) ? lo : std::stoi(range.substr(dash + 1));
+            for (int cpu = lo; cpu <= hi; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } catch (...) {
+            // Ignore malformed entries (and the trailing newline).
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    return cpus;
+}
+
+// read_sysfs_int()
+// Reads a single integer from a sysfs file, or returns fallback.
+inline int read_sysfs_int(const std::string& path, int fallback) {
+    std::ifstream file(path);
+    int value;
+    return (file >> value) ? value : fallback;
+}
+
+// cpu_topology()
+// Describes every CPU this process may run on.
+inline std::vector<CpuInfo> cpu_topology() {
+    std::vector<int> cpus = allowed_cpus();
+
+    // Map CPUs to NUMA nodes from the node directories. Node numbers may have
+    // gaps, so list the directories rather than counting up.
+    std::vector<int> node_of(CPU_SETSIZE, 0);
+    DIR* nodes = opendir("/sys/devices/system/node");
+    while (struct dirent* entry = nodes ? readdir(nodes) : NULL) {
+        std::string name = entry->d_name;
+        if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        int node = atoi(name.c_str() + 4);
+        std::ifstream list("/sys/devices/system/node/" + name + "/cpulist");
+        if (!list) {
+            continue;
+        }
+        std::string text;
+        std::getline(list, text);
+        for (int cpu : parse_cpu_list(text)) {
+            if (cpu < CPU_SETSIZE) {
+                node_of[cpu] = node;
+            }
+        }
+    }
+    if (nodes != NULL) {
+        closedir(nodes);
+    }
+
+    std::vector<CpuInfo> topology;
+    for (int cpu : cpus) {
+        std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuInfo info;
+        info.cpu = cpu;
+        info.core = read_sysfs_int(base + "core_id", cpu);
+        info.socket = read_sysfs_int(base + "physical_package_id", 0);
+        info.node = node_of[cpu];
+        topology.push_back(info);
+    }
+    return topology;
+}
+
+#endif
@@ -0,0 +1,243 @@
+// Opt-in timeline tracing in Chrome trace-event format.
+//
+// With --trace=path, every lock and semaphore operation that goes through the
+// wrappers in sync.h, every queue push/pop and every service span is recorded with
+// its thread id and a nanosecond timestamp. At the end of the run the events are
+// written as Chrome trace-event JSON, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) load directly.
+//
+// Each thread records into its own fixed-size buffer, so recording takes no lock.
+// When tracing is off every hook is a single predictable branch on trace_enabled.
+
+#ifndef POSIX_SAMPLES_TRACE_H
+#define POSIX_SAMPLES_TRACE_H
+
+// Library imports
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "options.h"
+#include "clock.h"
+
+// One recorded trace event. Names and categories point at string literals (or
+// names registered for the lifetime of the run), so nothing is copied.
+struct TraceEvent {
+    uint64_t timestamp_ns;
+    uint64_t duration_ns;   // Only for complete ('X') events.
+    const char* name;
+    const char* category;
+    int64_t arg;            // Entity id, queue depth, etc. Negative means none.
+    char phase;             // 'X' complete, 'B'/'E' begin/end, 'i' instant, 'C' counter.
+};
+
+// Per-thread event buffer. Only the owning thread appends; the writer at the end
+// of the run reads the published prefix.
+class TraceBuffer {
+    public:
+        std::unique_ptr<TraceEvent[]> events;
+        size_t capacity;
+        std::atomic<size_t> count{0};
+        uint64_t dropped = 0;
+        pid_t tid;
+        const char* thread_name = NULL;
+
+        TraceBuffer(size_t capacity) : events(new TraceEvent[capacity]), capacity(capacity) {
+            tid = syscall(SYS_gettid);
+        }
+
+        void append(const TraceEvent& e) {
+            size_t n = count.load(std::memory_order_relaxed);
+            if (n == capacity) {
+                dropped++;
+                return;
+            }
+            events[n] = e;
+            count.store(n + 1, std::memory_order_release);
+        }
+};
+
+// Process-wide trace state.
+struct TraceState {
+    std::string path;
+    size_t buffer_capacity = 1 << 20;
+    pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+inline bool trace_enabled = false;
+inline TraceState trace_state;
+inline thread_local TraceBuffer* trace_buffer = NULL;
+// The calling thread's name, kept even when tracing is off (replay.h identifies
+// threads by it).
+inline thread_local const char* trace_thread_label = "main";
+
+// trace_thread_buffer()
+// Returns the calling thread's buffer, registering one on first use.
+inline TraceBuffer* trace_thread_buffer() {
+    if (trace_buffer == NULL) {
+        std::unique_ptr<TraceBuffer> buffer(new TraceBuffer(trace_state.buffer_capacity));
+        trace_buffer = buffer.get();
+        pthread_mutex_lock(&trace_state.buffers_mutex);
+        trace_state.buffers.push_back(std::move(buffer));
+        pthread_mutex_unlock(&trace_state.buffers_mutex);
+    }
+    return trace_buffer;
+}
+
+inline void trace_record(char phase, const char* category, const char* name, uint64_t timestamp_ns,
+                         uint64_t duration_ns = 0, int64_t arg = -1) {
+    trace_thread_buffer()->append(TraceEvent{timestamp_ns, duration_ns, name, category, arg, phase});
+}
+
+// trace_thread_name()
+// Labels the calling thread in the timeline ("barber", "producer", ...).
+inline void trace_thread_name(const char* name) {
+    trace_thread_label = name;
+    if (trace_enabled) {
+        trace_thread_buffer()->thread_name = name;
+    }
+}
+
+// trace_complete()
+// Records a span whose start and end are both already known.
+inline void trace_complete(const char* category, const char* name, uint64_t start_ns, uint64_t end_ns, int64_t arg = -1) {
+    if (trace_enabled) {
+        trace_record('X', category, name, start_ns, end_ns - start_ns, arg);
+    }
+}
+
+// trace_begin() / trace_end()
+// Bracket a service span on the calling thread, such as one haircut.
+inline void trace_begin(const char* name, int64_t entity = -1) {
+    if (trace_enabled) {
+        trace_record('B', "service", name, monotonic_ns(), 0, entity);
+    }
+}
+
+inline void trace_end(const char* name, int64_t entity = -1) {
+    if (trace_enabled) {
+        trace_record('E', "service", name, monotonic_ns(), 0, entity);
+    }
+}
+
+// trace_instant()
+// Records a point event, such as a semaphore post.
+inline void trace_instant(const char* category, const char* name, int64_t arg = -1) {
+    if (trace_enabled) {
+        trace_record('i', category, name, monotonic_ns(), 0, arg);
+    }
+}
+
+// trace_queue()
+// Records a queue push or pop together with the queue's new depth, which shows
+// up in the timeline as a counter track named after the queue.
+inline void trace_queue(const char* queue_name, const char* operation, size_t depth) {
+    if (trace_enabled) {
+        uint64_t now = monotonic_ns();
+        trace_record('i', "queue", operation, now, 0, depth);
+        trace_record('C', "queue", queue_name, now, 0, depth);
+    }
+}
+
+// trace_start()
+// Reads --trace (output path) and --trace-buffer (events per thread). Call once
+// from main() before any worker threads are created.
+inline void trace_start(Options& options) {
+    trace_state.path = options.get("trace", "");
+    trace_state.buffer_capacity = options.value("trace-buffer", trace_state.buffer_capacity);
+    trace_enabled = !trace_state.path.empty();
+    if (trace_enabled) {
+        trace_thread_name("main");
+    }
+}
+
+// trace_json_escape()
+// Escapes a name for a JSON string.
+inline std::string trace_json_escape(const char* s) {
+    std::string out;
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            out += '\\';
+        }
+        out += *s;
+    }
+    return out;
+}
+
+// trace_write()
+// Writes every recorded event to the --trace file. Call from main() once the
+// worker threads have stopped.
+inline void trace_write() {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = false;
+    FILE* file = fopen(trace_state.path.c_str(), "w");
+    if (file == NULL) {
+        perror(trace_state.path.c_str());
+        return;
+    }
+
+    // Timestamps are written in microseconds relative to the first event, with
+    // three decimals to keep nanosecond resolution.
+    uint64_t origin = UINT64_MAX;
+    pthread_mutex_lock(&trace_state.buffers_mutex);
+    for (auto& buffer : trace_state.buffers) {
+        size_t n = buffer->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (buffer->events[i].timestamp_ns < origin) {
+                origin = buffer->events[i].timestamp_ns;
+            }
+        }
+    }
+
+    pid_t pid = getpid();
+    uint64_t dropped = 0;
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (auto& buffer : trace_state.buffers) {
+        dropped += buffer->dropped;
+        if (buffer->thread_name != NULL) {
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", pid, buffer->tid, trace_json_escape(buffer->thread_name).c_str());
+            first = false;
+        }
+        size_t n = buffer->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            const TraceEvent& e = buffer->events[i];
+            uint64_t ts = e.timestamp_ns - origin;
+            fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %llu.%03llu, \"pid\": %d, \"tid\": %d",
+                    first ? "" : ",\n", trace_json_escape(e.name).c_str(), e.category, e.phase,
+                    (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000), pid, buffer->tid);
+            first = false;
+            if (e.phase == 'X') {
+                fprintf(file, ", \"dur\": %llu.%03llu",
+                        (unsigned long long)(e.duration_ns / 1000), (unsigned long long)(e.duration_ns % 1000));
+            }
+            if (e.phase == 'i') {
+                fprintf(file, ", \"s\": \"t\"");
+            }
+            if (e.phase == 'C') {
+                fprintf(file, ", \"args\": {\"depth\": %lld}", (long long)e.arg);
+            } else if (e.arg >= 0) {
+                fprintf(file, ", \"args\": {\"value\": %lld}", (long long)e.arg);
+            }
+            fprintf(file, "}");
+        }
+    }
+    pthread_mutex_unlock(&trace_state.buffers_mutex);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    if (dropped > 0) {
+        fprintf(stderr, "trace: %llu events dropped; raise --trace-buffer\n", (unsigned long long)dropped);
+    }
+}
+
+#endif
@@ -0,0 +1,159 @@
+// Structure-of-arrays waiting area for the ravine samples.
+//
+// Waiting primates are kept as columns instead of an array of objects:
+//   ids      one int32_t per entry
+//   east     one bit per entry, set when going eastward
+//   human    one bit per entry, set for humans
+//   waiting  one bit per entry, cleared when the entry leaves
+// Entries are appended at the back and may leave from anywhere, so index order
+// is arrival order. Looking for the next primates going one way walks the
+// bitsets a 64-entry word at a time: (waiting & east), or (waiting & ~east),
+// selects a whole word's candidates in one operation, count-trailing-zeros
+// steps to each of them and popcount counts them, so a scan over a deep backlog
+// touches one bit per entry instead of a whole object. Nothing moves when an
+// entry leaves; the words in front of the first waiting entry are dropped in
+// bulk by push() once they make up half the columns.
+//
+// Indices stay valid until the next push().
+
+#ifndef POSIX_SAMPLES_WAITING_AREA_H
+#define POSIX_SAMPLES_WAITING_AREA_H
+
+// Library imports
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class WaitingArea {
+    public:
+        static const size_t npos = SIZE_MAX;
+
+    private:
+        std::vector<int32_t> ids;
+        std::vector<uint64_t> east;
+        std::vector<uint64_t> human;
+        std::vector<uint64_t> waiting;
+        size_t head = 0;        // No entry before head is waiting.
+        size_t num_waiting = 0;
+
+        static uint64_t bit(size_t i) { return 1ULL << (i % 64); }
+
+        // compact()
+        // Drops the words in front of head once they are half the columns.
+        void compact() {
+            size_t words = head / 64;
+            if (words < 64 || words * 2 < waiting.size()) {
+                return;
+            }
+            ids.erase(ids.begin(), ids.begin() + words * 64);
+            east.erase(east.begin(), east.begin() + words);
+            human.erase(human.begin(), human.begin() + words);
+            waiting.erase(waiting.begin(), waiting.begin() + words);
+            head -= words * 64;
+        }
+
+        // matching()
+        // The waiting entries of word w that go the given way.
+        uint64_t matching(size_t w, bool eastward) const {
+            return waiting[w] & (eastward ? east[w] : ~east[w]);
+        }
+
+    public:
+        // push()
+        // Appends an entry at the back.
+        void push(int32_t id, bool eastward, bool is_human = false) {
+            compact();
+            size_t i = ids.size();
+            if (i % 64 == 0) {
+                east.push_back(0);
+                human.push_back(0);
+                waiting.push_back(0);
+            }
+            ids.push_back(id);
+            if (eastward) {
+                east[i / 64] |= bit(i);
+            }
+            if (is_human) {
+                human[i / 64] |= bit(i);
+            }
+            waiting[i / 64] |= bit(i);
+            num_waiting++;
+        }
+
+        size_t size() const { return num_waiting; }
+        bool empty() const { return num_waiting == 0; }
+        int32_t id(size_t i) const { return ids[i]; }
+        bool eastward(size_t i) const { return east[i / 64] & bit(i); }
+        bool is_human(size_t i) const { return human[i / 64] & bit(i); }
+
+        // front()
+        // Index of the first waiting entry, or npos.
+        size_t front() {
+            for (size_t w = head / 64; w < waiting.size(); w++) {
+                if (waiting[w] != 0) {
+                    head = w * 64 + __builtin_ctzll(waiting[w]);
+                    return head;
+                }
+            }
+            head = ids.size();
+            return npos;
+        }
+
+        // next()
+        // Index of the first waiting entry at or after from that goes the given
+        // way, or npos.
+        size_t next(size_t from, bool eastward) const {
+            if (from < head) {
+                from = head;
+            }
+            size_t w = from / 64;
+            if (w >= waiting.size()) {
+                return npos;
+            }
+            uint64_t candidates = matching(w, eastward) & (~0ULL << (from % 64));
+            while (candidates == 0) {
+                if (++w == waiting.size()) {
+                    return npos;
+                }
+                candidates = matching(w, eastward);
+            }
+            return w * 64 + __builtin_ctzll(candidates);
+        }
+
+        // count()
+        // Number of waiting entries going the given way.
+        size_t count(bool eastward) const {
+            size_t total = 0;
+            for (size_t w = head / 64; w < waiting.size(); w++) {
+                total += __builtin_popcountll(matching(w, eastward));
+            }
+            return total;
+        }
+
+        // remove()
+        // Takes the entry out of the waiting area.
+        void remove(size_t i) {
+            waiting[i / 64] &= ~bit(i);
+            num_waiting--;
+        }
+
+        // pop_front()
+        // Removes the first waiting entry.
+        void pop_front() {
+            remove(front());
+        }
+
+        // clear()
+        // Removes every entry and releases nothing, so refilling does not
+        // allocate.
+        void clear() {
+            ids.clear();
+            east.clear();
+            human.clear();
+            waiting.clear();
+            head = 0;
+            num_waiting = 0;
+        }
+};
+
+#endif
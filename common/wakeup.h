@@ -0,0 +1,138 @@
+// Event-driven wakeups for worker threads.
+//
+// A worker that finds its queue empty blocks in epoll_wait() on three sources:
+//   work      an eventfd its producers write to
+//   timer     a timerfd, armed when the worker passes a deadline to wait()
+//   shutdown  one eventfd shared by every worker, written once by main()
+// Producers call notify() only when they turn the worker's queue from empty to
+// non-empty. The eventfd counter accumulates notifications until the worker
+// reads it, so a burst of arrivals while the worker is busy or already awake
+// costs it at most one wakeup, and a notification sent just before the worker
+// blocks is never lost.
+//
+// wakeup_report() prints how many times workers were woken for the number of
+// items they handled.
+
+#ifndef POSIX_SAMPLES_WAKEUP_H
+#define POSIX_SAMPLES_WAKEUP_H
+
+// Library imports
+#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "report.h"
+
+enum wakeup_source { WAKEUP_WORK, WAKEUP_TIMER, WAKEUP_SHUTDOWN };
+
+inline int wakeup_shutdown_fd = -1;
+inline std::atomic<uint64_t> wakeup_notifications(0);
+inline std::atomic<uint64_t> wakeup_wakeups(0);
+
+class Wakeup {
+    private:
+        int epoll_fd;
+        int work_fd;
+        int timer_fd;
+
+    public:
+        Wakeup() {
+            if (wakeup_shutdown_fd < 0) {
+                wakeup_shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            }
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            work_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+            int fds[3] = {work_fd, timer_fd, wakeup_shutdown_fd};
+            for (int fd : fds) {
+                struct epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            }
+        }
+
+        ~Wakeup() {
+            close(epoll_fd);
+            close(work_fd);
+            close(timer_fd);
+        }
+
+        Wakeup(const Wakeup&) = delete;
+        Wakeup& operator=(const Wakeup&) = delete;
+
+        // notify()
+        // Tells the worker there is work. Call after making its queue non-empty,
+        // preferably after releasing the queue's lock.
+        void notify() {
+            wakeup_notifications.fetch_add(1, std::memory_order_relaxed);
+            uint64_t one = 1;
+            while (write(work_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+            }
+        }
+
+        // wait()
+        // Blocks until work has been notified, the CLOCK_MONOTONIC deadline
+        // (if not 0) passes, or wakeup_shutdown() is called. Pending work
+        // notifications are consumed.
+        wakeup_source wait(uint64_t deadline_ns = 0) {
+            if (deadline_ns != 0) {
+                struct itimerspec spec = {};
+                spec.it_value.tv_sec = deadline_ns / 1000000000ULL;
+                spec.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+                timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+            }
+            struct epoll_event events[3];
+            int n;
+            while ((n = epoll_wait(epoll_fd, events, 3, -1)) < 0 && errno == EINTR) {
+            }
+            wakeup_wakeups.fetch_add(1, std::memory_order_relaxed);
+
+            bool work = false, timer = false, shutdown = false;
+            uint64_t count;
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == work_fd) {
+                    work = read(work_fd, &count, sizeof(count)) == sizeof(count);
+                } else if (events[i].data.fd == timer_fd) {
+                    timer = read(timer_fd, &count, sizeof(count)) == sizeof(count);
+                } else {
+                    shutdown = true;
+                }
+            }
+            if (deadline_ns != 0 && !timer) {
+                struct itimerspec disarm = {};
+                timerfd_settime(timer_fd, 0, &disarm, NULL);
+            }
+            if (shutdown) {
+                return WAKEUP_SHUTDOWN;
+            }
+            return work ? WAKEUP_WORK : WAKEUP_TIMER;
+        }
+};
+
+// wakeup_shutdown()
+// Wakes every worker blocked in Wakeup::wait(), now and in the future.
+inline void wakeup_shutdown() {
+    uint64_t one = 1;
+    while (write(wakeup_shutdown_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// wakeup_report()
+// Prints the wakeups per item handled and adds them to the report.
+inline void wakeup_report(Report& report, uint64_t items) {
+    uint64_t wakeups = wakeup_wakeups.load();
+    uint64_t notifications = wakeup_notifications.load();
+    double per_item = items ? (double)wakeups / items : 0;
+    std::cout << "Worker wakeups: " << wakeups << " for " << items << " items (" << per_item <<
+                 " per item), " << notifications << " notifications" << std::endl;
+    report.add("wakeups", (long long)wakeups);
+    report.add("wakeup_notifications", (long long)notifications);
+    report.add("wakeups_per_item", per_item);
+}
+
+#endif
@@ -0,0 +1,249 @@
+// Stall, livelock and throughput-collapse watchdog.
+//
+// Each worker thread takes a WatchdogWorker with watchdog_worker() and bumps
+// two relaxed counters on it: watchdog_progress() when it finishes an entity
+// and watchdog_pass() on every pass through its loop or retry of a wait.
+// watchdog_doing() names what it is about to block on. The counters sit on
+// separate cache lines and are updated whether or not the watchdog runs, so
+// the workers pay one uncontended add per event either way.
+//
+// With --watchdog (or --watchdog=250ms for a sampling interval other than
+// 100ms) a thread samples the counters and the program's backlog gauge,
+// and reports:
+//   - a stall, when entities are waiting but no worker has finished one for
+//     --watchdog-stall (default 2s, which should exceed the longest service
+//     time),
+//   - a livelock, when that happens while the workers have made at least
+//     WATCHDOG_LIVELOCK_PASSES loop passes, spinning without progress,
+//   - a throughput collapse, when entities are waiting and the progress in one
+//     interval falls below --watchdog-collapse (default 0.1) of the rolling
+//     baseline, an average over the busy intervals so far. It is only judged
+//     once that fraction of the baseline is at least one entity, so slow
+//     services that finish less than once per interval are not flagged.
+// Each is reported once per episode, on stderr, with a dump of every worker's
+// counters and current activity, every live metric (queue depths and
+// counters), and the state of every registered lock and semaphore.
+
+#ifndef POSIX_SAMPLES_WATCHDOG_H
+#define POSIX_SAMPLES_WATCHDOG_H
+
+// Library imports
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include "options.h"
+#include "report.h"
+#include "clock.h"
+#include "sim_time.h"
+#include "live_stats.h"
+#include "sync.h"
+
+const int WATCHDOG_MAX_WORKERS = 8;
+const uint64_t WATCHDOG_LIVELOCK_PASSES = 1000;
+// Busy intervals averaged before a collapse can be judged.
+const int WATCHDOG_WARMUP = 8;
+
+// One worker's progress, on its own cache line.
+struct alignas(64) WatchdogWorker {
+    const char* name = NULL;
+    std::atomic<uint64_t> progress{0};
+    std::atomic<uint64_t> passes{0};
+    std::atomic<const char*> doing{"running"};
+};
+
+struct WatchdogState {
+    WatchdogWorker workers[WATCHDOG_MAX_WORKERS];
+    std::atomic<int> num_workers{0};
+    LiveMetric* backlog = NULL;
+    bool enabled = false;
+    std::atomic<bool> running{false};
+    pthread_t thread;
+    uint64_t interval_ns = 100000000;
+    uint64_t stall_ns = 2000000000;
+    double collapse_fraction = 0.1;
+    uint64_t started_ns = 0;
+    int stalls = 0;
+    int livelocks = 0;
+    int collapses = 0;
+};
+
+inline WatchdogState watchdog;
+
+// watchdog_worker()
+// Registers a worker thread by name and returns its counters. Call from main()
+// before starting the worker. Workers must not share counters, so registering
+// more than WATCHDOG_MAX_WORKERS aborts.
+inline WatchdogWorker* watchdog_worker(const char* name) {
+    int index = watchdog.num_workers.load(std::memory_order_relaxed);
+    if (index == WATCHDOG_MAX_WORKERS) {
+        std::cerr << "watchdog: more than " << WATCHDOG_MAX_WORKERS << " workers registered (" << name << ")\n";
+        abort();
+    }
+    watchdog.workers[index].name = name;
+    watchdog.num_workers.store(index + 1, std::memory_order_release);
+    return &watchdog.workers[index];
+}
+
+inline void watchdog_progress(WatchdogWorker* worker, uint64_t entities = 1) {
+    worker->progress.fetch_add(entities, std::memory_order_relaxed);
+}
+
+inline void watchdog_pass(WatchdogWorker* worker) {
+    worker->passes.fetch_add(1, std::memory_order_relaxed);
+}
+
+// watchdog_doing()
+// Names what the worker is doing (a string literal), e.g. "waiting for
+// crossing_semaphore".
+inline void watchdog_doing(WatchdogWorker* worker, const char* what) {
+    worker->doing.store(what, std::memory_order_relaxed);
+}
+
+// watchdog_dump()
+// Prints the reason for a trigger and the state of the run.
+inline void watchdog_dump(const std::string& reason, uint64_t now) {
+    std::ostringstream out;
+    out << "watchdog: " << reason << " at " << format_seconds(now - watchdog.started_ns) << "s\n";
+    int num_workers = watchdog.num_workers.load(std::memory_order_acquire);
+    for (int i = 0; i < num_workers; i++) {
+        const WatchdogWorker& w = watchdog.workers[i];
+        out << "  worker " << w.name << ": " << w.progress.load(std::memory_order_relaxed) << " done, " <<
+               w.passes.load(std::memory_order_relaxed) << " loop passes, " <<
+               w.doing.load(std::memory_order_relaxed) << "\n";
+    }
+    LiveStatsSegment* segment = live_stats.segment;
+    uint32_t num_metrics = segment->num_metrics.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < num_metrics; i++) {
+        out << "  " << segment->metrics[i].name << " = " << segment->metrics[i].value.load(std::memory_order_relaxed) <<
+               "\n";
+    }
+    for (int i = 0; i < sync_num_objects; i++) {
+        out << "  " << sync_objects[i].name << ": " << sync_describe(sync_objects[i]) << "\n";
+    }
+    std::cerr << out.str() << std::flush;
+}
+
+// watchdog_thread()
+// Samples the counters every interval until watchdog_stop().
+inline void* watchdog_thread(void*) {
+    uint64_t last_progress = 0;
+    uint64_t quiet_passes = 0;          // Loop passes at the start of the quiet stretch.
+    uint64_t quiet_since = monotonic_ns();
+    double baseline = 0;
+    int busy_samples = 0;
+    bool stalled = false;
+    bool collapsed = false;
+    uint64_t next = monotonic_ns() + watchdog.interval_ns;
+    while (watchdog.running.load(std::memory_order_acquire)) {
+        sleep_until_ns(next);
+        next += watchdog.interval_ns;
+        uint64_t now = monotonic_ns();
+        uint64_t progress = 0, passes = 0;
+        int num_workers = watchdog.num_workers.load(std::memory_order_acquire);
+        for (int i = 0; i < num_workers; i++) {
+            progress += watchdog.workers[i].progress.load(std::memory_order_relaxed);
+            passes += watchdog.workers[i].passes.load(std::memory_order_relaxed);
+        }
+        uint64_t backlog = watchdog.backlog->value.load(std::memory_order_relaxed);
+        uint64_t done = progress - last_progress;
+        last_progress = progress;
+
+        // Stalls and livelocks: no progress while entities wait. An empty
+        // backlog restarts the quiet stretch, since idle workers are fine.
+        if (done > 0 || backlog == 0) {
+            quiet_since = now;
+            quiet_passes = passes;
+            stalled = false;
+        } else if (!stalled && now - quiet_since >= watchdog.stall_ns) {
+            stalled = true;
+            bool spinning = passes - quiet_passes >= WATCHDOG_LIVELOCK_PASSES;
+            (spinning ? watchdog.livelocks : watchdog.stalls)++;
+            watchdog_dump(std::string(spinning ? "livelock" : "stall") + ": nothing finished for " +
+                          format_duration(now - quiet_since) + " with " + std::to_string(backlog) + " waiting, " +
+                          std::to_string(passes - quiet_passes) + " loop passes", now);
+        }
+
+        // Throughput collapse against the average of the busy intervals.
+        if (backlog == 0) {
+            continue;
+        }
+        double floor = baseline * watchdog.collapse_fraction;
+        if (busy_samples >= WATCHDOG_WARMUP && floor >= 1 && done < floor) {
+            if (!collapsed) {
+                collapsed = true;
+                watchdog.collapses++;
+                std::ostringstream reason;
+                reason << "throughput collapse: " << done << " finished in the last " <<
+                          format_duration(watchdog.interval_ns) << ", baseline " << baseline;
+                watchdog_dump(reason.str(), now);
+            }
+            continue;
+        }
+        if (done >= baseline / 2) {
+            collapsed = false;
+        }
+        busy_samples++;
+        baseline += (done - baseline) / std::min(busy_samples, 64);
+    }
+    return NULL;
+}
+
+// watchdog_start()
+// Reads --watchdog, --watchdog-stall and --watchdog-collapse, and starts the
+// watchdog if asked. backlog is the gauge holding the number of waiting
+// entities. Call from main() once the workers have registered their counters
+// or before they start.
+inline void watchdog_start(Options& options, LiveMetric* backlog) {
+    std::string interval = options.get("watchdog", "false");
+    std::string stall = options.get("watchdog-stall", "2s");
+    watchdog.collapse_fraction = options.value("watchdog-collapse", watchdog.collapse_fraction);
+    if (interval == "false") {
+        return;
+    }
+    if (interval == "true") {
+        interval = "100ms";
+    }
+    if (!parse_duration(interval, watchdog.interval_ns) || watchdog.interval_ns == 0) {
+        options.fail("--watchdog takes a sampling interval such as 100ms");
+    }
+    if (!parse_duration(stall, watchdog.stall_ns) || watchdog.stall_ns == 0) {
+        options.fail("--watchdog-stall must be a duration such as 2s");
+    }
+    if (watchdog.collapse_fraction <= 0 || watchdog.collapse_fraction >= 1) {
+        options.fail("--watchdog-collapse must be between 0 and 1");
+    }
+    watchdog.backlog = backlog;
+    watchdog.enabled = true;
+    watchdog.started_ns = monotonic_ns();
+    watchdog.running = true;
+    pthread_create(&watchdog.thread, NULL, watchdog_thread, NULL);
+}
+
+// watchdog_stop()
+// Stops the watchdog thread. Call once the workers are done.
+inline void watchdog_stop() {
+    if (watchdog.running.exchange(false)) {
+        pthread_join(watchdog.thread, NULL);
+    }
+}
+
+// watchdog_report()
+// Prints what the watchdog found and adds it to the report.
+inline void watchdog_report(Report& report) {
+    if (!watchdog.enabled) {
+        return;
+    }
+    std::cout << "Watchdog (every " << format_duration(watchdog.interval_ns) << "): " << watchdog.stalls <<
+                 " stalls, " << watchdog.livelocks << " livelocks, " << watchdog.collapses <<
+                 " throughput collapses" << std::endl;
+    report.add("watchdog_stalls", watchdog.stalls);
+    report.add("watchdog_livelocks", watchdog.livelocks);
+    report.add("watchdog_collapses", watchdog.collapses);
+}
+
+#endif
@@ -0,0 +1,174 @@
+// Agent-based versions of the simulations, one coroutine per entity.
+//
+// The pthread samples keep their entities as passive queue entries served by a
+// few role threads. Here every customer, farmer or monkey is its own coroutine
+// that waits on the shared resources itself, so populations of a million or more
+// run on a handful of worker threads (see common/coro.h).
+//
+// Models:
+//   barbershop  customers take a waiting-room chair (or leave if none is free),
+//               then wait for the barber and hold it for the service time
+//   bridge      farmers cross a one-lane bridge one at a time
+//   ravine      monkeys cross on a rope holding up to 5, all in one direction
+//
+// Build with C++20:
+//   g++ -std=c++20 -O2 -pthread coroutines/agents.cpp -o coroutines/agents
+// Example:
+//   agents --model=ravine --entities=1000000 --arrival-rate=0 --service-time=10us
+
+// Library imports
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/sim_time.h"
+#include "../common/topology.h"
+#include "../common/coro.h"
+
+using namespace std;
+
+// Parameters
+string model = "barbershop";
+int num_entities = 1000000;
+int num_chairs = 3;
+const int ROPE_CAPACITY = 5;
+Interval arrival_rate = Interval(0);
+Interval service_time = Interval(1000);
+
+// Shared resources, created once the model is known.
+unique_ptr<AsyncSemaphore> waiting_room;
+unique_ptr<AsyncSemaphore> barber;
+unique_ptr<AsyncSemaphore> bridge;
+unique_ptr<DirectionalGate> rope;
+
+// Results
+atomic<long long> num_completed(0);
+atomic<long long> num_balked(0);
+atomic<long long> total_sojourn_ns(0);
+
+// record_completion()
+// Counts an entity that got through, with the time since it arrived.
+void record_completion(uint64_t arrived_ns) {
+    num_completed.fetch_add(1, memory_order_relaxed);
+    total_sojourn_ns.fetch_add(monotonic_ns() - arrived_ns, memory_order_relaxed);
+}
+
+// A customer: sit in the waiting room if there is a free chair, then get a
+// haircut when the barber is free.
+CoroTask customer(CoroRuntime& runtime, uint64_t arrived) {
+    if (!waiting_room->try_acquire()) {
+        num_balked.fetch_add(1, memory_order_relaxed);
+        co_return;
+    }
+    co_await barber->acquire();
+    waiting_room->release();
+    co_await runtime.sleep_for(service_time.sample());
+    barber->release();
+    record_completion(arrived);
+}
+
+// A farmer: wait for the bridge, cross, and free it.
+CoroTask farmer(CoroRuntime& runtime, uint64_t arrived) {
+    co_await bridge->acquire();
+    co_await runtime.sleep_for(service_time.sample());
+    bridge->release();
+    record_completion(arrived);
+}
+
+// A monkey: wait for room on the rope in its direction, cross, and let go.
+CoroTask monkey(CoroRuntime& runtime, uint64_t arrived, int direction) {
+    co_await rope->acquire(direction);
+    co_await runtime.sleep_for(service_time.sample());
+    rope->release();
+    record_completion(arrived);
+}
+
+// The arrival process: spawns one entity per arrival interval.
+CoroTask arrivals(CoroRuntime& runtime) {
+    uint64_t next_arrival = monotonic_ns();
+    for (int i = 0; i < num_entities; i++) {
+        // Time in system counts from when the entity was due, so a late
+        // arrivals coroutine does not hide the delay.
+        if (model == "barbershop") {
+            runtime.spawn(customer(runtime, next_arrival));
+        } else if (model == "bridge") {
+            runtime.spawn(farmer(runtime, next_arrival));
+        } else {
+            runtime.spawn(monkey(runtime, next_arrival, sim_random()() & 1));
+        }
+        if (i < num_entities - 1) {
+            next_arrival += arrival_rate.sample();
+            co_await runtime.sleep_until(next_arrival);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
+    cout << "Agent-Based Simulation\n" << \
+            "--------------------\n";
+    options.ask("model", "Which model would you like to run? (barbershop/bridge/ravine): ", model);
+    options.ask("entities", "How many entities would you like to simulate? (n): ", num_entities);
+    options.ask("arrival-rate", "How often should new entities appear? (seconds, or e.g. 250ms, exp:50us): ", arrival_rate);
+    options.ask("service-time", "How long does each entity hold the resource? (seconds, or e.g. 250ms, exp:50us): ", service_time);
+    num_chairs = options.value("chairs", num_chairs);
+    int num_workers = options.value("workers", (int)allowed_cpus().size());
+    options.check_unused();
+    if (model != "barbershop" && model != "bridge" && model != "ravine") {
+        options.fail("unknown --model " + model + " (expected barbershop, bridge or ravine)");
+    }
+    if (num_workers < 1) {
+        options.fail("--workers must be at least 1");
+    }
+
+    waiting_room.reset(new AsyncSemaphore(num_chairs));
+    barber.reset(new AsyncSemaphore(1));
+    bridge.reset(new AsyncSemaphore(1));
+    rope.reset(new DirectionalGate(ROPE_CAPACITY));
+
+    cout << "\nBeginning simulation with " << num_workers << " worker thread(s)...\n" << \
+            "-----------------------\n" << flush;
+
+    // Run until every entity has finished.
+    CoroRuntime runtime(num_workers);
+    uint64_t start_ns = monotonic_ns();
+    runtime.run(arrivals(runtime));
+    long long elapsed_us = (monotonic_ns() - start_ns) / 1000;
+
+    long long completed = num_completed.load();
+    long long mean_sojourn_ns = completed ? total_sojourn_ns.load() / completed : 0;
+    cout << "\nEnd simulation...\n" << \
+            "-------------------\n";
+    cout << "Entities completed: " << completed << ", balked: " << num_balked.load() << "\n";
+    cout << "Peak live entities: " << runtime.peak_live() << "\n";
+    cout << "Mean time in system: " << mean_sojourn_ns << " ns\n";
+    cout << "Resumptions: " << runtime.total_resumed() << ", steals: " << runtime.total_stolen() <<
+            ", parks: " << runtime.total_parked() << "\n";
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("model", model);
+    report.add("entities", num_entities);
+    report.add("workers", num_workers);
+    report.add("arrival_rate", arrival_rate.to_string());
+    report.add("service_time", service_time.to_string());
+    report.add("completed", completed);
+    report.add("balked", num_balked.load());
+    report.add("peak_live", (long long)runtime.peak_live());
+    report.add("mean_sojourn_ns", mean_sojourn_ns);
+    report.add("resumed", (long long)runtime.total_resumed());
+    report.add("stolen", (long long)runtime.total_stolen());
+    report.add("parked", (long long)runtime.total_parked());
+    report.add("elapsed_us", elapsed_us);
+    report.print(options.report_format());
+    return 0;
+}
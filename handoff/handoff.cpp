@@ -0,0 +1,284 @@
+// Cost of handing entities across a thread versus a process boundary.
+//
+// A producer hands numbered entities to one or more workers through a bounded
+// ring (common/shm_ring.h), the same shape as the samples' producer and worker
+// threads. In threads mode the workers are threads and the ring is private
+// memory with process-private semaphores. In processes mode every worker is a
+// separate process started with fork(), and the ring lives in a shm_open()
+// segment with process-shared semaphores. --mode=both runs one after the other
+// and compares throughput, hand-off latency and CPU cost.
+//
+// Example:
+//   handoff --items=1000000 --workers=2 --capacity=64 --mode=both
+//
+// With the default arrival rate of 0 the producer pushes as fast as the ring
+// accepts, so throughput is the hand-off capacity and latency includes the time
+// an entity spends in a full ring. Give --arrival-rate to measure an unloaded
+// hand-off instead.
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/clock.h"
+#include "../common/histogram.h"
+#include "../common/sim_time.h"
+#include "../common/shm_ring.h"
+
+using namespace std;
+
+// Parameters
+string mode = "both";
+int num_items = 1000000;
+int num_workers = 1;
+int capacity = 64;
+Interval arrival_rate = Interval(0);
+Interval service_time = Interval(0);
+
+// What one worker measured. Kept in a MAP_SHARED mapping so that worker
+// processes can hand it back to the producer.
+struct WorkerResult {
+    LatencyHistogram latency;
+    uint64_t items = 0;
+    uint64_t last_pop_ns = 0;
+};
+
+// The outcome of one run.
+struct RunResult {
+    string mode;
+    LatencyHistogram latency;
+    long long elapsed_us = 0;
+    double throughput = 0;          // Entities per second.
+    double cpu_ns_per_item = 0;     // User + system time, all threads/processes.
+    double switches_per_item = 0;   // Voluntary + involuntary context switches.
+};
+
+struct WorkerArgs {
+    ShmRing* ring;
+    WorkerResult* result;
+};
+
+// worker_loop()
+// Pops entities until the producer's end marker (a negative id) arrives.
+void worker_loop(ShmRing* ring, WorkerResult* result) {
+    while (true) {
+        ShmRingEntry entry = shm_ring_pop(ring);
+        uint64_t now = monotonic_ns();
+        if (entry.id < 0) {
+            break;
+        }
+        result->latency.record(now - entry.enqueued_ns);
+        result->items++;
+        if (service_time.mean_ns() > 0) {
+            sleep_for_ns(service_time.sample());
+            now = monotonic_ns();
+        }
+        result->last_pop_ns = now;
+    }
+}
+
+// worker_thread()
+// Thread entry point for threads mode.
+void* worker_thread(void* arg) {
+    WorkerArgs* args = (WorkerArgs*)arg;
+    worker_loop(args->ring, args->result);
+    return NULL;
+}
+
+// usage_totals()
+// CPU time (ns) and context switches used so far by this process and by its
+// waited-for children.
+void usage_totals(uint64_t& cpu_ns, uint64_t& switches) {
+    cpu_ns = 0;
+    switches = 0;
+    for (int who : {RUSAGE_SELF, RUSAGE_CHILDREN}) {
+        struct rusage usage;
+        getrusage(who, &usage);
+        cpu_ns += (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+        switches += usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+}
+
+// run()
+// Runs the producer and the workers once, as threads or as processes.
+RunResult run(Options& options, bool processes) {
+    RunResult result;
+    result.mode = processes ? "processes" : "threads";
+
+    string ring_name = "/posix_samples.handoff." + to_string(getpid());
+    ShmRing* ring = shm_ring_create(ring_name, capacity, processes);
+    if (ring == NULL) {
+        options.fail("cannot create ring " + ring_name + ": " + strerror(errno));
+    }
+    size_t results_size = num_workers * sizeof(WorkerResult);
+    void* results_address = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results_address == MAP_FAILED) {
+        options.fail(string("cannot map worker results: ") + strerror(errno));
+    }
+    WorkerResult* results = (WorkerResult*)results_address;
+    for (int w = 0; w < num_workers; w++) {
+        new (&results[w]) WorkerResult();
+    }
+
+    uint64_t cpu_before, switches_before;
+    usage_totals(cpu_before, switches_before);
+    uint64_t start_ns = monotonic_ns();
+
+    // Start the workers.
+    vector<pid_t> children;
+    vector<pthread_t> threads(num_workers);
+    vector<WorkerArgs> args(num_workers);
+    for (int w = 0; w < num_workers; w++) {
+        args[w] = WorkerArgs{ring, &results[w]};
+        if (processes) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                worker_loop(ring, &results[w]);
+                _exit(0);
+            }
+            if (pid < 0) {
+                options.fail(string("fork: ") + strerror(errno));
+            }
+            children.push_back(pid);
+        } else {
+            pthread_create(&threads[w], NULL, worker_thread, &args[w]);
+        }
+    }
+
+    // Produce. Arrivals are scheduled against absolute deadlines.
+    uint64_t next_arrival = monotonic_ns();
+    for (int i = 0; i < num_items; i++) {
+        shm_ring_push(ring, ShmRingEntry{i, monotonic_ns()});
+        if (arrival_rate.mean_ns() > 0 && i < num_items - 1) {
+            next_arrival += arrival_rate.sample();
+            sleep_until_ns(next_arrival);
+        }
+    }
+    // One end marker per worker.
+    for (int w = 0; w < num_workers; w++) {
+        shm_ring_push(ring, ShmRingEntry{-1, 0});
+    }
+
+    // Wait for the workers.
+    if (processes) {
+        for (pid_t pid : children) {
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            }
+        }
+    } else {
+        for (int w = 0; w < num_workers; w++) {
+            pthread_join(threads[w], NULL);
+        }
+    }
+    uint64_t cpu_after, switches_after;
+    usage_totals(cpu_after, switches_after);
+
+    // Elapsed time runs to the last entity handled.
+    uint64_t end_ns = start_ns;
+    uint64_t items = 0;
+    for (int w = 0; w < num_workers; w++) {
+        result.latency.merge(results[w].latency);
+        items += results[w].items;
+        if (results[w].last_pop_ns > end_ns) {
+            end_ns = results[w].last_pop_ns;
+        }
+    }
+    result.elapsed_us = (end_ns - start_ns) / 1000;
+    if (end_ns > start_ns) {
+        result.throughput = items * 1e9 / (end_ns - start_ns);
+    }
+    if (items > 0) {
+        result.cpu_ns_per_item = (double)(cpu_after - cpu_before) / items;
+        result.switches_per_item = (double)(switches_after - switches_before) / items;
+    }
+
+    munmap(results_address, results_size);
+    shm_ring_destroy(ring, ring_name);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
+    cout << "Hand-off Benchmark\n" << \
+            "--------------------\n";
+    options.ask("mode", "Run the workers as threads, processes, or both? (threads/processes/both): ", mode);
+    options.ask("items", "How many entities should be handed off? (n): ", num_items);
+    options.ask("workers", "How many workers should there be? (n): ", num_workers);
+    options.ask("capacity", "How many slots should the ring have? (n): ", capacity);
+    options.ask("arrival-rate", "How often should new entities appear? (seconds, or e.g. 250ms, exp:50us): ", arrival_rate);
+    options.ask("service-time", "How long should a worker spend on each entity? (seconds, or e.g. 250ms, exp:50us): ", service_time);
+    sim_time_start(options);
+    options.check_unused();
+    if (mode != "threads" && mode != "processes" && mode != "both") {
+        options.fail("unknown --mode " + mode + " (expected threads, processes or both)");
+    }
+    if (num_workers < 1 || capacity < 1 || num_items < 1) {
+        options.fail("--items, --workers and --capacity must be at least 1");
+    }
+
+    vector<RunResult> results;
+    if (mode != "processes") {
+        results.push_back(run(options, false));
+    }
+    if (mode != "threads") {
+        results.push_back(run(options, true));
+    }
+
+    // Format the comparison separately so its stream state does not leak into the report.
+    ostringstream table;
+    table << "\n" << left << setw(12) << "Mode" << right << setw(14) << "entities/s" << setw(12) << "p50 ns" <<
+            setw(12) << "p99 ns" << setw(12) << "max ns" << setw(14) << "CPU ns/item" << setw(16) <<
+            "switches/item" << "\n";
+    for (const RunResult& r : results) {
+        table << left << setw(12) << r.mode << right << fixed << setprecision(0) << setw(14) << r.throughput <<
+                setw(12) << r.latency.percentile(50) << setw(12) << r.latency.percentile(99) <<
+                setw(12) << (r.latency.total ? r.latency.max : 0) << setw(14) << r.cpu_ns_per_item <<
+                setprecision(3) << setw(16) << r.switches_per_item << "\n";
+    }
+    if (results.size() == 2 && results[0].throughput > 0) {
+        const RunResult& threads = results[0];
+        const RunResult& processes = results[1];
+        table << "Process boundary: throughput x" << setprecision(2) << processes.throughput / threads.throughput <<
+                ", p50 " << showpos << (long long)processes.latency.percentile(50) - (long long)threads.latency.percentile(50) <<
+                " ns, CPU " << setprecision(0) << processes.cpu_ns_per_item - threads.cpu_ns_per_item <<
+                " ns/item" << noshowpos << "\n";
+    }
+    cout << table.str() << flush;
+
+    // Print machine-readable results if requested.
+    report.add("items", num_items);
+    report.add("workers", num_workers);
+    report.add("capacity", capacity);
+    report.add("arrival_rate", arrival_rate.to_string());
+    report.add("service_time", service_time.to_string());
+    for (const RunResult& r : results) {
+        report.add(r.mode + "_elapsed_us", r.elapsed_us);
+        report.add(r.mode + "_throughput", r.throughput);
+        report.add(r.mode + "_cpu_ns_per_item", r.cpu_ns_per_item);
+        report.add(r.mode + "_switches_per_item", r.switches_per_item);
+        r.latency.add_to_report(report, r.mode + "_handoff");
+    }
+    report.print(options.report_format());
+    return 0;
+}
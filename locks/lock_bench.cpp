@@ -0,0 +1,196 @@
+// Benchmark of the SampleLock implementations (common/locks.h).
+//
+// Every thread repeatedly takes one shared lock, pushes or pops a shared
+// std::queue the way the samples' producers and workers do, releases it, and
+// then spends --think nanoseconds outside the lock. Each --lock kind is run in
+// turn and compared on throughput, acquire latency and CPU time per
+// acquisition.
+//
+// Example:
+//   lock_bench --threads=4 --iterations=1000000 --think=200ns --locks=pthread,adaptive,ticket,mcs
+//
+// To compare the locks inside the samples themselves, sweep --lock, e.g.
+//   sweep --program=vermont_bridge/vermont_bridge --param lock=pthread,adaptive,ticket,mcs
+//         --arg=--farmers=10000 --arg=--arrival-rate=0 --arg=--time-to-cross=0
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <cstdint>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/clock.h"
+#include "../common/histogram.h"
+#include "../common/sim_time.h"
+#include "../common/locks.h"
+
+using namespace std;
+
+// Parameters
+int num_threads = 4;
+int num_iterations = 200000;
+uint64_t think_ns = 0;
+
+// The shared state every thread works on.
+SampleLock lock;
+queue<int> shared_queue;
+
+// Per-thread acquire latencies.
+struct BenchThread {
+    pthread_t thread;
+    int index = 0;
+    LatencyHistogram acquire;
+};
+
+// One lock kind's results.
+struct BenchResult {
+    lock_kind kind;
+    LatencyHistogram acquire;
+    double ops_per_second = 0;
+    double cpu_ns_per_op = 0;
+    uint64_t spun = 0, parked = 0, yielded = 0;
+};
+
+// spin_for()
+// Busy work outside the lock.
+void spin_for(uint64_t ns) {
+    if (ns == 0) {
+        return;
+    }
+    uint64_t until = monotonic_ns() + ns;
+    while (monotonic_ns() < until) {
+        lock_cpu_relax();
+    }
+}
+
+// bench_thread()
+// Alternates pushes and pops, like a producer and a worker sharing a queue.
+void* bench_thread(void* arg) {
+    BenchThread* self = (BenchThread*)arg;
+    for (int i = 0; i < num_iterations; i++) {
+        uint64_t request_ns = monotonic_ns();
+        lock.lock();
+        self->acquire.record(monotonic_ns() - request_ns);
+        if ((i + self->index) % 2 == 0 || shared_queue.empty()) {
+            shared_queue.push(i);
+        } else {
+            shared_queue.pop();
+        }
+        lock.unlock();
+        spin_for(think_ns);
+    }
+    return NULL;
+}
+
+// cpu_time_ns()
+// CPU time used by the whole process so far.
+uint64_t cpu_time_ns() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+// run()
+// Runs every thread against one lock kind.
+BenchResult run(lock_kind kind) {
+    BenchResult result;
+    result.kind = kind;
+    lock_selected = kind;
+    lock_spun = 0;
+    lock_parked = 0;
+    lock_yielded = 0;
+    shared_queue = queue<int>();
+
+    vector<BenchThread> threads(num_threads);
+    uint64_t cpu_before = cpu_time_ns();
+    uint64_t start_ns = monotonic_ns();
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].index = t;
+        pthread_create(&threads[t].thread, NULL, bench_thread, &threads[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        result.acquire.merge(threads[t].acquire);
+    }
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    uint64_t ops = (uint64_t)num_threads * num_iterations;
+    result.ops_per_second = ops * 1e9 / elapsed_ns;
+    result.cpu_ns_per_op = (double)(cpu_time_ns() - cpu_before) / ops;
+    result.spun = lock_spun;
+    result.parked = lock_parked;
+    result.yielded = lock_yielded;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+    num_threads = options.value("threads", num_threads);
+    num_iterations = options.value("iterations", num_iterations);
+    string think = options.get("think", "0");
+    string kinds = options.get("locks", "pthread,adaptive,ticket,mcs");
+    options.check_unused();
+    if (!parse_duration(think, think_ns)) {
+        options.fail("--think must be a duration such as 200ns");
+    }
+    if (num_threads < 1 || num_iterations < 1) {
+        options.fail("--threads and --iterations must be at least 1");
+    }
+    lock.init();
+    if (allowed_cpus().size() == 1) {
+        lock_max_spins = 0;
+    }
+
+    // Run each requested kind.
+    vector<BenchResult> results;
+    stringstream list(kinds);
+    string name;
+    while (getline(list, name, ',')) {
+        lock_kind kind;
+        if (!lock_parse(name, kind)) {
+            options.fail("unknown lock " + name + " (expected pthread, adaptive, ticket or mcs)");
+        }
+        results.push_back(run(kind));
+    }
+
+    ostringstream table;
+    table << "Lock benchmark: " << num_threads << " threads x " << num_iterations << " acquisitions, think " <<
+             format_duration(think_ns) << "\n\n";
+    table << left << setw(10) << "Lock" << right << setw(14) << "ops/s" << setw(10) << "p50 ns" << setw(10) <<
+             "p99 ns" << setw(12) << "max ns" << setw(12) << "CPU ns/op" << setw(10) << "spun" << setw(10) <<
+             "parked" << setw(10) << "yielded" << "\n";
+    for (const BenchResult& r : results) {
+        table << left << setw(10) << lock_kind_name(r.kind) << right << fixed << setprecision(0) <<
+                 setw(14) << r.ops_per_second << setw(10) << r.acquire.percentile(50) << setw(10) <<
+                 r.acquire.percentile(99) << setw(12) << r.acquire.max << setw(12) << r.cpu_ns_per_op <<
+                 setw(10) << r.spun << setw(10) << r.parked << setw(10) << r.yielded << "\n";
+    }
+    cout << table.str() << flush;
+
+    // Print machine-readable results if requested.
+    report.add("threads", num_threads);
+    report.add("iterations", num_iterations);
+    report.add("think", format_duration(think_ns));
+    for (const BenchResult& r : results) {
+        string prefix = lock_kind_name(r.kind);
+        report.add(prefix + "_ops_per_second", r.ops_per_second);
+        report.add(prefix + "_cpu_ns_per_op", r.cpu_ns_per_op);
+        report.add(prefix + "_parked", (long long)r.parked);
+        report.add(prefix + "_yielded", (long long)r.yielded);
+        r.acquire.add_to_report(report, prefix + "_acquire");
+    }
+    report.print(options.report_format());
+    lock.destroy();
+    return 0;
+}
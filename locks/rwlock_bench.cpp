@@ -0,0 +1,241 @@
+// Benchmark of the SampleRwLock implementations (common/rwlock.h).
+//
+// Every thread repeatedly takes a read lock, sums a small shared table and
+// releases it, then spends --think nanoseconds outside the lock. With
+// --write-every=N one acquisition in N per thread is a write that updates the
+// table instead. Each --rwlocks kind is run at each --threads count, and the
+// table shows how read throughput scales as readers are added: the pthread
+// lock's shared reader count limits it, BRAVO's per-thread slots should not.
+//
+// Example:
+//   rwlock_bench --threads=1,2,4,8,16,32,64,128 --iterations=100000
+//   rwlock_bench --threads=16 --write-every=1000 --rwlocks=pthread,bravo
+//
+// Threads beyond the number of CPUs are time-sliced and add no throughput, so
+// pin the run to a large enough machine for the high counts to mean anything.
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <pthread.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/clock.h"
+#include "../common/sim_time.h"
+#include "../common/topology.h"
+#include "../common/rwlock.h"
+
+using namespace std;
+
+const int TABLE_SIZE = 8;
+const int MAX_THREADS = 1024;
+
+// Parameters
+int num_iterations = 100000;
+int write_every = 0;
+uint64_t think_ns = 0;
+
+// The shared state every thread works on.
+unique_ptr<SampleRwLock> rwlock;
+uint64_t shared_table[TABLE_SIZE];
+pthread_barrier_t start_barrier;
+
+struct alignas(64) BenchThread {
+    pthread_t thread;
+    int index = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t checksum = 0;
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+};
+
+// One run's results.
+struct BenchResult {
+    rwlock_kind kind;
+    int threads;
+    double reads_per_second = 0;
+    uint64_t writes = 0;
+    uint64_t fast_reads = 0;
+    uint64_t revocations = 0;
+};
+
+// spin_for()
+// Busy work outside the lock.
+void spin_for(uint64_t ns) {
+    if (ns == 0) {
+        return;
+    }
+    uint64_t until = monotonic_ns() + ns;
+    while (monotonic_ns() < until) {
+        lock_cpu_relax();
+    }
+}
+
+// bench_thread()
+// Reads the table under the lock, writing it every write_every acquisitions.
+void* bench_thread(void* arg) {
+    BenchThread* self = (BenchThread*)arg;
+    pthread_barrier_wait(&start_barrier);
+    self->start_ns = monotonic_ns();
+    for (int i = 1; i <= num_iterations; i++) {
+        if (write_every > 0 && (i + self->index) % write_every == 0) {
+            rwlock->write_lock();
+            for (int t = 0; t < TABLE_SIZE; t++) {
+                shared_table[t]++;
+            }
+            rwlock->write_unlock();
+            self->writes++;
+        } else {
+            rwlock->read_lock();
+            uint64_t sum = 0;
+            for (int t = 0; t < TABLE_SIZE; t++) {
+                sum += shared_table[t];
+            }
+            rwlock->read_unlock();
+            self->checksum += sum;
+            self->reads++;
+        }
+        spin_for(think_ns);
+    }
+    self->end_ns = monotonic_ns();
+    return NULL;
+}
+
+// run()
+// Runs num_threads threads against a fresh lock of one kind. The run is timed
+// from the first thread's start to the last one's end, since with few CPUs
+// some threads may finish before others, or main(), get to run.
+BenchResult run(rwlock_kind kind, int num_threads) {
+    BenchResult result;
+    result.kind = kind;
+    result.threads = num_threads;
+    rwlock_selected = kind;
+    rwlock_slow_reads = 0;
+    rwlock_revocations = 0;
+    rwlock_revoke_ns = 0;
+    rwlock.reset(new SampleRwLock());
+    rwlock->init();
+
+    vector<BenchThread> threads(num_threads);
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].index = t;
+        pthread_create(&threads[t].thread, NULL, bench_thread, &threads[t]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t reads = 0;
+    uint64_t start_ns = UINT64_MAX, end_ns = 0;
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        reads += threads[t].reads;
+        result.writes += threads[t].writes;
+        start_ns = min(start_ns, threads[t].start_ns);
+        end_ns = max(end_ns, threads[t].end_ns);
+    }
+    uint64_t elapsed_ns = max<uint64_t>(end_ns - start_ns, 1);
+    pthread_barrier_destroy(&start_barrier);
+    result.reads_per_second = reads * 1e9 / elapsed_ns;
+    result.fast_reads = rwlock->fast_reads();
+    result.revocations = rwlock_revocations;
+    rwlock->destroy();
+    return result;
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+    string thread_counts = options.get("threads", "1,2,4,8,16,32,64,128");
+    num_iterations = options.value("iterations", num_iterations);
+    write_every = options.value("write-every", write_every);
+    string think = options.get("think", "0");
+    string kinds = options.get("rwlocks", "semaphore,pthread,bravo");
+    options.check_unused();
+    if (!parse_duration(think, think_ns)) {
+        options.fail("--think must be a duration such as 200ns");
+    }
+    if (num_iterations < 1 || write_every < 0) {
+        options.fail("--iterations must be at least 1 and --write-every at least 0");
+    }
+    if (allowed_cpus().size() == 1) {
+        lock_max_spins = 0;
+    }
+
+    vector<int> counts;
+    stringstream count_list(thread_counts);
+    string count;
+    while (getline(count_list, count, ',')) {
+        int n = atoi(count.c_str());
+        if (n < 1 || n > MAX_THREADS) {
+            options.fail("--threads takes counts between 1 and " + to_string(MAX_THREADS));
+        }
+        counts.push_back(n);
+    }
+    vector<rwlock_kind> selected;
+    stringstream kind_list(kinds);
+    string name;
+    while (getline(kind_list, name, ',')) {
+        rwlock_kind kind;
+        if (!rwlock_parse(name, kind)) {
+            options.fail("unknown rwlock " + name + " (expected semaphore, pthread or bravo)");
+        }
+        selected.push_back(kind);
+    }
+
+    // Run every kind at every thread count.
+    vector<BenchResult> results;
+    for (int n : counts) {
+        for (rwlock_kind kind : selected) {
+            results.push_back(run(kind, n));
+        }
+    }
+
+    ostringstream table;
+    table << "Reader-writer lock benchmark: " << num_iterations << " acquisitions per thread, " <<
+             (write_every ? "1 write in " + to_string(write_every) : string("no writes")) << ", think " <<
+             format_duration(think_ns) << ", " << allowed_cpus().size() << " CPUs\n\n";
+    table << "Reads per second\n" << setw(8) << "Threads";
+    for (rwlock_kind kind : selected) {
+        table << setw(16) << rwlock_kind_name(kind);
+    }
+    table << "\n";
+    for (size_t i = 0; i < results.size(); i += selected.size()) {
+        table << setw(8) << results[i].threads << fixed << setprecision(0);
+        for (size_t k = 0; k < selected.size(); k++) {
+            table << setw(16) << results[i + k].reads_per_second;
+        }
+        table << "\n";
+    }
+    for (const BenchResult& r : results) {
+        if (r.kind == RWLOCK_BRAVO && r.writes > 0) {
+            table << "bravo, " << r.threads << " threads: " << r.fast_reads << " biased reads, " << r.revocations <<
+                     " revocations for " << r.writes << " writes\n";
+        }
+    }
+    cout << table.str() << flush;
+
+    // Print machine-readable results if requested.
+    report.add("iterations", num_iterations);
+    report.add("write_every", write_every);
+    report.add("think", format_duration(think_ns));
+    for (const BenchResult& r : results) {
+        string prefix = string(rwlock_kind_name(r.kind)) + "_" + to_string(r.threads);
+        report.add(prefix + "_reads_per_second", r.reads_per_second);
+        if (r.kind == RWLOCK_BRAVO) {
+            report.add(prefix + "_fast_reads", (long long)r.fast_reads);
+            report.add(prefix + "_revocations", (long long)r.revocations);
+        }
+    }
+    report.print(options.report_format());
+    return 0;
+}
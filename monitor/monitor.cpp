@@ -0,0 +1,183 @@
+// Live monitor for the simulations' shared-memory statistics.
+//
+// Attaches to the segment a simulation publishes with --live-stats (see
+// common/live_stats.h) and prints its counters as rates, its gauges and the
+// latest latency percentiles every interval, until the run finishes or
+// the process exits.
+//
+// Example:
+//   barbershop/barbershop --non-interactive --customers=1000000 --live-stats &
+//   monitor --interval=500ms
+//
+// Without --segment the monitor picks the most recent /posix_samples.* segment.
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../common/options.h"
+#include "../common/clock.h"
+#include "../common/sim_time.h"
+#include "../common/live_stats.h"
+
+using namespace std;
+
+// How long to wait for a just-created segment to be sized before giving up.
+const uint64_t SEGMENT_SIZE_TIMEOUT_NS = 5000000000ULL;
+
+// find_segment()
+// Returns the name of the most recently modified /posix_samples.* segment, or ""
+// if there is none.
+string find_segment() {
+    string newest;
+    struct timespec newest_time = {0, 0};
+    DIR* dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        return "";
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        struct stat info;
+        if (name.rfind("posix_samples.", 0) != 0 || stat(("/dev/shm/" + name).c_str(), &info) != 0) {
+            continue;
+        }
+        if (newest.empty() || info.st_mtim.tv_sec > newest_time.tv_sec ||
+            (info.st_mtim.tv_sec == newest_time.tv_sec && info.st_mtim.tv_nsec > newest_time.tv_nsec)) {
+            newest = "/" + name;
+            newest_time = info.st_mtim;
+        }
+    }
+    closedir(dir);
+    return newest;
+}
+
+// Latency snapshot copied out of the segment.
+struct LatencySnapshot {
+    uint64_t count, p50_ns, p90_ns, p99_ns, max_ns;
+};
+
+// read_latency()
+// Reads the latency snapshot under the sequence lock, retrying while the writer
+// is in the middle of an update.
+LatencySnapshot read_latency(const LiveLatency& latency) {
+    LatencySnapshot snapshot;
+    while (true) {
+        uint32_t before = latency.sequence.load(memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        snapshot.count = latency.count.load(memory_order_relaxed);
+        snapshot.p50_ns = latency.p50_ns.load(memory_order_relaxed);
+        snapshot.p90_ns = latency.p90_ns.load(memory_order_relaxed);
+        snapshot.p99_ns = latency.p99_ns.load(memory_order_relaxed);
+        snapshot.max_ns = latency.max_ns.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (latency.sequence.load(memory_order_relaxed) == before) {
+            return snapshot;
+        }
+    }
+}
+
+// print_sample()
+// Prints one line per metric: counters with their rate over the last interval.
+void print_sample(const LiveStatsSegment* segment, vector<uint64_t>& previous, uint64_t interval_ns) {
+    uint32_t num_metrics = segment->num_metrics.load(memory_order_acquire);
+    previous.resize(num_metrics, 0);
+    uint64_t elapsed = monotonic_ns() - segment->started_ns;
+    cout << "[" << format_seconds(elapsed) << "s] " << segment->program << " (pid " << segment->pid << ")\n";
+    for (uint32_t i = 0; i < num_metrics; i++) {
+        const LiveMetric& metric = segment->metrics[i];
+        uint64_t value = metric.value.load(memory_order_relaxed);
+        cout << "  " << left << setw(20) << metric.name << right << setw(12) << value;
+        if (metric.kind == LIVE_COUNTER) {
+            double rate = (value - previous[i]) * 1e9 / interval_ns;
+            cout << setw(14) << fixed << setprecision(1) << rate << " /s";
+        }
+        cout << "\n";
+        previous[i] = value;
+    }
+    LatencySnapshot latency = read_latency(segment->latency);
+    if (latency.count > 0) {
+        cout << "  arrival-to-pop       p50 " << latency.p50_ns << " ns, p90 " << latency.p90_ns << " ns, p99 " <<
+                latency.p99_ns << " ns, max " << latency.max_ns << " ns (" << latency.count << " samples)\n";
+    }
+    cout << flush;
+}
+
+int main(int argc, char** argv) {
+    Options options(argc, argv);
+    string name = options.get("segment", "");
+    uint64_t interval_ns = 0;
+    if (!parse_duration(options.get("interval", "1s"), interval_ns) || interval_ns == 0) {
+        options.fail("--interval must be a positive duration such as 1s or 250ms");
+    }
+    options.check_unused();
+    if (name.empty()) {
+        name = find_segment();
+        if (name.empty()) {
+            options.fail("no /posix_samples.* segment found; start a simulation with --live-stats or pass --segment");
+        }
+    }
+
+    // Map the segment read-only; the simulation is its only writer.
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        options.fail("cannot open shared-memory segment " + name + ": " + strerror(errno));
+    }
+    // live_stats_start() creates the segment empty and then sizes it; mapping it
+    // in between would fault on the first read.
+    uint64_t give_up = monotonic_ns() + SEGMENT_SIZE_TIMEOUT_NS;
+    struct stat info;
+    while (fstat(fd, &info) == 0 && info.st_size < (off_t)sizeof(LiveStatsSegment)) {
+        if (monotonic_ns() > give_up) {
+            options.fail(name + " is " + to_string(info.st_size) + " bytes, too small for a live-stats segment");
+        }
+        sleep_for_ns(1000000);
+    }
+    void* address = mmap(NULL, sizeof(LiveStatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        options.fail("cannot map shared-memory segment " + name + ": " + strerror(errno));
+    }
+    const LiveStatsSegment* segment = (const LiveStatsSegment*)address;
+    while (segment->magic.load(memory_order_acquire) != LIVE_STATS_MAGIC) {
+        sleep_for_ns(1000000);
+    }
+    if (segment->version != LIVE_STATS_VERSION) {
+        options.fail(name + " has layout version " + to_string(segment->version) +
+                     ", expected " + to_string(LIVE_STATS_VERSION));
+    }
+
+    // Poll until the run is marked finished or its process has gone away.
+    vector<uint64_t> previous;
+    uint64_t last = monotonic_ns();
+    uint64_t next = last + interval_ns;
+    while (true) {
+        sleep_until_ns(next);
+        bool finished = segment->finished.load(memory_order_acquire) != 0;
+        bool gone = !finished && kill(segment->pid, 0) != 0 && errno == ESRCH;
+        uint64_t now = monotonic_ns();
+        print_sample(segment, previous, now - last);
+        if (finished || gone) {
+            cout << (finished ? "Run finished.\n" : "Process exited without finishing.\n");
+            if (gone) {
+                shm_unlink(name.c_str());
+            }
+            break;
+        }
+        last = now;
+        next += interval_ns;
+    }
+    munmap(address, sizeof(LiveStatsSegment));
+    return 0;
+}
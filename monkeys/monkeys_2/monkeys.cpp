@@ -6,12 +6,26 @@
 
 // Library imports.
 #include <iostream>
-#include <chrono>
-#include <queue>
 #include <algorithm>
+#include <atomic>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include "../../common/options.h"
+#include "../../common/report.h"
+#include "../../common/event_log.h"
+#include "../../common/sync.h"
+#include "../../common/sim_time.h"
+#include "../../common/replay.h"
+#include "../../common/latch.h"
+#include "../../common/placement.h"
+#include "../../common/live_stats.h"
+#include "../../common/wakeup.h"
+#include "../../common/watchdog.h"
+#include "../../common/lockfree_queue.h"
+#include "../../common/waiting_area.h"
+#include "../../common/alloc_count.h"
+#include "../../common/perf.h"
 
 // Namespace declaration.
 using namespace std;
@@ -19,6 +33,9 @@ using namespace std;
 // Enum declarations.
 enum direction_type {EASTWARD, WESTWARD, NONE};
 enum species_type {MONKEY, HUMAN};
+// Interned labels, indexed by direction_type and species_type.
+const char* const DIRECTION_LABELS[] = {"eastward", "westward", "none"};
+const char* const SPECIES_LABELS[] = {"Monkey", "Human"};
 
 // Primate class, handles data for both monkeys and humans
 class Primate {
@@ -34,47 +51,40 @@ class Primate {
             this->species = species;
         }
 
+        int getId() {
+            return this->id;
+        }
+
         direction_type getDirection() {
             return this->direction;
         }
 
-        string getDirectionString() {
-            switch(this->direction) {
-                case EASTWARD:
-                    return "eastward";
-                    break;
-                case WESTWARD:
-                    return "westward";
-                    break;
-                case NONE:
-                    return "none";
-                    break;
-            }
-            return "";
+        const char* getDirectionString() {
+            return DIRECTION_LABELS[this->direction];
         }
 
         species_type getSpecies() {
             return this->species;
         }
 
-        string getSpeciesString() {
-            switch(this->species) {
-                case MONKEY:
-                    return "Monkey";
-                    break;
-                case HUMAN:
-                    return "Human";
-                    break;
-            }
-            return "";
+        const char* getSpeciesString() {
+            return SPECIES_LABELS[this->species];
         }
 
-        string getPrimateIdentifier() {
-            return getSpeciesString() + " #" + std::to_string(this->id);
+        // appendPrimateIdentifier()
+        // Appends "Species #id" to out without building a string.
+        void appendPrimateIdentifier(string& out) {
+            out += getSpeciesString();
+            out += " #";
+            log_append(out, this->id);
         }
 
-        string to_string() {
-            return getPrimateIdentifier() + ", " + getDirectionString();
+        // appendTo()
+        // Appends "Species #id, direction" to out.
+        void appendTo(string& out) {
+            appendPrimateIdentifier(out);
+            out += ", ";
+            out += getDirectionString();
         }
 };
 
@@ -84,15 +94,33 @@ const int MAX_CROSSING = 5;
 const int MAX_CROSSING_EASTWARD = 3;
 const int MAX_CROSSING_WESTWARD = 2;
 // Worker information
-bool worker_active = false;
-long int time_to_cross = 0;
-long int arrival_rate = 0;
-string simulation_mode = "";
-int num_primates = 0;
+atomic<bool> worker_active(false);
+// Counted down once per primate that has crossed.
+CompletionLatch completion;
+// Wakes the crossing guard when a primate arrives to an empty queue.
+Wakeup crossing_guard_wakeup;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_eastward;
+LiveMetric* live_westward;
+LiveMetric* live_queue_depth;
+// Progress counters sampled by --watchdog.
+WatchdogWorker* guard_watch;
+Interval time_to_cross = Interval::seconds(1);
+Interval arrival_rate = Interval::seconds(1);
+string simulation_mode = "monkey";
+int num_primates = 10;
 // Mutex locks, semaphores, shared queues, etc.
-sem_t queue_semaphore;
+SampleLock queue_semaphore;
 sem_t crossing_semaphore;
-queue<Primate> primate_queue;
+// Waiting primates in arrival order, stored as columns with direction and
+// species bitsets (see common/waiting_area.h).
+WaitingArea primate_queue;
+// Used instead of primate_queue with --queue=lockfree.
+LockFreeQueue<Primate> lockfree_primate_queue;
+// Popping the next primate and joining it to the crossing group, for --perf.
+PerfRegion group_formation("group_formation");
 // Shared struct of currently crossing primates.
 struct  {
     public: 
@@ -104,16 +132,75 @@ struct  {
         void decrement(Primate p) { (p.getDirection() == EASTWARD) ? total_east-- : total_west--; }
 } currently_crossing;
 
+// Events logged by the primates and the crossing guard. Except for
+// CROSSING_FULL, the argument is the primate's packed direction and species.
+enum ravine_event {
+    PRIMATE_ARRIVED,
+    PRIMATE_WAITING,
+    CROSSING_FULL,      // arg: number of primates on the rope
+    PRIMATE_CROSSING,
+    PRIMATE_CROSSED
+};
+
+// pack_primate()
+// Packs a primate's direction and species into one log argument.
+int64_t pack_primate(Primate& p) {
+    return p.getDirection() | (p.getSpecies() << 4);
+}
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    Primate p = Primate(e.entity, (direction_type)(e.arg & 0xf), (species_type)(e.arg >> 4));
+    switch (e.event) {
+        case PRIMATE_ARRIVED:
+            p.appendTo(out);
+            out += " has arrived.\n";
+            break;
+        case PRIMATE_WAITING:
+            p.appendTo(out);
+            out += " needs to wait\n";
+            break;
+        case CROSSING_FULL:
+            log_append(out, e.arg);
+            break;
+        case PRIMATE_CROSSING:
+            p.appendTo(out);
+            out += " is currently crossing.\n";
+            break;
+        case PRIMATE_CROSSED:
+            p.appendTo(out);
+            out += " has finished crossing.\n";
+            break;
+    }
+}
+
+// frontPrimate()
+// The primate at the front of the queue, rebuilt from its columns. Call with
+// the queue semaphore held, and only with primates waiting.
+Primate frontPrimate() {
+    if (queue_lockfree) {
+        return *lockfree_primate_queue.front();
+    }
+    size_t i = primate_queue.front();
+    return Primate(primate_queue.id(i), primate_queue.eastward(i) ? EASTWARD : WESTWARD,
+                   primate_queue.is_human(i) ? HUMAN : MONKEY);
+}
+
 auto waitUntilSafe() {
     // If there are less than MAX_CROSSING currently crossing,
     // and if the primate is going the same direction as the 
     // currently crossing primates, then they are able to go.
-    // Lock the queue semaphore.
-    sem_wait(&queue_semaphore);
+    // Lock the queue semaphore, unless the queue is lock-free.
+    if (!queue_lockfree) {
+        sync_mutex_lock(&queue_semaphore);
+    }
     // Init. a temp. primate.
-    Primate temp_primate = primate_queue.front();
+    Primate temp_primate = frontPrimate();
     // Post the queue semaphore.
-    sem_post(&queue_semaphore);
+    if (!queue_lockfree) {
+        sync_mutex_unlock(&queue_semaphore);
+    }
 
     // Base case: if there are no primate crossing, it's safe to cross.
     // If we're a monkey, then we have to check if the currently crossing total is under MAX_CROSSING.
@@ -123,39 +210,45 @@ auto waitUntilSafe() {
     // However, we do not have to check if we're going the same direction as the other humans, 
     // we only have to check if there are less than MAX_CROSSING_EASTWARD and MAX_CROSSING_WESTWARD depending on direction.
     if (!(currently_crossing.total() == 0)) {
+        watchdog_doing(guard_watch, "waiting until it is safe to cross");
         switch(temp_primate.getSpecies()) {
             case MONKEY:
                 while (currently_crossing.total() == MAX_CROSSING) {
-                    cout << currently_crossing.total();
+                    log_event(CROSSING_FULL, 0, currently_crossing.total());
                     // If the current amount of monkeys is equal to the max, we need to wait
                     // for the crossing semaphore until there is room.
-                    sem_wait(&crossing_semaphore);
+                    watchdog_pass(guard_watch);
+                    sync_sem_wait(&crossing_semaphore);
                 }
                 while (currently_crossing.direction != temp_primate.getDirection()) {
-                    cout << temp_primate.to_string() << " needs to wait\n";
+                    log_event(PRIMATE_WAITING, temp_primate.getId(), pack_primate(temp_primate));
                     // If the current monkey does not fit in with the current direction,
                     // wait until all monkeys have crossed in the current direction before continuing.
-                    sem_wait(&crossing_semaphore);
+                    watchdog_pass(guard_watch);
+                    sync_sem_wait(&crossing_semaphore);
                 }
                 // We should be good to cross now. We'll add to the currently crossing in crossRavine().
                 break;
             case HUMAN:
                 while (currently_crossing.total() == MAX_CROSSING) {
                     // Wait for the semaphore if the max amount of current humans has been reached.
-                    sem_wait(&crossing_semaphore);
+                    watchdog_pass(guard_watch);
+                    sync_sem_wait(&crossing_semaphore);
                 }
                 // Switch based on direction of the human.
                 switch(temp_primate.getDirection()) {
                     case EASTWARD:
                         while (currently_crossing.total_east == MAX_CROSSING_EASTWARD) {
                             // Wait for the semaphore if the max amount of eastward crossing humans has been reached.
-                            sem_wait(&crossing_semaphore);
+                            watchdog_pass(guard_watch);
+                            sync_sem_wait(&crossing_semaphore);
                         }
                         break;
                     case WESTWARD:
                         while (currently_crossing.total_west == MAX_CROSSING_WESTWARD) {
                             // Wait for the semaphore if the max amount of eastward crossing humans has been reached.
-                            sem_wait(&crossing_semaphore);
+                            watchdog_pass(guard_watch);
+                            sync_sem_wait(&crossing_semaphore);
                         }
                         break;
                     case NONE:
@@ -167,13 +260,33 @@ auto waitUntilSafe() {
     }
 }
 
+// popPrimate()
+// Pops the primate at the front of the queue.
+Primate popPrimate() {
+    // The crossing guard is the only consumer, so the primate it looked at in
+    // waitUntilSafe() is still the one at the front.
+    if (queue_lockfree) {
+        Primate p = *lockfree_primate_queue.pop();
+        handoff.dequeued(p.getId());
+        trace_queue("primate_queue", "pop primate_queue", lockfree_primate_queue.size());
+        live_queue_depth->set(lockfree_primate_queue.size());
+        return p;
+    }
+    sync_mutex_lock(&queue_semaphore);
+    Primate p = frontPrimate();
+    primate_queue.pop_front();
+    handoff.dequeued(p.getId());
+    trace_queue("primate_queue", "pop primate_queue", primate_queue.size());
+    live_queue_depth->set(primate_queue.size());
+    sync_mutex_unlock(&queue_semaphore);
+    return p;
+}
+
 auto crossRavine() {
     // We know the primate next in line is cleared to cross the ravine.
     // Pop the first primate off of the queue.
-    sem_wait(&queue_semaphore);
-    Primate p = primate_queue.front();
-    primate_queue.pop();
-    sem_post(&queue_semaphore);
+    perf_begin(group_formation);
+    Primate p = popPrimate();
     // Update the currently crossing structure.
     // Update direction.
     if (currently_crossing.direction == NONE) {
@@ -181,11 +294,18 @@ auto crossRavine() {
     }
     // Update count.
     currently_crossing.increment(p);
+    perf_end(group_formation);
 
     // Output crossing string and wait the crossing amount of time.
-    cout << p.to_string() << " is currently crossing.\n";
-    sleep(time_to_cross);
-    cout << p.to_string() << " has finished crossing.\n";
+    log_event(PRIMATE_CROSSING, p.getId(), pack_primate(p));
+    watchdog_doing(guard_watch, "crossing");
+    trace_begin("crossing", p.getId());
+    sleep_for_ns(arrival_service(p.getId() - 1, time_to_cross));
+    trace_end("crossing", p.getId());
+    log_event(PRIMATE_CROSSED, p.getId(), pack_primate(p));
+    (p.getDirection() == EASTWARD ? live_eastward : live_westward)->add();
+    completion.count_down();
+    watchdog_progress(guard_watch);
 
     // The primate we just dequeued has finished crossing the ravine.
     // Update the currently crossing structure.
@@ -199,90 +319,179 @@ auto crossRavine() {
 
 auto doneWithCrossing() {
     // We can signal that the next primate can cross.
-    sem_post(&crossing_semaphore);
+    sync_sem_post(&crossing_semaphore);
 }
 
 void* crossing_guard (void* arg) {
+    trace_thread_name("crossing_guard");
+    perf_thread_start("crossing_guard");
     while (worker_active) {
-        if (!primate_queue.empty()) {
+        watchdog_pass(guard_watch);
+        // Check for waiting primates under the queue semaphore.
+        bool primates_waiting;
+        if (queue_lockfree) {
+            primates_waiting = !lockfree_primate_queue.empty();
+        } else {
+            sync_mutex_lock(&queue_semaphore);
+            primates_waiting = !primate_queue.empty();
+            sync_mutex_unlock(&queue_semaphore);
+        }
+        if (primates_waiting) {
             // Wait until it is safe for the next primate to cross.
             waitUntilSafe();
             // Cross the ravine when it is safe to cross.
             crossRavine();
             // Signal that primate is done with crossing.
             doneWithCrossing();
+        } else {
+            // Sleep until a primate arrives or the simulation ends.
+            watchdog_doing(guard_watch, "idle");
+            crossing_guard_wakeup.wait();
         }
     }
     return NULL;
 }
 
 
-int main() {
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
     // Intalize semaphores.
-    sem_init(&crossing_semaphore, 0, 1);
-    sem_init(&queue_semaphore, 0, 1);
+    sync_sem_init(&crossing_semaphore, "crossing_semaphore", 1);
+    sync_mutex_init(&queue_semaphore, "queue_semaphore");
 
     // Ask user some questions about the simulation
     cout << "Primate Crossing Simulation\n" << \
             "--------------------\n";
-    cout << "Would you like to run the simulation in monkey or human mode? (monkey/human): ";
-    cin >> simulation_mode;
-    cout << "How many primates would you like to simulate? (n): ";
-    cin >> num_primates;
-       cout << "How often do primates appear at the ravine? (seconds): ";
-    cin >> arrival_rate;
-    cout << "How long does it take to cross the ravine? (seconds): ";
-    cin >> time_to_cross;
+    options.ask("mode", "Would you like to run the simulation in monkey or human mode? (monkey/human): ", simulation_mode);
+    options.ask("primates", "How many primates would you like to simulate? (n): ", num_primates);
+    options.ask("arrival-rate", "How often do primates appear at the ravine? (seconds, or e.g. 250ms, exp:50us): ", arrival_rate);
+    options.ask("time-to-cross", "How long does it take to cross the ravine? (seconds, or e.g. 250ms, exp:50us): ", time_to_cross);
+    sim_time_start(options);
+    arrival_trace_start(options, num_primates);
+    replay_start(options, "monkeys");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    queue_start(options);
+    perf_start(options);
+    live_stats_start(options, "monkeys");
+    live_arrived = live_counter("arrived");
+    live_eastward = live_counter("eastward");
+    live_westward = live_counter("westward");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&crossing_semaphore, sizeof(crossing_semaphore));
+    placement_bind(&queue_semaphore, sizeof(queue_semaphore));
+    placement_bind(&primate_queue, sizeof(primate_queue));
+    placement_bind(&lockfree_primate_queue, sizeof(lockfree_primate_queue));
+    guard_watch = watchdog_worker("crossing_guard");
+    watchdog_start(options, live_queue_depth);
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
-    // Seed random number generator.
-    srand(time(0));
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_primates);
+    handoff.reset(num_primates);
 
     // Start "crossing guard" worker thread.
     worker_active = true;
     pthread_t crossing_guard_thread;
-    pthread_create(&crossing_guard_thread, NULL, crossing_guard, 0);
+    pthread_create(&crossing_guard_thread, placement_worker_attr(), crossing_guard, 0);
 
-    // Start adding primates to the queue.
+    // Start adding primates to the queue. Arrival times come from the schedule (see
+    // --load), and latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(arrival_rate);
     for (int i = 0; i < num_primates; i++) {
-        sem_wait(&queue_semaphore);
-        // Generate a random number from 0 to 1
-        direction_type d = (rand() % 2) ? EASTWARD : WESTWARD;
+        uint64_t arrival_ns = arrivals.wait();
+        if (!queue_lockfree) {
+            sync_mutex_lock(&queue_semaphore);
+        }
+        // Generate a random number from 0 to 1, or take it from the arrival trace.
+        direction_type d = (direction_type)arrival_choice(2);
         species_type s = (simulation_mode == "monkey") ? MONKEY : HUMAN;
         Primate p = Primate(i+1, d, s);
-        primate_queue.push(p);
-        cout << p.Primate::to_string() << " has arrived.\n";
-        sem_post(&queue_semaphore);
-        // Wait for the next primate.
-        sleep(arrival_rate);
+        handoff.enqueued(p.getId(), arrival_ns);
+        bool notify_guard;
+        size_t depth;
+        if (queue_lockfree) {
+            notify_guard = lockfree_primate_queue.push(p);
+            depth = lockfree_primate_queue.size();
+        } else {
+            primate_queue.push(p.getId(), p.getDirection() == EASTWARD, p.getSpecies() == HUMAN);
+            depth = primate_queue.size();
+            notify_guard = depth == 1;
+        }
+        live_arrived->add();
+        trace_queue("primate_queue", "push primate_queue", depth);
+        live_queue_depth->set(depth);
+        log_event(PRIMATE_ARRIVED, p.getId(), pack_primate(p));
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&queue_semaphore);
+        }
+        // Wake the crossing guard if this primate is the only one waiting.
+        if (notify_guard) {
+            crossing_guard_wakeup.notify();
+        }
     }
 
-    // Hold program until the primate vector is empty.
-    while (!primate_queue.empty()) {}
-    // Wait for the final primate to cross.
-    sleep(time_to_cross);
-    // Kill the crossing guard.
+    // Hold program until every primate has crossed.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the crossing guard and wait for it to exit.
     worker_active = false;
+    wakeup_shutdown();
     pthread_join(crossing_guard_thread, NULL);
+    watchdog_stop();
 
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker threads to finish being killed before printing results.
-    sleep(1);
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
         "-------------------\n";
     cout << "All primates have crossed the ravine.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("mode", simulation_mode);
+    report.add("primates", num_primates);
+    report.add("arrival_rate", arrival_rate.to_string());
+    report.add("time_to_cross", time_to_cross.to_string());
+    report.add("elapsed_us", elapsed_us);
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    watchdog_report(report);
+    alloc_report(report, num_primates);
+    lock_report(report);
+    queue_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
 
 
     // Destroy semaphores
-    sem_destroy(&crossing_semaphore);
-    sem_destroy(&queue_semaphore);
+    sync_sem_destroy(&crossing_semaphore);
+    sync_mutex_destroy(&queue_semaphore);
     return 0;
 }
\ No newline at end of file
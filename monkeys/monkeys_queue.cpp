@@ -6,16 +6,32 @@
 
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/watchdog.h"
+#include "../common/waiting_area.h"
+#include "../common/alloc_count.h"
+#include "../common/perf.h"
 
 using namespace std;
 
 enum direction_type {EASTWARD, WESTWARD};
+// Interned direction labels, indexed by direction_type.
+const char* const DIRECTION_LABELS[] = {"eastward", "westward"};
 
 class Monkey {
     public:
@@ -28,45 +44,139 @@ class Monkey {
             this->direction = direction;
         }
 
-        string getMonkeyIdentifier() {
-            return "Monkey #" + std::to_string(this->id);
+        // appendMonkeyIdentifier()
+        // Appends "Monkey #id" to out without building a string.
+        void appendMonkeyIdentifier(string& out) {
+            out += "Monkey #";
+            log_append(out, this->id);
         }
 
-        string getDirection() {            
-            switch (this->direction) {
-                case EASTWARD:
-                    return "eastward";
-                    break;
-                case WESTWARD:
-                    return "westward";
-                    break;
-            } 
-            return "";
+        const char* getDirection() {
+            return DIRECTION_LABELS[this->direction];
         }
 
-        string to_string() {
-            string s = "";
-            s += getMonkeyIdentifier();
-            s += ", ";
-            s += getDirection();
-            return s;
+        // appendTo()
+        // Appends "Monkey #id, direction" to out.
+        void appendTo(string& out) {
+            appendMonkeyIdentifier(out);
+            out += ", ";
+            out += getDirection();
         }
 };
 
 // Global variables 
-bool workers_active = false;
-long int time_to_cross = 0;
-long int arrival_rate = 0;
-int num_monkeys;
+atomic<bool> workers_active(false);
+// Counted down once per monkey that has crossed.
+CompletionLatch completion;
+// Wakes the crossing guard when a monkey arrives to an empty vector.
+Wakeup crossing_guard_wakeup;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_groups;
+LiveMetric* live_eastward;
+LiveMetric* live_westward;
+LiveMetric* live_queue_depth;
+// Progress counters sampled by --watchdog.
+WatchdogWorker* guard_watch;
+Interval time_to_cross = Interval::seconds(1);
+Interval arrival_rate = Interval::seconds(1);
+int num_monkeys = 10;
 const int MAX_MONKEYS = 5;
 // Mutex locks, semaphores, shared queues
-sem_t vector_semaphore;
+SampleLock vector_semaphore;
 sem_t crossing_semaphore;
-vector<Monkey> monkey_vector;
+// Waiting monkeys in arrival order, stored as columns with a direction bitset
+// (see common/waiting_area.h) so forming a group skips 64 monkeys at a time.
+WaitingArea monkey_vector;
+// The group being sent across, reused by every crossRavine() so that forming a
+// group allocates nothing once it has grown.
+vector<Monkey> currently_crossing;
+// Number of groups sent across so far; identifies a group in the event log.
+int num_groups = 0;
+// Forming a group under the vector semaphore, for --perf.
+PerfRegion group_formation("group_formation");
+
+// Events logged by the monkeys and the crossing guard.
+enum ravine_event {
+    MONKEY_ARRIVED,     // arg: direction
+    MONKEY_READY,       // arg: group the monkey joins
+    MONKEY_GROUP_FULL,  // arg: direction
+    GROUP_CROSSING,     // entity: group, arg: direction
+    GROUP_CROSSED       // entity: group
+};
+
+// Members of a group, remembered from their MONKEY_READY events so the group
+// messages can list them. Only one group is on the rope at a time, so a few
+// slots, indexed by group number, are plenty.
+const int GROUP_SLOTS = 4;
+struct GroupMembers {
+    int64_t group = 0;
+    int count = 0;
+    int ids[MAX_MONKEYS];
+};
+
+// append_members()
+// Appends "Monkey #a, Monkey #b, ..." to out.
+void append_members(string& out, const GroupMembers& members) {
+    for (int i = 0; i < members.count; i++) {
+        if (i > 0) {
+            out += ", ";
+        }
+        Monkey(members.ids[i], EASTWARD).appendMonkeyIdentifier(out);
+    }
+}
+
+// format_event()
+// Turns a logged event back into the simulation's message, appending to out
+// without building intermediate strings.
+void format_event(const LogEvent& e, string& out) {
+    static GroupMembers groups[GROUP_SLOTS];
+    Monkey m = Monkey(e.entity, (direction_type)e.arg);
+    switch (e.event) {
+        case MONKEY_ARRIVED:
+            m.appendTo(out);
+            out += " has arrived.\n";
+            break;
+        case MONKEY_READY: {
+            GroupMembers& members = groups[e.arg % GROUP_SLOTS];
+            if (members.group != e.arg) {
+                members.group = e.arg;
+                members.count = 0;
+            }
+            if (members.count < MAX_MONKEYS) {
+                members.ids[members.count++] = e.entity;
+            }
+            m.appendMonkeyIdentifier(out);
+            out += " is getting ready to cross.\n";
+            break;
+        }
+        case MONKEY_GROUP_FULL:
+            m.appendMonkeyIdentifier(out);
+            out += " is waiting to cross ";
+            out += m.getDirection();
+            out += ", but the current group is full.\n";
+            break;
+        case GROUP_CROSSING:
+            out += "A group of monkeys (";
+            append_members(out, groups[e.entity % GROUP_SLOTS]);
+            out += ") is crossing the ravine going ";
+            out += m.getDirection();
+            out += ".\n";
+            break;
+        case GROUP_CROSSED:
+            out += "The group of monkeys (";
+            append_members(out, groups[e.entity % GROUP_SLOTS]);
+            out += ") has made it across the ravine.\n";
+            groups[e.entity % GROUP_SLOTS].count = 0;
+            break;
+    }
+}
 
 auto waitUntilSafe () {
     // Wait until the crossing_semaphore is posted.
-    sem_wait(&crossing_semaphore);
+    watchdog_doing(guard_watch, "waiting for crossing_semaphore");
+    sync_sem_wait(&crossing_semaphore);
 }
 
 auto crossRavine () {
@@ -78,85 +188,90 @@ auto crossRavine () {
     // than 5, let them go.
 
     // Lock the main vector from operations.
-    sem_wait(&vector_semaphore);
+    perf_begin(group_formation);
+    sync_mutex_lock(&vector_semaphore);
 
     // Get the first monkey in the queue, the "leader"
     // and add to the currently crossing vector
-    vector<Monkey> currently_crossing;
-    direction_type currently_crossing_direction;
-    cout << monkey_vector.front().Monkey::getMonkeyIdentifier() <<
-                        " is getting ready to cross.\n";
-    currently_crossing.push_back(monkey_vector.front());
-    currently_crossing_direction = monkey_vector.front().direction;
-    monkey_vector.erase(monkey_vector.begin());
-
-    // For the rest of the monkeys in the monkey vector/queue,
-    // check if they're going the same direction as the "leader"
-    // monkey at the front of the currently crossing vector.
-    // If they are, we can add them to the currently crossing group
-    // as long as there are not more than MAX_MONKEYS in the group.
-    // Otherwise, state the monkey is going in the same direction, 
-    // but cannot come due to the limit on the rope.
-    vector<Monkey> remaining_monkeys;
-    for (int i = 0; i < monkey_vector.size(); i++) {
-        if (monkey_vector[i].direction == currently_crossing_direction) {
-            if (currently_crossing.size() < MAX_MONKEYS) {
-                cout << monkey_vector[i].getMonkeyIdentifier() << 
-                    " is getting ready to cross.\n";
-                currently_crossing.push_back(monkey_vector[i]);
-            } else {
-                cout << monkey_vector[i].getMonkeyIdentifier() << 
-                    " is waiting to cross " << monkey_vector[i].getDirection() <<
-                    ", but the current group is full.\n";
-                remaining_monkeys.push_back(monkey_vector[i]);
-            }
-        } else {
-            remaining_monkeys.push_back(monkey_vector[i]);
+    currently_crossing.clear();
+    size_t leader = monkey_vector.front();
+    direction_type currently_crossing_direction = monkey_vector.eastward(leader) ? EASTWARD : WESTWARD;
+    bool eastward = currently_crossing_direction == EASTWARD;
+    int group = ++num_groups;
+
+    // Walk the monkeys going the same direction as the "leader", starting
+    // with the leader itself; the others are skipped a word at a time. We
+    // can add them to the currently crossing group as long as there are not
+    // more than MAX_MONKEYS in the group.
+    size_t i = leader;
+    while (i != WaitingArea::npos && currently_crossing.size() < MAX_MONKEYS) {
+        log_event(MONKEY_READY, monkey_vector.id(i), group);
+        currently_crossing.push_back(Monkey(monkey_vector.id(i), currently_crossing_direction));
+        monkey_vector.remove(i);
+        i = monkey_vector.next(i + 1, eastward);
+    }
+
+    // State that the rest going the same direction cannot come due to the
+    // limit on the rope. They stay where they are in the queue.
+    if (log_enabled()) {
+        for (; i != WaitingArea::npos; i = monkey_vector.next(i + 1, eastward)) {
+            log_event(MONKEY_GROUP_FULL, monkey_vector.id(i), currently_crossing_direction);
         }
     }
-    monkey_vector = remaining_monkeys;
+    for (Monkey& m : currently_crossing) {
+        handoff.dequeued(m.id);
+    }
+    trace_queue("monkey_vector", "pop group monkey_vector", monkey_vector.size());
+    live_queue_depth->set(monkey_vector.size());
 
 
     // Free the main vector for writing.
-    sem_post(&vector_semaphore);
+    sync_mutex_unlock(&vector_semaphore);
+    perf_end(group_formation);
 
 
     // Cross all monkeys going the same direction, in n=MAX_MONKEYS group
-    cout << "A group of monkeys (";
-    string curr = "";
-    for (Monkey m : currently_crossing) {
-        curr += m.Monkey::getMonkeyIdentifier();
-        curr += ", ";
-    }
-    curr.resize(curr.size() - 2);
-    cout << curr << 
-            ") is crossing the ravine going " <<
-            currently_crossing.front().Monkey::getDirection()
-            << ".\n";
+    log_event(GROUP_CROSSING, group, currently_crossing_direction);
 
-    // Wait the ravine crossing time.
-    sleep(time_to_cross);
+    // Wait the ravine crossing time (the leader's, with an arrival trace).
+    watchdog_doing(guard_watch, "crossing");
+    trace_begin("group crossing", group);
+    sleep_for_ns(arrival_service(currently_crossing.front().id - 1, time_to_cross));
+    trace_end("group crossing", group);
 
     // Print that the group has made it across.
-    cout << "The group of monkeys (" <<
-            curr <<
-            ") has made it across the ravine.\n";
+    log_event(GROUP_CROSSED, group);
+    live_groups->add();
+    (currently_crossing_direction == EASTWARD ? live_eastward : live_westward)->add(currently_crossing.size());
+    completion.count_down(currently_crossing.size());
+    watchdog_progress(guard_watch, currently_crossing.size());
 }
 
 auto doneWithCrossing() {
     // Post the crossing semaphore.
-    sem_post(&crossing_semaphore);
+    sync_sem_post(&crossing_semaphore);
 }
 
 void* crossing_guard (void* arg) {
+    trace_thread_name("crossing_guard");
+    perf_thread_start("crossing_guard");
     while (workers_active) {
-        if (!monkey_vector.empty()) {
+        watchdog_pass(guard_watch);
+        // Check for waiting monkeys under the vector semaphore.
+        sync_mutex_lock(&vector_semaphore);
+        bool monkeys_waiting = !monkey_vector.empty();
+        sync_mutex_unlock(&vector_semaphore);
+        if (monkeys_waiting) {
             // Wait until it is safe for monkeys to cross.
             waitUntilSafe();
             // If it's safe to cross, cross the ravine.
             crossRavine();
             // Signal that the current group of monkeys is done crossing.
             doneWithCrossing();
+        } else {
+            // Sleep until a monkey arrives or the simulation ends.
+            watchdog_doing(guard_watch, "idle");
+            crossing_guard_wakeup.wait();
         }
     }
 
@@ -164,69 +279,128 @@ void* crossing_guard (void* arg) {
 }
 
 
-int main() {
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
     // Intalize semaphores.
-    sem_init(&crossing_semaphore, 0, 1);
-    sem_init(&vector_semaphore, 0, 1);
+    sync_sem_init(&crossing_semaphore, "crossing_semaphore", 1);
+    sync_mutex_init(&vector_semaphore, "vector_semaphore");
 
     // Ask user how many monkeys they'd like to simulate 
     cout << "Monkey Crossing Simulation\n" << \
             "--------------------\n";
-    cout << "How many monkeys would you like to simulate? (n): ";
-    cin >> num_monkeys;
-       cout << "How often do monkeys appear at the ravine? (seconds): ";
-    cin >> arrival_rate;
-    cout << "How long does it take to cross the ravine? (seconds): ";
-    cin >> time_to_cross;
+    options.ask("monkeys", "How many monkeys would you like to simulate? (n): ", num_monkeys);
+    options.ask("arrival-rate", "How often do monkeys appear at the ravine? (seconds, or e.g. 250ms, exp:50us): ", arrival_rate);
+    options.ask("time-to-cross", "How long does it take to cross the ravine? (seconds, or e.g. 250ms, exp:50us): ", time_to_cross);
+    sim_time_start(options);
+    arrival_trace_start(options, num_monkeys);
+    replay_start(options, "monkeys_queue");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    perf_start(options);
+    live_stats_start(options, "monkeys_queue");
+    live_arrived = live_counter("arrived");
+    live_groups = live_counter("groups");
+    live_eastward = live_counter("eastward");
+    live_westward = live_counter("westward");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&crossing_semaphore, sizeof(crossing_semaphore));
+    placement_bind(&vector_semaphore, sizeof(vector_semaphore));
+    placement_bind(&monkey_vector, sizeof(monkey_vector));
+    guard_watch = watchdog_worker("crossing_guard");
+    watchdog_start(options, live_queue_depth);
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_monkeys);
+    handoff.reset(num_monkeys);
 
 
     // Start "crossing guard" worker thread.
     workers_active = true;
     pthread_t crossing_guard_thread;
-    pthread_create(&crossing_guard_thread, NULL, crossing_guard, 0);
+    pthread_create(&crossing_guard_thread, placement_worker_attr(), crossing_guard, 0);
 
-    // Seed random number generator.
-    srand(time(0));
     
-    // Start adding monkeys to the vector.
+    // Start adding monkeys to the vector. Arrival times come from the schedule (see
+    // --load), and latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(arrival_rate);
     for (int i = 0; i < num_monkeys; i++) {
-        sem_wait(&vector_semaphore);
-        // Generate a random number from 0 to 1
-        direction_type d = (rand() % 2) ? EASTWARD : WESTWARD;
+        uint64_t arrival_ns = arrivals.wait();
+        sync_mutex_lock(&vector_semaphore);
+        // Generate a random number from 0 to 1, or take it from the arrival trace.
+        direction_type d = (direction_type)arrival_choice(2);
         Monkey m = Monkey(i+1, d);
-        monkey_vector.push_back(m);
-        cout << m.Monkey::to_string() << " has arrived.\n";
-        sem_post(&vector_semaphore);
-
-        // Wait for the next monkey
-        sleep(arrival_rate);
+        handoff.enqueued(m.id, arrival_ns);
+        monkey_vector.push(m.id, m.direction == EASTWARD);
+        live_arrived->add();
+        trace_queue("monkey_vector", "push monkey_vector", monkey_vector.size());
+        live_queue_depth->set(monkey_vector.size());
+        log_event(MONKEY_ARRIVED, m.id, m.direction);
+        bool notify_guard = monkey_vector.size() == 1;
+        sync_mutex_unlock(&vector_semaphore);
+        // Wake the crossing guard if this monkey is the only one waiting.
+        if (notify_guard) {
+            crossing_guard_wakeup.notify();
+        }
     }
 
-    // Hold program until the monkey vector is empty.
-    while (!monkey_vector.empty()) {}
-    // Wait for the final monkey group to cross.
-    sleep(time_to_cross);
-    // Kill the operation handler crossing guard.
+    // Hold program until every monkey has crossed.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the crossing guard and wait for it to exit.
     workers_active = false;
-
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker threads to finish being killed before printing results.
-    sleep(1);
+    wakeup_shutdown();
+    pthread_join(crossing_guard_thread, NULL);
+    watchdog_stop();
+
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
         "-------------------\n";
     cout << "All monkeys have crossed the ravine.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("monkeys", num_monkeys);
+    report.add("arrival_rate", arrival_rate.to_string());
+    report.add("time_to_cross", time_to_cross.to_string());
+    report.add("elapsed_us", elapsed_us);
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    watchdog_report(report);
+    alloc_report(report, num_monkeys);
+    lock_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
 
     // Destroy semaphores
-    sem_destroy(&crossing_semaphore);
-    sem_destroy(&vector_semaphore);
+    sync_sem_destroy(&crossing_semaphore);
+    sync_mutex_destroy(&vector_semaphore);
     return 0;
 }
\ No newline at end of file
@@ -3,19 +3,43 @@
 // while readers are accessing the resource, it will wait until those readers free the
 // resource, and then modify it. New readers arriving in the meantime will have to
 // wait.
+//
+// One operation handler serves the operations by default, holding the resource
+// alone for each. With --handlers=N several serve them at once, and
+// --rwlock=pthread or --rwlock=bravo lets readers share the resource (see
+// common/rwlock.h). A handler then takes the turnstile, pops the next operation
+// and locks the resource for it before letting the next handler through, so
+// operations still enter in their order of arrival and a writer waiting for
+// readers holds back the readers behind it.
 
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <queue>
 #include <algorithm>
+#include <atomic>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/rwlock.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/lockfree_queue.h"
+#include "../common/alloc_count.h"
+#include "../common/perf.h"
 
 using namespace std;
 
 enum operation_type {READER, WRITER};
+// Interned operation labels, indexed by operation_type.
+const char* const OPERATION_LABELS[] = {"reader", "writer"};
 
 class Operation { 
     public: 
@@ -27,63 +51,185 @@ class Operation {
             this->type = type;
         }
 
-        string to_string() {
-            string s = "";
-            s += "Operation #"; 
-            s += std::to_string(this->id);
-            s += ", ";
-            switch(type) {
-                case READER: 
-                    s += "reader";
-                    break;
-                case WRITER: 
-                    s += "writer";
-                    break;
-            }
-            return s;
+        // append_to()
+        // Appends "Operation #id, type" to out without building a string.
+        void append_to(string& out) const {
+            out += "Operation #";
+            log_append(out, this->id);
+            out += ", ";
+            out += OPERATION_LABELS[this->type];
         }
 };
 
+const int MAX_HANDLERS = 32;
+
 // Global variables 
-int worker_active = false;
+int num_handlers = 1;
+atomic<bool> worker_active(false);
+// Counted down once per handled operation.
+CompletionLatch completion;
+// Wakes the operation handler when an operation arrives to an empty queue.
+Wakeup operation_wakeup;
+// Handlers asleep in operation_wakeup.
+atomic<int> idle_handlers(0);
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_reads;
+LiveMetric* live_writes;
+LiveMetric* live_queue_depth;
+// Operation order, one letter per operation: R for a reader, W for a writer.
+string operation_order = "RWRWRRR";
 // Muxex locks, semaphores, shared queues, ect.
-sem_t operation_semaphore;
-sem_t queue_semaphore;
+// The resource, a binary semaphore unless --rwlock picks a reader-writer lock.
+SampleRwLock operation_semaphore;
+// Lets one handler at a time pop an operation and lock the resource for it.
+SampleLock turnstile;
+SampleLock queue_semaphore;
 queue<Operation> operation_queue;
+// Used instead of operation_queue with --queue=lockfree.
+LockFreeQueue<Operation> lockfree_operation_queue;
+// A handler's pass through the operation queue, for --perf.
+PerfRegion handler_pop("handler_pop");
 int shared_int = 0; // This is the shared value we're going to be targeting.
 
-// Operation worker thread code.
-void* operation_handler(void* arg) {
-    while (worker_active) {
+// Events logged by the operation handler.
+enum operation_event {
+    OPERATION_READ,     // arg: value read
+    OPERATION_WRITE
+};
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    switch (e.event) {
+        case OPERATION_READ:
+            Operation(e.entity, READER).append_to(out);
+            out += ", reads: ";
+            log_append(out, e.arg);
+            out += "\n";
+            break;
+        case OPERATION_WRITE:
+            Operation(e.entity, WRITER).append_to(out);
+            out += ", increments shared value.\n";
+            break;
+    }
+}
+
+// take_operation()
+// Pops the operation at the front of the queue into op. Returns false if the
+// queue was empty. With several handlers, wakes an idle one if more operations
+// are waiting, since the producer only wakes one when the queue fills from
+// empty. A handler just going to sleep may miss it, which costs parallelism
+// but not progress: the caller comes back for the rest.
+bool take_operation(Operation& op) {
+    PerfScope scope(handler_pop);
+    size_t remaining;
+    if (queue_lockfree) {
+        optional<Operation> taken = lockfree_operation_queue.pop();
+        if (!taken) {
+            return false;
+        }
+        op = *taken;
+        handoff.dequeued(op.id);
+        remaining = lockfree_operation_queue.size();
+        trace_queue("operation_queue", "pop operation_queue", remaining);
+        live_queue_depth->set(remaining);
+    } else {
+        sync_mutex_lock(&queue_semaphore);
+        if (operation_queue.empty()) {
+            sync_mutex_unlock(&queue_semaphore);
+            return false;
+        }
+        // Pop an operation off the queue. 
+        op = operation_queue.front();
+        operation_queue.pop();
+        handoff.dequeued(op.id);
+        remaining = operation_queue.size();
+        trace_queue("operation_queue", "pop operation_queue", remaining);
+        live_queue_depth->set(remaining);
+        sync_mutex_unlock(&queue_semaphore);
+    }
+    if (num_handlers > 1 && remaining > 0 && idle_handlers.load(memory_order_relaxed) > 0) {
+        operation_wakeup.notify();
+    }
+    return true;
+}
+
+// begin_operation()
+// Takes the next operation into op and locks the resource for it. Returns
+// false, holding nothing, if the queue was empty.
+bool begin_operation(Operation& op) {
+    if (rwlock_selected == RWLOCK_SEMAPHORE) {
         // Signal that we're working on an operation.
-        sem_wait(&operation_semaphore);
+        sync_write_lock(&operation_semaphore);
+        if (!take_operation(op)) {
+            sync_write_unlock(&operation_semaphore);
+            return false;
+        }
+        return true;
+    }
+    sync_mutex_lock(&turnstile);
+    bool taken = take_operation(op);
+    if (taken && op.type == READER) {
+        sync_read_lock(&operation_semaphore);
+    } else if (taken) {
+        sync_write_lock(&operation_semaphore);
+    }
+    sync_mutex_unlock(&turnstile);
+    return taken;
+}
 
-        // Check if the queue has operations for us.
-        if (!operation_queue.empty()) {
-            // Pop an operation off the queue. 
-            sem_wait(&queue_semaphore);
-            Operation op = operation_queue.front();
-            operation_queue.pop();
-            sem_post(&queue_semaphore);
+// end_operation()
+// Unlocks the resource after op.
+void end_operation(const Operation& op) {
+    if (op.type == READER && rwlock_selected != RWLOCK_SEMAPHORE) {
+        sync_read_unlock(&operation_semaphore);
+    } else {
+        sync_write_unlock(&operation_semaphore);
+    }
+}
 
+// Operation worker thread code.
+void* operation_handler(void* arg) {
+    trace_thread_name((const char*)arg);
+    perf_thread_start((const char*)arg);
+    while (worker_active) {
+        // Check if the queue has operations for us, and lock the resource.
+        Operation op = Operation(0, READER);
+        bool idle = !begin_operation(op);
+        if (!idle) {
             // Handle the popped operation. 
             switch (op.type) {
                 case READER:
                     // Reader code.
-                    cout << op.to_string() << ", reads: " << shared_int << "\n";
+                    trace_begin("read", op.id);
+                    log_event(OPERATION_READ, op.id, shared_int);
+                    live_reads->add();
+                    trace_end("read", op.id);
                     break;
                 case WRITER:
                     // Writer code.
-                    cout << op.to_string() << ", increments shared value.\n";
+                    trace_begin("write", op.id);
+                    log_event(OPERATION_WRITE, op.id);
                     shared_int++;
+                    live_writes->add();
+                    trace_end("write", op.id);
                     break;
                 default:
                     break; 
             }
+            completion.count_down();
+            // We're done with the operation.
+            end_operation(op);
         }
 
-        // We're done with the operation.
-        sem_post(&operation_semaphore);
+        // Sleep until an operation arrives or the simulation ends.
+        if (idle) {
+            idle_handlers.fetch_add(1, memory_order_relaxed);
+            operation_wakeup.wait();
+            idle_handlers.fetch_sub(1, memory_order_relaxed);
+        }
     }
 
     return NULL;
@@ -92,57 +238,170 @@ void* operation_handler(void* arg) {
 
 
 
-int main() {
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+    operation_order = options.value("operations", operation_order);
+    num_handlers = options.value("handlers", num_handlers);
+    int num_operations = operation_order.size();
+    sim_time_start(options);
+    arrival_trace_start(options, num_operations);
+    replay_start(options, "readers_writers");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    rwlock_start(options);
+    queue_start(options);
+    perf_start(options);
+    live_stats_start(options, "readers_writers");
+    live_arrived = live_counter("arrived");
+    live_reads = live_counter("reads");
+    live_writes = live_counter("writes");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&operation_semaphore, sizeof(operation_semaphore));
+    placement_bind(&turnstile, sizeof(turnstile));
+    placement_bind(&queue_semaphore, sizeof(queue_semaphore));
+    placement_bind(&operation_queue, sizeof(operation_queue));
+    placement_bind(&lockfree_operation_queue, sizeof(lockfree_operation_queue));
+    options.check_unused();
+    if (num_handlers < 1 || num_handlers > MAX_HANDLERS) {
+        options.fail("--handlers must be between 1 and " + to_string(MAX_HANDLERS));
+    }
+
     // Initalize the semaphore.
-    sem_init(&operation_semaphore, 0, 1);
-    sem_init(&queue_semaphore, 0, 1);
+    sync_rwlock_init(&operation_semaphore, "operation_semaphore");
+    if (rwlock_selected != RWLOCK_SEMAPHORE) {
+        sync_mutex_init(&turnstile, "turnstile");
+    }
+    sync_mutex_init(&queue_semaphore, "queue_semaphore");
 
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_operations);
+    handoff.reset(num_operations);
 
     cout << "Starting value: " << shared_int << "\n";
 
-    // Start the worker thread for operations.
+    // Start the worker threads for operations.
     worker_active = true;
-    pthread_t operation_handler_thread;
-    pthread_create(&operation_handler_thread, NULL, operation_handler, 0);
+    vector<pthread_t> operation_handler_threads(num_handlers);
+    vector<string> handler_names;
+    for (int h = 0; h < num_handlers; h++) {
+        handler_names.push_back(num_handlers > 1 ? "operation_handler_" + to_string(h) : "operation_handler");
+    }
+    for (int h = 0; h < num_handlers; h++) {
+        pthread_create(&operation_handler_threads[h], placement_worker_attr(), operation_handler,
+                       (void*)handler_names[h].c_str());
+    }
 
     // Operation type queue:
-    vector<operation_type> op_types = {READER, WRITER, READER, WRITER, READER, READER, READER};
-    // Queue some operations.
+    vector<operation_type> op_types;
+    for (char c : operation_order) {
+        switch (c) {
+            case 'R':
+                op_types.push_back(READER);
+                break;
+            case 'W':
+                op_types.push_back(WRITER);
+                break;
+            default:
+                options.fail(string("invalid operation '") + c + "' (expected R or W)");
+        }
+    }
+    // Queue some operations. They all arrive at once, so with --load=open every
+    // operation's latency is measured from the start of the run. With
+    // --arrivals the trace gives their times and types instead.
+    ArrivalSchedule arrivals(Interval(0));
     int i = 0;
-    while (!op_types.empty()) {
+    while (i < num_operations) {
+        uint64_t arrival_ns = arrivals.wait();
         // Make operation.
-        Operation op = Operation(i, op_types.front());
-        // Remove from op_types vector.
-        op_types.erase(op_types.begin());
+        Operation op = Operation(i, arrival_current != NULL ? (operation_type)arrival_choice(2) : op_types[i]);
 
-        // Get queue_semaphore.
-        sem_wait(&queue_semaphore);
+        // Get queue_semaphore, unless the queue is lock-free.
+        if (!queue_lockfree) {
+            sync_mutex_lock(&queue_semaphore);
+        }
         // Add new operation to queue.
-        operation_queue.push(op);
+        handoff.enqueued(op.id, arrival_ns);
+        bool notify_handler;
+        size_t depth;
+        if (queue_lockfree) {
+            notify_handler = lockfree_operation_queue.push(op);
+            depth = lockfree_operation_queue.size();
+        } else {
+            operation_queue.push(op);
+            depth = operation_queue.size();
+            notify_handler = depth == 1;
+        }
+        live_arrived->add();
+        trace_queue("operation_queue", "push operation_queue", depth);
+        live_queue_depth->set(depth);
         // Release queue_semaphore;
-        sem_post(&queue_semaphore);
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&queue_semaphore);
+        }
+        // Wake the handler if this operation is the only one waiting.
+        if (notify_handler) {
+            operation_wakeup.notify();
+        }
         i++;
     }
 
 
-    // Hold program until queue is empty.
-    while (!operation_queue.empty()) {};
-    // Kill the operation handler.
+    // Hold program until every operation has been handled.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the operation handlers and wait for them to exit.
     worker_active = false;
+    wakeup_shutdown();
+    for (pthread_t thread : operation_handler_threads) {
+        pthread_join(thread, NULL);
+    }
 
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::microseconds>(end_time - start_time);
-    // Wait a second for the worker thread to finish being killed before printing results.
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print elapese time.
-    cout << "Elapsed time: " << elapsed_time.count() << " microseconds" << endl;
+    cout << "Elapsed time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("operations", operation_order);
+    report.add("num_operations", num_operations);
+    report.add("handlers", num_handlers);
+    report.add("final_value", shared_int);
+    report.add("elapsed_us", elapsed_us);
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    alloc_report(report, num_operations);
+    lock_report(report);
+    rwlock_report(report, operation_semaphore);
+    queue_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
 
     // Free the semaphore from memory.
-    sem_destroy(&operation_semaphore);
-    sem_destroy(&queue_semaphore);
+    sync_rwlock_destroy(&operation_semaphore);
+    sync_mutex_destroy(&queue_semaphore);
     // End program.
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,326 @@
+// Parameter-sweep driver for the simulations.
+//
+// Runs one simulation program over the cartesian product of the given parameter
+// ranges. Independent runs execute in parallel, one per job slot, and each slot is
+// pinned to its own CPU(s). Every run is started non-interactively with
+// --quiet --report=json, and the reports are collected into one CSV or JSON table.
+//
+// Example:
+//   sweep --program=barbershop/barbershop --param customers=100
+//         --param chairs=1..8 --param customer-rate=0,1 --repeat=3 --output=chairs.csv
+//
+// Parameter values are a single value, a comma-separated list (a,b,c), or an
+// integer range lo..hi or lo..hi:step.
+
+// Library imports
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <unistd.h>
+#include "../common/options.h"
+#include "../common/run_process.h"
+
+using namespace std;
+
+// One swept parameter and the values it takes.
+struct SweepParameter {
+    string name;
+    vector<string> values;
+};
+
+// One run of the program: its parameter values and what came back.
+struct SweepRun {
+    vector<pair<string, string>> parameters;
+    int repeat = 0;
+    vector<int> cpus;
+    ProcessResult process;
+    vector<pair<string, string>> report;
+};
+
+// expand_values()
+// Turns "a,b,c", "lo..hi" or "lo..hi:step" into the list of values.
+vector<string> expand_values(Options& options, const string& name, const string& spec) {
+    vector<string> values;
+    size_t dots = spec.find("..");
+    if (dots == string::npos) {
+        size_t start = 0;
+        while (true) {
+            size_t comma = spec.find(',', start);
+            values.push_back(spec.substr(start, comma == string::npos ? string::npos : comma - start));
+            if (comma == string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+        return values;
+    }
+
+    string rest = spec.substr(dots + 2);
+    size_t colon = rest.find(':');
+    long long lo = options.parse<long long>(name, spec.substr(0, dots));
+    long long hi = options.parse<long long>(name, rest.substr(0, colon));
+    long long step = (colon == string::npos) ? 1 : options.parse<long long>(name, rest.substr(colon + 1));
+    if (step <= 0) {
+        options.fail("range step for " + name + " must be positive");
+    }
+    for (long long v = lo; v <= hi; v += step) {
+        values.push_back(to_string(v));
+    }
+    return values;
+}
+
+// json_to_csv()
+// Renders a JSON scalar for a CSV cell: strings lose their JSON escaping and are
+// quoted only if they need it.
+string json_to_csv(const string& value) {
+    if (value.empty() || value[0] != '"') {
+        return value;
+    }
+    string raw;
+    for (size_t i = 1; i + 1 < value.size(); i++) {
+        if (value[i] == '\\' && i + 2 < value.size()) {
+            i++;
+        }
+        raw += value[i];
+    }
+    if (raw.find_first_of(",\"\n") == string::npos) {
+        return raw;
+    }
+    string quoted = "\"";
+    for (char c : raw) {
+        quoted += (c == '"') ? "\"\"" : string(1, c);
+    }
+    return quoted + "\"";
+}
+
+// is_number()
+// True if a parameter value can be written to JSON without quotes.
+bool is_number(const string& s) {
+    if (s.empty()) {
+        return false;
+    }
+    char* end = NULL;
+    strtod(s.c_str(), &end);
+    return end && *end == '\0';
+}
+
+int main(int argc, char** argv) {
+    Options options(argc, argv);
+    string program = options.get("program");
+    if (program.empty()) {
+        options.fail("usage: sweep --program=path [--param name=values]... [--jobs=N] "
+                     "[--cpus-per-job=N] [--repeat=N] [--format=csv|json] [--output=path]");
+    }
+    int repeat = options.value("repeat", 1);
+    int cpus_per_job = options.value("cpus-per-job", 1);
+    string format = options.get("format", "csv");
+    string output_path = options.get("output", "");
+    vector<string> extra_args = options.get_all("arg");
+
+    // Parse the swept parameters.
+    vector<SweepParameter> parameters;
+    for (const string& spec : options.get_all("param")) {
+        size_t equals = spec.find('=');
+        if (equals == string::npos) {
+            options.fail("expected --param name=values, got " + spec);
+        }
+        SweepParameter parameter;
+        parameter.name = spec.substr(0, equals);
+        parameter.values = expand_values(options, parameter.name, spec.substr(equals + 1));
+        parameters.push_back(parameter);
+    }
+
+    // Split the CPUs we are allowed to use into job slots.
+    vector<int> cpus = allowed_cpus();
+    if (cpus_per_job < 1 || cpus_per_job > (int)cpus.size()) {
+        options.fail("--cpus-per-job must be between 1 and " + to_string(cpus.size()));
+    }
+    int max_jobs = cpus.size() / cpus_per_job;
+    int jobs = options.value("jobs", max_jobs);
+    bool pin = !options.flag("no-pin");
+    options.check_unused();
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    // Expand the cartesian product of parameter values, times the repeat count.
+    vector<SweepRun> runs;
+    vector<size_t> index(parameters.size(), 0);
+    while (true) {
+        for (int r = 0; r < repeat; r++) {
+            SweepRun run;
+            for (size_t p = 0; p < parameters.size(); p++) {
+                run.parameters.push_back({parameters[p].name, parameters[p].values[index[p]]});
+            }
+            run.repeat = r;
+            runs.push_back(run);
+        }
+        // Advance the odometer; the last parameter varies fastest.
+        int p = (int)parameters.size() - 1;
+        while (p >= 0 && ++index[p] == parameters[p].values.size()) {
+            index[p] = 0;
+            p--;
+        }
+        if (p < 0) {
+            break;
+        }
+    }
+    if (jobs > (int)runs.size()) {
+        jobs = runs.size();
+    }
+
+    cerr << "Running " << runs.size() << " configurations of " << program <<
+            " on " << jobs << " job slot(s)" << (pin ? ", pinned" : "") << ".\n";
+
+    // Each job slot pulls the next run off a shared counter and executes it on its
+    // own CPUs until the runs are exhausted.
+    atomic<size_t> next_run(0);
+    atomic<size_t> finished(0);
+    mutex progress_mutex;
+    vector<thread> slots;
+    for (int slot = 0; slot < jobs; slot++) {
+        slots.emplace_back([&, slot]() {
+            vector<int> slot_cpus;
+            if (pin) {
+                for (int c = 0; c < cpus_per_job; c++) {
+                    slot_cpus.push_back(cpus[(slot % max_jobs) * cpus_per_job + c]);
+                }
+            }
+            size_t i;
+            while ((i = next_run.fetch_add(1)) < runs.size()) {
+                SweepRun& run = runs[i];
+                vector<string> args = {program};
+                for (auto& parameter : run.parameters) {
+                    args.push_back("--" + parameter.first + "=" + parameter.second);
+                }
+                for (const string& extra : extra_args) {
+                    args.push_back(extra);
+                }
+                args.push_back("--non-interactive");
+                args.push_back("--quiet");
+                args.push_back("--report=json");
+
+                run.cpus = slot_cpus;
+                run.process = run_pinned(args, slot_cpus);
+                run.report = parse_report_line(run.process.output);
+
+                lock_guard<mutex> lock(progress_mutex);
+                size_t done = ++finished;
+                cerr << "[" << done << "/" << runs.size() << "] run " << i;
+                if (run.process.exit_status != 0) {
+                    cerr << " failed with status " << run.process.exit_status;
+                }
+                cerr << "\n";
+            }
+        });
+    }
+    for (thread& t : slots) {
+        t.join();
+    }
+
+    // Build the table columns: swept parameters first, then the driver's own
+    // measurements, then every report key in first-seen order.
+    vector<string> columns;
+    auto add_column = [&](const string& name) {
+        for (const string& c : columns) {
+            if (c == name) {
+                return;
+            }
+        }
+        columns.push_back(name);
+    };
+    for (auto& parameter : parameters) {
+        add_column(parameter.name);
+    }
+    for (const char* name : {"repeat", "cpus", "exit_status", "wall_us", "user_us", "system_us", "max_rss_kb"}) {
+        add_column(name);
+    }
+    for (auto& run : runs) {
+        for (auto& field : run.report) {
+            add_column(field.first);
+        }
+    }
+
+    // Collect every run's cells as JSON values.
+    vector<vector<string>> rows;
+    for (auto& run : runs) {
+        vector<pair<string, string>> cells;
+        for (auto& parameter : run.parameters) {
+            cells.push_back({parameter.first, is_number(parameter.second) ? parameter.second : "\"" + parameter.second + "\""});
+        }
+        string cpu_list;
+        for (int cpu : run.cpus) {
+            cpu_list += (cpu_list.empty() ? "" : " ") + to_string(cpu);
+        }
+        cells.push_back({"repeat", to_string(run.repeat)});
+        cells.push_back({"cpus", "\"" + cpu_list + "\""});
+        cells.push_back({"exit_status", to_string(run.process.exit_status)});
+        cells.push_back({"wall_us", to_string(run.process.wall_us)});
+        cells.push_back({"user_us", to_string(run.process.user_us)});
+        cells.push_back({"system_us", to_string(run.process.system_us)});
+        cells.push_back({"max_rss_kb", to_string(run.process.max_rss_kb)});
+        for (auto& field : run.report) {
+            cells.push_back(field);
+        }
+
+        vector<string> row;
+        for (const string& column : columns) {
+            string value = "null";
+            // Later cells win, so the program's own report of a parameter (for
+            // example after it clamped a value) replaces the requested value.
+            for (auto& cell : cells) {
+                if (cell.first == column) {
+                    value = cell.second;
+                }
+            }
+            row.push_back(value);
+        }
+        rows.push_back(row);
+    }
+
+    // Write the table.
+    ofstream file;
+    if (!output_path.empty()) {
+        file.open(output_path);
+        if (!file) {
+            options.fail("cannot write " + output_path);
+        }
+    }
+    ostream& out = output_path.empty() ? cout : file;
+    if (format == "json") {
+        out << "[\n";
+        for (size_t r = 0; r < rows.size(); r++) {
+            out << "  {";
+            for (size_t c = 0; c < columns.size(); c++) {
+                out << (c ? ", " : "") << "\"" << columns[c] << "\": " << rows[r][c];
+            }
+            out << "}" << (r + 1 < rows.size() ? "," : "") << "\n";
+        }
+        out << "]\n";
+    } else {
+        for (size_t c = 0; c < columns.size(); c++) {
+            out << (c ? "," : "") << columns[c];
+        }
+        out << "\n";
+        for (auto& row : rows) {
+            for (size_t c = 0; c < row.size(); c++) {
+                out << (c ? "," : "") << (row[c] == "null" ? "" : json_to_csv(row[c]));
+            }
+            out << "\n";
+        }
+    }
+
+    // Exit non-zero if any run failed so scripts notice.
+    for (auto& run : runs) {
+        if (run.process.exit_status != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -12,138 +12,426 @@
 // student, the student sits on one of the chairs in the hallway and waits. If no
 // chairs are available, the student will come back later.
 
+// With --pipeline a visit is not one help session but passes through four
+// stages, each with its own desk staff: check-in, triage, the help session and
+// a follow-up (see common/pipeline.h). The hallway is the queue in front of
+// check-in; between the other stages there are --stage-capacity chairs, and a
+// student finished at one desk waits there until the next queue has a free
+// chair. --stage-workers and --stage-times set each stage's staff and service
+// time, as one value for every stage or a comma-separated list. The help
+// session takes --ta-time by default, and check-in, triage and follow-up a
+// tenth, a fifth and a tenth of its mean. The run reports every stage's
+// utilization and queueing delay and names the bottleneck, e.g.
+//   teaching_assistant --non-interactive --students=200 --student-rate=exp:20ms
+//       --ta-time=exp:50ms --pipeline --stage-workers=1,1,3,1 --stage-capacity=2
+
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <queue>
+#include <atomic>
 #include <pthread.h>
 #include <unistd.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/pipeline.h"
+#include "../common/alloc_count.h"
+#include "../common/perf.h"
 
 // Namespace declaration
 using namespace std;
 
 // Global variables 
-int num_students;
-const int max_chairs = 3;
-long int teaching_assistant_wait_time;
-long int student_rate;
+int num_students = 10;
+int max_chairs = 3;
+Interval teaching_assistant_wait_time = Interval::seconds(1);
+Interval student_rate = Interval::seconds(1);
 // Define teaching assistant status enum
 enum enum_teaching_assistant_status { AWAKE = true, ASLEEP = false};
 enum_teaching_assistant_status teaching_assistant_status = ASLEEP;
 // Define worker process management variable 
-bool worker_active = false;
+atomic<bool> worker_active(false);
+// Counted down once per student, helped or turned away.
+CompletionLatch completion;
+// Wakes the teaching assistant when a student arrives to an empty queue.
+Wakeup teaching_assistant_wakeup;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_helped;
+LiveMetric* live_turned_away;
+LiveMetric* live_queue_depth;
+// Students sent away because the hallway was full.
+int num_turned_away = 0;
 
 // Mutex lock semaphore, and queue variables.
-pthread_mutex_t mutex;
+SampleLock queue_mutex;
 queue<int> student_queue;
+// The teaching assistant's pass through the locked queue, for --perf.
+PerfRegion ta_pop("ta_pop");
+
+// The staged office hours of --pipeline.
+const int NUM_STAGES = 4;
+const int HELP_STAGE = 2;
+const char* const STAGE_NAMES[NUM_STAGES] = {"check_in", "triage", "help_session", "follow_up"};
+// What a student does at each stage, for the event log.
+const char* const STAGE_LABELS[NUM_STAGES] = {"checks in", "is triaged", "sits down with the teaching assistant",
+                                              "gets a follow-up"};
+bool pipeline_mode = false;
+Pipeline office;
+vector<Interval> stage_times;
+
+// Events logged by the teaching assistant and the students.
+enum office_hours_event {
+    STUDENT_WAITING,    // arg: number of waiting students
+    STUDENT_TURNED_AWAY,
+    STUDENT_SEATED,
+    TA_WOKEN,
+    STUDENT_HELPED,
+    TA_ASLEEP,
+    STUDENT_STAGE       // arg: stage
+};
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    // Every message but the teaching assistant's falling asleep starts with
+    // the student.
+    if (e.event != TA_ASLEEP) {
+        out += "Student #";
+        log_append(out, e.entity);
+    }
+    switch (e.event) {
+        case STUDENT_WAITING:
+            out += " arrives and sits in the hallway. Current # of waiting students: ";
+            log_append(out, e.arg);
+            out += "\n";
+            break;
+        case STUDENT_TURNED_AWAY:
+            out += " arrives and sees that there is no room for them in the hallway, so they leave.\n";
+            break;
+        case STUDENT_SEATED:
+            out += " sits down with the teaching assistant.\n";
+            break;
+        case TA_WOKEN:
+            out += " has woken the teaching assistant.\n";
+            break;
+        case STUDENT_HELPED:
+            out += " gets their questions answered. They leave office hours.\n";
+            break;
+        case TA_ASLEEP:
+            out += "There are no students waiting. The teaching assistant has fallen asleep.\n";
+            break;
+        case STUDENT_STAGE:
+            out += " ";
+            out += STAGE_LABELS[e.arg];
+            out += ".\n";
+            break;
+    }
+}
+
+// Pipeline callbacks. Only the help session takes a trace's service demand.
+uint64_t stage_service_ns(int student, int stage) {
+    if (stage == HELP_STAGE) {
+        return arrival_service(student - 1, stage_times[stage]);
+    }
+    return stage_times[stage].sample();
+}
+
+void student_entered(int student, size_t waiting) {
+    log_event(STUDENT_WAITING, student, waiting);
+}
+
+void stage_popped(int student, int stage) {
+    if (stage == 0) {
+        handoff.dequeued(student);
+    }
+}
+
+void stage_started(int student, int stage) {
+    log_event(STUDENT_STAGE, student, stage);
+}
+
+void student_finished(int student) {
+    log_event(STUDENT_HELPED, student);
+    live_helped->add();
+    completion.count_down();
+}
+
+// stage_values()
+// Reads a per-stage option: one value for every stage, or a comma-separated
+// list with one per stage.
+vector<string> stage_values(Options& options, const string& name, const string& fallback, int count) {
+    vector<string> values;
+    stringstream list(options.get(name, fallback));
+    string value;
+    while (getline(list, value, ',')) {
+        values.push_back(value);
+    }
+    if (values.size() == 1) {
+        values.assign(count, values[0]);
+    }
+    if ((int)values.size() != count) {
+        options.fail("--" + name + " takes one value or " + to_string(count));
+    }
+    return values;
+}
+
+// build_office()
+// Reads the --pipeline options and sets up the stages.
+void build_office(Options& options) {
+    uint64_t help_ns = teaching_assistant_wait_time.mean_ns();
+    string defaults = format_duration(help_ns / 10) + "," + format_duration(help_ns / 5) + "," +
+                      teaching_assistant_wait_time.to_string() + "," + format_duration(help_ns / 10);
+    vector<string> workers = stage_values(options, "stage-workers", "1", NUM_STAGES);
+    vector<string> times = stage_values(options, "stage-times", defaults, NUM_STAGES);
+    vector<string> capacities = stage_values(options, "stage-capacity", "2", NUM_STAGES - 1);
+    if (!pipeline_mode) {
+        return;
+    }
+    for (int s = 0; s < NUM_STAGES; s++) {
+        int num_workers = atoi(workers[s].c_str());
+        if (num_workers < 1 || num_workers > PIPELINE_MAX_WORKERS) {
+            options.fail("--stage-workers must be between 1 and " + to_string(PIPELINE_MAX_WORKERS));
+        }
+        Interval time;
+        if (!time.parse(times[s])) {
+            options.fail("--stage-times: cannot parse " + times[s]);
+        }
+        // The hallway is the queue in front of check-in.
+        int capacity = s == 0 ? max_chairs : atoi(capacities[s - 1].c_str());
+        if (capacity < 1) {
+            options.fail("--chairs and --stage-capacity must be at least 1");
+        }
+        stage_times.push_back(time);
+        office.add_stage(STAGE_NAMES[s], num_workers, capacity, time);
+    }
+    office.service_ns = stage_service_ns;
+    office.entered = student_entered;
+    office.popped = stage_popped;
+    office.started = stage_started;
+    office.finished = student_finished;
+}
 
 // Code for the teaching assistant (worker thread)
 void* teaching_assistant(void* arg) {
+   trace_thread_name("teaching_assistant");
+   perf_thread_start("teaching_assistant");
    while (worker_active) {
         // Lock the mutex (nodifying the student queue).
-        pthread_mutex_lock(&mutex);
+        perf_begin(ta_pop);
+        sync_mutex_lock(&queue_mutex);
         // Check the student queue.
         if (!student_queue.empty()) { // There are customers in the queue.
             // Pop the first customer from the queue.
             int student = student_queue.front();
             student_queue.pop();
+            handoff.dequeued(student);
+            trace_queue("student_queue", "pop student_queue", student_queue.size());
+            live_queue_depth->set(student_queue.size());
 
             // Unlock the mutex (done with modifications to the customer queue)
-            pthread_mutex_unlock(&mutex);
+            sync_mutex_unlock(&queue_mutex);
+            perf_end(ta_pop);
             // Announce that a new student is being processed.
-            cout << "Student #" << student << " sits down with the teaching assistant.\n";
+            log_event(STUDENT_SEATED, student);
 
             // If the TA is asleep, wake up the TA.
             if (teaching_assistant_status == ASLEEP) {
                 teaching_assistant_status = AWAKE;
-                cout << "Student #" << student << " has woken the teaching assistant.\n";
+                log_event(TA_WOKEN, student);
             }
 
             // Process the student currently with the TA.
             // Wait x time to "process the stydent".
-            sleep(teaching_assistant_wait_time);
+            trace_begin("help session", student);
+            sleep_for_ns(arrival_service(student - 1, teaching_assistant_wait_time));
+            trace_end("help session", student);
             // Student is done being processed.
-            cout << "Student #" << student << " gets their questions answered. They leave office hours.\n";
+            log_event(STUDENT_HELPED, student);
+            live_helped->add();
+            completion.count_down();
 
         } else { // There are no students in the queue.
             // No students in the queue, so the teaching assistant falls asleep.
             if (teaching_assistant_status == AWAKE ) {
-                cout << "There are no students waiting. The teaching assistant has fallen asleep.\n";
+                log_event(TA_ASLEEP, 0);
                 teaching_assistant_status = ASLEEP;
             }
 
             // Unlock the mutex (done with modifications to the customer queue)
-            pthread_mutex_unlock(&mutex);
+            sync_mutex_unlock(&queue_mutex);
+            perf_end(ta_pop);
+            // Sleep until a student arrives or the simulation ends.
+            teaching_assistant_wakeup.wait();
         }
     }
     return NULL;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
     // Initialize the mutex lock
-    pthread_mutex_init(&mutex, NULL);
+    sync_mutex_init(&queue_mutex, "mutex");
 
     // Ask user how many customers they'd like to simulate 
     cout << "Office Hours Simulation\n" << \
             "--------------------\n";
-    cout << "How many students would you like to simulate? (n): ";
-    cin >> num_students;
-    cout << "How often should the students appear? (seconds): ";
-    cin >> student_rate;
-    cout << "How long should the teaching assistant spend with each student? (seconds): ";
-    cin >> teaching_assistant_wait_time;
+    options.ask("students", "How many students would you like to simulate? (n): ", num_students);
+    options.ask("student-rate", "How often should the students appear? (seconds, or e.g. 250ms, exp:50us): ", student_rate);
+    options.ask("ta-time", "How long should the teaching assistant spend with each student? (seconds, or e.g. 250ms, exp:50us): ", teaching_assistant_wait_time);
+    // The hallway size is fixed by the problem, but can be changed for sweeps.
+    max_chairs = options.value("chairs", max_chairs);
+    pipeline_mode = options.flag("pipeline");
+    sim_time_start(options);
+    arrival_trace_start(options, num_students);
+    replay_start(options, "teaching_assistant");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    perf_start(options);
+    live_stats_start(options, "teaching_assistant");
+    live_arrived = live_counter("arrived");
+    live_helped = live_counter("helped");
+    live_turned_away = live_counter("turned_away");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&queue_mutex, sizeof(queue_mutex));
+    placement_bind(&student_queue, sizeof(student_queue));
+    build_office(options);
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_students);
+    handoff.reset(num_students);
 
-    // Initalize barber worker thread.
+    // Initalize barber worker thread, or the staff of every stage.
     teaching_assistant_status = ASLEEP;
     worker_active = true;
     pthread_t teaching_assistant_thread;
-    pthread_create(&teaching_assistant_thread, NULL, teaching_assistant, 0);
+    if (pipeline_mode) {
+        office.start();
+    } else {
+        pthread_create(&teaching_assistant_thread, placement_worker_attr(), teaching_assistant, 0);
+    }
 
-    // Enqueue students.
+    // Enqueue students. Arrival times come from the schedule (see --load), and
+    // latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(student_rate);
     for (int i = 1; i < num_students + 1; i++) {
+        uint64_t arrival_ns = arrivals.wait();
+        if (pipeline_mode) {
+            // Take a seat in the hallway in front of check-in, if there is one.
+            live_arrived->add();
+            handoff.enqueued(i, arrival_ns);
+            if (!office.enter(i, arrival_ns)) {
+                num_turned_away++;
+                live_turned_away->add();
+                log_event(STUDENT_TURNED_AWAY, i);
+                completion.count_down();
+            }
+            continue;
+        }
         // Lock the mutex (nodifying the students queue).
-        pthread_mutex_lock(&mutex);
+        sync_mutex_lock(&queue_mutex);
+        live_arrived->add();
+        bool notify_teaching_assistant = false;
 
         if (student_queue.size() >= max_chairs) {
             // Queue full, do not add.
-            cout << "Student #" << i << " arrives and sees that there is no room for them in the hallway, so they leave.\n";
+            num_turned_away++;
+            live_turned_away->add();
+            log_event(STUDENT_TURNED_AWAY, i);
+            completion.count_down();
         } else {
+            handoff.enqueued(i, arrival_ns);
             student_queue.push(i);
-            cout << "Student #" << i << " arrives and sits in the hallway. Current # of waiting students: " << student_queue.size() << "\n";
+            trace_queue("student_queue", "push student_queue", student_queue.size());
+            live_queue_depth->set(student_queue.size());
+            log_event(STUDENT_WAITING, i, student_queue.size());
+            // Wake the TA if this student is the only one waiting.
+            notify_teaching_assistant = student_queue.size() == 1;
         }
 
         // Unlock the mutex (done with modifications to the student queue)
-        pthread_mutex_unlock(&mutex);
-
-        // Wait student_rate amount seconds before another student arrives.
-        sleep(student_rate);
+        sync_mutex_unlock(&queue_mutex);
+        if (notify_teaching_assistant) {
+            teaching_assistant_wakeup.notify();
+        }
     }
 
-    // Hold the main thread until the student queue is empty.
-    while (!student_queue.empty()) {}
-    // Wait an additional time for the TA to finish with the last student.
-    sleep(teaching_assistant_wait_time);
-    // Kill the teaching assistant thread.
+    // Hold the main thread until every student has been helped or turned away.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop the teaching assistant thread and wait for it to exit.
     worker_active = false;
+    if (pipeline_mode) {
+        office.stop();
+    } else {
+        wakeup_shutdown();
+        pthread_join(teaching_assistant_thread, NULL);
+    }
 
-    // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker thread to finish being killed before printing results.
-    sleep(1);
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
             "-------------------\n";
     cout << "Office hours are now over.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
+
+    // Print machine-readable results if requested.
+    report.add("students", num_students);
+    report.add("chairs", max_chairs);
+    report.add("student_rate", student_rate.to_string());
+    report.add("ta_time", teaching_assistant_wait_time.to_string());
+    report.add("helped", num_students - num_turned_away);
+    report.add("turned_away", num_turned_away);
+    report.add("elapsed_us", elapsed_us);
+    report.add("visit", pipeline_mode ? "pipeline" : "single");
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    if (pipeline_mode) {
+        pipeline_report(report, office, completion.completed_ns() - office.started_ns);
+    }
+    wakeup_report(report, handoff.histogram.total);
+    alloc_report(report, num_students);
+    lock_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
 
     // Free the mutex lock.
-    pthread_mutex_destroy(&mutex);
+    sync_mutex_destroy(&queue_mutex);
+    office.destroy();
 
     return 0;
 }
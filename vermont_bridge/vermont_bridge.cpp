@@ -6,16 +6,32 @@
 
 // Library imports
 #include <iostream>
-#include <chrono>
 #include <queue>
 #include <algorithm>
+#include <atomic>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/event_log.h"
+#include "../common/sync.h"
+#include "../common/sim_time.h"
+#include "../common/replay.h"
+#include "../common/latch.h"
+#include "../common/placement.h"
+#include "../common/live_stats.h"
+#include "../common/wakeup.h"
+#include "../common/watchdog.h"
+#include "../common/lockfree_queue.h"
+#include "../common/alloc_count.h"
+#include "../common/perf.h"
 
 using namespace std;
 
 enum direction_type {NORTHBOUND, SOUTHBOUND};
+// Interned direction labels, indexed by direction_type.
+const char* const DIRECTION_LABELS[] = {"northbound", "southbound"};
 
 class Farmer {
     public: 
@@ -27,65 +43,158 @@ class Farmer {
             this->direction = direction;
         }
 
-        string to_string() {
-            string s = "";
-            s += "Farmer #";
-            s += std::to_string(this->id);
-            s += ", ";
-            switch (direction) {
-                case NORTHBOUND:
-                    s += "northbound";
-                    break;
-                case SOUTHBOUND:
-                    s += "southbound";
-                break;
-            }
-            return s;
+        // append_to()
+        // Appends "Farmer #id, direction" to out without building a string.
+        void append_to(string& out) const {
+            out += "Farmer #";
+            log_append(out, this->id);
+            out += ", ";
+            out += DIRECTION_LABELS[this->direction];
         }
 
 };
 
 // Global variables 
-bool workers_active = false;
-long int time_to_cross = 0;
-long int arrival_rate = 0;
-int num_farmers = 0;
+atomic<bool> workers_active(false);
+// Counted down once per farmer that has crossed.
+CompletionLatch completion;
+// Wake each direction's thread when a farmer going its way reaches the front of
+// the queue.
+Wakeup northbound_wakeup;
+Wakeup southbound_wakeup;
+
+// Live statistics, published with --live-stats.
+LiveMetric* live_arrived;
+LiveMetric* live_num_northbound;
+LiveMetric* live_num_southbound;
+LiveMetric* live_queue_depth;
+// Progress counters sampled by --watchdog.
+WatchdogWorker* northbound_watch;
+WatchdogWorker* southbound_watch;
+Interval time_to_cross = Interval::seconds(1);
+Interval arrival_rate = Interval::seconds(1);
+int num_farmers = 10;
 // Create totals for purpose of demonstrating seperate threads
 // for northbound and southbound farmers.
 int num_northbound = 0;
 int num_southbound = 0;
 // Muxex locks, semaphores, shared queues, ect.
-sem_t bridge_semaphore;
-sem_t queue_semaphore;
+SampleLock bridge_semaphore;
+SampleLock queue_semaphore;
 queue<Farmer> farmer_queue;
+// Used instead of farmer_queue with --queue=lockfree.
+LockFreeQueue<Farmer> lockfree_farmer_queue;
+// A farmer thread's pass through the farmer queue, for --perf.
+PerfRegion farmer_pop("farmer_pop");
+
+// Events logged by the farmers. The argument is always the farmer's direction.
+enum bridge_event {
+    FARMER_ARRIVED,
+    FARMER_CROSSING,
+    FARMER_CROSSED
+};
+
+// format_event()
+// Turns a logged event back into the simulation's message.
+void format_event(const LogEvent& e, string& out) {
+    Farmer f = Farmer(e.entity, (direction_type)e.arg);
+    switch (e.event) {
+        case FARMER_ARRIVED:
+            f.append_to(out);
+            out += " has arrived.\n";
+            break;
+        case FARMER_CROSSING:
+            out += (f.direction == NORTHBOUND ? "Now travelling: " : "Now traveling: ");
+            f.append_to(out);
+            out += "\n";
+            break;
+        case FARMER_CROSSED:
+            f.append_to(out);
+            out += " has finished crossing.\n";
+            break;
+    }
+}
+
+// take_farmer()
+// Pops the farmer at the front of the queue into f if they are going the given
+// way. Wakes the other direction's thread if the farmer now at the front is
+// going its way. Returns false if there was no farmer to take.
+bool take_farmer(direction_type direction, Farmer& f) {
+    direction_type other = (direction == NORTHBOUND) ? SOUTHBOUND : NORTHBOUND;
+    bool notify_other;
+    PerfScope scope(farmer_pop);
+    if (queue_lockfree) {
+        optional<Farmer> taken = lockfree_farmer_queue.pop_if([direction](const Farmer& front) {
+            return front.direction == direction;
+        });
+        if (!taken) {
+            return false;
+        }
+        f = *taken;
+        handoff.dequeued(f.id);
+        trace_queue("farmer_queue", "pop farmer_queue", lockfree_farmer_queue.size());
+        live_queue_depth->set(lockfree_farmer_queue.size());
+        optional<Farmer> next = lockfree_farmer_queue.front();
+        notify_other = next && next->direction == other;
+    } else {
+        sync_mutex_lock(&queue_semaphore);
+        if (farmer_queue.empty() || farmer_queue.front().direction != direction) {
+            // Free the queue semaphore, there is no farmer going our way to take.
+            sync_mutex_unlock(&queue_semaphore);
+            return false;
+        }
+        // Pop an operation off the queue.
+        f = farmer_queue.front();
+        farmer_queue.pop();
+        handoff.dequeued(f.id);
+        trace_queue("farmer_queue", "pop farmer_queue", farmer_queue.size());
+        live_queue_depth->set(farmer_queue.size());
+        // The next farmer may be going the other way; that thread has to
+        // be woken to take them.
+        notify_other = !farmer_queue.empty() && farmer_queue.front().direction == other;
+        sync_mutex_unlock(&queue_semaphore);
+    }
+    if (notify_other) {
+        (other == NORTHBOUND ? northbound_wakeup : southbound_wakeup).notify();
+    }
+    return true;
+}
 
 // Farmer threads based on direction. 
 // northbound_thread()
 void* northbound_thread(void* arg) {
+    trace_thread_name("northbound");
+    perf_thread_start("northbound");
     while (workers_active) {
-        sem_wait(&bridge_semaphore);
+        watchdog_pass(northbound_watch);
+        watchdog_doing(northbound_watch, "waiting for bridge_semaphore");
+        sync_mutex_lock(&bridge_semaphore);
         // Check the farmer queue.
-        sem_wait(&queue_semaphore);
-        if (!farmer_queue.empty() && 
-            farmer_queue.front().direction == NORTHBOUND
-        ) {
-            // Pop an operation off the queue.
-            Farmer f = farmer_queue.front();
-            farmer_queue.pop();
-            sem_post(&queue_semaphore);
-
+        Farmer f = Farmer(0, NORTHBOUND);
+        bool idle = !take_farmer(NORTHBOUND, f);
+        if (!idle) {
             // Handle the popped operation.
             // We know this farmer has a northbound operation.
-            cout << "Now travelling: " << f.Farmer::to_string() << "\n";
+            log_event(FARMER_CROSSING, f.id, f.direction);
             // Wait for the time to cross.
-            sleep(time_to_cross);
-            cout << f.Farmer::to_string() << " has finished crossing.\n";
+            watchdog_doing(northbound_watch, "crossing");
+            trace_begin("crossing", f.id);
+            sleep_for_ns(arrival_service(f.id, time_to_cross));
+            trace_end("crossing", f.id);
+            log_event(FARMER_CROSSED, f.id, f.direction);
             // Add to northbound total.
             num_northbound++;
-         }
-         // Free the queue semaphore in case the farmer queue is empty.
-        sem_post(&queue_semaphore);
-        sem_post(&bridge_semaphore);
+            live_num_northbound->add();
+            completion.count_down();
+            watchdog_progress(northbound_watch);
+        }
+        sync_mutex_unlock(&bridge_semaphore);
+
+        // Sleep until a northbound farmer is at the front or the simulation ends.
+        if (idle) {
+            watchdog_doing(northbound_watch, "idle");
+            northbound_wakeup.wait();
+        }
     }
     return NULL;
 }
@@ -93,100 +202,184 @@ void* northbound_thread(void* arg) {
 // Farmer threads based on direction. 
 // southbound_thread()
 void* southbound_thread(void* arg) {
+    trace_thread_name("southbound");
+    perf_thread_start("southbound");
     while (workers_active) {
-        sem_wait(&bridge_semaphore);
+        watchdog_pass(southbound_watch);
+        watchdog_doing(southbound_watch, "waiting for bridge_semaphore");
+        sync_mutex_lock(&bridge_semaphore);
         // Check the farmer queue.
-        sem_wait(&queue_semaphore);
-        if (!farmer_queue.empty() && 
-            farmer_queue.front().direction == SOUTHBOUND
-        ) {
-            // Pop an operation off the queue.
-            Farmer f = farmer_queue.front();
-            farmer_queue.pop();
-            sem_post(&queue_semaphore);
-
+        Farmer f = Farmer(0, SOUTHBOUND);
+        bool idle = !take_farmer(SOUTHBOUND, f);
+        if (!idle) {
             // Handle the popped operation.
             // We know this farmer has a southbound operation.
-            cout << "Now traveling: " << f.Farmer::to_string() << "\n";
+            log_event(FARMER_CROSSING, f.id, f.direction);
             // Wait for the time to cross.
-            sleep(time_to_cross);
-            cout << f.Farmer::to_string() << " has finished crossing.\n";
+            watchdog_doing(southbound_watch, "crossing");
+            trace_begin("crossing", f.id);
+            sleep_for_ns(arrival_service(f.id, time_to_cross));
+            trace_end("crossing", f.id);
+            log_event(FARMER_CROSSED, f.id, f.direction);
             // Add to southbound total.
             num_southbound++;
+            live_num_southbound->add();
+            completion.count_down();
+            watchdog_progress(southbound_watch);
+        }
+        sync_mutex_unlock(&bridge_semaphore);
+
+        // Sleep until a southbound farmer is at the front or the simulation ends.
+        if (idle) {
+            watchdog_doing(southbound_watch, "idle");
+            southbound_wakeup.wait();
         }
-        // Free the queue semaphore in case the farmer queue is empty.
-        sem_post(&queue_semaphore);
-        sem_post(&bridge_semaphore);
     }
     return NULL;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+
     // Initalize semaphores.
-    sem_init(&bridge_semaphore, 0, 1);
-    sem_init(&queue_semaphore, 0, 1);
+    sync_mutex_init(&bridge_semaphore, "bridge_semaphore");
+    sync_mutex_init(&queue_semaphore, "queue_semaphore");
 
     // Ask user how many customers they'd like to simulate 
     cout << "Bridge Crossing Simulation\n" << \
             "--------------------\n";
-    cout << "How many farmers would you like to simulate? (n): ";
-    cin >> num_farmers;
-       cout << "How often do farmers appear at the bridge? (seconds): ";
-    cin >> arrival_rate;
-    cout << "How long does it take to cross the bridge? (seconds): ";
-    cin >> time_to_cross;
+    options.ask("farmers", "How many farmers would you like to simulate? (n): ", num_farmers);
+    options.ask("arrival-rate", "How often do farmers appear at the bridge? (seconds, or e.g. 250ms, exp:50us): ", arrival_rate);
+    options.ask("time-to-cross", "How long does it take to cross the bridge? (seconds, or e.g. 250ms, exp:50us): ", time_to_cross);
+    sim_time_start(options);
+    arrival_trace_start(options, num_farmers);
+    replay_start(options, "vermont_bridge");
+    event_log_start(options, format_event);
+    trace_start(options);
+    sync_profile_start(options);
+    lock_start(options);
+    queue_start(options);
+    perf_start(options);
+    live_stats_start(options, "vermont_bridge");
+    live_arrived = live_counter("arrived");
+    live_num_northbound = live_counter("num_northbound");
+    live_num_southbound = live_counter("num_southbound");
+    live_queue_depth = live_gauge("queue_depth");
+    placement_start(options);
+    placement_bind(&bridge_semaphore, sizeof(bridge_semaphore));
+    placement_bind(&queue_semaphore, sizeof(queue_semaphore));
+    placement_bind(&farmer_queue, sizeof(farmer_queue));
+    placement_bind(&lockfree_farmer_queue, sizeof(lockfree_farmer_queue));
+    northbound_watch = watchdog_worker("northbound");
+    southbound_watch = watchdog_worker("southbound");
+    watchdog_start(options, live_queue_depth);
+    options.check_unused();
     cout << "\nBeginning simulation...\n" << \
-            "-----------------------\n";
+            "-----------------------\n" << flush;
 
+    // Count allocations from here to the end of the event log.
+    alloc_start();
     // Start clock.
-    auto start_time = chrono::high_resolution_clock::now();
+    uint64_t start_ns = monotonic_ns();
+    completion.reset(num_farmers);
+    handoff.reset(num_farmers);
 
     // Start both worker threads.
     workers_active = true;
     pthread_t northbound_thread_obj;
     pthread_t southbound_thread_obj;
-    pthread_create(&northbound_thread_obj, NULL, northbound_thread, 0);
-    pthread_create(&southbound_thread_obj, NULL, southbound_thread, 0);
+    pthread_create(&northbound_thread_obj, placement_worker_attr(), northbound_thread, 0);
+    pthread_create(&southbound_thread_obj, placement_worker_attr(), southbound_thread, 0);
 
-    // Seed random number generator. 
-    srand(time(0));
-
-    // Enqueue farmers.
+    // Enqueue farmers. Arrival times come from the schedule (see --load), and
+    // latency is measured from when each arrival was due.
+    ArrivalSchedule arrivals(arrival_rate);
     for (int i = 0; i < num_farmers; i++) {
-        sem_wait(&queue_semaphore);
-        // Generate random number from 0 to 1.
-        direction_type d = (rand() % 2) ? NORTHBOUND : SOUTHBOUND;
+        uint64_t arrival_ns = arrivals.wait();
+        if (!queue_lockfree) {
+            sync_mutex_lock(&queue_semaphore);
+        }
+        // Generate random number from 0 to 1, or take it from the arrival trace.
+        direction_type d = (direction_type)arrival_choice(2);
         Farmer f = Farmer(i, d);
-        farmer_queue.push(f);
-        cout << f.Farmer::to_string() << " has arrived.\n";
-        sem_post(&queue_semaphore);
-
-        // Wait for the next farmer;
-        sleep(arrival_rate);
+        handoff.enqueued(f.id, arrival_ns);
+        bool notify;
+        size_t depth;
+        if (queue_lockfree) {
+            notify = lockfree_farmer_queue.push(f);
+            depth = lockfree_farmer_queue.size();
+        } else {
+            farmer_queue.push(f);
+            depth = farmer_queue.size();
+            notify = depth == 1;
+        }
+        live_arrived->add();
+        trace_queue("farmer_queue", "push farmer_queue", depth);
+        live_queue_depth->set(depth);
+        log_event(FARMER_ARRIVED, f.id, f.direction);
+        if (!queue_lockfree) {
+            sync_mutex_unlock(&queue_semaphore);
+        }
+        // Wake the thread for this farmer's direction if they are at the front.
+        if (notify) {
+            (f.direction == NORTHBOUND ? northbound_wakeup : southbound_wakeup).notify();
+        }
     }
 
-    // Hold program until queue is empty.
-    while (!farmer_queue.empty()) {};
-    // Wait for the final farmer to cross.
-    sleep(time_to_cross);
-    // Kill the operation handler.
+    // Hold program until every farmer has crossed.
+    completion.wait();
+    // The shutdown that follows is not part of a recorded or replayed schedule.
+    replay_stop();
+    // Stop both direction threads and wait for them to exit.
     workers_active = false;
+    wakeup_shutdown();
+    pthread_join(northbound_thread_obj, NULL);
+    pthread_join(southbound_thread_obj, NULL);
+    watchdog_stop();
 
-     // Stop the chrono clock, print elapsed time in microseconds
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::seconds>(end_time - start_time);
-    // Wait a second for the worker threads to finish being killed before printing results.
-    sleep(1);
+    // Elapsed time runs to the last completion, in microseconds.
+    long long elapsed_us = (completion.completed_ns() - start_ns) / 1000;
+    // Mark the live statistics finished.
+    live_stats_stop(handoff.from_arrival);
+    // Write out any events still buffered.
+    event_log_stop();
+    alloc_stop();
+    // Write the timeline if tracing was requested.
+    trace_write();
     // Print simulation results
     cout << "\nEnd simulation...\n" << \
             "-------------------\n";
     cout << "The bridge is now closed for transport.\n";
-    cout << "Elapsed simulation time: " << elapsed_time.count() << " seconds" << endl;
+    cout << "Elapsed simulation time: " << elapsed_us << " microseconds" << endl;
     cout << "Total number of northbound farmers: " << num_northbound << "\n";
     cout << "Total number of southbound farmers: " << num_southbound << "\n";
 
+    // Print machine-readable results if requested.
+    report.add("farmers", num_farmers);
+    report.add("arrival_rate", arrival_rate.to_string());
+    report.add("time_to_cross", time_to_cross.to_string());
+    report.add("northbound", num_northbound);
+    report.add("southbound", num_southbound);
+    report.add("elapsed_us", elapsed_us);
+    replay_report(report);
+    arrival_report(report, arrivals);
+    handoff_report(report);
+    wakeup_report(report, handoff.histogram.total);
+    watchdog_report(report);
+    alloc_report(report, num_farmers);
+    lock_report(report);
+    queue_report(report);
+    perf_report(report);
+    sync_profile_report(report);
+    report.print(options.report_format());
+
     // Destroy semaphores.
-    sem_destroy(&bridge_semaphore);
-    sem_destroy(&queue_semaphore);
+    sync_mutex_destroy(&bridge_semaphore);
+    sync_mutex_destroy(&queue_semaphore);
     return 0;
 }
\ No newline at end of file
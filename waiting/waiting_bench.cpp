@@ -0,0 +1,249 @@
+// Benchmark of the ravine samples' waiting area (common/waiting_area.h).
+//
+// Fills a backlog of --entities waiting monkeys with random directions twice:
+// once as the vector of objects monkeys_queue used to keep, and once as the
+// WaitingArea columns. Both are then timed on the same work:
+//   count   counting the eastward monkeys in the whole backlog
+//   next    finding the first --group-size westward monkeys from the front
+//   group   forming --groups groups the way crossRavine() does, with the
+//           event log off: the leader and the next monkeys going its way
+// and the results are checked against each other.
+//
+// Example:
+//   waiting_bench --entities=10000000 --groups=100 --eastward=0.5
+//
+// A high --eastward (e.g. 0.999) makes the westward monkeys rare, so "next" has
+// to look deep into the backlog.
+
+// Library imports
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include "../common/options.h"
+#include "../common/report.h"
+#include "../common/clock.h"
+#include "../common/waiting_area.h"
+
+using namespace std;
+
+enum direction_type {EASTWARD, WESTWARD};
+
+// A waiting monkey as monkeys_queue stored it before the columns.
+struct WaitingMonkey {
+    int id;
+    direction_type direction;
+};
+
+// Parameters
+int num_entities = 10000000;
+int num_groups = 100;
+int num_repeats = 5;
+size_t group_size = 5;
+double eastward_fraction = 0.5;
+
+// One operation's timings.
+struct BenchResult {
+    string name;
+    double vector_ns = 0;
+    double columns_ns = 0;
+};
+
+// fill()
+// Builds the same backlog in both layouts.
+void fill(vector<WaitingMonkey>& objects, WaitingArea& columns, uint64_t seed) {
+    mt19937_64 random(seed);
+    bernoulli_distribution eastward(eastward_fraction);
+    objects.clear();
+    columns.clear();
+    objects.reserve(num_entities);
+    for (int i = 0; i < num_entities; i++) {
+        direction_type d = eastward(random) ? EASTWARD : WESTWARD;
+        objects.push_back(WaitingMonkey{i + 1, d});
+        columns.push(i + 1, d == EASTWARD);
+    }
+}
+
+// count_vector()
+// Counts the eastward monkeys one object at a time.
+size_t count_vector(const vector<WaitingMonkey>& objects) {
+    size_t total = 0;
+    for (const WaitingMonkey& m : objects) {
+        total += m.direction == EASTWARD;
+    }
+    return total;
+}
+
+// next_vector()
+// Collects the ids of the first group_size westward monkeys.
+void next_vector(const vector<WaitingMonkey>& objects, vector<int>& ids) {
+    ids.clear();
+    for (size_t i = 0; i < objects.size() && ids.size() < group_size; i++) {
+        if (objects[i].direction == WESTWARD) {
+            ids.push_back(objects[i].id);
+        }
+    }
+}
+
+// next_columns()
+// Collects the ids of the first group_size westward monkeys.
+void next_columns(const WaitingArea& columns, vector<int>& ids) {
+    ids.clear();
+    for (size_t i = columns.next(0, false); i != WaitingArea::npos && ids.size() < group_size;
+         i = columns.next(i + 1, false)) {
+        ids.push_back(columns.id(i));
+    }
+}
+
+// group_vector()
+// Forms one group the way crossRavine() did with a vector: take the leader,
+// then copy every other monkey either into the group or into the remainder.
+void group_vector(vector<WaitingMonkey>& objects, vector<WaitingMonkey>& remaining, vector<int>& ids) {
+    ids.clear();
+    WaitingMonkey leader = objects.front();
+    ids.push_back(leader.id);
+    objects.erase(objects.begin());
+    remaining.clear();
+    for (const WaitingMonkey& m : objects) {
+        if (m.direction == leader.direction && ids.size() < group_size) {
+            ids.push_back(m.id);
+        } else {
+            remaining.push_back(m);
+        }
+    }
+    objects.swap(remaining);
+}
+
+// group_columns()
+// Forms one group the way crossRavine() does with the columns.
+void group_columns(WaitingArea& columns, vector<int>& ids) {
+    ids.clear();
+    size_t i = columns.front();
+    bool eastward = columns.eastward(i);
+    while (i != WaitingArea::npos && ids.size() < group_size) {
+        ids.push_back(columns.id(i));
+        columns.remove(i);
+        i = columns.next(i + 1, eastward);
+    }
+}
+
+int main(int argc, char** argv) {
+    // Read command-line/config-file parameters.
+    Options options(argc, argv);
+    Report report;
+    if (options.quiet()) {
+        cout.setstate(ios::failbit);
+    }
+    num_entities = options.value("entities", num_entities);
+    num_groups = options.value("groups", num_groups);
+    num_repeats = options.value("repeats", num_repeats);
+    int size = options.value("group-size", (int)group_size);
+    eastward_fraction = options.value("eastward", eastward_fraction);
+    uint64_t seed = options.value("seed", (uint64_t)1);
+    options.check_unused();
+    if (num_entities < 1 || num_groups < 1 || num_repeats < 1 || size < 1) {
+        options.fail("--entities, --groups, --repeats and --group-size must be at least 1");
+    }
+    if (eastward_fraction < 0 || eastward_fraction > 1) {
+        options.fail("--eastward must be between 0 and 1");
+    }
+    if (num_groups > num_entities) {
+        num_groups = num_entities;
+    }
+    group_size = size;
+
+    vector<WaitingMonkey> objects;
+    vector<WaitingMonkey> remaining;
+    WaitingArea columns;
+    vector<int> vector_ids, column_ids;
+    fill(objects, columns, seed);
+    remaining.reserve(num_entities);
+    vector<BenchResult> results;
+
+    // Whole-backlog counts, best of --repeats.
+    BenchResult count = {"count"};
+    size_t vector_total = 0, column_total = 0;
+    for (int r = 0; r < num_repeats; r++) {
+        uint64_t start_ns = monotonic_ns();
+        vector_total = count_vector(objects);
+        uint64_t middle_ns = monotonic_ns();
+        column_total = columns.count(true);
+        uint64_t end_ns = monotonic_ns();
+        if (r == 0 || middle_ns - start_ns < count.vector_ns) {
+            count.vector_ns = middle_ns - start_ns;
+        }
+        if (r == 0 || end_ns - middle_ns < count.columns_ns) {
+            count.columns_ns = end_ns - middle_ns;
+        }
+    }
+    if (vector_total != column_total) {
+        options.fail("count differs: " + to_string(vector_total) + " vs " + to_string(column_total));
+    }
+    results.push_back(count);
+
+    // Searches from the front, best of --repeats.
+    BenchResult next = {"next"};
+    for (int r = 0; r < num_repeats; r++) {
+        uint64_t start_ns = monotonic_ns();
+        next_vector(objects, vector_ids);
+        uint64_t middle_ns = monotonic_ns();
+        next_columns(columns, column_ids);
+        uint64_t end_ns = monotonic_ns();
+        if (r == 0 || middle_ns - start_ns < next.vector_ns) {
+            next.vector_ns = middle_ns - start_ns;
+        }
+        if (r == 0 || end_ns - middle_ns < next.columns_ns) {
+            next.columns_ns = end_ns - middle_ns;
+        }
+    }
+    if (vector_ids != column_ids) {
+        options.fail("next differs between the layouts");
+    }
+    results.push_back(next);
+
+    // Group formation, averaged over --groups consecutive groups.
+    BenchResult group = {"group"};
+    uint64_t vector_elapsed = 0, columns_elapsed = 0;
+    for (int g = 0; g < num_groups; g++) {
+        uint64_t start_ns = monotonic_ns();
+        group_vector(objects, remaining, vector_ids);
+        uint64_t middle_ns = monotonic_ns();
+        group_columns(columns, column_ids);
+        uint64_t end_ns = monotonic_ns();
+        vector_elapsed += middle_ns - start_ns;
+        columns_elapsed += end_ns - middle_ns;
+        if (vector_ids != column_ids) {
+            options.fail("group " + to_string(g + 1) + " differs between the layouts");
+        }
+    }
+    group.vector_ns = (double)vector_elapsed / num_groups;
+    group.columns_ns = (double)columns_elapsed / num_groups;
+    results.push_back(group);
+
+    ostringstream table;
+    table << "Waiting area benchmark: " << num_entities << " waiting, " << eastward_fraction * 100 <<
+             "% eastward, groups of " << group_size << "\n\n";
+    table << left << setw(8) << "Op" << right << setw(16) << "vector ns" << setw(16) << "columns ns" <<
+             setw(10) << "speedup" << "\n";
+    for (const BenchResult& r : results) {
+        double speedup = r.columns_ns > 0 ? r.vector_ns / r.columns_ns : 0;
+        table << left << setw(8) << r.name << right << fixed << setprecision(0) << setw(16) << r.vector_ns <<
+                 setw(16) << r.columns_ns << setprecision(1) << setw(9) << speedup << "x\n";
+    }
+    cout << table.str() << flush;
+
+    // Print machine-readable results if requested.
+    report.add("entities", num_entities);
+    report.add("groups", num_groups);
+    report.add("group_size", (long long)group_size);
+    report.add("eastward", eastward_fraction);
+    for (const BenchResult& r : results) {
+        report.add(r.name + "_vector_ns", r.vector_ns);
+        report.add(r.name + "_columns_ns", r.columns_ns);
+    }
+    report.print(options.report_format());
+    return 0;
+}